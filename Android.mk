@@ -1,15 +1,23 @@
 LOCAL_PATH:= $(call my-dir)
 
-include $(CLEAR_VARS)
-
-LOCAL_SRC_FILES:=                                      \
+netd_src_files :=                                      \
+                  AsyncResolver.cpp                    \
                   BandwidthController.cpp              \
+                  BinaryFraming.cpp                    \
+                  BroadcastFilter.cpp                  \
+                  BroadcastQueue.cpp                   \
                   ClatdController.cpp                  \
                   CommandListener.cpp                  \
+                  CommandTrace.cpp                     \
                   DnsProxyListener.cpp                 \
+                  DnsResponse.cpp                      \
+                  DnsStats.cpp                         \
                   FirewallController.cpp               \
                   IdletimerController.cpp              \
+                  InterfaceCache.cpp                   \
                   InterfaceController.cpp              \
+                  IptablesTransaction.cpp              \
+                  LatencyStats.cpp                     \
                   MDnsSdListener.cpp                   \
                   NatController.cpp                    \
                   NetdCommand.cpp                      \
@@ -18,17 +26,22 @@ LOCAL_SRC_FILES:=                                      \
                   NetlinkManager.cpp                   \
                   NetworkController.cpp                \
                   PppController.cpp                    \
+                  ProcessSupervisor.cpp                \
+                  QuotaFileCache.cpp                   \
                   ResolverController.cpp               \
+                  RouteCache.cpp                       \
+                  RtnetlinkBatch.cpp                   \
                   SecondaryTableController.cpp         \
+                  Slab.cpp                             \
                   SoftapController.cpp                 \
+                  SysctlCache.cpp                      \
                   TetherController.cpp                 \
+                  ThreadPool.cpp                       \
+                  UidChainTree.cpp                     \
+                  UidStatsReader.cpp                   \
                   oem_iptables_hook.cpp                \
-                  main.cpp                             \
-
-
-LOCAL_MODULE:= netd
 
-LOCAL_C_INCLUDES := \
+netd_c_includes := \
                     external/mdnsresponder/mDNSShared \
                     external/openssl/include \
                     external/stlport/stlport \
@@ -36,11 +49,37 @@ LOCAL_C_INCLUDES := \
                     bionic/libc/dns/include \
                     $(call include-path-for, libhardware_legacy)/hardware_legacy
 
+netd_shared_libraries := libstlport libsysutils liblog libcutils libnetutils \
+                         libcrypto libhardware_legacy libmdnssd libdl \
+                         liblogwrap
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES:= $(netd_src_files) main.cpp
+
+LOCAL_MODULE:= netd
+
+LOCAL_C_INCLUDES := $(netd_c_includes)
+
+LOCAL_CFLAGS := -Werror=format
+
+LOCAL_SHARED_LIBRARIES := $(netd_shared_libraries)
+
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES:= $(netd_src_files) netd_benchmark.cpp
+
+LOCAL_MODULE:= netd_benchmark
+
+LOCAL_MODULE_TAGS := optional
+
+LOCAL_C_INCLUDES := $(netd_c_includes)
+
 LOCAL_CFLAGS := -Werror=format
 
-LOCAL_SHARED_LIBRARIES := libstlport libsysutils liblog libcutils libnetutils \
-                          libcrypto libhardware_legacy libmdnssd libdl \
-                          liblogwrap
+LOCAL_SHARED_LIBRARIES := $(netd_shared_libraries)
 
 include $(BUILD_EXECUTABLE)
 
@@ -57,3 +96,19 @@ LOCAL_CFLAGS :=
 LOCAL_SHARED_LIBRARIES := libcutils
 
 include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES:=          \
+                  netd_replay.cpp \
+
+LOCAL_MODULE:= netd_replay
+
+LOCAL_MODULE_TAGS := optional
+
+LOCAL_C_INCLUDES := external/stlport/stlport bionic
+
+LOCAL_CFLAGS := -Werror=format
+
+LOCAL_SHARED_LIBRARIES := libstlport libcutils
+
+include $(BUILD_EXECUTABLE)
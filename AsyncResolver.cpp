@@ -0,0 +1,1141 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#define LOG_TAG "AsyncResolver"
+
+#include <cutils/log.h>
+
+#include "AsyncResolver.h"
+#include "DnsStats.h"
+
+static const char HOSTS_PATH[] = "/system/etc/hosts";
+
+static const int DNS_PORT = 53;
+static const size_t DNS_HEADER_SIZE = 12;
+static const size_t MAX_RESPONSE_SIZE = 1500;
+static const size_t MAX_NAME_SIZE = 253;
+static const int MAX_CNAME_HOPS = 8;
+
+static const uint16_t TYPE_A = 1;
+static const uint16_t TYPE_CNAME = 5;
+static const uint16_t TYPE_AAAA = 28;
+static const uint16_t CLASS_IN = 1;
+
+static const uint16_t FLAG_QR = 0x8000;
+static const uint16_t FLAG_TC = 0x0200;
+static const uint16_t FLAG_RD = 0x0100;
+static const int RCODE_NOERROR = 0;
+static const int RCODE_NXDOMAIN = 3;
+
+// The schedule of bionic's res_send(): RES_TIMEOUT split over the servers, RES_DFLRETRY rounds.
+static const int64_t BASE_TIMEOUT_US = 5000000;
+static const int64_t MIN_TIMEOUT_US = 1000000;
+static const int RETRY_ROUNDS = 2;
+
+static const size_t MAX_CACHE_ENTRIES = 512;
+static const int MAX_EVENTS = 32;
+
+static int64_t nowUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static std::string toLower(const char *s, size_t len) {
+    std::string out(s, len);
+    for (size_t i = 0; i < out.size(); i++) {
+        out[i] = tolower((unsigned char) out[i]);
+    }
+    return out;
+}
+
+/* Like bionic's _have_ipv4() and _have_ipv6(): is there a route to the global internet? */
+static bool haveRoute(int family) {
+    struct sockaddr_storage ss;
+    socklen_t len;
+    memset(&ss, 0, sizeof(ss));
+    if (family == AF_INET) {
+        struct sockaddr_in *sin = reinterpret_cast<struct sockaddr_in *>(&ss);
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons(42);
+        sin->sin_addr.s_addr = htonl(0x08080808);
+        len = sizeof(*sin);
+    } else {
+        struct sockaddr_in6 *sin6 = reinterpret_cast<struct sockaddr_in6 *>(&ss);
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = htons(42);
+        sin6->sin6_addr.s6_addr[0] = 0x20;
+        len = sizeof(*sin6);
+    }
+    int s = socket(family, SOCK_DGRAM | SOCK_CLOEXEC, IPPROTO_UDP);
+    if (s < 0) {
+        return false;
+    }
+    bool ok = connect(s, reinterpret_cast<struct sockaddr *>(&ss), len) == 0;
+    close(s);
+    return ok;
+}
+
+struct DnsServer {
+    struct sockaddr_storage addr;
+    socklen_t len;
+};
+
+/* What one question (the A or the AAAA of the name) came to. */
+struct DnsAnswer {
+    enum Status { OK, NXDOMAIN, FAILED, TRUNCATED };
+    Status status;
+    uint16_t type;
+    std::vector<std::string> addrs;  // 4 or 16 bytes each, in network order
+    std::string canonName;
+    uint32_t ttl;
+    DnsAnswer() : status(FAILED), type(0), ttl(0) {}
+};
+
+/* A resource record of the answer section. */
+struct DnsRecord {
+    std::string owner;
+    uint16_t type;
+    uint32_t ttl;
+    size_t rdata;           // offset in the message
+    uint16_t rdlen;
+    std::string target;     // of a CNAME
+};
+
+enum ParseResult {
+    PARSE_IGNORE,       // not an answer to the question
+    PARSE_RETRY,        // malformed
+    PARSE_SERVFAIL,     // SERVFAIL, REFUSED...: as res_send(), try the next server
+    PARSE_DONE
+};
+
+static uint16_t get16(const uint8_t *p) {
+    return (p[0] << 8) | p[1];
+}
+
+static uint32_t get32(const uint8_t *p) {
+    return ((uint32_t) get16(p) << 16) | get16(p + 2);
+}
+
+static void put16(std::string &out, uint16_t value) {
+    out += (char) (value >> 8);
+    out += (char) value;
+}
+
+/* Reads a possibly compressed name at *offset, in lower case, and moves *offset past it. */
+static bool readName(const uint8_t *msg, size_t len, size_t *offset, std::string *name) {
+    size_t pos = *offset;
+    bool jumped = false;
+    int jumps = 0;
+    name->clear();
+    for (;;) {
+        if (pos >= len) {
+            return false;
+        }
+        uint8_t labelLen = msg[pos];
+        if ((labelLen & 0xc0) == 0xc0) {
+            if (pos + 1 >= len || ++jumps > 16) {
+                return false;
+            }
+            if (!jumped) {
+                *offset = pos + 2;
+                jumped = true;
+            }
+            pos = ((labelLen & 0x3f) << 8) | msg[pos + 1];
+            continue;
+        }
+        if (labelLen & 0xc0) {
+            return false;
+        }
+        pos++;
+        if (labelLen == 0) {
+            if (!jumped) {
+                *offset = pos;
+            }
+            return true;
+        }
+        if (pos + labelLen > len || name->size() + labelLen + 1 > MAX_NAME_SIZE + 1) {
+            return false;
+        }
+        if (!name->empty()) {
+            *name += '.';
+        }
+        *name += toLower(reinterpret_cast<const char *>(msg + pos), labelLen);
+        pos += labelLen;
+    }
+}
+
+/*
+ * Destination address selection, as bionic's _rfc6724_sort() does it: rules 1, 2, 5, 6, 8
+ * and 9 of RFC 6724 section 6, with the source address the kernel would pick for each.
+ */
+struct SortCandidate {
+    struct sockaddr_storage addr;
+    socklen_t len;
+    int order;              // rule 10: otherwise keep the order of the answers
+    bool hasSource;
+    int scope;
+    int sourceScope;
+    int label;
+    int sourceLabel;
+    int precedence;
+    int prefixLen;          // in common with the source, IPv6 only
+};
+
+static const int SCOPE_LINKLOCAL = 0x2;
+static const int SCOPE_SITELOCAL = 0x5;
+static const int SCOPE_GLOBAL = 0xe;
+
+/* As IPv6, IPv4 addresses being their ::ffff:0:0/96 mapping. */
+static void toInet6(const struct sockaddr_storage &ss, uint8_t out[16]) {
+    if (ss.ss_family == AF_INET) {
+        const struct sockaddr_in *sin = reinterpret_cast<const struct sockaddr_in *>(&ss);
+        memset(out, 0, 10);
+        out[10] = out[11] = 0xff;
+        memcpy(out + 12, &sin->sin_addr, 4);
+    } else {
+        memcpy(out, &reinterpret_cast<const struct sockaddr_in6 *>(&ss)->sin6_addr, 16);
+    }
+}
+
+static bool hasPrefix(const uint8_t *a, const uint8_t *prefix, int bits) {
+    for (int i = 0; i < bits / 8; i++) {
+        if (a[i] != prefix[i]) {
+            return false;
+        }
+    }
+    int rest = bits % 8;
+    return !rest || ((a[bits / 8] ^ prefix[bits / 8]) >> (8 - rest)) == 0;
+}
+
+static const uint8_t PREFIX_LOOPBACK[16] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1 };
+static const uint8_t PREFIX_V4MAPPED[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+static const uint8_t PREFIX_V4COMPAT[12] = { 0 };
+static const uint8_t PREFIX_6TO4[2] = { 0x20, 0x02 };
+static const uint8_t PREFIX_TEREDO[4] = { 0x20, 0x01, 0, 0 };
+static const uint8_t PREFIX_ULA[1] = { 0xfc };
+static const uint8_t PREFIX_SITELOCAL[2] = { 0xfe, 0xc0 };
+static const uint8_t PREFIX_LINKLOCAL[2] = { 0xfe, 0x80 };
+static const uint8_t PREFIX_6BONE[2] = { 0x3f, 0xfe };
+
+/* The policy table of RFC 6724 section 2.1, as bionic has it. */
+static void getPolicy(const uint8_t a[16], int *label, int *precedence) {
+    if (hasPrefix(a, PREFIX_LOOPBACK, 128)) {
+        *label = 0; *precedence = 50;
+    } else if (hasPrefix(a, PREFIX_V4MAPPED, 96)) {
+        *label = 4; *precedence = 35;
+    } else if (hasPrefix(a, PREFIX_6TO4, 16)) {
+        *label = 2; *precedence = 30;
+    } else if (hasPrefix(a, PREFIX_TEREDO, 32)) {
+        *label = 5; *precedence = 5;
+    } else if (hasPrefix(a, PREFIX_ULA, 7)) {
+        *label = 13; *precedence = 3;
+    } else if (hasPrefix(a, PREFIX_V4COMPAT, 96)) {
+        *label = 3; *precedence = 1;
+    } else if (hasPrefix(a, PREFIX_SITELOCAL, 10)) {
+        *label = 11; *precedence = 1;
+    } else if (hasPrefix(a, PREFIX_6BONE, 16)) {
+        *label = 12; *precedence = 1;
+    } else {
+        *label = 1; *precedence = 40;
+    }
+}
+
+static int getScope(const uint8_t a[16]) {
+    if (a[0] == 0xff) {
+        return a[1] & 0x0f;  // multicast
+    }
+    if (hasPrefix(a, PREFIX_V4MAPPED, 96)) {
+        // 127/8 and 169.254/16 are link-local (RFC 6724 section 3.2).
+        return a[12] == 127 || (a[12] == 169 && a[13] == 254) ? SCOPE_LINKLOCAL : SCOPE_GLOBAL;
+    }
+    if (hasPrefix(a, PREFIX_LOOPBACK, 128) || hasPrefix(a, PREFIX_LINKLOCAL, 10)) {
+        return SCOPE_LINKLOCAL;
+    }
+    if (hasPrefix(a, PREFIX_SITELOCAL, 10)) {
+        return SCOPE_SITELOCAL;
+    }
+    return SCOPE_GLOBAL;
+}
+
+static int commonPrefixLen(const uint8_t a[16], const uint8_t b[16]) {
+    int len = 0;
+    for (int i = 0; i < 16; i++) {
+        uint8_t x = a[i] ^ b[i];
+        if (!x) {
+            len += 8;
+            continue;
+        }
+        while (!(x & 0x80)) {
+            len++;
+            x <<= 1;
+        }
+        break;
+    }
+    return len;
+}
+
+static void prepareCandidate(SortCandidate *c) {
+    uint8_t dst[16], src[16];
+    toInet6(c->addr, dst);
+    c->scope = getScope(dst);
+    getPolicy(dst, &c->label, &c->precedence);
+
+    struct sockaddr_storage source;
+    socklen_t sourceLen = sizeof(source);
+    int s = socket(c->addr.ss_family, SOCK_DGRAM | SOCK_CLOEXEC, IPPROTO_UDP);
+    c->hasSource = s >= 0 &&
+            connect(s, reinterpret_cast<const struct sockaddr *>(&c->addr), c->len) == 0 &&
+            getsockname(s, reinterpret_cast<struct sockaddr *>(&source), &sourceLen) == 0;
+    if (s >= 0) {
+        close(s);
+    }
+    c->sourceScope = c->sourceLabel = c->prefixLen = 0;
+    if (c->hasSource) {
+        toInet6(source, src);
+        c->sourceScope = getScope(src);
+        int unused;
+        getPolicy(src, &c->sourceLabel, &unused);
+        if (c->addr.ss_family == AF_INET6) {
+            c->prefixLen = commonPrefixLen(dst, src);
+        }
+    }
+}
+
+/* Whether a sorts before b. */
+static bool candidateBefore(const SortCandidate &a, const SortCandidate &b) {
+    // Rule 1: avoid unusable destinations.
+    if (a.hasSource != b.hasSource) {
+        return a.hasSource;
+    }
+    if (a.hasSource) {
+        // Rule 2: prefer matching scope.
+        bool aMatch = a.scope == a.sourceScope;
+        bool bMatch = b.scope == b.sourceScope;
+        if (aMatch != bMatch) {
+            return aMatch;
+        }
+        // Rule 5: prefer matching label.
+        aMatch = a.label == a.sourceLabel;
+        bMatch = b.label == b.sourceLabel;
+        if (aMatch != bMatch) {
+            return aMatch;
+        }
+    }
+    // Rule 6: prefer higher precedence.
+    if (a.precedence != b.precedence) {
+        return a.precedence > b.precedence;
+    }
+    // Rule 8: prefer smaller scope.
+    if (a.scope != b.scope) {
+        return a.scope < b.scope;
+    }
+    // Rule 9: use longest matching prefix.
+    if (a.hasSource && a.addr.ss_family == AF_INET6 && b.addr.ss_family == AF_INET6 &&
+            a.prefixLen != b.prefixLen) {
+        return a.prefixLen > b.prefixLen;
+    }
+    return a.order < b.order;
+}
+
+struct AsyncResolver::Query {
+    /* The A or the AAAA of the name; the questions of a query are asked in parallel. */
+    struct Question {
+        Query *query;
+        uint16_t type;
+        std::string packet;
+        uint16_t id;
+        int attempt;
+        int fd;                 // of the attempt in progress, or -1
+        int64_t sentUs;
+        int64_t deadlineUs;
+        bool done;
+        DnsAnswer answer;
+    };
+
+    Callback *callback;
+    std::string name;           // lower case, without a trailing dot
+    uint16_t port;
+    struct addrinfo hints;
+    bool searchDomains;         // an unanswered name may still resolve with a search domain
+    std::vector<DnsServer> servers;
+    std::vector<Question> questions;  // not resized once the query is enqueued
+    size_t outstanding;
+};
+
+class AsyncResolver::Network {
+public:
+    Network(unsigned netId);
+
+    /* Replaces the servers and drops the cache. */
+    void setConfig(const std::vector<DnsServer> &servers, bool hasDomains);
+    void flushCache();
+    /* Hands q to the loop thread. Returns false if the network has no usable servers. */
+    bool enqueue(Query *q);
+
+private:
+    typedef Query::Question Question;
+    typedef std::pair<std::string, uint16_t> CacheKey;
+    struct CacheEntry {
+        int64_t expiresUs;
+        DnsAnswer answer;
+    };
+
+    int ensureStarted();
+    static void *threadStart(void *obj);
+    void run();
+    void takePending();
+    bool ask(Question *question);
+    bool sendAttempt(Question *question);
+    void closeAttempt(Question *question);
+    void recordAttempt(const Question *question, DnsStats::Outcome outcome);
+    void onReadable(Question *question);
+    void onTimeout(Question *question);
+    void answered(Question *question);
+    void finish(Query *q);
+    ParseResult parse(const Question *question, const uint8_t *msg, size_t len,
+                      DnsAnswer *answer) const;
+    bool lookupCache(const std::string &name, uint16_t type, DnsAnswer *answer);
+    void storeCache(const std::string &name, const DnsAnswer &answer);
+
+    // Guards everything up to mCache; the rest belongs to the loop thread.
+    pthread_mutex_t mLock;
+    std::vector<DnsServer> mServers;
+    bool mHasDomains;
+    unsigned mNetId;
+    bool mStarted;
+    int mEpoll;
+    int mEventFd;
+    std::vector<Query *> mPending;
+    std::map<CacheKey, CacheEntry> mCache;
+
+    // The attempts in flight, by deadline.
+    std::set<std::pair<int64_t, Question *> > mDeadlines;
+    // Finished queries, deleted once no event of this round can refer to them.
+    std::vector<Query *> mFinished;
+};
+
+AsyncResolver::Network::Network(unsigned netId)
+        : mHasDomains(false), mNetId(netId), mStarted(false), mEpoll(-1), mEventFd(-1) {
+    pthread_mutex_init(&mLock, NULL);
+}
+
+/* Called with mLock held. */
+int AsyncResolver::Network::ensureStarted() {
+    if (mStarted) {
+        return 0;
+    }
+    mEpoll = epoll_create1(EPOLL_CLOEXEC);
+    mEventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (mEpoll < 0 || mEventFd < 0) {
+        ALOGE("Unable to set up the DNS loop of netId %u (%s)", mNetId, strerror(errno));
+        goto fail;
+    }
+    {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        pthread_t thread;
+        if (epoll_ctl(mEpoll, EPOLL_CTL_ADD, mEventFd, &ev) ||
+                pthread_create(&thread, NULL, threadStart, this)) {
+            ALOGE("Unable to start the DNS loop of netId %u", mNetId);
+            goto fail;
+        }
+        pthread_detach(thread);
+    }
+    mStarted = true;
+    return 0;
+
+fail:
+    if (mEpoll >= 0) close(mEpoll);
+    if (mEventFd >= 0) close(mEventFd);
+    mEpoll = mEventFd = -1;
+    return -1;
+}
+
+void AsyncResolver::Network::setConfig(const std::vector<DnsServer> &servers,
+                                       bool hasDomains) {
+    pthread_mutex_lock(&mLock);
+    mServers = servers;
+    mHasDomains = hasDomains;
+    mCache.clear();
+    pthread_mutex_unlock(&mLock);
+}
+
+bool AsyncResolver::Network::enqueue(Query *q) {
+    pthread_mutex_lock(&mLock);
+    if (mServers.empty() || ensureStarted()) {
+        pthread_mutex_unlock(&mLock);
+        return false;
+    }
+    q->servers = mServers;
+    q->searchDomains = mHasDomains;
+    mPending.push_back(q);
+    uint64_t one = 1;
+    if (write(mEventFd, &one, sizeof(one)) < 0) {
+        ALOGE("Unable to wake the DNS loop of netId %u (%s)", mNetId, strerror(errno));
+    }
+    pthread_mutex_unlock(&mLock);
+    return true;
+}
+
+void AsyncResolver::Network::flushCache() {
+    pthread_mutex_lock(&mLock);
+    mCache.clear();
+    pthread_mutex_unlock(&mLock);
+}
+
+void *AsyncResolver::Network::threadStart(void *obj) {
+    static_cast<Network *>(obj)->run();
+    return NULL;
+}
+
+void AsyncResolver::Network::run() {
+    struct epoll_event events[MAX_EVENTS];
+    for (;;) {
+        int timeoutMs = -1;
+        if (!mDeadlines.empty()) {
+            int64_t waitUs = mDeadlines.begin()->first - nowUs();
+            timeoutMs = waitUs > 0 ? (int) ((waitUs + 999) / 1000) : 0;
+        }
+        int n = epoll_wait(mEpoll, events, MAX_EVENTS, timeoutMs);
+        if (n < 0 && errno != EINTR) {
+            ALOGE("epoll_wait failed on netId %u (%s)", mNetId, strerror(errno));
+            n = 0;
+        }
+        // Every question has one socket at a time, so it gets at most one event here.
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr) {
+                onReadable(static_cast<Question *>(events[i].data.ptr));
+            } else {
+                takePending();
+            }
+        }
+
+        // A timeout either ends the attempt or moves it to a later deadline.
+        int64_t now = nowUs();
+        while (!mDeadlines.empty() && mDeadlines.begin()->first <= now) {
+            onTimeout(mDeadlines.begin()->second);
+        }
+
+        for (size_t i = 0; i < mFinished.size(); i++) {
+            delete mFinished[i];
+        }
+        mFinished.clear();
+    }
+}
+
+void AsyncResolver::Network::takePending() {
+    uint64_t count;
+    if (read(mEventFd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        ALOGE("Reading the eventfd of netId %u failed (%s)", mNetId, strerror(errno));
+    }
+    std::vector<Query *> pending;
+    pthread_mutex_lock(&mLock);
+    pending.swap(mPending);
+    pthread_mutex_unlock(&mLock);
+    for (size_t i = 0; i < pending.size(); i++) {
+        Query *q = pending[i];
+        q->outstanding = q->questions.size();
+        for (size_t j = 0; j < q->questions.size(); j++) {
+            Question *question = &q->questions[j];
+            question->query = q;
+            if (ask(question)) {
+                answered(question);
+                if (!q->outstanding) {
+                    break;  // finished
+                }
+            }
+        }
+    }
+}
+
+/* Starts a question. Returns true if it was answered, from the cache or with a failure. */
+bool AsyncResolver::Network::ask(Question *question) {
+    Query *q = question->query;
+    question->done = false;
+    question->fd = -1;
+    question->attempt = 0;
+    bool hit = lookupCache(q->name, question->type, &question->answer);
+    DnsStats::Instance()->recordCache(mNetId, hit);
+    if (hit) {
+        return true;
+    }
+
+    question->id = arc4random() & 0xffff;
+    std::string &packet = question->packet;
+    packet.clear();
+    put16(packet, question->id);
+    put16(packet, FLAG_RD);
+    put16(packet, 1);
+    put16(packet, 0);
+    put16(packet, 0);
+    put16(packet, 0);
+    size_t start = 0;
+    while (start < q->name.size()) {
+        size_t end = q->name.find('.', start);
+        if (end == std::string::npos) {
+            end = q->name.size();
+        }
+        packet += (char) (end - start);
+        packet.append(q->name, start, end - start);
+        start = end + 1;
+    }
+    packet += '\0';
+    put16(packet, question->type);
+    put16(packet, CLASS_IN);
+
+    if (sendAttempt(question)) {
+        return false;  // resumed by onReadable() or onTimeout()
+    }
+    question->answer.type = question->type;
+    question->answer.status = DnsAnswer::FAILED;
+    return true;
+}
+
+/* Sends the question to the next server. Returns false once every attempt is used up. */
+bool AsyncResolver::Network::sendAttempt(Question *question) {
+    const std::vector<DnsServer> &servers = question->query->servers;
+    int numServers = servers.size();
+    for (; question->attempt < numServers * RETRY_ROUNDS; question->attempt++) {
+        const DnsServer &server = servers[question->attempt % numServers];
+        int fd = socket(server.addr.ss_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                        IPPROTO_UDP);
+        if (fd < 0) {
+            ALOGE("Unable to open a DNS socket (%s)", strerror(errno));
+            return false;
+        }
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = question;
+        if (connect(fd, reinterpret_cast<const struct sockaddr *>(&server.addr), server.len) ||
+                send(fd, question->packet.data(), question->packet.size(), 0) < 0 ||
+                epoll_ctl(mEpoll, EPOLL_CTL_ADD, fd, &ev)) {
+            close(fd);
+            continue;
+        }
+
+        int round = question->attempt / numServers;
+        int64_t timeoutUs = (BASE_TIMEOUT_US << round) / numServers;
+        if (timeoutUs < MIN_TIMEOUT_US) {
+            timeoutUs = MIN_TIMEOUT_US;
+        }
+        question->fd = fd;
+        question->sentUs = nowUs();
+        question->deadlineUs = question->sentUs + timeoutUs;
+        mDeadlines.insert(std::make_pair(question->deadlineUs, question));
+        return true;
+    }
+    return false;
+}
+
+void AsyncResolver::Network::closeAttempt(Question *question) {
+    mDeadlines.erase(std::make_pair(question->deadlineUs, question));
+    close(question->fd);  // also takes it out of the epoll set
+    question->fd = -1;
+}
+
+void AsyncResolver::Network::recordAttempt(const Question *question,
+                                           DnsStats::Outcome outcome) {
+    int server = question->attempt % question->query->servers.size();
+    DnsStats::Instance()->recordServer(mNetId, server, nowUs() - question->sentUs, outcome);
+}
+
+void AsyncResolver::Network::onReadable(Question *question) {
+    if (question->fd < 0) {
+        return;  // cancelled by the other question of its query during this round
+    }
+    uint8_t buf[MAX_RESPONSE_SIZE];
+    ssize_t len = recv(question->fd, buf, sizeof(buf), 0);
+    if (len < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+
+    DnsAnswer answer;
+    // A socket error (say ECONNREFUSED) means this server is no use; so does a bad answer.
+    ParseResult res = len < 0 ? PARSE_RETRY : parse(question, buf, len, &answer);
+    if (res == PARSE_IGNORE) {
+        return;  // not the answer to this question, keep waiting
+    }
+    closeAttempt(question);
+    recordAttempt(question, res == PARSE_DONE ? DnsStats::ANSWERED :
+                  res == PARSE_SERVFAIL ? DnsStats::SERVFAIL : DnsStats::ERROR);
+    if (res != PARSE_DONE) {
+        question->attempt++;
+        if (sendAttempt(question)) {
+            return;
+        }
+        answer.type = question->type;
+        answer.status = DnsAnswer::FAILED;
+    } else if (answer.status == DnsAnswer::OK && !answer.addrs.empty() && answer.ttl > 0) {
+        storeCache(question->query->name, answer);
+    }
+    question->answer = answer;
+    answered(question);
+}
+
+void AsyncResolver::Network::onTimeout(Question *question) {
+    closeAttempt(question);
+    recordAttempt(question, DnsStats::TIMEOUT);
+    question->attempt++;
+    if (sendAttempt(question)) {
+        return;
+    }
+    question->answer.type = question->type;
+    question->answer.status = DnsAnswer::FAILED;
+    answered(question);
+}
+
+void AsyncResolver::Network::answered(Question *question) {
+    Query *q = question->query;
+    question->done = true;
+    q->outstanding--;
+    // The other family can't do better than a missing name or a truncated answer.
+    DnsAnswer::Status status = question->answer.status;
+    if (status == DnsAnswer::NXDOMAIN || status == DnsAnswer::TRUNCATED) {
+        for (size_t i = 0; i < q->questions.size(); i++) {
+            Question *other = &q->questions[i];
+            if (!other->done) {
+                if (other->fd >= 0) {
+                    closeAttempt(other);
+                }
+                other->done = true;
+                q->outstanding--;
+            }
+        }
+    }
+    if (!q->outstanding) {
+        finish(q);
+    }
+}
+
+/*
+ * Hands the addresses to the callback in RFC 6724 order, or the lookup back to the
+ * blocking resolver if it could still do better.
+ */
+void AsyncResolver::Network::finish(Query *q) {
+    mFinished.push_back(q);
+    Callback *callback = q->callback;
+    bool truncated = false;
+    for (size_t i = 0; i < q->questions.size(); i++) {
+        truncated |= q->questions[i].answer.status == DnsAnswer::TRUNCATED;
+    }
+
+    std::vector<SortCandidate> candidates;
+    const std::string *canonName = NULL;
+    for (size_t i = 0; i < q->questions.size() && !truncated; i++) {
+        const DnsAnswer &answer = q->questions[i].answer;
+        if (answer.status != DnsAnswer::OK) {
+            continue;
+        }
+        for (size_t j = 0; j < answer.addrs.size(); j++) {
+            SortCandidate c;
+            memset(&c, 0, sizeof(c));
+            if (answer.type == TYPE_A) {
+                struct sockaddr_in *sin = reinterpret_cast<struct sockaddr_in *>(&c.addr);
+                sin->sin_family = AF_INET;
+                sin->sin_port = htons(q->port);
+                memcpy(&sin->sin_addr, answer.addrs[j].data(), sizeof(sin->sin_addr));
+                c.len = sizeof(*sin);
+            } else {
+                struct sockaddr_in6 *sin6 = reinterpret_cast<struct sockaddr_in6 *>(&c.addr);
+                sin6->sin6_family = AF_INET6;
+                sin6->sin6_port = htons(q->port);
+                memcpy(&sin6->sin6_addr, answer.addrs[j].data(), sizeof(sin6->sin6_addr));
+                c.len = sizeof(*sin6);
+            }
+            c.order = candidates.size();
+            prepareCandidate(&c);
+            candidates.push_back(c);
+        }
+        if (!canonName && !answer.addrs.empty()) {
+            canonName = &answer.canonName;
+        }
+    }
+
+    if (truncated || (candidates.empty() && q->searchDomains)) {
+        callback->onFallback();
+        return;
+    }
+    if (candidates.empty()) {
+        callback->onResult(EAI_NODATA, NULL);
+        return;
+    }
+    std::sort(candidates.begin(), candidates.end(), candidateBefore);
+
+    size_t n = candidates.size();
+    std::vector<struct addrinfo> ais(n);
+    int protocol = q->hints.ai_protocol;
+    if (!protocol) {
+        protocol = q->hints.ai_socktype == SOCK_STREAM ? IPPROTO_TCP : IPPROTO_UDP;
+    }
+    for (size_t i = 0; i < n; i++) {
+        struct addrinfo &ai = ais[i];
+        memset(&ai, 0, sizeof(ai));
+        ai.ai_flags = q->hints.ai_flags;
+        ai.ai_family = candidates[i].addr.ss_family;
+        ai.ai_socktype = q->hints.ai_socktype;
+        ai.ai_protocol = protocol;
+        ai.ai_addrlen = candidates[i].len;
+        ai.ai_addr = reinterpret_cast<struct sockaddr *>(&candidates[i].addr);
+        ai.ai_next = i + 1 < n ? &ais[i + 1] : NULL;
+    }
+    if (q->hints.ai_flags & AI_CANONNAME) {
+        ais[0].ai_canonname = const_cast<char *>(canonName->c_str());
+    }
+    callback->onResult(0, &ais[0]);
+}
+
+ParseResult AsyncResolver::Network::parse(const Question *question, const uint8_t *msg,
+                                          size_t len, DnsAnswer *answer) const {
+    const Query *q = question->query;
+    if (len < DNS_HEADER_SIZE || get16(msg) != question->id) {
+        return PARSE_IGNORE;
+    }
+    uint16_t flags = get16(msg + 2);
+    if (!(flags & FLAG_QR) || get16(msg + 4) != 1) {
+        return PARSE_IGNORE;
+    }
+    uint16_t type = question->type;
+    size_t off = DNS_HEADER_SIZE;
+    std::string name;
+    if (!readName(msg, len, &off, &name) || off + 4 > len || name != q->name ||
+            get16(msg + off) != type || get16(msg + off + 2) != CLASS_IN) {
+        return PARSE_IGNORE;
+    }
+    off += 4;
+
+    answer->type = type;
+    if (flags & FLAG_TC) {
+        answer->status = DnsAnswer::TRUNCATED;
+        return PARSE_DONE;
+    }
+    int rcode = flags & 0xf;
+    if (rcode == RCODE_NXDOMAIN) {
+        answer->status = DnsAnswer::NXDOMAIN;
+        return PARSE_DONE;
+    }
+    if (rcode != RCODE_NOERROR) {
+        return PARSE_SERVFAIL;
+    }
+
+    std::vector<DnsRecord> records;
+    uint16_t count = get16(msg + 6);
+    for (uint16_t i = 0; i < count; i++) {
+        DnsRecord r;
+        if (!readName(msg, len, &off, &r.owner) || off + 10 > len) {
+            return PARSE_RETRY;
+        }
+        r.type = get16(msg + off);
+        uint16_t cls = get16(msg + off + 2);
+        r.ttl = get32(msg + off + 4);
+        r.rdlen = get16(msg + off + 8);
+        off += 10;
+        r.rdata = off;
+        if (off + r.rdlen > len) {
+            return PARSE_RETRY;
+        }
+        off += r.rdlen;
+        if (cls != CLASS_IN) {
+            continue;
+        }
+        if (r.type == TYPE_CNAME) {
+            size_t target = r.rdata;
+            if (!readName(msg, len, &target, &r.target)) {
+                return PARSE_RETRY;
+            }
+        }
+        records.push_back(r);
+    }
+
+    std::string target = q->name;
+    uint32_t ttl = 0xffffffff;
+    for (int hop = 0; hop < MAX_CNAME_HOPS; hop++) {
+        size_t i;
+        for (i = 0; i < records.size(); i++) {
+            if (records[i].type == TYPE_CNAME && records[i].owner == target) {
+                break;
+            }
+        }
+        if (i == records.size()) {
+            break;
+        }
+        target = records[i].target;
+        ttl = records[i].ttl < ttl ? records[i].ttl : ttl;
+    }
+
+    size_t addrLen = type == TYPE_A ? 4 : 16;
+    for (size_t i = 0; i < records.size(); i++) {
+        const DnsRecord &r = records[i];
+        if (r.type == type && r.owner == target && r.rdlen == addrLen) {
+            answer->addrs.push_back(std::string(reinterpret_cast<const char *>(msg + r.rdata),
+                                                r.rdlen));
+            ttl = r.ttl < ttl ? r.ttl : ttl;
+        }
+    }
+    answer->status = DnsAnswer::OK;
+    answer->canonName = target;
+    answer->ttl = answer->addrs.empty() ? 0 : ttl;
+    return PARSE_DONE;
+}
+
+bool AsyncResolver::Network::lookupCache(const std::string &name, uint16_t type,
+                                         DnsAnswer *answer) {
+    bool found = false;
+    pthread_mutex_lock(&mLock);
+    std::map<CacheKey, CacheEntry>::iterator it = mCache.find(CacheKey(name, type));
+    if (it != mCache.end()) {
+        if (it->second.expiresUs > nowUs()) {
+            *answer = it->second.answer;
+            found = true;
+        } else {
+            mCache.erase(it);
+        }
+    }
+    pthread_mutex_unlock(&mLock);
+    return found;
+}
+
+void AsyncResolver::Network::storeCache(const std::string &name, const DnsAnswer &answer) {
+    int64_t now = nowUs();
+    pthread_mutex_lock(&mLock);
+    if (mCache.size() >= MAX_CACHE_ENTRIES) {
+        std::map<CacheKey, CacheEntry>::iterator it = mCache.begin();
+        while (it != mCache.end()) {
+            if (it->second.expiresUs <= now) {
+                mCache.erase(it++);
+            } else {
+                ++it;
+            }
+        }
+        if (mCache.size() >= MAX_CACHE_ENTRIES) {
+            mCache.clear();
+        }
+    }
+    CacheEntry &entry = mCache[CacheKey(name, answer.type)];
+    entry.expiresUs = now + answer.ttl * 1000000LL;
+    entry.answer = answer;
+    pthread_mutex_unlock(&mLock);
+}
+
+AsyncResolver *AsyncResolver::sInstance = NULL;
+
+AsyncResolver *AsyncResolver::Instance() {
+    if (!sInstance) {
+        sInstance = new AsyncResolver();
+    }
+    return sInstance;
+}
+
+AsyncResolver::AsyncResolver() : mEnabled(false) {
+    pthread_mutex_init(&mLock, NULL);
+    loadHosts();
+}
+
+void AsyncResolver::setEnabled(bool enabled) {
+    mEnabled = enabled;
+}
+
+/* The names of the hosts file, which bionic answers before asking any server. */
+void AsyncResolver::loadHosts() {
+    FILE *fp = fopen(HOSTS_PATH, "re");
+    if (!fp) {
+        return;
+    }
+    char line[512];
+    while (fgets(line, sizeof(line), fp)) {
+        char *comment = strchr(line, '#');
+        if (comment) {
+            *comment = '\0';
+        }
+        char *save;
+        // The address, then its names.
+        if (!strtok_r(line, " \t\r\n", &save)) {
+            continue;
+        }
+        char *name;
+        while ((name = strtok_r(NULL, " \t\r\n", &save))) {
+            size_t len = strlen(name);
+            if (len && name[len - 1] == '.') {
+                len--;
+            }
+            mHostsNames.insert(toLower(name, len));
+        }
+    }
+    fclose(fp);
+}
+
+AsyncResolver::Network *AsyncResolver::getNetwork(unsigned netId, bool create) {
+    pthread_mutex_lock(&mLock);
+    Network *net = NULL;
+    std::map<unsigned, Network *>::iterator it = mNetworks.find(netId);
+    if (it != mNetworks.end()) {
+        net = it->second;
+    } else if (create) {
+        net = new Network(netId);
+        mNetworks[netId] = net;
+    }
+    pthread_mutex_unlock(&mLock);
+    return net;
+}
+
+void AsyncResolver::setServers(unsigned netId, const char **servers, int numServers,
+                               const char *domains) {
+    std::vector<DnsServer> parsed;
+    for (int i = 0; i < numServers; i++) {
+        DnsServer server;
+        memset(&server, 0, sizeof(server));
+        struct sockaddr_in *sin = reinterpret_cast<struct sockaddr_in *>(&server.addr);
+        struct sockaddr_in6 *sin6 = reinterpret_cast<struct sockaddr_in6 *>(&server.addr);
+        if (inet_pton(AF_INET, servers[i], &sin->sin_addr) == 1) {
+            sin->sin_family = AF_INET;
+            sin->sin_port = htons(DNS_PORT);
+            server.len = sizeof(*sin);
+        } else if (inet_pton(AF_INET6, servers[i], &sin6->sin6_addr) == 1) {
+            sin6->sin6_family = AF_INET6;
+            sin6->sin6_port = htons(DNS_PORT);
+            server.len = sizeof(*sin6);
+        } else {
+            // Leave the whole network to bionic rather than use some of its servers.
+            ALOGD("netId %u has non-numeric server %s, not resolving it here", netId,
+                  servers[i]);
+            parsed.clear();
+            break;
+        }
+        parsed.push_back(server);
+    }
+    getNetwork(netId, true)->setConfig(parsed, domains && *domains);
+}
+
+void AsyncResolver::flushCache(unsigned netId) {
+    Network *net = getNetwork(netId, false);
+    if (net) {
+        net->flushCache();
+    }
+}
+
+bool AsyncResolver::isEligible(const char *host, const char *service,
+                               const struct addrinfo *hints, uint16_t *port) const {
+    if (!host || !hints) {
+        return false;
+    }
+
+    size_t len = strlen(host);
+    if (len && host[len - 1] == '.') {
+        len--;
+    }
+    // Bare names go through the search domains first.
+    if (len == 0 || len > MAX_NAME_SIZE || !memchr(host, '.', len)) {
+        return false;
+    }
+    if (strspn(host, "0123456789.") >= len || strchr(host, ':')) {
+        return false;  // numeric, inet_aton() style included
+    }
+    size_t labelStart = 0;
+    for (size_t i = 0; i <= len; i++) {
+        if (i == len || host[i] == '.') {
+            if (i == labelStart || i - labelStart > 63) {
+                return false;
+            }
+            labelStart = i + 1;
+        }
+    }
+    if (mHostsNames.count(toLower(host, len))) {
+        return false;
+    }
+
+    if (hints->ai_flags & ~(AI_ADDRCONFIG | AI_CANONNAME | AI_NUMERICSERV | AI_PASSIVE)) {
+        return false;
+    }
+    if (hints->ai_family != AF_UNSPEC && hints->ai_family != AF_INET &&
+            hints->ai_family != AF_INET6) {
+        return false;
+    }
+    // Without a socket type bionic returns an entry per type, protocol and address.
+    if (!((hints->ai_socktype == SOCK_STREAM &&
+           (!hints->ai_protocol || hints->ai_protocol == IPPROTO_TCP)) ||
+          (hints->ai_socktype == SOCK_DGRAM &&
+           (!hints->ai_protocol || hints->ai_protocol == IPPROTO_UDP)))) {
+        return false;
+    }
+
+    *port = 0;
+    if (service) {
+        size_t digits = strspn(service, "0123456789");
+        if (!digits || service[digits] || digits > 5 || atoi(service) > 65535) {
+            return false;  // service names need getservbyname()
+        }
+        *port = atoi(service);
+    }
+    return true;
+}
+
+bool AsyncResolver::getaddrinfo(unsigned netId, const char *host, const char *service,
+                                const struct addrinfo *hints, Callback *callback) {
+    uint16_t port;
+    if (!mEnabled || !isEligible(host, service, hints, &port)) {
+        return false;
+    }
+    Network *net = getNetwork(netId, false);
+    if (!net) {
+        return false;
+    }
+
+    Query *q = new Query();
+    q->callback = callback;
+    size_t len = strlen(host);
+    q->name = toLower(host, host[len - 1] == '.' ? len - 1 : len);
+    q->port = port;
+    memset(&q->hints, 0, sizeof(q->hints));
+    q->hints.ai_flags = hints->ai_flags;
+    q->hints.ai_family = hints->ai_family;
+    q->hints.ai_socktype = hints->ai_socktype;
+    q->hints.ai_protocol = hints->ai_protocol;
+    // The same checks as bionic's AI_ADDRCONFIG.
+    bool addrConfig = hints->ai_flags & AI_ADDRCONFIG;
+    Query::Question question = Query::Question();
+    if (hints->ai_family != AF_INET6 && (!addrConfig || haveRoute(AF_INET))) {
+        question.type = TYPE_A;
+        q->questions.push_back(question);
+    }
+    if (hints->ai_family != AF_INET && (!addrConfig || haveRoute(AF_INET6))) {
+        question.type = TYPE_AAAA;
+        q->questions.push_back(question);
+    }
+
+    if (q->questions.empty() || !net->enqueue(q)) {
+        delete q;
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _ASYNC_RESOLVER_H
+#define _ASYNC_RESOLVER_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+struct addrinfo;
+
+/*
+ * Resolves the common getaddrinfo() lookups without tying up a thread per lookup: the
+ * queries go out over non-blocking UDP sockets, and each network's queries are driven
+ * by one epoll loop thread. Thousands of lookups can be in flight on a handful of
+ * threads, where the blocking resolver needs a pool thread for each. The A and AAAA
+ * questions of an AF_UNSPEC lookup are asked at the same time, and the addresses are
+ * sorted by RFC 6724 as bionic sorts them.
+ *
+ * Only lookups that the engine can answer exactly as bionic would are taken: a
+ * dotted, non-numeric host name that isn't in the hosts file, a numeric or no service,
+ * an explicit socket type and a network whose servers are numeric addresses. Anything
+ * it can't finish (a truncated answer, which needs TCP, or a name the search domains
+ * may still resolve) is handed back through onFallback() for the blocking resolver.
+ *
+ * The engine keeps its own cache of positive answers, by TTL, since it doesn't go
+ * through bionic's; ResolverController clears it with bionic's.
+ */
+class AsyncResolver {
+public:
+    class Callback {
+    public:
+        virtual ~Callback() {}
+        /* rv is 0 or an EAI_* error; result is only valid during the call. */
+        virtual void onResult(int rv, const struct addrinfo *result) = 0;
+        /* The lookup has to be done by the blocking resolver after all. */
+        virtual void onFallback() = 0;
+    };
+
+    static AsyncResolver *Instance();
+
+    void setEnabled(bool enabled);
+    bool isEnabled() const { return mEnabled; }
+
+    /* Called by ResolverController for every configuration it applies. */
+    void setServers(unsigned netId, const char **servers, int numServers, const char *domains);
+    void flushCache(unsigned netId);
+
+    /*
+     * Starts a lookup. Returns false if it isn't one the engine takes, and callback
+     * wasn't used. Otherwise exactly one of the callback methods is called, possibly
+     * before this returns, and possibly from another thread.
+     */
+    bool getaddrinfo(unsigned netId, const char *host, const char *service,
+                     const struct addrinfo *hints, Callback *callback);
+
+private:
+    class Network;
+    struct Query;
+
+    AsyncResolver();
+    Network *getNetwork(unsigned netId, bool create);
+    bool isEligible(const char *host, const char *service, const struct addrinfo *hints,
+                    uint16_t *port) const;
+    void loadHosts();
+
+    static AsyncResolver *sInstance;
+
+    volatile bool mEnabled;
+    pthread_mutex_t mLock;  // guards mNetworks
+    std::map<unsigned, Network *> mNetworks;
+    std::set<std::string> mHostsNames;  // names in the hosts file, lower case
+};
+
+#endif
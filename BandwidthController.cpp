@@ -36,17 +36,25 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 
+#include <netinet/in.h>
+#include <net/if.h>
+
+#include <linux/netfilter_ipv4/ip_tables.h>
 #include <linux/netlink.h>
 #include <linux/rtnetlink.h>
 #include <linux/pkt_sched.h>
 
+#include <algorithm>
+
 #define LOG_TAG "BandwidthController"
 #include <cutils/log.h>
 #include <cutils/properties.h>
-#include <logwrap/logwrap.h>
 
 #include "NetdConstants.h"
+#include "BinaryFraming.h"
 #include "BandwidthController.h"
+#include "IptablesTransaction.h"
+#include "LatencyStats.h"
 #include "NatController.h"  /* For LOCAL_TETHER_COUNTERS_CHAIN */
 #include "ResponseCode.h"
 
@@ -99,15 +107,18 @@ const int  BandwidthController::MAX_IPT_OUTPUT_LINE_LEN = 256;
  *
  * * bw_penalty_box handling:
  *  - only one bw_penalty_box for all interfaces
- *   E.g  Adding an app, it has to preserve the appened bw_happy_box, so "-I":
- *    iptables -I bw_penalty_box -m owner --uid-owner app_3 \
+ *  - the naughty app uids are a tree of chains rooted at bw_penalty_box, see UidChainTree,
+ *    and rewritten as a whole on every change. A uid ends up in a rule like:
+ *    iptables -A bw_penalty_box_2 -m owner --uid-owner app_3 \
  *        --jump REJECT --reject-with icmp-port-unreachable
  *
  * * bw_happy_box handling:
- *  - The bw_happy_box goes at the end of the penalty box.
- *   E.g  Adding a happy app,
- *    iptables -I bw_happy_box -m owner --uid-owner app_3 \
+ *  - The bw_happy_box goes at the end of the penalty box: every chain of the penalty
+ *    tree ends with "--jump bw_happy_box".
+ *  - The nice app uids are a tree rooted at bw_happy_box, with rules like:
+ *    iptables -A bw_happy_box_1 -m owner --uid-owner app_3 \
  *        --jump RETURN
+ *    and every chain of it ends with "--jump REJECT".
  */
 const char *BandwidthController::IPT_FLUSH_COMMANDS[] = {
     /*
@@ -133,12 +144,6 @@ const char *BandwidthController::IPT_CLEANUP_COMMANDS[] = {
     "-X bw_costly_shared",
 };
 
-const char *BandwidthController::IPT_SETUP_COMMANDS[] = {
-    "-N bw_happy_box",
-    "-N bw_penalty_box",
-    "-N bw_costly_shared",
-};
-
 const char *BandwidthController::IPT_BASIC_ACCOUNTING_COMMANDS[] = {
     "-A bw_INPUT -m owner --socket-exists", /* This is a tracking rule. */
 
@@ -150,17 +155,32 @@ const char *BandwidthController::IPT_BASIC_ACCOUNTING_COMMANDS[] = {
     "-t mangle -A bw_mangle_POSTROUTING -m owner --socket-exists", /* This is a tracking rule. */
 };
 
-BandwidthController::BandwidthController(void) {
+BandwidthController::BandwidthController(void)
+        : mAdopted(false), mPenaltyBox("bw_penalty_box"), mHappyBox("bw_happy_box"),
+          mHappyBoxEnabled(false) {
 }
 
+class BandwidthController::IptablesCmdTask : public FamilyTask {
+public:
+    IptablesCmdTask(const char *cmd, IptJumpOp jumpHandling, IptFailureLog failureHandling)
+            : mCmd(cmd), mJumpHandling(jumpHandling), mFailureHandling(failureHandling) {}
+
+    virtual int run(IptablesTarget family) {
+        return runIptablesCmd(mCmd, mJumpHandling, family == V4 ? IptIpV4 : IptIpV6,
+                              mFailureHandling);
+    }
+
+private:
+    const char *mCmd;
+    IptJumpOp mJumpHandling;
+    IptFailureLog mFailureHandling;
+};
+
 int BandwidthController::runIpxtablesCmd(const char *cmd, IptJumpOp jumpHandling,
                                          IptFailureLog failureHandling) {
-    int res = 0;
-
     ALOGV("runIpxtablesCmd(cmd=%s)", cmd);
-    res |= runIptablesCmd(cmd, jumpHandling, IptIpV4, failureHandling);
-    res |= runIptablesCmd(cmd, jumpHandling, IptIpV6, failureHandling);
-    return res;
+    IptablesCmdTask task(cmd, jumpHandling, failureHandling);
+    return runForFamilies(V4V6, &task);
 }
 
 int BandwidthController::StrncpyAndCheck(char *buffer, const char *src, size_t buffSize) {
@@ -170,6 +190,8 @@ int BandwidthController::StrncpyAndCheck(char *buffer, const char *src, size_t b
     return buffer[buffSize - 1];
 }
 
+static LatencyStats sRunIptablesCmdStats("exec", "BandwidthController::runIptablesCmd");
+
 int BandwidthController::runIptablesCmd(const char *cmd, IptJumpOp jumpHandling,
                                         IptIpVer iptVer, IptFailureLog failureHandling) {
     char buffer[MAX_CMD_LEN];
@@ -216,12 +238,16 @@ int BandwidthController::runIptablesCmd(const char *cmd, IptJumpOp jumpHandling,
     }
 
     argv[argc] = NULL;
-    res = android_fork_execvp(argc, (char **)argv, &status, false,
-            failureHandling == IptFailShow);
-    res = res || !WIFEXITED(status) || WEXITSTATUS(status);
+    // Not through logwrap, which would serialize the IPv4 and IPv6 halves of
+    // runIpxtablesCmd().
+    std::string output;
+    int64_t start = LatencyStats::now();
+    status = execWithInput(argv, std::string(), &output);
+    res = status != 0;
+    sRunIptablesCmdStats.record(start, res);
     if (res && failureHandling == IptFailShow) {
-      ALOGE("runIptablesCmd(): res=%d status=%d failed %s", res, status,
-            fullCmd.c_str());
+      ALOGE("runIptablesCmd(): res=%d status=%d failed %s: %s", res, status,
+            fullCmd.c_str(), output.c_str());
     }
     return res;
 }
@@ -230,6 +256,16 @@ void BandwidthController::flushCleanTables(bool doClean) {
     /* Flush and remove the bw_costly_<iface> tables */
     flushExistingCostlyTables(doClean);
 
+    /* Drop the special app trees first, they jump to bw_happy_box. */
+    IptablesTransaction t;
+    mPenaltyBox.clear(t);
+    mHappyBox.clear(t);
+    if (!t.commit(true)) {
+        mPenaltyBox.committed();
+        mHappyBox.committed();
+    }
+    mHappyBoxEnabled = false;
+
     /* Some of the initialCommands are allowed to fail */
     runCommands(sizeof(IPT_FLUSH_COMMANDS) / sizeof(char*),
             IPT_FLUSH_COMMANDS, RunCmdFailureOk);
@@ -240,34 +276,296 @@ void BandwidthController::flushCleanTables(bool doClean) {
     }
 }
 
-int BandwidthController::setupIptablesHooks(void) {
+int BandwidthController::setupIptablesHooks(IptablesTransaction &bootstrap,
+                                            const std::string *savedRules) {
+    char value[PROPERTY_VALUE_MAX];
+    std::list<std::string> costlyTables;
+    std::list<std::string>::iterator it;
 
-    /* flush+clean is allowed to fail */
-    flushCleanTables(true);
-    runCommands(sizeof(IPT_SETUP_COMMANDS) / sizeof(char*),
-            IPT_SETUP_COMMANDS, RunCmdFailureBad);
+    /*
+     * The bw_* child chains have just been created empty, so nothing references
+     * the bw_costly_<iface> tables anymore and they can all go.
+     * Declaring a chain creates it if needed, so the -X holds for both ip4 and ip6.
+     */
+    findExistingCostlyTables(costlyTables);
+    for (it = costlyTables.begin(); it != costlyTables.end(); it++) {
+        bootstrap.addChain(V4V6, "filter", it->c_str());
+        bootstrap.add(V4V6, "-X", it->c_str(), NULL);
+    }
+
+    /*
+     * Creates the shared chains, or flushes them if they survived a restart, along with
+     * the rest of the special app trees.
+     */
+    mPenaltyBox.adopt(savedRules);
+    mHappyBox.adopt(savedRules);
+    mPenaltyBox.clear(bootstrap);
+    mHappyBox.clear(bootstrap);
+    bootstrap.addChain(V4V6, "filter", "bw_costly_shared");
+
+    resetState();
+
+    property_get("persist.bandwidth.enable", value, "1");
+    if (strcmp(value, "0")) {
+        for (size_t i = 0; i < ARRAY_SIZE(IPT_BASIC_ACCOUNTING_COMMANDS); i++) {
+            bootstrap.addCommand(V4V6, IPT_BASIC_ACCOUNTING_COMMANDS[i]);
+        }
+    }
 
     return 0;
 }
 
-int BandwidthController::enableBandwidthControl(bool force) {
-    int res;
+/* Splits an iptables-save rule into its words. */
+static void splitRule(const std::string &rule, std::vector<std::string> *words) {
+    size_t start = 0;
+    while (start < rule.size()) {
+        size_t end = rule.find(' ', start);
+        if (end == std::string::npos) {
+            end = rule.size();
+        }
+        if (end > start) {
+            words->push_back(rule.substr(start, end - start));
+        }
+        start = end + 1;
+    }
+}
+
+/* Finds the value following option in a rule, e.g. "wlan0" for "-i". */
+static bool getRuleOption(const std::vector<std::string> &words, const char *option,
+                          std::string *value) {
+    for (size_t i = 0; i + 1 < words.size(); i++) {
+        if (words[i] == option) {
+            *value = words[i + 1];
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * The name and configured bytes of a quota2 rule. The bytes left are only in
+ * /proc/net/xt_quota/<name>, which is what survives untouched.
+ */
+static bool getRuleQuota(const std::vector<std::string> &words, std::string *name,
+                         int64_t *bytes) {
+    std::string value;
+    if (!getRuleOption(words, "--name", name) || !getRuleOption(words, "--quota", &value)) {
+        return false;
+    }
+    char *end;
+    *bytes = strtoll(value.c_str(), &end, 10);
+    return *bytes > 0 && !*end;
+}
+
+int BandwidthController::adoptCostlyChain(const std::string &dump, const std::string &costName,
+                                          int64_t *quota, int64_t *alert) {
+    std::string chain = "bw_costly_" + costName;
+    std::string alertName = costName + "Alert";
+    std::vector<std::string> rules;
+
+    IptablesTransaction::listRules(dump, "filter", chain.c_str(), &rules);
+    *quota = *alert = 0;
+    for (size_t i = 0; i < rules.size(); i++) {
+        std::vector<std::string> words;
+        std::string name;
+        int64_t bytes;
+        splitRule(rules[i], &words);
+        if (!getRuleOption(words, "--name", &name)) {
+            continue;   // The bw_penalty_box jump.
+        }
+        if (!getRuleQuota(words, &name, &bytes)) {
+            ALOGE("Unexpected rule in %s: %s", chain.c_str(), rules[i].c_str());
+            return -1;
+        }
+        if (name == costName) {
+            *quota = bytes;
+        } else if (name == alertName) {
+            *alert = bytes;
+        } else {
+            ALOGE("Unexpected quota %s in %s", name.c_str(), chain.c_str());
+            return -1;
+        }
+    }
+    if (!*quota) {
+        ALOGE("No quota in %s", chain.c_str());
+        return -1;
+    }
+    return 0;
+}
+
+int BandwidthController::adoptSpecialApps(const std::string &dump, const UidChainTree &box,
+                                          std::set<int /*appUid*/> &specialAppUids) {
+    std::vector<std::string> chains;
+    std::vector<std::string> rules;
+
+    IptablesTransaction::listChains(dump, "filter", &chains);
+    for (size_t i = 0; i < chains.size(); i++) {
+        if (box.isTreeChain(chains[i])) {
+            IptablesTransaction::listRules(dump, "filter", chains[i].c_str(), &rules);
+        }
+    }
+    for (size_t i = 0; i < rules.size(); i++) {
+        std::vector<std::string> words;
+        std::string value;
+        int first, last;
+        splitRule(rules[i], &words);
+        if (!getRuleOption(words, "--uid-owner", &value) || getRuleOption(words, "-g", &value)) {
+            continue;   // The jumps inside the tree, to bw_happy_box, and the REJECTs.
+        }
+        int matched = sscanf(value.c_str(), "%d-%d", &first, &last);
+        if (matched < 1 || first < 0) {
+            ALOGE("Unexpected rule in %s: %s", box.root(), rules[i].c_str());
+            return -1;
+        }
+        if (matched == 1) {
+            last = first;
+        }
+        for (int uid = first; uid <= last; uid++) {
+            specialAppUids.insert(uid);
+        }
+    }
+    return 0;
+}
+
+int BandwidthController::adoptIptablesState(IptablesTransaction &bootstrap,
+                                            const std::string *savedRules) {
+    // bw_happy_box is gone while the happy box is disabled.
+    static const char *SHARED_CHAINS[] = { "bw_penalty_box", "bw_costly_shared" };
+    static const char *COSTLY_PREFIX = "bw_costly_";
+    const std::string &dump = savedRules[V4];
     char value[PROPERTY_VALUE_MAX];
+    std::vector<std::string> chains;
+    std::set<std::string> adoptedChains;
+    std::vector<std::string> rules;
+
+    property_get("persist.bandwidth.enable", value, "1");
+    if (!strcmp(value, "0") ||
+            IptablesTransaction::countRules(dump, "filter",
+                                            "-A bw_INPUT -m owner --socket-exists") != 1) {
+        ALOGI("No bandwidth accounting to adopt");
+        return -1;
+    }
 
-    if (!force) {
-            property_get("persist.bandwidth.enable", value, "1");
-            if (!strcmp(value, "0"))
-                    return 0;
+    IptablesTransaction::listChains(dump, "filter", &chains);
+    for (size_t i = 0; i < ARRAY_SIZE(SHARED_CHAINS); i++) {
+        if (std::find(chains.begin(), chains.end(), SHARED_CHAINS[i]) == chains.end()) {
+            ALOGE("No %s to adopt", SHARED_CHAINS[i]);
+            return -1;
+        }
     }
 
-    /* Let's pretend we started from scratch ... */
+    /*
+     * Both families always get the same jumps and alerts, and a quota2 counter is shared
+     * by the rules of both, so the IPv4 dump says it all once they agree.
+     */
+    const char *checkedChains[] = { LOCAL_INPUT, LOCAL_OUTPUT };
+    for (size_t i = 0; i < ARRAY_SIZE(checkedChains); i++) {
+        std::vector<std::string> v4Rules, v6Rules;
+        IptablesTransaction::listRules(savedRules[V4], "filter", checkedChains[i], &v4Rules);
+        IptablesTransaction::listRules(savedRules[V6], "filter", checkedChains[i], &v6Rules);
+        if (v4Rules != v6Rules) {
+            ALOGE("The IPv4 and IPv6 %s differ", checkedChains[i]);
+            return -1;
+        }
+    }
+
+    resetState();
+    IptablesTransaction::listRules(dump, "filter", LOCAL_INPUT, &rules);
+    for (size_t i = 0; i < rules.size(); i++) {
+        std::vector<std::string> words;
+        std::string target, iface, name;
+        int64_t bytes;
+        splitRule(rules[i], &words);
+
+        if (getRuleOption(words, "-j", &target) && !target.compare(0, strlen(COSTLY_PREFIX),
+                COSTLY_PREFIX)) {
+            std::string costName = target.substr(strlen(COSTLY_PREFIX));
+            if (!getRuleOption(words, "-i", &iface)) {
+                goto fail;
+            }
+            if (costName == "shared") {
+                sharedQuotaIfaces.push_back(iface);
+            } else if (costName == iface) {
+                QuotaInfo info(iface, 0, 0);
+                if (adoptCostlyChain(dump, costName, &info.quota, &info.alert)) {
+                    goto fail;
+                }
+                quotaIfaces.push_back(info);
+            } else {
+                goto fail;
+            }
+            adoptedChains.insert(target);
+        } else if (getRuleOption(words, "--name", &name)) {
+            if (name != ALERT_GLOBAL_NAME || !getRuleQuota(words, &name, &bytes)) {
+                goto fail;
+            }
+            globalAlertBytes = bytes;
+        }
+    }
+    if (!sharedQuotaIfaces.empty() &&
+            adoptCostlyChain(dump, "shared", &sharedQuotaBytes, &sharedAlertBytes)) {
+        goto fail;
+    }
+    if (adoptSpecialApps(dump, mPenaltyBox, naughtyAppUids) ||
+            adoptSpecialApps(dump, mHappyBox, niceAppUids)) {
+        goto fail;
+    }
+    mPenaltyBox.adopt(savedRules);
+    mHappyBox.adopt(savedRules);
+    mHappyBoxEnabled = IptablesTransaction::countRules(dump, "filter",
+                                                       "-A bw_penalty_box -j bw_happy_box") == 1;
+
+    /* Nothing jumps to the other bw_costly_<iface> chains anymore. */
+    for (size_t i = 0; i < chains.size(); i++) {
+        if (!chains[i].compare(0, strlen(COSTLY_PREFIX), COSTLY_PREFIX) &&
+                chains[i] != "bw_costly_shared" && !adoptedChains.count(chains[i])) {
+            bootstrap.addChain(V4V6, "filter", chains[i].c_str());
+            bootstrap.add(V4V6, "-X", chains[i].c_str(), NULL);
+        }
+    }
+
+    ALOGI("Adopted %zu interface quotas, %zu shared quota interfaces, %zu naughty and "
+          "%zu nice apps", quotaIfaces.size(), sharedQuotaIfaces.size(),
+          naughtyAppUids.size(), niceAppUids.size());
+    mAdopted = true;
+    return 0;
+
+    fail:
+    ALOGE("Unable to adopt the %s rules", LOCAL_INPUT);
+    resetState();
+    return -1;
+}
+
+void BandwidthController::resetState(void) {
     sharedQuotaIfaces.clear();
     quotaIfaces.clear();
+    quotaFiles.clear();
     naughtyAppUids.clear();
     niceAppUids.clear();
     globalAlertBytes = 0;
     globalAlertTetherCount = 0;
     sharedQuotaBytes = sharedAlertBytes = 0;
+    mHappyBoxEnabled = false;
+}
+
+int BandwidthController::enableBandwidthControl(bool force) {
+    int res;
+    char value[PROPERTY_VALUE_MAX];
+
+    if (!force) {
+            property_get("persist.bandwidth.enable", value, "1");
+            if (!strcmp(value, "0"))
+                    return 0;
+    }
+
+    if (mAdopted) {
+        /* The framework is setting up again what adoptIptablesState() kept. */
+        mAdopted = false;
+        return 0;
+    }
+
+    /* Let's pretend we started from scratch ... */
+    resetState();
 
     flushCleanTables(false);
     res = runCommands(sizeof(IPT_BASIC_ACCOUNTING_COMMANDS) / sizeof(char*),
@@ -279,6 +577,7 @@ int BandwidthController::enableBandwidthControl(bool force) {
 
 int BandwidthController::disableBandwidthControl(void) {
 
+    mAdopted = false;
     flushCleanTables(false);
     return 0;
 }
@@ -299,77 +598,35 @@ int BandwidthController::runCommands(int numCommands, const char *commands[],
     return 0;
 }
 
-std::string BandwidthController::makeIptablesSpecialAppCmd(IptOp op, int uid, const char *chain) {
-    std::string res;
-    char *buff;
-    const char *opFlag;
-
-    switch (op) {
-    case IptOpInsert:
-        opFlag = "-I";
-        break;
-    case IptOpAppend:
-        ALOGE("Append op not supported for %s uids", chain);
-        res = "";
-        return res;
-        break;
-    case IptOpReplace:
-        opFlag = "-R";
-        break;
-    default:
-    case IptOpDelete:
-        opFlag = "-D";
-        break;
-    }
-    asprintf(&buff, "%s %s -m owner --uid-owner %d", opFlag, chain, uid);
-    res = buff;
-    free(buff);
-    return res;
-}
-
 int BandwidthController::enableHappyBox(void) {
-    char cmd[MAX_CMD_LEN];
-    int res = 0;
-
-    /*
-     * We tentatively delete before adding, which helps recovering
-     * from bad states (e.g. netd died).
-     */
-
-    /* Should not exist, but ignore result if already there. */
-    snprintf(cmd, sizeof(cmd), "-N bw_happy_box");
-    runIpxtablesCmd(cmd, IptJumpNoAdd);
+    IptablesTransaction t;
 
     /* Should be empty, but clear in case something was wrong. */
     niceAppUids.clear();
-    snprintf(cmd, sizeof(cmd), "-F bw_happy_box");
-    res |= runIpxtablesCmd(cmd, IptJumpNoAdd);
-
-    snprintf(cmd, sizeof(cmd), "-D bw_penalty_box -j bw_happy_box");
-    runIpxtablesCmd(cmd, IptJumpNoAdd);
-    snprintf(cmd, sizeof(cmd), "-A bw_penalty_box -j bw_happy_box");
-    res |= runIpxtablesCmd(cmd, IptJumpNoAdd);
-
-    /* Reject. Defaulting to prot-unreachable */
-    snprintf(cmd, sizeof(cmd), "-D bw_happy_box -j REJECT");
-    runIpxtablesCmd(cmd, IptJumpNoAdd);
-    snprintf(cmd, sizeof(cmd), "-A bw_happy_box -j REJECT");
-    res |= runIpxtablesCmd(cmd, IptJumpNoAdd);
-
+    mHappyBoxEnabled = true;
+    buildSpecialAppBox(t, mHappyBox, niceAppUids);
+    buildSpecialAppBox(t, mPenaltyBox, naughtyAppUids);
+
+    int res = t.commit();
+    if (!res) {
+        mHappyBox.committed();
+        mPenaltyBox.committed();
+    }
     return res;
 }
 
 int BandwidthController::disableHappyBox(void) {
-    char cmd[MAX_CMD_LEN];
+    IptablesTransaction t;
 
     /* Best effort */
-    snprintf(cmd, sizeof(cmd), "-D bw_penalty_box -j bw_happy_box");
-    runIpxtablesCmd(cmd, IptJumpNoAdd);
     niceAppUids.clear();
-    snprintf(cmd, sizeof(cmd), "-F bw_happy_box");
-    runIpxtablesCmd(cmd, IptJumpNoAdd);
-    snprintf(cmd, sizeof(cmd), "-X bw_happy_box");
-    runIpxtablesCmd(cmd, IptJumpNoAdd);
+    mHappyBoxEnabled = false;
+    buildSpecialAppBox(t, mPenaltyBox, naughtyAppUids);
+    mHappyBox.remove(t);
+    if (!t.commit()) {
+        mPenaltyBox.committed();
+        mHappyBox.committed();
+    }
 
     return 0;
 }
@@ -391,34 +648,38 @@ int BandwidthController::removeNiceApps(int numUids, char *appUids[]) {
 }
 
 int BandwidthController::manipulateNaughtyApps(int numUids, char *appStrUids[], SpecialAppOp appOp) {
-    return manipulateSpecialApps(numUids, appStrUids, "bw_penalty_box", naughtyAppUids, IptJumpReject, appOp);
+    return manipulateSpecialApps(numUids, appStrUids, mPenaltyBox, naughtyAppUids, appOp);
 }
 
 int BandwidthController::manipulateNiceApps(int numUids, char *appStrUids[], SpecialAppOp appOp) {
-    return manipulateSpecialApps(numUids, appStrUids, "bw_happy_box", niceAppUids, IptJumpReturn, appOp);
+    return manipulateSpecialApps(numUids, appStrUids, mHappyBox, niceAppUids, appOp);
 }
 
 
+void BandwidthController::buildSpecialAppBox(IptablesTransaction &t, UidChainTree &box,
+                                             const std::set<int /*appUid*/> &uids) {
+    if (&box == &mPenaltyBox) {
+        box.build(t, uids, "REJECT", mHappyBoxEnabled ? "-j bw_happy_box" : NULL);
+    } else {
+        box.build(t, uids, "RETURN", mHappyBoxEnabled ? "-j REJECT" : NULL);
+    }
+}
+
 int BandwidthController::manipulateSpecialApps(int numUids, char *appStrUids[],
-                                               const char *chain,
-                                               std::list<int /*appUid*/> &specialAppUids,
-                                               IptJumpOp jumpHandling, SpecialAppOp appOp) {
+                                               UidChainTree &box,
+                                               std::set<int /*appUid*/> &specialAppUids,
+                                               SpecialAppOp appOp) {
 
-    char cmd[MAX_CMD_LEN];
     int uidNum;
     const char *failLogTemplate;
-    IptOp op;
-    int appUids[numUids];
-    std::string iptCmd;
-    std::list<int /*uid*/>::iterator it;
+    const char *chain = box.root();
+    std::set<int /*uid*/> newUids = specialAppUids;
 
     switch (appOp) {
     case SpecialAppOpAdd:
-        op = IptOpInsert;
         failLogTemplate = "Failed to add app uid %s(%d) to %s.";
         break;
     case SpecialAppOpRemove:
-        op = IptOpDelete;
         failLogTemplate = "Failed to delete app uid %s(%d) from %s box.";
         break;
     default:
@@ -428,49 +689,37 @@ int BandwidthController::manipulateSpecialApps(int numUids, char *appStrUids[],
 
     for (uidNum = 0; uidNum < numUids; uidNum++) {
         char *end;
-        appUids[uidNum] = strtoul(appStrUids[uidNum], &end, 0);
+        int uid = strtoul(appStrUids[uidNum], &end, 0);
         if (*end || !*appStrUids[uidNum]) {
-            ALOGE(failLogTemplate, appStrUids[uidNum], appUids[uidNum], chain);
-            goto fail_parse;
-        }
-    }
-
-    for (uidNum = 0; uidNum < numUids; uidNum++) {
-        int uid = appUids[uidNum];
-        for (it = specialAppUids.begin(); it != specialAppUids.end(); it++) {
-            if (*it == uid)
-                break;
+            ALOGE(failLogTemplate, appStrUids[uidNum], uid, chain);
+            return -1;
         }
-        bool found = (it != specialAppUids.end());
 
         if (appOp == SpecialAppOpRemove) {
-            if (!found) {
+            if (!newUids.erase(uid)) {
                 ALOGE("No such appUid %d to remove", uid);
                 return -1;
             }
-            specialAppUids.erase(it);
-        } else {
-            if (found) {
-                ALOGE("appUid %d exists already", uid);
-                return -1;
-            }
-            specialAppUids.push_front(uid);
+        } else if (!newUids.insert(uid).second) {
+            ALOGE("appUid %d exists already", uid);
+            return -1;
         }
+    }
 
-        iptCmd = makeIptablesSpecialAppCmd(op, uid, chain);
-        if (runIpxtablesCmd(iptCmd.c_str(), jumpHandling)) {
-            ALOGE(failLogTemplate, appStrUids[uidNum], uid, chain);
-            goto fail_with_uidNum;
-        }
+    /*
+     * The whole tree is rewritten in one transaction, so adding or removing a batch of
+     * uids costs a single iptables-restore rather than one iptables run per uid.
+     */
+    IptablesTransaction t;
+    buildSpecialAppBox(t, box, newUids);
+
+    if (t.commit()) {
+        ALOGE("Failed to update %d app uid(s) in %s", numUids, chain);
+        return -1;
     }
+    box.committed();
+    specialAppUids.swap(newUids);
     return 0;
-
-fail_with_uidNum:
-    /* Try to remove the uid that failed in any case*/
-    iptCmd = makeIptablesSpecialAppCmd(IptOpDelete, appUids[uidNum], chain);
-    runIpxtablesCmd(iptCmd.c_str(), jumpHandling);
-fail_parse:
-    return -1;
 }
 
 std::string BandwidthController::makeIptablesQuotaCmd(IptOp op, const char *costName, int64_t quota) {
@@ -690,6 +939,7 @@ int BandwidthController::removeInterfaceSharedQuota(const char *iface) {
         std::string quotaCmd;
         quotaCmd = makeIptablesQuotaCmd(IptOpDelete, costName, sharedQuotaBytes);
         res |= runIpxtablesCmd(quotaCmd.c_str(), IptJumpReject);
+        quotaFiles.forget(costName);
         sharedQuotaBytes = 0;
         if (sharedAlertBytes) {
             removeSharedAlert();
@@ -746,7 +996,7 @@ int BandwidthController::setInterfaceQuota(const char *iface, int64_t maxBytes)
 
         quotaIfaces.push_front(QuotaInfo(ifaceName, maxBytes, 0));
 
-    } else {
+    } else if (maxBytes != it->quota) {
         res |= updateQuota(costName, maxBytes);
         if (res) {
             ALOGE("Failed update quota for %s", iface);
@@ -772,21 +1022,45 @@ int BandwidthController::getInterfaceSharedQuota(int64_t *bytes) {
 }
 
 int BandwidthController::getInterfaceQuota(const char *costName, int64_t *bytes) {
-    FILE *fp;
-    char *fname;
-    int scanRes;
-
-    asprintf(&fname, "/proc/net/xt_quota/%s", costName);
-    fp = fopen(fname, "r");
-    free(fname);
-    if (!fp) {
-        ALOGE("Reading quota %s failed (%s)", costName, strerror(errno));
+    bool exists;
+    if (!strcmp(costName, "shared")) {
+        exists = !sharedQuotaIfaces.empty();
+    } else {
+        std::list<QuotaInfo>::iterator it;
+        for (it = quotaIfaces.begin(); it != quotaIfaces.end() && it->ifaceName != costName; it++) {
+        }
+        exists = (it != quotaIfaces.end());
+    }
+    if (!exists) {
+        ALOGE("No quota set for %s", costName);
         return -1;
     }
-    scanRes = fscanf(fp, "%" SCNd64, bytes);
-    ALOGV("Read quota res=%d bytes=%" PRId64, scanRes, *bytes);
-    fclose(fp);
-    return scanRes == 1 ? 0 : -1;
+
+    int res = quotaFiles.read(costName, bytes);
+    ALOGV("Read quota res=%d bytes=%" PRId64, res, *bytes);
+    return res;
+}
+
+int BandwidthController::getInterfaceQuotas(std::list<std::pair<std::string, int64_t> > &quotas) {
+    int64_t bytes;
+    int res = 0;
+
+    if (!sharedQuotaIfaces.empty()) {
+        if (quotaFiles.read("shared", &bytes)) {
+            res = -1;
+        } else {
+            quotas.push_back(std::make_pair(std::string("shared"), bytes));
+        }
+    }
+    std::list<QuotaInfo>::iterator it;
+    for (it = quotaIfaces.begin(); it != quotaIfaces.end(); it++) {
+        if (quotaFiles.read(it->ifaceName.c_str(), &bytes)) {
+            res = -1;
+        } else {
+            quotas.push_back(std::make_pair(it->ifaceName, bytes));
+        }
+    }
+    return res;
 }
 
 int BandwidthController::removeInterfaceQuota(const char *iface) {
@@ -818,6 +1092,7 @@ int BandwidthController::removeInterfaceQuota(const char *iface) {
     res |= cleanupCostlyIface(ifn, QuotaUnique);
 
     quotaIfaces.erase(it);
+    quotaFiles.forget(costName);
 
     return res;
 }
@@ -1090,26 +1365,17 @@ int BandwidthController::removeCostlyAlert(const char *costName, int64_t *alertB
  *       1040   107471 RETURN     all  --  bt-pan rmnet0  0.0.0.0/0            0.0.0.0/0            counter bt-pan_rmnet0: 0 bytes
  *       1450  1708806 RETURN     all  --  rmnet0 bt-pan  0.0.0.0/0            0.0.0.0/0            counter rmnet0_bt-pan: 0 bytes
  */
-int BandwidthController::parseForwardChainStats(SocketClient *cli, const TetherStats filter,
-                                                FILE *fp, std::string &extraProcessingInfo) {
+void BandwidthController::parseForwardChainRules(FILE *fp, std::vector<ForwardChainRule> &rules,
+                                                 std::string &extraProcessingInfo) {
     int res;
     char lineBuffer[MAX_IPT_OUTPUT_LINE_LEN];
     char iface0[MAX_IPT_OUTPUT_LINE_LEN];
     char iface1[MAX_IPT_OUTPUT_LINE_LEN];
     char rest[MAX_IPT_OUTPUT_LINE_LEN];
 
-    TetherStats stats;
     char *buffPtr;
     int64_t packets, bytes;
 
-    bool filterPair = filter.intIface[0] && filter.extIface[0];
-
-    char *filterMsg = filter.getStatsLine();
-    ALOGV("filter: %s",  filterMsg);
-    free(filterMsg);
-
-    stats = filter;
-
     while (NULL != (buffPtr = fgets(lineBuffer, MAX_IPT_OUTPUT_LINE_LEN, fp))) {
         /* Clean up, so a failed parse can still print info */
         iface0[0] = iface1[0] = rest[0] = packets = bytes = 0;
@@ -1122,6 +1388,136 @@ int BandwidthController::parseForwardChainStats(SocketClient *cli, const TetherS
         if (res != 5) {
             continue;
         }
+        rules.push_back(ForwardChainRule(iface0, iface1, packets, bytes));
+    }
+}
+
+int BandwidthController::readForwardChainRules(const char *chain,
+                                               std::vector<ForwardChainRule> &rules,
+                                               std::string &extraProcessingInfo) {
+    int sock = socket(AF_INET, SOCK_RAW | SOCK_CLOEXEC, IPPROTO_RAW);
+    if (sock < 0) {
+        ALOGE("Failed to open iptables socket err=%s", strerror(errno));
+        return -1;
+    }
+
+    /* The table may be replaced between the two calls; the kernel says EAGAIN then. */
+    struct ipt_get_entries *entries = NULL;
+    int res = -1;
+    for (int attempt = 0; attempt < 3 && res; attempt++) {
+        struct ipt_getinfo info;
+        memset(&info, 0, sizeof(info));
+        strncpy(info.name, "filter", sizeof(info.name) - 1);
+        socklen_t len = sizeof(info);
+        if (getsockopt(sock, IPPROTO_IP, IPT_SO_GET_INFO, &info, &len)) {
+            break;
+        }
+
+        len = sizeof(*entries) + info.size;
+        free(entries);
+        entries = (struct ipt_get_entries *) malloc(len);
+        if (!entries) {
+            break;
+        }
+        memset(entries, 0, sizeof(*entries));
+        strncpy(entries->name, "filter", sizeof(entries->name) - 1);
+        entries->size = info.size;
+        if (!getsockopt(sock, IPPROTO_IP, IPT_SO_GET_ENTRIES, entries, &len)) {
+            res = 0;
+        } else if (errno != EAGAIN) {
+            break;
+        }
+    }
+    if (res) {
+        ALOGE("Failed to read iptables counters err=%s", strerror(errno));
+        close(sock);
+        free(entries);
+        return -1;
+    }
+    close(sock);
+
+    /*
+     * A user chain starts with an ERROR target named after the chain and ends with an
+     * implicit RETURN that iptables -L doesn't list.
+     */
+    std::vector<struct ipt_entry *> chainEntries;
+    bool inChain = false;
+    bool foundChain = false;
+    unsigned int offset = 0;
+    while (offset + sizeof(struct ipt_entry) <= entries->size) {
+        struct ipt_entry *e = (struct ipt_entry *)((char *) entries->entrytable + offset);
+        struct xt_entry_target *t = (struct xt_entry_target *)((char *) e + e->target_offset);
+        if (e->next_offset < sizeof(struct ipt_entry)) {
+            break;
+        }
+        offset += e->next_offset;
+
+        if (!strcmp(t->u.user.name, XT_ERROR_TARGET)) {
+            if (inChain) {
+                break;
+            }
+            inChain = foundChain = !strcmp((const char *) t->data, chain);
+        } else if (inChain) {
+            chainEntries.push_back(e);
+        }
+    }
+    if (!chainEntries.empty()) {
+        chainEntries.pop_back();
+    }
+
+    for (size_t i = 0; i < chainEntries.size(); i++) {
+        struct ipt_entry *e = chainEntries[i];
+        struct xt_standard_target *t =
+                (struct xt_standard_target *)((char *) e + e->target_offset);
+
+        /* Only what the iptables -L parsing accepts: "RETURN all -- <in> <out> 0.x". */
+        if (strcmp(t->target.u.user.name, XT_STANDARD_TARGET) || t->verdict != XT_RETURN ||
+                e->ip.proto || e->ip.flags || e->ip.invflags || e->ip.smsk.s_addr) {
+            continue;
+        }
+        const char *in = e->ip.iniface[0] ? e->ip.iniface : "*";
+        const char *out = e->ip.outiface[0] ? e->ip.outiface : "*";
+        rules.push_back(ForwardChainRule(in, out, e->counters.pcnt, e->counters.bcnt));
+
+        char line[MAX_IPT_OUTPUT_LINE_LEN];
+        snprintf(line, sizeof(line), "%" PRIu64" %" PRIu64" RETURN all -- %s %s\n",
+                 (uint64_t) e->counters.pcnt, (uint64_t) e->counters.bcnt, in, out);
+        extraProcessingInfo += line;
+    }
+    free(entries);
+
+    if (!foundChain) {
+        ALOGE("iptables chain %s not found", chain);
+        return -1;
+    }
+    return 0;
+}
+
+int BandwidthController::parseForwardChainStats(SocketClient *cli, const TetherStats filter,
+                                                FILE *fp, std::string &extraProcessingInfo) {
+    std::vector<ForwardChainRule> rules;
+    parseForwardChainRules(fp, rules, extraProcessingInfo);
+    return sendTetherStats(cli, filter, rules);
+}
+
+int BandwidthController::sendTetherStats(SocketClient *cli, const TetherStats filter,
+                                         const std::vector<ForwardChainRule> &rules) {
+    TetherStats stats;
+    bool filterPair = filter.intIface[0] && filter.extIface[0];
+    bool binary = BinaryFraming::isEnabled(cli);
+    FrameBuilder frame(NETD_RECORD_TETHER_STATS);
+
+    char *filterMsg = filter.getStatsLine();
+    ALOGV("filter: %s",  filterMsg);
+    free(filterMsg);
+
+    stats = filter;
+
+    for (size_t i = 0; i < rules.size(); i++) {
+        const char *iface0 = rules[i].inIface.c_str();
+        const char *iface1 = rules[i].outIface.c_str();
+        int64_t packets = rules[i].packets;
+        int64_t bytes = rules[i].bytes;
         /*
          * The following assumes that the 1st rule has in:extIface out:intIface,
          * which is what NatController sets up.
@@ -1167,9 +1563,19 @@ int BandwidthController::parseForwardChainStats(SocketClient *cli, const TetherS
         if (stats.rxBytes != -1 && stats.txBytes != -1) {
             ALOGV("rx_bytes=%" PRId64" tx_bytes=%" PRId64" filterPair=%d", stats.rxBytes, stats.txBytes, filterPair);
             /* Send out stats, and prep for the next if needed. */
+            if (binary) {
+                stats.appendRecord(frame);
+                if (filterPair) {
+                    frame.send(cli, ResponseCode::TetheringStatsResult);
+                    return 0;
+                }
+                stats = filter;
+                continue;
+            }
             char *msg = stats.getStatsLine();
             if (filterPair) {
                 cli->sendMsg(ResponseCode::TetheringStatsResult, msg, false);
+                free(msg);
                 return 0;
             } else {
                 cli->sendMsg(ResponseCode::TetheringStatsListResult, msg, false);
@@ -1178,6 +1584,10 @@ int BandwidthController::parseForwardChainStats(SocketClient *cli, const TetherS
             free(msg);
         }
     }
+    /* The whole list goes out as one frame, sent like the lines before the status. */
+    if (!frame.empty()) {
+        frame.send(cli, ResponseCode::TetheringStatsListResult);
+    }
     /* Successful if the last stats entry wasn't partial. */
     if ((stats.rxBytes == -1) == (stats.txBytes == -1)) {
         cli->sendMsg(ResponseCode::CommandOkay, "Tethering stats list completed", false);
@@ -1186,6 +1596,15 @@ int BandwidthController::parseForwardChainStats(SocketClient *cli, const TetherS
     return -1;
 }
 
+void BandwidthController::TetherStats::appendRecord(FrameBuilder &frame) const {
+    frame.appendName(intIface.c_str());
+    frame.appendName(extIface.c_str());
+    frame.appendInt64(rxBytes);
+    frame.appendInt64(rxPackets);
+    frame.appendInt64(txBytes);
+    frame.appendInt64(txPackets);
+}
+
 char *BandwidthController::TetherStats::getStatsLine(void) const {
     char *msg;
     asprintf(&msg, "%s %s %" PRId64" %" PRId64" %" PRId64" %" PRId64, intIface.c_str(), extIface.c_str(),
@@ -1200,12 +1619,16 @@ int BandwidthController::getTetherStats(SocketClient *cli, TetherStats &stats, s
     const char *cmd;
 
     /*
-     * Why not use some kind of lib to talk to iptables?
-     * Because the only libs are libiptc and libip6tc in iptables, and they are
-     * not easy to use. They require the known iptables match modules to be
-     * preloaded/linked, and require apparently a lot of wrapper code to get
-     * the wanted info.
+     * The framework polls this often, so read the counters straight from the kernel.
+     * Only fall back to listing the chain with iptables if that fails.
      */
+    std::vector<ForwardChainRule> rules;
+    if (!readForwardChainRules(NatController::LOCAL_TETHER_COUNTERS_CHAIN, rules,
+                               extraProcessingInfo)) {
+        /* Currently NatController doesn't do ipv6 tethering, so we are done. */
+        return sendTetherStats(cli, stats, rules);
+    }
+
     fullCmd = IPTABLES_PATH;
     fullCmd += " -nvx -L ";
     fullCmd += NatController::LOCAL_TETHER_COUNTERS_CHAIN;
@@ -1222,13 +1645,33 @@ int BandwidthController::getTetherStats(SocketClient *cli, TetherStats &stats, s
     return res;
 }
 
+int BandwidthController::getUidStats(SocketClient *cli, uint64_t cursor) {
+    return mUidStats.send(cli, cursor);
+}
+
 void BandwidthController::flushExistingCostlyTables(bool doClean) {
-    int res;
+    char cmd[MAX_CMD_LEN];
+    std::list<std::string> costlyTables;
+    std::list<std::string>::iterator it;
+
+    /* Only lookup ip4 table names as ip6 will have the same tables ... */
+    findExistingCostlyTables(costlyTables);
+
+    /* ... then flush/clean both ip4 and ip6 iptables. */
+    for (it = costlyTables.begin(); it != costlyTables.end(); it++) {
+        snprintf(cmd, sizeof(cmd), "-F %s", it->c_str());
+        runIpxtablesCmd(cmd, IptJumpNoAdd, IptFailHide);
+        if (doClean) {
+            snprintf(cmd, sizeof(cmd), "-X %s", it->c_str());
+            runIpxtablesCmd(cmd, IptJumpNoAdd, IptFailHide);
+        }
+    }
+}
+
+void BandwidthController::findExistingCostlyTables(std::list<std::string> &costlyTables) {
     std::string fullCmd;
     FILE *iptOutput;
-    const char *cmd;
 
-    /* Only lookup ip4 table names as ip6 will have the same tables ... */
     fullCmd = IPTABLES_PATH;
     fullCmd += " -S";
     iptOutput = popen(fullCmd.c_str(), "r");
@@ -1236,16 +1679,14 @@ void BandwidthController::flushExistingCostlyTables(bool doClean) {
             ALOGE("Failed to run %s err=%s", fullCmd.c_str(), strerror(errno));
         return;
     }
-    /* ... then flush/clean both ip4 and ip6 iptables. */
-    parseAndFlushCostlyTables(iptOutput, doClean);
+    parseCostlyTables(iptOutput, costlyTables);
     pclose(iptOutput);
 }
 
-void BandwidthController::parseAndFlushCostlyTables(FILE *fp, bool doRemove) {
+void BandwidthController::parseCostlyTables(FILE *fp, std::list<std::string> &costlyTables) {
     int res;
     char lineBuffer[MAX_IPT_OUTPUT_LINE_LEN];
     char costlyIfaceName[MAX_IPT_OUTPUT_LINE_LEN];
-    char cmd[MAX_CMD_LEN];
     char *buffPtr;
 
     while (NULL != (buffPtr = fgets(lineBuffer, MAX_IPT_OUTPUT_LINE_LEN, fp))) {
@@ -1261,11 +1702,6 @@ void BandwidthController::parseAndFlushCostlyTables(FILE *fp, bool doRemove) {
             continue;
         }
 
-        snprintf(cmd, sizeof(cmd), "-F bw_costly_%s", costlyIfaceName);
-        runIpxtablesCmd(cmd, IptJumpNoAdd, IptFailHide);
-        if (doRemove) {
-            snprintf(cmd, sizeof(cmd), "-X bw_costly_%s", costlyIfaceName);
-            runIpxtablesCmd(cmd, IptJumpNoAdd, IptFailHide);
-        }
+        costlyTables.push_back(std::string("bw_costly_") + costlyIfaceName);
     }
 }
@@ -17,11 +17,20 @@
 #define _BANDWIDTH_CONTROLLER_H
 
 #include <list>
+#include <set>
 #include <string>
 #include <utility>  // for pair
+#include <vector>
 
 #include <sysutils/SocketClient.h>
 
+#include "QuotaFileCache.h"
+#include "UidChainTree.h"
+#include "UidStatsReader.h"
+
+class FrameBuilder;
+class IptablesTransaction;
+
 class BandwidthController {
 public:
     class TetherStats {
@@ -47,11 +56,27 @@ public:
          * The caller is responsible for free()'ing the returned ptr.
          */
         char *getStatsLine(void) const;
+        /* The same fields as a NETD_RECORD_TETHER_STATS record. */
+        void appendRecord(FrameBuilder &frame) const;
     };
 
     BandwidthController();
 
-    int setupIptablesHooks(void);
+    /*
+     * Queues the initial rules, including basic accounting unless
+     * persist.bandwidth.enable is 0. savedRules are the current iptables-save dumps,
+     * indexed by V4/V6.
+     */
+    int setupIptablesHooks(IptablesTransaction &bootstrap, const std::string *savedRules);
+    /*
+     * On a warm restart, instead of setupIptablesHooks(): takes over the quotas, alerts
+     * and special apps found in savedRules (iptables-save dumps indexed by V4/V6), so
+     * that the bw_costly_* chains and their quota2 counters survive, and queues the
+     * removal of unreferenced bw_costly_* chains. The next enableBandwidthControl()
+     * keeps that state. Returns -1 without queuing anything if the dumps don't look
+     * like netd's own rules.
+     */
+    int adoptIptablesState(IptablesTransaction &bootstrap, const std::string *savedRules);
 
     int enableBandwidthControl(bool force);
     int disableBandwidthControl(void);
@@ -62,6 +87,8 @@ public:
 
     int setInterfaceQuota(const char *iface, int64_t bytes);
     int getInterfaceQuota(const char *iface, int64_t *bytes);
+    /* Lists the shared quota (as "shared") and every interface quota. */
+    int getInterfaceQuotas(std::list<std::pair<std::string, int64_t> > &quotas);
     int removeInterfaceQuota(const char *iface);
 
     int enableHappyBox(void);
@@ -91,6 +118,12 @@ public:
      */
     int getTetherStats(SocketClient *cli, TetherStats &stats, std::string &extraProcessingInfo);
 
+    /*
+     * Sends the per uid counters that changed since cursor; see UidStatsReader::send().
+     * Error is to be handled on the outside
+     */
+    int getUidStats(SocketClient *cli, uint64_t cursor);
+
     static const char* LOCAL_INPUT;
     static const char* LOCAL_FORWARD;
     static const char* LOCAL_OUTPUT;
@@ -119,17 +152,17 @@ protected:
     enum IptFailureLog { IptFailShow, IptFailHide = IptFailShow };
 #endif
 
-    int manipulateSpecialApps(int numUids, char *appStrUids[],
-                               const char *chain,
-                               std::list<int /*appUid*/> &specialAppUids,
-                               IptJumpOp jumpHandling, SpecialAppOp appOp);
+    int manipulateSpecialApps(int numUids, char *appStrUids[], UidChainTree &box,
+                               std::set<int /*appUid*/> &specialAppUids, SpecialAppOp appOp);
+    /* Queues the uid tree of bw_penalty_box or bw_happy_box for uids. */
+    void buildSpecialAppBox(IptablesTransaction &t, UidChainTree &box,
+                            const std::set<int /*appUid*/> &uids);
     int manipulateNaughtyApps(int numUids, char *appStrUids[], SpecialAppOp appOp);
     int manipulateNiceApps(int numUids, char *appStrUids[], SpecialAppOp appOp);
 
     int prepCostlyIface(const char *ifn, QuotaType quotaType);
     int cleanupCostlyIface(const char *ifn, QuotaType quotaType);
 
-    std::string makeIptablesSpecialAppCmd(IptOp op, int uid, const char *chain);
     std::string makeIptablesQuotaCmd(IptOp op, const char *costName, int64_t quota);
 
     int runIptablesAlertCmd(IptOp op, const char *alertName, int64_t bytes);
@@ -137,6 +170,7 @@ protected:
 
     /* Runs for both ipv4 and ipv6 iptables */
     int runCommands(int numCommands, const char *commands[], RunCmdErrHandling cmdErrHandling);
+    class IptablesCmdTask;
     /* Runs for both ipv4 and ipv6 iptables, appends -j REJECT --reject-with ...  */
     static int runIpxtablesCmd(const char *cmd, IptJumpOp jumpHandling,
                                IptFailureLog failureHandling = IptFailShow);
@@ -164,6 +198,30 @@ protected:
     static int parseForwardChainStats(SocketClient *cli, const TetherStats filter, FILE *fp,
                                       std::string &extraProcessingInfo);
 
+    /* A "RETURN all -- <inIface> <outIface> 0.0.0.0/0 ..." rule and its counters. */
+    class ForwardChainRule {
+    public:
+        ForwardChainRule(const char *in, const char *out, int64_t p, int64_t b)
+                : inIface(in), outIface(out), packets(p), bytes(b) {};
+        std::string inIface;
+        std::string outIface;
+        int64_t packets;
+        int64_t bytes;
+    };
+
+    /*
+     * Reads the RETURN rules of an IPv4 filter chain and their counters from the kernel
+     * with IPT_SO_GET_ENTRIES, in the same order as iptables -L lists them.
+     */
+    static int readForwardChainRules(const char *chain, std::vector<ForwardChainRule> &rules,
+                                     std::string &extraProcessingInfo);
+    /* Same, but parses the output of iptables -nvx -L <chain>. */
+    static void parseForwardChainRules(FILE *fp, std::vector<ForwardChainRule> &rules,
+                                       std::string &extraProcessingInfo);
+    /* Matches the rules against filter and sends the results; see getTetherStats(). */
+    static int sendTetherStats(SocketClient *cli, const TetherStats filter,
+                               const std::vector<ForwardChainRule> &rules);
+
     /*
      * Attempt to find the bw_costly_* tables that need flushing,
      * and flush them.
@@ -171,7 +229,9 @@ protected:
      * Deals with both ip4 and ip6 tables.
      */
     void flushExistingCostlyTables(bool doClean);
-    static void parseAndFlushCostlyTables(FILE *fp, bool doRemove);
+    static void parseCostlyTables(FILE *fp, std::list<std::string> &costlyTables);
+    /* Fills costlyTables with the bw_costly_<iface> chain names, except bw_costly_shared. */
+    static void findExistingCostlyTables(std::list<std::string> &costlyTables);
 
     /*
      * Attempt to flush our tables.
@@ -180,6 +240,15 @@ protected:
      */
     void flushCleanTables(bool doClean);
 
+    /* Forgets all quotas, alerts and special apps. */
+    void resetState(void);
+    /* Fills the quota state from the quota2 rules of one bw_costly_<costName> chain. */
+    int adoptCostlyChain(const std::string &dump, const std::string &costName,
+                         int64_t *quota, int64_t *alert);
+    /* Fills specialAppUids from the uid rules of a box's tree. */
+    static int adoptSpecialApps(const std::string &dump, const UidChainTree &box,
+                                std::set<int /*appUid*/> &specialAppUids);
+
     /*------------------*/
 
     std::list<std::string> sharedQuotaIfaces;
@@ -197,13 +266,24 @@ protected:
     int globalAlertTetherCount;
 
     std::list<QuotaInfo> quotaIfaces;
-    std::list<int /*appUid*/> naughtyAppUids;
-    std::list<int /*appUid*/> niceAppUids;
+    QuotaFileCache quotaFiles;
+    UidStatsReader mUidStats;
+    std::set<int /*appUid*/> naughtyAppUids;
+    std::set<int /*appUid*/> niceAppUids;
+    /* The state was adopted at startup; see adoptIptablesState(). */
+    bool mAdopted;
+    /*
+     * The naughty and nice app uids, as trees rooted at bw_penalty_box and bw_happy_box.
+     * Once the happy box is enabled, every chain of the first ends with a jump to the
+     * second, and every chain of the second with a REJECT.
+     */
+    UidChainTree mPenaltyBox;
+    UidChainTree mHappyBox;
+    bool mHappyBoxEnabled;
 
 private:
     static const char *IPT_FLUSH_COMMANDS[];
     static const char *IPT_CLEANUP_COMMANDS[];
-    static const char *IPT_SETUP_COMMANDS[];
     static const char *IPT_BASIC_ACCOUNTING_COMMANDS[];
 
     /* Alphabetical */
@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include <set>
+
+#define LOG_TAG "BinaryFraming"
+
+#include <cutils/log.h>
+#include <sysutils/SocketClient.h>
+
+#include "BinaryFraming.h"
+
+static std::set<SocketClient *> sBinaryClients;
+static pthread_mutex_t sBinaryClientsLock = PTHREAD_MUTEX_INITIALIZER;
+
+void BinaryFraming::setEnabled(SocketClient *c, bool enabled) {
+    pthread_mutex_lock(&sBinaryClientsLock);
+    if (enabled) {
+        sBinaryClients.insert(c);
+    } else {
+        sBinaryClients.erase(c);
+    }
+    pthread_mutex_unlock(&sBinaryClientsLock);
+}
+
+bool BinaryFraming::isEnabled(SocketClient *c) {
+    pthread_mutex_lock(&sBinaryClientsLock);
+    bool enabled = sBinaryClients.count(c) != 0;
+    pthread_mutex_unlock(&sBinaryClientsLock);
+    return enabled;
+}
+
+static void appendUint32(std::string &data, uint32_t value) {
+    uint32_t value_be = htonl(value);
+    data.append(reinterpret_cast<const char *>(&value_be), sizeof(value_be));
+}
+
+void FrameBuilder::appendName(const char *name) {
+    char field[NETD_FRAME_NAME_SIZE];
+    memset(field, 0, sizeof(field));
+    strncpy(field, name, sizeof(field) - 1);
+    mData.append(field, sizeof(field));
+}
+
+void FrameBuilder::appendInt64(int64_t value) {
+    appendUint32(mData, (uint32_t) ((uint64_t) value >> 32));
+    appendUint32(mData, (uint32_t) value);
+}
+
+int FrameBuilder::send(SocketClient *c, int code) const {
+    std::string header;
+    header.reserve(NETD_FRAME_HEADER_SIZE);
+    header += (char) NETD_FRAME_MAGIC;
+    header += (char) NETD_FRAME_VERSION;
+    uint16_t type_be = htons(mRecordType);
+    header.append(reinterpret_cast<const char *>(&type_be), sizeof(type_be));
+    appendUint32(header, code);
+    appendUint32(header, c->getCmdNum());
+    appendUint32(header, mData.size());
+
+    struct iovec iov[2];
+    iov[0].iov_base = const_cast<char *>(header.data());
+    iov[0].iov_len = header.size();
+    iov[1].iov_base = const_cast<char *>(mData.data());
+    iov[1].iov_len = mData.size();
+    if (c->sendDatav(iov, 2)) {
+        ALOGW("Failed to send a frame of %zu bytes", mData.size());
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _BINARY_FRAMING_H
+#define _BINARY_FRAMING_H
+
+/*
+ * Binary replies on the netd command socket.
+ *
+ * A client that sent "framing binary" gets the bulk results of some commands as one
+ * frame instead of one text line per entry. Everything else, including the final
+ * CommandOkay of those commands, stays a NUL terminated text reply. A frame begins with
+ * NETD_FRAME_MAGIC, which no text reply starts with, followed by the rest of the header:
+ *
+ *   uint8  magic, uint8 version, uint16 record type,
+ *   uint32 response code, uint32 command sequence number, uint32 payload length
+ *
+ * The payload is a run of fixed size records of the given type. As in the dnsproxyd
+ * replies, all integers are big-endian; strings are NUL padded to their field size.
+ * This header is shared with ndc, so the wire format part of it is plain C.
+ */
+
+#define NETD_FRAME_MAGIC            0xfe
+#define NETD_FRAME_VERSION          1
+#define NETD_FRAME_HEADER_SIZE      16
+
+#define NETD_FRAME_NAME_SIZE        16  /* IFNAMSIZ */
+
+/* name */
+#define NETD_RECORD_NAME            1
+#define NETD_RECORD_NAME_SIZE       NETD_FRAME_NAME_SIZE
+/* name, int64 value */
+#define NETD_RECORD_QUOTA           2
+#define NETD_RECORD_QUOTA_SIZE      (NETD_FRAME_NAME_SIZE + 8)
+/* intIface, extIface, int64 rxBytes, rxPackets, txBytes, txPackets */
+#define NETD_RECORD_TETHER_STATS    3
+#define NETD_RECORD_TETHER_STATS_SIZE (2 * NETD_FRAME_NAME_SIZE + 4 * 8)
+
+#ifdef __cplusplus
+
+#include <stdint.h>
+
+#include <string>
+
+class SocketClient;
+
+class BinaryFraming {
+public:
+    /* Cleared again when the client disconnects. */
+    static void setEnabled(SocketClient *c, bool enabled);
+    static bool isEnabled(SocketClient *c);
+};
+
+/* Collects records of one type and sends them to the client as a single frame. */
+class FrameBuilder {
+public:
+    FrameBuilder(uint16_t recordType) : mRecordType(recordType) {}
+
+    /* Truncated to NETD_FRAME_NAME_SIZE - 1 characters. */
+    void appendName(const char *name);
+    void appendInt64(int64_t value);
+
+    bool empty() const { return mData.empty(); }
+
+    /* Sends the frame tagged with code and the client's current sequence number. */
+    int send(SocketClient *c, int code) const;
+
+private:
+    uint16_t mRecordType;
+    std::string mData;
+};
+
+#endif
+
+#endif
@@ -0,0 +1,139 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <net/if.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <map>
+#include <set>
+
+#define LOG_TAG "BroadcastFilter"
+
+#include <cutils/log.h>
+#include <sysutils/SocketClient.h>
+#include <sysutils/SocketClientCommand.h>
+#include <sysutils/SocketListener.h>
+
+#include "BroadcastFilter.h"
+#include "NetdConstants.h"
+#include "ResponseCode.h"
+
+/* Interfaces per subscribed code; an empty set is all of them. */
+typedef std::map<int, std::set<std::string> > Subscription;
+
+static std::map<SocketClient *, Subscription> sSubscriptions;
+static pthread_mutex_t sSubscriptionsLock = PTHREAD_MUTEX_INITIALIZER;
+
+static const struct {
+    const char *name;
+    int code;
+} CLASSES[] = {
+    { "address",       ResponseCode::InterfaceAddressChange },
+    { "bandwidth",     ResponseCode::BandwidthControl },
+    { "classactivity", ResponseCode::InterfaceClassActivity },
+    { "dnsinfo",       ResponseCode::InterfaceDnsInfo },
+    { "interface",     ResponseCode::InterfaceChange },
+};
+
+class BroadcastFilter::Sender : public SocketClientCommand {
+public:
+    Sender(int code, const std::string &iface, const char *msg)
+            : mCode(code), mIface(iface), mMsg(msg) {}
+    virtual ~Sender() {}
+
+    virtual void runSocketCommand(SocketClient *c) {
+        if (BroadcastFilter::wants(c, mCode, mIface)) {
+            c->sendMsg(mMsg);
+        }
+    }
+
+private:
+    int mCode;
+    const std::string &mIface;
+    const char *mMsg;
+};
+
+int BroadcastFilter::parseClass(const char *name) {
+    for (size_t i = 0; i < ARRAY_SIZE(CLASSES); i++) {
+        if (!strcmp(name, CLASSES[i].name)) {
+            return CLASSES[i].code;
+        }
+    }
+    char *end;
+    long code = strtol(name, &end, 10);
+    if (*name && !*end && code >= 600 && code < 700) {
+        return code;
+    }
+    return -1;
+}
+
+void BroadcastFilter::subscribe(SocketClient *c, int code,
+                                const std::vector<std::string> &ifaces) {
+    pthread_mutex_lock(&sSubscriptionsLock);
+    sSubscriptions[c][code] = std::set<std::string>(ifaces.begin(), ifaces.end());
+    pthread_mutex_unlock(&sSubscriptionsLock);
+}
+
+void BroadcastFilter::unsubscribe(SocketClient *c, int code) {
+    pthread_mutex_lock(&sSubscriptionsLock);
+    // Creating the entry matters: a client that only unsubscribed still has a filter.
+    sSubscriptions[c].erase(code);
+    pthread_mutex_unlock(&sSubscriptionsLock);
+}
+
+void BroadcastFilter::unsubscribeAll(SocketClient *c) {
+    pthread_mutex_lock(&sSubscriptionsLock);
+    sSubscriptions[c].clear();
+    pthread_mutex_unlock(&sSubscriptionsLock);
+}
+
+void BroadcastFilter::reset(SocketClient *c) {
+    pthread_mutex_lock(&sSubscriptionsLock);
+    sSubscriptions.erase(c);
+    pthread_mutex_unlock(&sSubscriptionsLock);
+}
+
+bool BroadcastFilter::wants(SocketClient *c, int code, const std::string &iface) {
+    pthread_mutex_lock(&sSubscriptionsLock);
+    bool wanted = true;
+    std::map<SocketClient *, Subscription>::const_iterator client = sSubscriptions.find(c);
+    if (client != sSubscriptions.end()) {
+        Subscription::const_iterator sub = client->second.find(code);
+        wanted = sub != client->second.end() &&
+                (sub->second.empty() || sub->second.count(iface));
+    }
+    pthread_mutex_unlock(&sSubscriptionsLock);
+    return wanted;
+}
+
+void BroadcastFilter::broadcast(SocketListener *listener, int code, const char *iface,
+                                const char *msg) {
+    char *buf;
+    if (asprintf(&buf, "%d %s", code, msg) < 0) {
+        ALOGE("Failed to format broadcast %d", code);
+        return;
+    }
+    std::string ifaceName;
+    if (iface) {
+        ifaceName.assign(iface, strnlen(iface, IFNAMSIZ));
+    }
+    Sender sender(code, ifaceName, buf);
+    listener->runOnEachSocket(&sender);
+    free(buf);
+}
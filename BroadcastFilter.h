@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _BROADCAST_FILTER_H
+#define _BROADCAST_FILTER_H
+
+#include <string>
+#include <vector>
+
+class SocketClient;
+class SocketListener;
+
+/*
+ * Which unsolicited broadcasts each client of the command socket wants.
+ *
+ * A client that never subscribed gets every broadcast, as before. Once it subscribes it
+ * only gets the classes (response codes) it asked for, optionally only for some
+ * interfaces. For InterfaceClassActivity the "interface" is the idletimer label.
+ */
+class BroadcastFilter {
+public:
+    /* Maps a class name of the subscribe command ("interface", "bandwidth", ...) or a
+     * 6xx code to its response code. Returns -1 if it isn't one. */
+    static int parseClass(const char *name);
+
+    /* Replaces the client's subscription to code; an empty ifaces means all of them. */
+    static void subscribe(SocketClient *c, int code, const std::vector<std::string> &ifaces);
+    static void unsubscribe(SocketClient *c, int code);
+    /* Stops all broadcasts to the client until it subscribes to something. */
+    static void unsubscribeAll(SocketClient *c);
+    /* Back to getting everything. Also done when the client disconnects. */
+    static void reset(SocketClient *c);
+
+    /*
+     * Sends "<code> <msg>" to the clients of listener that want it, formatting it once.
+     * iface may be NULL, and is at most IFNAMSIZ characters even if not terminated.
+     */
+    static void broadcast(SocketListener *listener, int code, const char *iface,
+                          const char *msg);
+
+private:
+    class Sender;
+
+    static bool wants(SocketClient *c, int code, const std::string &iface);
+};
+
+#endif
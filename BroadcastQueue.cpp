@@ -0,0 +1,208 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#define LOG_TAG "BroadcastQueue"
+
+#include <cutils/atomic.h>
+#include <cutils/log.h>
+#include <sysutils/SocketListener.h>
+
+#include "BroadcastFilter.h"
+#include "BroadcastQueue.h"
+
+/* Ring positions wrap around; do the arithmetic unsigned so that is well defined. */
+static int32_t advance(int32_t pos, int32_t n) {
+    return (int32_t) ((uint32_t) pos + (uint32_t) n);
+}
+
+static int32_t distance(int32_t from, int32_t to) {
+    return (int32_t) ((uint32_t) to - (uint32_t) from);
+}
+
+struct QueuedBroadcast {
+    int code;
+    std::string iface;
+    std::string key;
+    std::string msg;
+};
+
+BroadcastQueue::BroadcastQueue(SocketListener *broadcaster)
+        : mBroadcaster(broadcaster), mTail(0), mHead(0), mEventFd(-1), mStopping(0),
+          mStarted(false), mCoalesced(0) {
+    // Slot i can be written at position i; a writer publishes position p as seq p + 1
+    // and the reader frees it for the next lap as p + CAPACITY.
+    mSlots = new Slot[CAPACITY];
+    for (int i = 0; i < CAPACITY; i++) {
+        mSlots[i].seq = i;
+        mSlots[i].longMsg = NULL;
+    }
+}
+
+BroadcastQueue::~BroadcastQueue() {
+    stop();
+    for (int i = 0; i < CAPACITY; i++) {
+        free(mSlots[i].longMsg);
+    }
+    delete[] mSlots;
+}
+
+int BroadcastQueue::start() {
+    mEventFd = eventfd(0, EFD_CLOEXEC);
+    if (mEventFd < 0) {
+        ALOGE("eventfd failed (%s)", strerror(errno));
+        return -1;
+    }
+    int res = pthread_create(&mThread, NULL, BroadcastQueue::threadStart, this);
+    if (res) {
+        ALOGE("pthread_create failed (%s)", strerror(res));
+        close(mEventFd);
+        mEventFd = -1;
+        return -1;
+    }
+    mStarted = true;
+    return 0;
+}
+
+void BroadcastQueue::stop() {
+    if (!mStarted) {
+        return;
+    }
+    android_atomic_release_store(1, &mStopping);
+    uint64_t one = 1;
+    write(mEventFd, &one, sizeof(one));
+    pthread_join(mThread, NULL);
+    close(mEventFd);
+    mEventFd = -1;
+    mStarted = false;
+}
+
+bool BroadcastQueue::post(int code, const char *iface, const char *key, const char *format,
+                          va_list args) {
+    int32_t pos = android_atomic_acquire_load(&mTail);
+    Slot *slot;
+    while (true) {
+        slot = &mSlots[pos & (CAPACITY - 1)];
+        int32_t lap = distance(pos, android_atomic_acquire_load(&slot->seq));
+        if (lap < 0) {
+            // The sender hasn't freed this slot from the previous lap yet: full.
+            return false;
+        }
+        if (lap == 0 && !android_atomic_release_cas(pos, advance(pos, 1), &mTail)) {
+            break;
+        }
+        pos = android_atomic_acquire_load(&mTail);
+    }
+
+    slot->code = code;
+    if (iface) {
+        // May not be terminated if it came out of a netlink message.
+        strncpy(slot->iface, iface, MAX_IFACE_LEN - 1);
+        slot->iface[MAX_IFACE_LEN - 1] = '\0';
+    } else {
+        slot->iface[0] = '\0';
+    }
+    if (key) {
+        strncpy(slot->key, key, MAX_KEY_LEN - 1);
+        slot->key[MAX_KEY_LEN - 1] = '\0';
+    } else {
+        slot->key[0] = '\0';
+    }
+
+    va_list copy;
+    va_copy(copy, args);
+    int len = vsnprintf(slot->msg, MAX_MSG_LEN, format, args);
+    if (len >= MAX_MSG_LEN && vasprintf(&slot->longMsg, format, copy) < 0) {
+        slot->longMsg = NULL;
+    }
+    va_end(copy);
+
+    android_atomic_release_store(advance(pos, 1), &slot->seq);
+
+    uint64_t one = 1;
+    write(mEventFd, &one, sizeof(one));
+    return true;
+}
+
+uint32_t BroadcastQueue::getCoalescedCount() const {
+    return android_atomic_acquire_load(&mCoalesced);
+}
+
+void *BroadcastQueue::threadStart(void *obj) {
+    reinterpret_cast<BroadcastQueue *>(obj)->run();
+    return NULL;
+}
+
+void BroadcastQueue::run() {
+    while (true) {
+        uint64_t count;
+        if (read(mEventFd, &count, sizeof(count)) < 0 && errno != EINTR) {
+            ALOGE("eventfd read failed (%s)", strerror(errno));
+            return;
+        }
+        drain();
+        if (android_atomic_acquire_load(&mStopping)) {
+            return;
+        }
+    }
+}
+
+void BroadcastQueue::drain() {
+    std::vector<QueuedBroadcast> batch;
+
+    while (true) {
+        Slot *slot = &mSlots[mHead & (CAPACITY - 1)];
+        if (android_atomic_acquire_load(&slot->seq) != advance(mHead, 1)) {
+            break;
+        }
+        batch.push_back(QueuedBroadcast());
+        QueuedBroadcast &p = batch.back();
+        p.code = slot->code;
+        p.iface = slot->iface;
+        p.msg = slot->longMsg ? slot->longMsg : slot->msg;
+        p.key = slot->key[0] ? slot->key : p.msg;
+        free(slot->longMsg);
+        slot->longMsg = NULL;
+        android_atomic_release_store(advance(mHead, CAPACITY), &slot->seq);
+        mHead = advance(mHead, 1);
+    }
+
+    // Only the last event for each code and key in the batch is sent.
+    std::map<std::pair<int, std::string>, size_t> last;
+    for (size_t i = 0; i < batch.size(); i++) {
+        last[std::make_pair(batch[i].code, batch[i].key)] = i;
+    }
+    for (size_t i = 0; i < batch.size(); i++) {
+        if (last[std::make_pair(batch[i].code, batch[i].key)] != i) {
+            android_atomic_inc(&mCoalesced);
+            continue;
+        }
+        BroadcastFilter::broadcast(mBroadcaster, batch[i].code,
+                                   batch[i].iface.empty() ? NULL : batch[i].iface.c_str(),
+                                   batch[i].msg.c_str());
+    }
+}
@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _BROADCAST_QUEUE_H
+#define _BROADCAST_QUEUE_H
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+
+class SocketListener;
+
+/*
+ * Hands unsolicited broadcasts from the netlink threads to a single sender thread,
+ * so that a slow framework socket never stalls netlink parsing.
+ *
+ * post() formats straight into a preallocated slot of a bounded ring and never takes a
+ * lock or blocks; when the ring is full the event is dropped and post() returns false.
+ * The sender drains everything queued at once and, within that batch, only sends the
+ * latest event for each coalescing key (e.g. "linkstate wlan0"), so a burst of flaps
+ * turns into the final state. Each event is only sent to the clients that subscribed to
+ * its code and interface; see BroadcastFilter.
+ */
+class BroadcastQueue {
+public:
+    BroadcastQueue(SocketListener *broadcaster);
+    ~BroadcastQueue();
+
+    int start();
+    void stop();
+
+    /*
+     * Queues a broadcast. Events with the same code and key that are still queued
+     * are replaced by this one; a NULL key means the message text itself is the key,
+     * so only identical events coalesce. iface, which may be NULL, is what the
+     * event is about for the subscriptions.
+     */
+    bool post(int code, const char *iface, const char *key, const char *format,
+              va_list args);
+
+    uint32_t getCoalescedCount() const;
+
+private:
+    static const int CAPACITY = 256;  // must be a power of two
+    static const int MAX_IFACE_LEN = 16;  // IFNAMSIZ
+    static const int MAX_KEY_LEN = 96;
+    static const int MAX_MSG_LEN = 256;
+
+    struct Slot {
+        volatile int32_t seq;
+        int code;
+        char iface[MAX_IFACE_LEN];
+        char key[MAX_KEY_LEN];
+        char msg[MAX_MSG_LEN];
+        char *longMsg;  // heap copy for the rare message that doesn't fit in msg
+    };
+
+    static void *threadStart(void *obj);
+    void run();
+    void drain();
+
+    SocketListener *mBroadcaster;
+    Slot *mSlots;
+    volatile int32_t mTail;  // next position to write, shared by the producers
+    int32_t mHead;           // next position to read, only used by the sender
+    int mEventFd;
+    volatile int32_t mStopping;
+    pthread_t mThread;
+    bool mStarted;
+    volatile int32_t mCoalesced;
+};
+
+#endif
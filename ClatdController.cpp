@@ -16,24 +16,25 @@
 #include <unistd.h>
 #include <errno.h>
 #include <sys/types.h>
-#include <sys/wait.h>
+
+#include <string>
+#include <vector>
 
 #define LOG_TAG "ClatdController"
 #include <cutils/log.h>
 
 #include "ClatdController.h"
+#include "ProcessSupervisor.h"
 
 ClatdController::ClatdController() {
-    mClatdPid = 0;
+    mClatdId = -1;
 }
 
 ClatdController::~ClatdController() {
 }
 
 int ClatdController::startClatd(char *interface) {
-    pid_t pid;
-
-    if(mClatdPid != 0) {
+    if (mClatdId != -1) {
         ALOGE("clatd already running");
         errno = EBUSY;
         return -1;
@@ -41,43 +42,30 @@ int ClatdController::startClatd(char *interface) {
 
     ALOGD("starting clatd");
 
-    if ((pid = fork()) < 0) {
-        ALOGE("fork failed (%s)", strerror(errno));
+    std::vector<std::string> args;
+    args.push_back("/system/bin/clatd");
+    args.push_back("-i");
+    args.push_back(interface);
+    // IPv4 connectivity is gone while clatd isn't running, so bring it back if it dies.
+    mClatdId = ProcessSupervisor::Instance()->spawn("clatd", args, -1, true);
+    if (mClatdId == -1) {
         return -1;
     }
 
-    if (!pid) {
-        char **args = (char **)malloc(sizeof(char *) * 4);
-        args[0] = (char *)"/system/bin/clatd";
-        args[1] = (char *)"-i";
-        args[2] = interface;
-        args[3] = NULL;
-
-        if (execv(args[0], args)) {
-            ALOGE("execv failed (%s)", strerror(errno));
-        }
-        ALOGE("Should never get here!");
-        free(args);
-        _exit(0);
-    } else {
-        mClatdPid = pid;
-        ALOGD("clatd started");
-    }
-
+    ALOGD("clatd started");
     return 0;
 }
 
 int ClatdController::stopClatd() {
-    if (mClatdPid == 0) {
+    if (mClatdId == -1) {
         ALOGE("clatd already stopped");
         return -1;
     }
 
     ALOGD("Stopping clatd");
 
-    kill(mClatdPid, SIGTERM);
-    waitpid(mClatdPid, NULL, 0);
-    mClatdPid = 0;
+    ProcessSupervisor::Instance()->stop(mClatdId);
+    mClatdId = -1;
 
     ALOGD("clatd stopped");
 
@@ -85,13 +73,12 @@ int ClatdController::stopClatd() {
 }
 
 bool ClatdController::isClatdStarted() {
-    pid_t waitpid_status;
-    if(mClatdPid == 0) {
+    if (mClatdId == -1) {
         return false;
     }
-    waitpid_status = waitpid(mClatdPid, NULL, WNOHANG);
-    if(waitpid_status != 0) {
-        mClatdPid = 0; // child exited, don't call waitpid on it again
+    if (!ProcessSupervisor::Instance()->isRunning(mClatdId)) {
+        ProcessSupervisor::Instance()->stop(mClatdId);
+        mClatdId = -1;
     }
-    return waitpid_status == 0; // 0 while child is running
+    return mClatdId != -1;
 }
@@ -18,7 +18,7 @@
 #define _CLATD_CONTROLLER_H
 
 class ClatdController {
-    pid_t mClatdPid;
+    int mClatdId;  // ProcessSupervisor id, -1 when stopped
 
 public:
     ClatdController();
@@ -23,16 +23,22 @@
 #include <arpa/inet.h>
 #include <dirent.h>
 #include <errno.h>
+#include <limits.h>
 #include <string.h>
+#include <time.h>
 #include <linux/if.h>
 #include <resolv_netid.h>
 
 #define __STDC_FORMAT_MACROS 1
 #include <inttypes.h>
 
+#include <algorithm>
+#include <vector>
+
 #define LOG_TAG "CommandListener"
 
 #include <cutils/log.h>
+#include <cutils/properties.h>
 #include <netutils/ifc.h>
 #include <sysutils/SocketClient.h>
 
@@ -44,8 +50,19 @@
 #include "oem_iptables_hook.h"
 #include "NetdConstants.h"
 #include "FirewallController.h"
+#include "IptablesTransaction.h"
+#include "NetlinkManager.h"
+#include "ProcessSupervisor.h"
+#include "BinaryFraming.h"
+#include "BroadcastFilter.h"
+#include "CommandTrace.h"
+#include "RouteCache.h"
+#include "InterfaceCache.h"
+#include "DnsStats.h"
+#include "Slab.h"
 
 NetworkController *CommandListener::sNetCtrl = NULL;
+ThreadPool *CommandListener::sDnsPool = NULL;
 TetherController *CommandListener::sTetherCtrl = NULL;
 NatController *CommandListener::sNatCtrl = NULL;
 PppController *CommandListener::sPppCtrl = NULL;
@@ -115,40 +132,280 @@ static const char* NAT_POSTROUTING[] = {
         NULL,
 };
 
-static void createChildChains(IptablesTarget target, const char* table, const char* parentChain,
+/* The parent chains the lists above are attached to. */
+static const struct {
+    IptablesTarget target;
+    const char *table;
+    const char *parent;
+    const char **children;
+} CHILD_CHAINS[] = {
+    { V4V6, "filter", "INPUT",       FILTER_INPUT },
+    { V4V6, "filter", "FORWARD",     FILTER_FORWARD },
+    { V4V6, "filter", "OUTPUT",      FILTER_OUTPUT },
+    { V4V6, "raw",    "PREROUTING",  RAW_PREROUTING },
+    { V4V6, "mangle", "POSTROUTING", MANGLE_POSTROUTING },
+    { V4V6, "mangle", "OUTPUT",      MANGLE_OUTPUT },
+    { V4,   "nat",    "PREROUTING",  NAT_PREROUTING },
+    { V4,   "nat",    "POSTROUTING", NAT_POSTROUTING },
+};
+
+/*
+ * Child chains whose rules are kept on a warm restart; their owner adopts them instead
+ * of setting them up again. All the others are flushed and set up as usual.
+ */
+static const char* WARM_RESTART_KEPT_CHAINS[] = {
+        BandwidthController::LOCAL_INPUT,
+        BandwidthController::LOCAL_OUTPUT,
+        BandwidthController::LOCAL_RAW_PREROUTING,
+        BandwidthController::LOCAL_MANGLE_POSTROUTING,
+        NULL,
+};
+
+static bool isListed(const char **chains, const char *chain) {
+    for (; *chains != NULL; chains++) {
+        if (!strcmp(*chains, chain)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Whether the current ruleset (savedRules, indexed by V4/V6) has every child chain,
+ * jumped to exactly once from the parent and in the listed order, i.e. what
+ * createChildChains() would have left behind.
+ */
+static bool hasChildChains(const std::string *savedRules, IptablesTarget target,
+        const char* table, const char* parentChain, const char** childChains) {
+    for (int family = V4; family <= V6; family++) {
+        if (target != V4V6 && target != family) {
+            continue;
+        }
+        std::vector<std::string> chains;
+        std::vector<std::string> rules;
+        IptablesTransaction::listChains(savedRules[family], table, &chains);
+        IptablesTransaction::listRules(savedRules[family], table, parentChain, &rules);
+
+        std::vector<std::string>::iterator last = rules.begin();
+        for (const char** childChain = childChains; *childChain != NULL; childChain++) {
+            std::string jump = std::string("-A ") + parentChain + " -j " + *childChain;
+            std::vector<std::string>::iterator it = std::find(rules.begin(), rules.end(), jump);
+            if (std::find(chains.begin(), chains.end(), *childChain) == chains.end() ||
+                    std::count(rules.begin(), rules.end(), jump) != 1 || it < last) {
+                ALOGI("%s %s %s is not set up", family == V4 ? "iptables" : "ip6tables",
+                      table, *childChain);
+                return false;
+            }
+            last = it;
+        }
+    }
+    return true;
+}
+
+/*
+ * iptables-restore gives up on a whole table at the first failing rule, so instead
+ * of tentatively deleting jumps as before, only the ones found in the current
+ * ruleset (savedRules, indexed by V4/V6) are deleted.
+ * On a warm restart the jumps are known to be in place already, and only the child
+ * chains not kept are flushed.
+ */
+static void createChildChains(IptablesTransaction &bootstrap, const std::string *savedRules,
+        bool warm, IptablesTarget target, const char* table, const char* parentChain,
         const char** childChains) {
     const char** childChain = childChains;
     do {
+        if (warm) {
+            if (!isListed(WARM_RESTART_KEPT_CHAINS, *childChain)) {
+                bootstrap.addChain(target, table, *childChain);
+            }
+            continue;
+        }
         // Order is important:
-        // -D to delete any pre-existing jump rule (removes references
-        //    that would prevent -X from working)
-        // -F to flush any existing chain
-        // -X to delete any existing chain
-        // -N to create the chain
+        // -D to delete any pre-existing jump rule, so that jumps end up in
+        //    the listed order
+        // :chain to create the chain, or flush it if it already exists
         // -A to append the chain to parent
-
-        execIptablesSilently(target, "-t", table, "-D", parentChain, "-j", *childChain, NULL);
-        execIptablesSilently(target, "-t", table, "-F", *childChain, NULL);
-        execIptablesSilently(target, "-t", table, "-X", *childChain, NULL);
-        execIptables(target, "-t", table, "-N", *childChain, NULL);
-        execIptables(target, "-t", table, "-A", parentChain, "-j", *childChain, NULL);
+        std::string jump = std::string("-A ") + parentChain + " -j " + *childChain;
+        for (int family = V4; family <= V6; family++) {
+            if (target != V4V6 && target != family) {
+                continue;
+            }
+            int jumps = IptablesTransaction::countRules(savedRules[family], table, jump);
+            while (jumps-- > 0) {
+                bootstrap.add((IptablesTarget) family, "-t", table, "-D", parentChain,
+                        "-j", *childChain, NULL);
+            }
+        }
+        bootstrap.addChain(target, table, *childChain);
+        bootstrap.add(target, "-t", table, "-A", parentChain, "-j", *childChain, NULL);
     } while (*(++childChain) != NULL);
 }
 
+/*
+ * Whether to keep the rules a previous netd left behind (persist.netd.warm_restart),
+ * and whether they are intact enough to do so.
+ */
+static bool canWarmRestart(const std::string *savedRules) {
+    char value[PROPERTY_VALUE_MAX];
+    property_get("persist.netd.warm_restart", value, "0");
+    if (strcmp(value, "1")) {
+        return false;
+    }
+    for (size_t i = 0; i < ARRAY_SIZE(CHILD_CHAINS); i++) {
+        if (!hasChildChains(savedRules, CHILD_CHAINS[i].target, CHILD_CHAINS[i].table,
+                CHILD_CHAINS[i].parent, CHILD_CHAINS[i].children)) {
+            ALOGI("Rebuilding the iptables rules from scratch");
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Logs how long each step of the startup took, so boot time regressions can be tracked. */
+class StartupTimer {
+public:
+    StartupTimer() : mStart(now()), mLast(mStart) {}
+
+    void step(const char *name) {
+        int64_t t = now();
+        ALOGI("startup: %s took %" PRId64 "ms", name, (t - mLast) / 1000000);
+        mLast = t;
+    }
+
+    void done() {
+        ALOGI("startup: total %" PRId64 "ms", (now() - mStart) / 1000000);
+    }
+
+private:
+    static int64_t now() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    }
+
+    int64_t mStart;
+    int64_t mLast;
+};
+
+/* Most commands the framework can have outstanding on one queue at a time. */
+static const int COMMAND_QUEUE_DEPTH = 64;
+
+/* Keeps the stride of every uid in the DNS pool's fair share above zero. */
+static const int MAX_DNS_UID_WEIGHT = 1000;
+
+/*
+ * Parses a whole decimal number no larger than max, such as a uid. atoi() and a bare
+ * strtoul() would turn garbage into 0, which as a uid is root.
+ */
+static bool parseUnsigned(const char *arg, uint32_t max, uint32_t *value) {
+    if (*arg < '0' || *arg > '9') {
+        return false;
+    }
+    char *end;
+    errno = 0;
+    unsigned long long v = strtoull(arg, &end, 10);
+    if (errno || *end || v > max) {
+        return false;
+    }
+    *value = v;
+    return true;
+}
+
+static int compareSubcommand(const void *key, const void *entry) {
+    return strcmp((const char *) key, *(const char * const *) entry);
+}
+
+/* Subcommand tables are entries sorted by name, which is their first member. */
+template <class Entry>
+static const Entry *findSubcommand(const Entry *table, size_t count, const char *name) {
+    return (const Entry *) bsearch(name, table, count, sizeof(Entry), compareSubcommand);
+}
+
+template <class Entry>
+static void checkSubcommandOrder(const char *command, const Entry *table, size_t count) {
+    for (size_t i = 1; i < count; i++) {
+        if (strcmp(table[i - 1].name, table[i].name) >= 0) {
+            ALOGE("%s subcommand %s is out of order", command, table[i].name);
+        }
+    }
+}
+
+/* Runs the subcommand argv[1] of cmd, answering unknown ones with unknownMsg. */
+template <class Cmd>
+static int runSubcommand(Cmd *cmd, const SubcommandEntry<Cmd> *table, size_t count,
+                         SocketClient *cli, int argc, char **argv, const char *unknownMsg) {
+    const SubcommandEntry<Cmd> *sub = findSubcommand(table, count, argv[1]);
+    if (!sub) {
+        cli->sendMsg(ResponseCode::CommandSyntaxError, unknownMsg, false);
+        return 0;
+    }
+    if (argc < sub->minArgc || (sub->maxArgc >= 0 && argc > sub->maxArgc)) {
+        cli->sendMsg(ResponseCode::CommandSyntaxError, sub->usage, false);
+        return 0;
+    }
+    return (cmd->*sub->run)(cli, argc, argv);
+}
+
+/* Returns a started single worker ThreadPool, or NULL to run the commands inline. */
+static ThreadPool *startCommandQueue(const char *name) {
+    ThreadPool *queue = new ThreadPool(name, 1, COMMAND_QUEUE_DEPTH);
+    int res = queue->start();
+    if (res) {
+        ALOGE("Unable to start %s (%s), running its commands inline", name, strerror(res));
+        delete queue;
+        return NULL;
+    }
+    return queue;
+}
+
+/* The wrappers every netd command gets; see NetdCommand.h. */
+static FrameworkCommand *timed(FrameworkCommand *cmd) {
+    return new TimedCommand("netd", cmd);
+}
+
+static FrameworkCommand *traced(FrameworkCommand *cmd) {
+    return new TracedCommand("netd", cmd);
+}
+
 CommandListener::CommandListener() :
                  FrameworkListener("netd", true) {
-    registerCmd(new InterfaceCmd());
-    registerCmd(new IpFwdCmd());
-    registerCmd(new TetherCmd());
-    registerCmd(new NatCmd());
-    registerCmd(new ListTtysCmd());
-    registerCmd(new PppdCmd());
-    registerCmd(new SoftapCmd());
-    registerCmd(new BandwidthControlCmd());
-    registerCmd(new IdletimerControlCmd());
-    registerCmd(new ResolverCmd());
-    registerCmd(new FirewallCmd());
-    registerCmd(new ClatdCmd());
+    /*
+     * Each controller's commands run in order on its own queue, so a slow bandwidth or nat
+     * command doesn't hold up everything else. Commands that share controller state share
+     * a queue: nat also drives BandwidthController, ipfwd lives in TetherController.
+     */
+    ThreadPool *interfaceQueue = startCommandQueue("netd interface");
+    ThreadPool *tetherQueue = startCommandQueue("netd tether");
+    ThreadPool *natQueue = startCommandQueue("netd nat");
+    ThreadPool *pppQueue = startCommandQueue("netd ppp");
+    ThreadPool *softapQueue = startCommandQueue("netd softap");
+    ThreadPool *idletimerQueue = startCommandQueue("netd idletimer");
+    ThreadPool *resolverQueue = startCommandQueue("netd resolver");
+    ThreadPool *firewallQueue = startCommandQueue("netd firewall");
+    ThreadPool *clatdQueue = startCommandQueue("netd clatd");
+
+    registerCmd(traced(new QueuedCommand(interfaceQueue, timed(new InterfaceCmd()))));
+    registerCmd(traced(new QueuedCommand(tetherQueue, timed(new IpFwdCmd()))));
+    registerCmd(traced(new QueuedCommand(tetherQueue, timed(new TetherCmd()))));
+    registerCmd(traced(new QueuedCommand(natQueue, timed(new NatCmd()))));
+    registerCmd(traced(new QueuedCommand(pppQueue, timed(new ListTtysCmd()))));
+    registerCmd(traced(new QueuedCommand(pppQueue, timed(new PppdCmd()))));
+    registerCmd(traced(new QueuedCommand(softapQueue, timed(new SoftapCmd()))));
+    registerCmd(traced(new QueuedCommand(natQueue, timed(new BandwidthControlCmd()))));
+    registerCmd(traced(new QueuedCommand(idletimerQueue, timed(new IdletimerControlCmd()))));
+    registerCmd(traced(new QueuedCommand(resolverQueue, timed(new ResolverCmd()))));
+    registerCmd(traced(new QueuedCommand(firewallQueue, timed(new FirewallCmd()))));
+    registerCmd(traced(new QueuedCommand(clatdQueue, timed(new ClatdCmd()))));
+    // Runs on the listener thread, so it dumps even while the queues are stuck; its reply
+    // only waits for the client's own earlier commands.
+    registerCmd(traced(new QueuedCommand(NULL, timed(new StatsCmd()))));
+    // These change state kept for the client itself, so they can't run on a capture and
+    // reply immediately, possibly ahead of the client's pending commands. The change
+    // applies to every command the client sends after them.
+    registerCmd(traced(timed(new FramingCmd())));
+    registerCmd(traced(timed(new SubscribeCmd())));
+    // Not traced: a replay shouldn't start or stop traces.
+    registerCmd(new QueuedCommand(NULL, timed(new TraceCmd())));
 
     if (!sNetCtrl)
         sNetCtrl = new NetworkController();
@@ -185,42 +442,118 @@ CommandListener::CommandListener() :
      * otherwise DROP/REJECT.
      */
 
+    StartupTimer timer;
+
+    /*
+     * Everything is queued into one transaction and applied with a single
+     * iptables-restore per family.
+     */
+    IptablesTransaction bootstrap;
+    std::string savedRules[2];
+    IptablesTransaction::save(V4, &savedRules[V4]);
+    IptablesTransaction::save(V6, &savedRules[V6]);
+    timer.step("reading iptables");
+
+    bool warm = canWarmRestart(savedRules);
+    if (warm && sBandwidthCtrl->adoptIptablesState(bootstrap, savedRules)) {
+        ALOGI("Rebuilding the iptables rules from scratch");
+        warm = false;
+    }
+
     // Create chains for children modules
-    createChildChains(V4V6, "filter", "INPUT", FILTER_INPUT);
-    createChildChains(V4V6, "filter", "FORWARD", FILTER_FORWARD);
-    createChildChains(V4V6, "filter", "OUTPUT", FILTER_OUTPUT);
-    createChildChains(V4V6, "raw", "PREROUTING", RAW_PREROUTING);
-    createChildChains(V4V6, "mangle", "POSTROUTING", MANGLE_POSTROUTING);
-    createChildChains(V4V6, "mangle", "OUTPUT", MANGLE_OUTPUT);
-    createChildChains(V4, "nat", "PREROUTING", NAT_PREROUTING);
-    createChildChains(V4, "nat", "POSTROUTING", NAT_POSTROUTING);
+    for (size_t i = 0; i < ARRAY_SIZE(CHILD_CHAINS); i++) {
+        createChildChains(bootstrap, savedRules, warm, CHILD_CHAINS[i].target,
+                CHILD_CHAINS[i].table, CHILD_CHAINS[i].parent, CHILD_CHAINS[i].children);
+    }
 
     // Let each module setup their child chains
-    setupOemIptablesHook();
 
     /* When enabled, DROPs all packets except those matching rules. */
-    sFirewallCtrl->setupIptablesHooks();
+    sFirewallCtrl->setupIptablesHooks(bootstrap, savedRules);
+    timer.step("FirewallController");
 
     /* Does DROPs in FORWARD by default */
-    sNatCtrl->setupIptablesHooks();
+    sNatCtrl->setupIptablesHooks(bootstrap);
+    timer.step("NatController");
     /*
      * Does REJECT in INPUT, OUTPUT. Does counting also.
      * No DROP/REJECT allowed later in netfilter-flow hook order.
+     * On a warm restart its rules were adopted above.
      */
-    sBandwidthCtrl->setupIptablesHooks();
+    if (!warm) {
+        sBandwidthCtrl->setupIptablesHooks(bootstrap, savedRules);
+    }
+    timer.step("BandwidthController");
     /*
      * Counts in nat: PREROUTING, POSTROUTING.
      * No DROP/REJECT allowed later in netfilter-flow hook order.
      */
     sIdletimerCtrl->setupIptablesHooks();
+    timer.step("IdletimerController");
+
+    sSecondaryTableCtrl->setupIptablesHooks(bootstrap);
+    timer.step("SecondaryTableController");
+
+    /*
+     * The rules of the OEM rules file go into the same restore. The OEM script is only
+     * run if there is no such file, or its rules could not be applied.
+     */
+    size_t coreRules = bootstrap.size();
+    int oemRules = addOemIptablesRules(bootstrap);
+    int res = bootstrap.commit();
+    if (res && oemRules > 0) {
+        ALOGE("Failed to apply the initial iptables rules, retrying without %s",
+              OEM_RULES_PATH);
+        bootstrap.truncate(coreRules);
+        oemRules = -1;
+        res = bootstrap.commit();
+    }
+    if (res) {
+        ALOGE("Failed to apply the initial iptables rules");
+    }
+    timer.step("iptables-restore");
 
-    sBandwidthCtrl->enableBandwidthControl(false);
+    /* The OEM chains exist now; the OEM script can fill them. */
+    if (oemRules < 0) {
+        setupOemIptablesHook();
+        timer.step("OEM iptables hook");
+    }
 
-    sSecondaryTableCtrl->setupIptablesHooks();
+    timer.done();
 }
 
+const SubcommandEntry<CommandListener::InterfaceCmd>
+        CommandListener::InterfaceCmd::SUBCOMMANDS[] = {
+    { "clearaddrs", 3, -1, "Missing argument",
+      &CommandListener::InterfaceCmd::runClearAddrs },
+    { "driver", 4, -1, "Usage: interface driver <interface> <cmd> <args>",
+      &CommandListener::InterfaceCmd::runDriver },
+    { "fwmark", 3, -1, "Missing argument",
+      &CommandListener::InterfaceCmd::runFwmark },
+    { "getcfg", 3, -1, "Missing argument",
+      &CommandListener::InterfaceCmd::runGetCfg },
+    { "getcfgall", 2, -1, "Missing argument",
+      &CommandListener::InterfaceCmd::runGetCfgAll },
+    { "getmtu", 3, -1, "Missing argument",
+      &CommandListener::InterfaceCmd::runGetMtu },
+    { "ipv6", 4, 4, "Usage: interface ipv6 <interface> <enable|disable>",
+      &CommandListener::InterfaceCmd::runIpv6 },
+    { "ipv6privacyextensions", 4, 4,
+      "Usage: interface ipv6privacyextensions <interface> <enable|disable>",
+      &CommandListener::InterfaceCmd::runIpv6PrivacyExtensions },
+    { "list", 2, -1, "Missing argument",
+      &CommandListener::InterfaceCmd::runList },
+    { "route", 8, -1, "Missing argument",
+      &CommandListener::InterfaceCmd::runRoute },
+    { "setcfg", 4, -1, "Missing argument",
+      &CommandListener::InterfaceCmd::runSetCfg },
+    { "setmtu", 4, 4, "Usage: interface setmtu <interface> <val>",
+      &CommandListener::InterfaceCmd::runSetMtu },
+};
+
 CommandListener::InterfaceCmd::InterfaceCmd() :
                  NetdCommand("interface") {
+    checkSubcommandOrder("interface", SUBCOMMANDS, ARRAY_SIZE(SUBCOMMANDS));
 }
 
 int CommandListener::InterfaceCmd::runCommand(SocketClient *cli,
@@ -229,681 +562,743 @@ int CommandListener::InterfaceCmd::runCommand(SocketClient *cli,
         cli->sendMsg(ResponseCode::CommandSyntaxError, "Missing argument", false);
         return 0;
     }
+    return runSubcommand(this, SUBCOMMANDS, ARRAY_SIZE(SUBCOMMANDS), cli, argc, argv,
+                         "Unknown interface cmd");
+}
 
-    if (!strcmp(argv[1], "list")) {
-        DIR *d;
-        struct dirent *de;
+int CommandListener::InterfaceCmd::runList(SocketClient *cli, int, char **) {
+    DIR *d;
+    struct dirent *de;
 
-        if (!(d = opendir("/sys/class/net"))) {
-            cli->sendMsg(ResponseCode::OperationFailed, "Failed to open sysfs dir", true);
-            return 0;
-        }
+    if (!(d = opendir("/sys/class/net"))) {
+        cli->sendMsg(ResponseCode::OperationFailed, "Failed to open sysfs dir", true);
+        return 0;
+    }
 
-        while((de = readdir(d))) {
-            if (de->d_name[0] == '.')
-                continue;
+    bool binary = BinaryFraming::isEnabled(cli);
+    FrameBuilder frame(NETD_RECORD_NAME);
+    while((de = readdir(d))) {
+        if (de->d_name[0] == '.')
+            continue;
+        if (binary)
+            frame.appendName(de->d_name);
+        else
             cli->sendMsg(ResponseCode::InterfaceListResult, de->d_name, false);
+    }
+    closedir(d);
+    if (binary && !frame.empty())
+        frame.send(cli, ResponseCode::InterfaceListResult);
+    cli->sendMsg(ResponseCode::CommandOkay, "Interface list completed", false);
+    return 0;
+}
+
+int CommandListener::InterfaceCmd::runGetCfgAll(SocketClient *cli, int, char **) {
+    if (InterfaceCache::Instance()->send(cli)) {
+        cli->sendMsg(ResponseCode::OperationFailed, "Failed to dump interfaces", true);
+    } else {
+        cli->sendMsg(ResponseCode::CommandOkay, "Interface config listed", false);
+    }
+    return 0;
+}
+
+int CommandListener::InterfaceCmd::runDriver(SocketClient *cli, int argc, char **argv) {
+    int rc;
+    char *rbuf;
+
+    rc = sInterfaceCtrl->interfaceCommand(argc, argv, &rbuf);
+    if (rc) {
+        cli->sendMsg(ResponseCode::OperationFailed, "Failed to execute command", true);
+    } else {
+        cli->sendMsg(ResponseCode::CommandOkay, rbuf, false);
+    }
+    return 0;
+}
+
+    //     0       1       2        3          4           5        6      7
+    // interface route add/remove iface default/secondary dest    prefix gateway
+    // interface fwmark  rule  add/remove    iface
+    // interface fwmark  route add/remove    iface        dest    prefix
+    // interface fwmark  uid   add/remove    iface      uid_start uid_end
+    // interface fwmark exempt add/remove    dest
+    // interface fwmark  get     protect
+    // interface fwmark  get     mark        uid
+int CommandListener::InterfaceCmd::runFwmark(SocketClient *cli, int argc, char **argv) {
+    if (!strcmp(argv[2], "rule")) {
+        if (argc < 5) {
+            cli->sendMsg(ResponseCode::CommandSyntaxError, "Missing argument", false);
+            return 0;
+        }
+        if (!strcmp(argv[3], "add")) {
+            if (!sSecondaryTableCtrl->addFwmarkRule(argv[4])) {
+                cli->sendMsg(ResponseCode::CommandOkay,
+                        "Fwmark rule successfully added", false);
+            } else {
+                cli->sendMsg(ResponseCode::OperationFailed, "Failed to add fwmark rule",
+                        true);
+            }
+        } else if (!strcmp(argv[3], "remove")) {
+            if (!sSecondaryTableCtrl->removeFwmarkRule(argv[4])) {
+                cli->sendMsg(ResponseCode::CommandOkay,
+                        "Fwmark rule successfully removed", false);
+            } else {
+                cli->sendMsg(ResponseCode::OperationFailed,
+                        "Failed to remove fwmark rule", true);
+            }
+        } else {
+            cli->sendMsg(ResponseCode::CommandSyntaxError, "Unknown fwmark rule cmd",
+                    false);
+        }
+        return 0;
+    } else if (!strcmp(argv[2], "route")) {
+        if (argc < 7) {
+            cli->sendMsg(ResponseCode::CommandSyntaxError, "Missing argument", false);
+            return 0;
+        }
+        if (!strcmp(argv[3], "add")) {
+            if (!sSecondaryTableCtrl->addFwmarkRoute(argv[4], argv[5], atoi(argv[6]))) {
+                cli->sendMsg(ResponseCode::CommandOkay,
+                        "Fwmark route successfully added", false);
+            } else {
+                cli->sendMsg(ResponseCode::OperationFailed,
+                        "Failed to add fwmark route", true);
+            }
+        } else if (!strcmp(argv[3], "remove")) {
+            if (!sSecondaryTableCtrl->removeFwmarkRoute(argv[4], argv[5],
+                        atoi(argv[6]))) {
+                cli->sendMsg(ResponseCode::CommandOkay,
+                        "Fwmark route successfully removed", false);
+            } else {
+                cli->sendMsg(ResponseCode::OperationFailed,
+                        "Failed to remove fwmark route", true);
+            }
+        } else {
+            cli->sendMsg(ResponseCode::CommandSyntaxError, "Unknown fwmark route cmd",
+                    false);
         }
-        closedir(d);
-        cli->sendMsg(ResponseCode::CommandOkay, "Interface list completed", false);
         return 0;
-    } else if (!strcmp(argv[1], "driver")) {
-        int rc;
-        char *rbuf;
 
-        if (argc < 4) {
-            cli->sendMsg(ResponseCode::CommandSyntaxError,
-                    "Usage: interface driver <interface> <cmd> <args>", false);
+    } else if (!strcmp(argv[2], "uid")) {
+        if (argc < 7) {
+            cli->sendMsg(ResponseCode::CommandSyntaxError, "Missing argument", false);
             return 0;
         }
-        rc = sInterfaceCtrl->interfaceCommand(argc, argv, &rbuf);
-        if (rc) {
-            cli->sendMsg(ResponseCode::OperationFailed, "Failed to execute command", true);
+        if (!strcmp(argv[3], "add")) {
+            if (!sSecondaryTableCtrl->addUidRule(argv[4], atoi(argv[5]), atoi(argv[6]))) {
+                cli->sendMsg(ResponseCode::CommandOkay, "uid rule successfully added",
+                        false);
+            } else {
+                cli->sendMsg(ResponseCode::OperationFailed, "Failed to add uid rule", true);
+            }
+        } else if (!strcmp(argv[3], "remove")) {
+            if (!sSecondaryTableCtrl->removeUidRule(argv[4],
+                        atoi(argv[5]), atoi(argv[6]))) {
+                cli->sendMsg(ResponseCode::CommandOkay, "uid rule successfully removed",
+                        false);
+            } else {
+                cli->sendMsg(ResponseCode::OperationFailed, "Failed to remove uid rule",
+                        true);
+            }
         } else {
-            cli->sendMsg(ResponseCode::CommandOkay, rbuf, false);
+            cli->sendMsg(ResponseCode::CommandSyntaxError, "Unknown uid cmd", false);
         }
         return 0;
-    } else {
-        /*
-         * These commands take a minimum of 3 arguments
-         */
-        if (argc < 3) {
+    } else if (!strcmp(argv[2], "exempt")) {
+        if (argc < 5) {
             cli->sendMsg(ResponseCode::CommandSyntaxError, "Missing argument", false);
             return 0;
         }
-
-        //     0       1       2        3          4           5        6      7
-        // interface route add/remove iface default/secondary dest    prefix gateway
-        // interface fwmark  rule  add/remove    iface
-        // interface fwmark  route add/remove    iface        dest    prefix
-        // interface fwmark  uid   add/remove    iface      uid_start uid_end
-        // interface fwmark exempt add/remove    dest
-        // interface fwmark  get     protect
-        // interface fwmark  get     mark        uid
-        if (!strcmp(argv[1], "fwmark")) {
-            if (!strcmp(argv[2], "rule")) {
-                if (argc < 5) {
-                    cli->sendMsg(ResponseCode::CommandSyntaxError, "Missing argument", false);
-                    return 0;
-                }
-                if (!strcmp(argv[3], "add")) {
-                    if (!sSecondaryTableCtrl->addFwmarkRule(argv[4])) {
-                        cli->sendMsg(ResponseCode::CommandOkay,
-                                "Fwmark rule successfully added", false);
-                    } else {
-                        cli->sendMsg(ResponseCode::OperationFailed, "Failed to add fwmark rule",
-                                true);
-                    }
-                } else if (!strcmp(argv[3], "remove")) {
-                    if (!sSecondaryTableCtrl->removeFwmarkRule(argv[4])) {
-                        cli->sendMsg(ResponseCode::CommandOkay,
-                                "Fwmark rule successfully removed", false);
-                    } else {
-                        cli->sendMsg(ResponseCode::OperationFailed,
-                                "Failed to remove fwmark rule", true);
-                    }
-                } else {
-                    cli->sendMsg(ResponseCode::CommandSyntaxError, "Unknown fwmark rule cmd",
-                            false);
-                }
-                return 0;
-            } else if (!strcmp(argv[2], "route")) {
-                if (argc < 7) {
-                    cli->sendMsg(ResponseCode::CommandSyntaxError, "Missing argument", false);
-                    return 0;
-                }
-                if (!strcmp(argv[3], "add")) {
-                    if (!sSecondaryTableCtrl->addFwmarkRoute(argv[4], argv[5], atoi(argv[6]))) {
-                        cli->sendMsg(ResponseCode::CommandOkay,
-                                "Fwmark route successfully added", false);
-                    } else {
-                        cli->sendMsg(ResponseCode::OperationFailed,
-                                "Failed to add fwmark route", true);
-                    }
-                } else if (!strcmp(argv[3], "remove")) {
-                    if (!sSecondaryTableCtrl->removeFwmarkRoute(argv[4], argv[5],
-                                atoi(argv[6]))) {
-                        cli->sendMsg(ResponseCode::CommandOkay,
-                                "Fwmark route successfully removed", false);
-                    } else {
-                        cli->sendMsg(ResponseCode::OperationFailed,
-                                "Failed to remove fwmark route", true);
-                    }
-                } else {
-                    cli->sendMsg(ResponseCode::CommandSyntaxError, "Unknown fwmark route cmd",
-                            false);
-                }
-                return 0;
-
-            } else if (!strcmp(argv[2], "uid")) {
-                if (argc < 7) {
-                    cli->sendMsg(ResponseCode::CommandSyntaxError, "Missing argument", false);
-                    return 0;
-                }
-                if (!strcmp(argv[3], "add")) {
-                    if (!sSecondaryTableCtrl->addUidRule(argv[4], atoi(argv[5]), atoi(argv[6]))) {
-                        cli->sendMsg(ResponseCode::CommandOkay, "uid rule successfully added",
-                                false);
-                    } else {
-                        cli->sendMsg(ResponseCode::OperationFailed, "Failed to add uid rule", true);
-                    }
-                } else if (!strcmp(argv[3], "remove")) {
-                    if (!sSecondaryTableCtrl->removeUidRule(argv[4],
-                                atoi(argv[5]), atoi(argv[6]))) {
-                        cli->sendMsg(ResponseCode::CommandOkay, "uid rule successfully removed",
-                                false);
-                    } else {
-                        cli->sendMsg(ResponseCode::OperationFailed, "Failed to remove uid rule",
-                                true);
-                    }
-                } else {
-                    cli->sendMsg(ResponseCode::CommandSyntaxError, "Unknown uid cmd", false);
-                }
-                return 0;
-            } else if (!strcmp(argv[2], "exempt")) {
-                if (argc < 5) {
-                    cli->sendMsg(ResponseCode::CommandSyntaxError, "Missing argument", false);
-                    return 0;
-                }
-                if (!strcmp(argv[3], "add")) {
-                    if (!sSecondaryTableCtrl->addHostExemption(argv[4])) {
-                        cli->sendMsg(ResponseCode::CommandOkay, "exemption rule successfully added",
-                                false);
-                    } else {
-                        cli->sendMsg(ResponseCode::OperationFailed, "Failed to add exemption rule",
-                                true);
-                    }
-                } else if (!strcmp(argv[3], "remove")) {
-                    if (!sSecondaryTableCtrl->removeHostExemption(argv[4])) {
-                        cli->sendMsg(ResponseCode::CommandOkay,
-                                "exemption rule successfully removed", false);
-                    } else {
-                        cli->sendMsg(ResponseCode::OperationFailed,
-                                "Failed to remove exemption rule", true);
-                    }
-                } else {
-                    cli->sendMsg(ResponseCode::CommandSyntaxError, "Unknown exemption cmd", false);
-                }
-                return 0;
-            } else if (!strcmp(argv[2], "get")) {
-                if (argc < 4) {
-                    cli->sendMsg(ResponseCode::CommandSyntaxError, "Missing argument", false);
-                    return 0;
-                }
-                if (!strcmp(argv[3], "protect")) {
-                    sSecondaryTableCtrl->getProtectMark(cli);
-                    return 0;
-                } else if (!strcmp(argv[3], "mark")) {
-                    if (argc < 5) {
-                        cli->sendMsg(ResponseCode::CommandSyntaxError, "Missing argument", false);
-                        return 0;
-                    }
-                    sSecondaryTableCtrl->getUidMark(cli, atoi(argv[4]));
-                    return 0;
-                } else {
-                    cli->sendMsg(ResponseCode::CommandSyntaxError, "Unknown fwmark get cmd", false);
-                    return 0;
-                }
+        if (!strcmp(argv[3], "add")) {
+            if (!sSecondaryTableCtrl->addHostExemption(argv[4])) {
+                cli->sendMsg(ResponseCode::CommandOkay, "exemption rule successfully added",
+                        false);
             } else {
-                cli->sendMsg(ResponseCode::CommandSyntaxError, "Unknown fwmark cmd", false);
-                return 0;
+                cli->sendMsg(ResponseCode::OperationFailed, "Failed to add exemption rule",
+                        true);
+            }
+        } else if (!strcmp(argv[3], "remove")) {
+            if (!sSecondaryTableCtrl->removeHostExemption(argv[4])) {
+                cli->sendMsg(ResponseCode::CommandOkay,
+                        "exemption rule successfully removed", false);
+            } else {
+                cli->sendMsg(ResponseCode::OperationFailed,
+                        "Failed to remove exemption rule", true);
             }
+        } else {
+            cli->sendMsg(ResponseCode::CommandSyntaxError, "Unknown exemption cmd", false);
+        }
+        return 0;
+    } else if (!strcmp(argv[2], "get")) {
+        if (argc < 4) {
+            cli->sendMsg(ResponseCode::CommandSyntaxError, "Missing argument", false);
+            return 0;
         }
-        if (!strcmp(argv[1], "route")) {
-            int prefix_length = 0;
-            if (argc < 8) {
+        if (!strcmp(argv[3], "protect")) {
+            sSecondaryTableCtrl->getProtectMark(cli);
+            return 0;
+        } else if (!strcmp(argv[3], "mark")) {
+            if (argc < 5) {
                 cli->sendMsg(ResponseCode::CommandSyntaxError, "Missing argument", false);
                 return 0;
             }
-            if (sscanf(argv[6], "%d", &prefix_length) != 1) {
-                cli->sendMsg(ResponseCode::CommandParameterError, "Invalid route prefix", false);
-                return 0;
+            sSecondaryTableCtrl->getUidMark(cli, atoi(argv[4]));
+            return 0;
+        } else {
+            cli->sendMsg(ResponseCode::CommandSyntaxError, "Unknown fwmark get cmd", false);
+            return 0;
+        }
+    } else {
+        cli->sendMsg(ResponseCode::CommandSyntaxError, "Unknown fwmark cmd", false);
+        return 0;
+    }
+}
+
+int CommandListener::InterfaceCmd::runRoute(SocketClient *cli, int, char **argv) {
+    int prefix_length = 0;
+    if (sscanf(argv[6], "%d", &prefix_length) != 1) {
+        cli->sendMsg(ResponseCode::CommandParameterError, "Invalid route prefix", false);
+        return 0;
+    }
+    if (!strcmp(argv[2], "add")) {
+        if (!strcmp(argv[4], "default")) {
+            if (ifc_add_route(argv[3], argv[5], prefix_length, argv[7])) {
+                cli->sendMsg(ResponseCode::OperationFailed,
+                        "Failed to add route to default table", true);
+            } else {
+                cli->sendMsg(ResponseCode::CommandOkay,
+                        "Route added to default table", false);
             }
-            if (!strcmp(argv[2], "add")) {
-                if (!strcmp(argv[4], "default")) {
-                    if (ifc_add_route(argv[3], argv[5], prefix_length, argv[7])) {
-                        cli->sendMsg(ResponseCode::OperationFailed,
-                                "Failed to add route to default table", true);
-                    } else {
-                        cli->sendMsg(ResponseCode::CommandOkay,
-                                "Route added to default table", false);
-                    }
-                } else if (!strcmp(argv[4], "secondary")) {
-                    return sSecondaryTableCtrl->addRoute(cli, argv[3], argv[5],
-                            prefix_length, argv[7]);
-                } else {
-                    cli->sendMsg(ResponseCode::CommandParameterError,
-                            "Invalid route type, expecting 'default' or 'secondary'", false);
-                    return 0;
-                }
-            } else if (!strcmp(argv[2], "remove")) {
-                if (!strcmp(argv[4], "default")) {
-                    if (ifc_remove_route(argv[3], argv[5], prefix_length, argv[7])) {
-                        cli->sendMsg(ResponseCode::OperationFailed,
-                                "Failed to remove route from default table", true);
-                    } else {
-                        cli->sendMsg(ResponseCode::CommandOkay,
-                                "Route removed from default table", false);
-                    }
-                } else if (!strcmp(argv[4], "secondary")) {
-                    return sSecondaryTableCtrl->removeRoute(cli, argv[3], argv[5],
-                            prefix_length, argv[7]);
-                } else {
-                    cli->sendMsg(ResponseCode::CommandParameterError,
-                            "Invalid route type, expecting 'default' or 'secondary'", false);
-                    return 0;
-                }
+        } else if (!strcmp(argv[4], "secondary")) {
+            return sSecondaryTableCtrl->addRoute(cli, argv[3], argv[5],
+                    prefix_length, argv[7]);
+        } else {
+            cli->sendMsg(ResponseCode::CommandParameterError,
+                    "Invalid route type, expecting 'default' or 'secondary'", false);
+            return 0;
+        }
+    } else if (!strcmp(argv[2], "remove")) {
+        if (!strcmp(argv[4], "default")) {
+            if (ifc_remove_route(argv[3], argv[5], prefix_length, argv[7])) {
+                cli->sendMsg(ResponseCode::OperationFailed,
+                        "Failed to remove route from default table", true);
             } else {
-                cli->sendMsg(ResponseCode::CommandSyntaxError, "Unknown interface cmd", false);
+                cli->sendMsg(ResponseCode::CommandOkay,
+                        "Route removed from default table", false);
             }
+        } else if (!strcmp(argv[4], "secondary")) {
+            return sSecondaryTableCtrl->removeRoute(cli, argv[3], argv[5],
+                    prefix_length, argv[7]);
+        } else {
+            cli->sendMsg(ResponseCode::CommandParameterError,
+                    "Invalid route type, expecting 'default' or 'secondary'", false);
             return 0;
         }
+    } else {
+        cli->sendMsg(ResponseCode::CommandSyntaxError, "Unknown interface cmd", false);
+    }
+    return 0;
+}
 
-        if (!strcmp(argv[1], "getcfg")) {
-            struct in_addr addr;
-            int prefixLength;
-            unsigned char hwaddr[6];
-            unsigned flags = 0;
-
-            ifc_init();
-            memset(hwaddr, 0, sizeof(hwaddr));
+int CommandListener::InterfaceCmd::runGetCfg(SocketClient *cli, int, char **argv) {
+    struct in_addr addr;
+    int prefixLength;
+    unsigned char hwaddr[6];
+    unsigned flags = 0;
 
-            if (ifc_get_info(argv[2], &addr.s_addr, &prefixLength, &flags)) {
-                cli->sendMsg(ResponseCode::OperationFailed, "Interface not found", true);
-                ifc_close();
-                return 0;
-            }
+    ifc_init();
+    memset(hwaddr, 0, sizeof(hwaddr));
 
-            if (ifc_get_hwaddr(argv[2], (void *) hwaddr)) {
-                ALOGW("Failed to retrieve HW addr for %s (%s)", argv[2], strerror(errno));
-            }
+    if (ifc_get_info(argv[2], &addr.s_addr, &prefixLength, &flags)) {
+        cli->sendMsg(ResponseCode::OperationFailed, "Interface not found", true);
+        ifc_close();
+        return 0;
+    }
 
-            char *addr_s = strdup(inet_ntoa(addr));
-            const char *updown, *brdcst, *loopbk, *ppp, *running, *multi;
+    if (ifc_get_hwaddr(argv[2], (void *) hwaddr)) {
+        ALOGW("Failed to retrieve HW addr for %s (%s)", argv[2], strerror(errno));
+    }
 
-            updown =  (flags & IFF_UP)           ? "up" : "down";
-            brdcst =  (flags & IFF_BROADCAST)    ? " broadcast" : "";
-            loopbk =  (flags & IFF_LOOPBACK)     ? " loopback" : "";
-            ppp =     (flags & IFF_POINTOPOINT)  ? " point-to-point" : "";
-            running = (flags & IFF_RUNNING)      ? " running" : "";
-            multi =   (flags & IFF_MULTICAST)    ? " multicast" : "";
+    char *addr_s = strdup(inet_ntoa(addr));
+    const char *updown, *brdcst, *loopbk, *ppp, *running, *multi;
 
-            char *flag_s;
+    updown =  (flags & IFF_UP)           ? "up" : "down";
+    brdcst =  (flags & IFF_BROADCAST)    ? " broadcast" : "";
+    loopbk =  (flags & IFF_LOOPBACK)     ? " loopback" : "";
+    ppp =     (flags & IFF_POINTOPOINT)  ? " point-to-point" : "";
+    running = (flags & IFF_RUNNING)      ? " running" : "";
+    multi =   (flags & IFF_MULTICAST)    ? " multicast" : "";
 
-            asprintf(&flag_s, "%s%s%s%s%s%s", updown, brdcst, loopbk, ppp, running, multi);
+    char *flag_s;
 
-            char *msg = NULL;
-            asprintf(&msg, "%.2x:%.2x:%.2x:%.2x:%.2x:%.2x %s %d %s",
-                     hwaddr[0], hwaddr[1], hwaddr[2], hwaddr[3], hwaddr[4], hwaddr[5],
-                     addr_s, prefixLength, flag_s);
+    asprintf(&flag_s, "%s%s%s%s%s%s", updown, brdcst, loopbk, ppp, running, multi);
 
-            cli->sendMsg(ResponseCode::InterfaceGetCfgResult, msg, false);
+    char *msg = NULL;
+    asprintf(&msg, "%.2x:%.2x:%.2x:%.2x:%.2x:%.2x %s %d %s",
+             hwaddr[0], hwaddr[1], hwaddr[2], hwaddr[3], hwaddr[4], hwaddr[5],
+             addr_s, prefixLength, flag_s);
 
-            free(addr_s);
-            free(flag_s);
-            free(msg);
+    cli->sendMsg(ResponseCode::InterfaceGetCfgResult, msg, false);
 
-            ifc_close();
-            return 0;
-        } else if (!strcmp(argv[1], "setcfg")) {
-            // arglist: iface [addr prefixLength] flags
-            if (argc < 4) {
-                cli->sendMsg(ResponseCode::CommandSyntaxError, "Missing argument", false);
-                return 0;
-            }
-            ALOGD("Setting iface cfg");
+    free(addr_s);
+    free(flag_s);
+    free(msg);
 
-            struct in_addr addr;
-            unsigned flags = 0;
-            int index = 5;
+    ifc_close();
+    return 0;
+}
 
-            ifc_init();
+int CommandListener::InterfaceCmd::runSetCfg(SocketClient *cli, int argc, char **argv) {
+    // arglist: iface [addr prefixLength] flags
+    ALOGD("Setting iface cfg");
 
-            if (!inet_aton(argv[3], &addr)) {
-                // Handle flags only case
-                index = 3;
-            } else {
-                if (ifc_set_addr(argv[2], addr.s_addr)) {
-                    cli->sendMsg(ResponseCode::OperationFailed, "Failed to set address", true);
-                    ifc_close();
-                    return 0;
-                }
-
-                // Set prefix length on a non zero address
-                if (addr.s_addr != 0 && ifc_set_prefixLength(argv[2], atoi(argv[4]))) {
-                   cli->sendMsg(ResponseCode::OperationFailed, "Failed to set prefixLength", true);
-                   ifc_close();
-                   return 0;
-               }
-            }
+    struct in_addr addr;
+    unsigned flags = 0;
+    int index = 5;
 
-            /* Process flags */
-            for (int i = index; i < argc; i++) {
-                char *flag = argv[i];
-                if (!strcmp(flag, "up")) {
-                    ALOGD("Trying to bring up %s", argv[2]);
-                    if (ifc_up(argv[2])) {
-                        ALOGE("Error upping interface");
-                        cli->sendMsg(ResponseCode::OperationFailed, "Failed to up interface", true);
-                        ifc_close();
-                        return 0;
-                    }
-                } else if (!strcmp(flag, "down")) {
-                    ALOGD("Trying to bring down %s", argv[2]);
-                    if (ifc_down(argv[2])) {
-                        ALOGE("Error downing interface");
-                        cli->sendMsg(ResponseCode::OperationFailed, "Failed to down interface", true);
-                        ifc_close();
-                        return 0;
-                    }
-                } else if (!strcmp(flag, "broadcast")) {
-                    // currently ignored
-                } else if (!strcmp(flag, "multicast")) {
-                    // currently ignored
-                } else if (!strcmp(flag, "running")) {
-                    // currently ignored
-                } else if (!strcmp(flag, "loopback")) {
-                    // currently ignored
-                } else if (!strcmp(flag, "point-to-point")) {
-                    // currently ignored
-                } else {
-                    cli->sendMsg(ResponseCode::CommandParameterError, "Flag unsupported", false);
-                    ifc_close();
-                    return 0;
-                }
-            }
+    ifc_init();
 
-            cli->sendMsg(ResponseCode::CommandOkay, "Interface configuration set", false);
+    if (!inet_aton(argv[3], &addr)) {
+        // Handle flags only case
+        index = 3;
+    } else {
+        if (ifc_set_addr(argv[2], addr.s_addr)) {
+            cli->sendMsg(ResponseCode::OperationFailed, "Failed to set address", true);
             ifc_close();
             return 0;
-        } else if (!strcmp(argv[1], "clearaddrs")) {
-            // arglist: iface
-            ALOGD("Clearing all IP addresses on %s", argv[2]);
-
-            ifc_clear_addresses(argv[2]);
+        }
 
-            cli->sendMsg(ResponseCode::CommandOkay, "Interface IP addresses cleared", false);
-            return 0;
-        } else if (!strcmp(argv[1], "ipv6privacyextensions")) {
-            if (argc != 4) {
-                cli->sendMsg(ResponseCode::CommandSyntaxError,
-                        "Usage: interface ipv6privacyextensions <interface> <enable|disable>",
-                        false);
-                return 0;
-            }
-            int enable = !strncmp(argv[3], "enable", 7);
-            if (sInterfaceCtrl->setIPv6PrivacyExtensions(argv[2], enable) == 0) {
-                cli->sendMsg(ResponseCode::CommandOkay, "IPv6 privacy extensions changed", false);
-            } else {
-                cli->sendMsg(ResponseCode::OperationFailed,
-                        "Failed to set ipv6 privacy extensions", true);
-            }
-            return 0;
-        } else if (!strcmp(argv[1], "ipv6")) {
-            if (argc != 4) {
-                cli->sendMsg(ResponseCode::CommandSyntaxError,
-                        "Usage: interface ipv6 <interface> <enable|disable>",
-                        false);
+        // Set prefix length on a non zero address
+        if (addr.s_addr != 0 && ifc_set_prefixLength(argv[2], atoi(argv[4]))) {
+           cli->sendMsg(ResponseCode::OperationFailed, "Failed to set prefixLength", true);
+           ifc_close();
+           return 0;
+       }
+    }
+
+    /* Process flags */
+    for (int i = index; i < argc; i++) {
+        char *flag = argv[i];
+        if (!strcmp(flag, "up")) {
+            ALOGD("Trying to bring up %s", argv[2]);
+            if (ifc_up(argv[2])) {
+                ALOGE("Error upping interface");
+                cli->sendMsg(ResponseCode::OperationFailed, "Failed to up interface", true);
+                ifc_close();
                 return 0;
             }
-
-            int enable = !strncmp(argv[3], "enable", 7);
-            if (sInterfaceCtrl->setEnableIPv6(argv[2], enable) == 0) {
-                cli->sendMsg(ResponseCode::CommandOkay, "IPv6 state changed", false);
-            } else {
-                cli->sendMsg(ResponseCode::OperationFailed,
-                        "Failed to change IPv6 state", true);
-            }
-            return 0;
-        } else if (!strcmp(argv[1], "getmtu")) {
-            char *msg = NULL;
-            int mtu = 0;
-            if (sInterfaceCtrl->getMtu(argv[2], &mtu) == 0) {
-                asprintf(&msg, "MTU = %d", mtu);
-                cli->sendMsg(ResponseCode::InterfaceGetMtuResult, msg, false);
-                free(msg);
-            } else {
-                cli->sendMsg(ResponseCode::OperationFailed,
-                        "Failed to get MTU", true);
-            }
-            return 0;
-        } else if (!strcmp(argv[1], "setmtu")) {
-            if (argc != 4) {
-                cli->sendMsg(ResponseCode::CommandSyntaxError,
-                        "Usage: interface setmtu <interface> <val>", false);
+        } else if (!strcmp(flag, "down")) {
+            ALOGD("Trying to bring down %s", argv[2]);
+            if (ifc_down(argv[2])) {
+                ALOGE("Error downing interface");
+                cli->sendMsg(ResponseCode::OperationFailed, "Failed to down interface", true);
+                ifc_close();
                 return 0;
             }
-            if (sInterfaceCtrl->setMtu(argv[2], argv[3]) == 0) {
-                cli->sendMsg(ResponseCode::CommandOkay, "MTU changed", false);
-            } else {
-                cli->sendMsg(ResponseCode::OperationFailed,
-                        "Failed to get MTU", true);
-            }
-            return 0;
+        } else if (!strcmp(flag, "broadcast")) {
+            // currently ignored
+        } else if (!strcmp(flag, "multicast")) {
+            // currently ignored
+        } else if (!strcmp(flag, "running")) {
+            // currently ignored
+        } else if (!strcmp(flag, "loopback")) {
+            // currently ignored
+        } else if (!strcmp(flag, "point-to-point")) {
+            // currently ignored
         } else {
-            cli->sendMsg(ResponseCode::CommandSyntaxError, "Unknown interface cmd", false);
+            cli->sendMsg(ResponseCode::CommandParameterError, "Flag unsupported", false);
+            ifc_close();
             return 0;
         }
     }
+
+    cli->sendMsg(ResponseCode::CommandOkay, "Interface configuration set", false);
+    ifc_close();
     return 0;
 }
 
+int CommandListener::InterfaceCmd::runClearAddrs(SocketClient *cli, int, char **argv) {
+    // arglist: iface
+    ALOGD("Clearing all IP addresses on %s", argv[2]);
 
-CommandListener::ListTtysCmd::ListTtysCmd() :
-                 NetdCommand("list_ttys") {
-}
+    ifc_clear_addresses(argv[2]);
 
-int CommandListener::ListTtysCmd::runCommand(SocketClient *cli,
-                                             int argc, char **argv) {
-    TtyCollection *tlist = sPppCtrl->getTtyList();
-    TtyCollection::iterator it;
+    cli->sendMsg(ResponseCode::CommandOkay, "Interface IP addresses cleared", false);
+    return 0;
+}
 
-    for (it = tlist->begin(); it != tlist->end(); ++it) {
-        cli->sendMsg(ResponseCode::TtyListResult, *it, false);
+int CommandListener::InterfaceCmd::runIpv6PrivacyExtensions(SocketClient *cli, int, char **argv) {
+    int enable = !strncmp(argv[3], "enable", 7);
+    if (sInterfaceCtrl->setIPv6PrivacyExtensions(argv[2], enable) == 0) {
+        cli->sendMsg(ResponseCode::CommandOkay, "IPv6 privacy extensions changed", false);
+    } else {
+        cli->sendMsg(ResponseCode::OperationFailed,
+                "Failed to set ipv6 privacy extensions", true);
     }
-
-    cli->sendMsg(ResponseCode::CommandOkay, "Ttys listed.", false);
     return 0;
 }
 
-CommandListener::IpFwdCmd::IpFwdCmd() :
-                 NetdCommand("ipfwd") {
+int CommandListener::InterfaceCmd::runIpv6(SocketClient *cli, int, char **argv) {
+    int enable = !strncmp(argv[3], "enable", 7);
+    if (sInterfaceCtrl->setEnableIPv6(argv[2], enable) == 0) {
+        cli->sendMsg(ResponseCode::CommandOkay, "IPv6 state changed", false);
+    } else {
+        cli->sendMsg(ResponseCode::OperationFailed,
+                "Failed to change IPv6 state", true);
+    }
+    return 0;
 }
 
-int CommandListener::IpFwdCmd::runCommand(SocketClient *cli,
-                                                      int argc, char **argv) {
-    int rc = 0;
+int CommandListener::InterfaceCmd::runGetMtu(SocketClient *cli, int, char **argv) {
+    char *msg = NULL;
+    int mtu = 0;
+    if (sInterfaceCtrl->getMtu(argv[2], &mtu) == 0) {
+        asprintf(&msg, "MTU = %d", mtu);
+        cli->sendMsg(ResponseCode::InterfaceGetMtuResult, msg, false);
+        free(msg);
+    } else {
+        cli->sendMsg(ResponseCode::OperationFailed,
+                "Failed to get MTU", true);
+    }
+    return 0;
+}
 
-    if (argc < 2) {
-        cli->sendMsg(ResponseCode::CommandSyntaxError, "Missing argument", false);
-        return 0;
+int CommandListener::InterfaceCmd::runSetMtu(SocketClient *cli, int, char **argv) {
+    if (sInterfaceCtrl->setMtu(argv[2], argv[3]) == 0) {
+        cli->sendMsg(ResponseCode::CommandOkay, "MTU changed", false);
+    } else {
+        cli->sendMsg(ResponseCode::OperationFailed,
+                "Failed to get MTU", true);
     }
+    return 0;
+}
 
-    if (!strcmp(argv[1], "status")) {
-        char *tmp = NULL;
 
-        asprintf(&tmp, "Forwarding %s", (sTetherCtrl->getIpFwdEnabled() ? "enabled" : "disabled"));
-        cli->sendMsg(ResponseCode::IpFwdStatusResult, tmp, false);
-        free(tmp);
-        return 0;
-    } else if (!strcmp(argv[1], "enable")) {
-        rc = sTetherCtrl->setIpFwdEnabled(true);
-    } else if (!strcmp(argv[1], "disable")) {
-        rc = sTetherCtrl->setIpFwdEnabled(false);
-    } else {
-        cli->sendMsg(ResponseCode::CommandSyntaxError, "Unknown ipfwd cmd", false);
-        return 0;
+CommandListener::ListTtysCmd::ListTtysCmd() :
+                 NetdCommand("list_ttys") {
+}
+
+int CommandListener::ListTtysCmd::runCommand(SocketClient *cli,
+                                             int argc, char **argv) {
+    TtyCollection *tlist = sPppCtrl->getTtyList();
+    TtyCollection::iterator it;
+
+    for (it = tlist->begin(); it != tlist->end(); ++it) {
+        cli->sendMsg(ResponseCode::TtyListResult, *it, false);
     }
 
+    cli->sendMsg(ResponseCode::CommandOkay, "Ttys listed.", false);
+    return 0;
+}
+
+const SubcommandEntry<CommandListener::IpFwdCmd> CommandListener::IpFwdCmd::SUBCOMMANDS[] = {
+    { "disable", 2, -1, "Missing argument",
+      &CommandListener::IpFwdCmd::runDisable },
+    { "enable", 2, -1, "Missing argument",
+      &CommandListener::IpFwdCmd::runEnable },
+    { "status", 2, -1, "Missing argument",
+      &CommandListener::IpFwdCmd::runStatus },
+};
+
+CommandListener::IpFwdCmd::IpFwdCmd() :
+                 NetdCommand("ipfwd") {
+    checkSubcommandOrder("ipfwd", SUBCOMMANDS, ARRAY_SIZE(SUBCOMMANDS));
+}
+
+int CommandListener::IpFwdCmd::sendGenericOkFail(SocketClient *cli, int rc) {
     if (!rc) {
         cli->sendMsg(ResponseCode::CommandOkay, "ipfwd operation succeeded", false);
     } else {
         cli->sendMsg(ResponseCode::OperationFailed, "ipfwd operation failed", true);
     }
+    return 0;
+}
 
+int CommandListener::IpFwdCmd::runCommand(SocketClient *cli,
+                                                      int argc, char **argv) {
+    if (argc < 2) {
+        cli->sendMsg(ResponseCode::CommandSyntaxError, "Missing argument", false);
+        return 0;
+    }
+    return runSubcommand(this, SUBCOMMANDS, ARRAY_SIZE(SUBCOMMANDS), cli, argc, argv,
+                         "Unknown ipfwd cmd");
+}
+
+int CommandListener::IpFwdCmd::runStatus(SocketClient *cli, int, char **) {
+    char *tmp = NULL;
+
+    asprintf(&tmp, "Forwarding %s", (sTetherCtrl->getIpFwdEnabled() ? "enabled" : "disabled"));
+    cli->sendMsg(ResponseCode::IpFwdStatusResult, tmp, false);
+    free(tmp);
     return 0;
 }
 
+int CommandListener::IpFwdCmd::runEnable(SocketClient *cli, int, char **) {
+    return sendGenericOkFail(cli, sTetherCtrl->setIpFwdEnabled(true));
+}
+
+int CommandListener::IpFwdCmd::runDisable(SocketClient *cli, int, char **) {
+    return sendGenericOkFail(cli, sTetherCtrl->setIpFwdEnabled(false));
+}
+
+const SubcommandEntry<CommandListener::TetherCmd> CommandListener::TetherCmd::SUBCOMMANDS[] = {
+    { "dns", 3, -1, "Missing argument",
+      &CommandListener::TetherCmd::runDns },
+    { "interface", 3, -1, "Missing argument",
+      &CommandListener::TetherCmd::runInterface },
+    { "start", 4, -1, "Missing argument",
+      &CommandListener::TetherCmd::runStart },
+    { "status", 2, -1, "Missing argument",
+      &CommandListener::TetherCmd::runStatus },
+    { "stop", 2, -1, "Missing argument",
+      &CommandListener::TetherCmd::runStop },
+};
+
 CommandListener::TetherCmd::TetherCmd() :
                  NetdCommand("tether") {
+    checkSubcommandOrder("tether", SUBCOMMANDS, ARRAY_SIZE(SUBCOMMANDS));
+}
+
+int CommandListener::TetherCmd::sendGenericOkFail(SocketClient *cli, int rc) {
+    if (!rc) {
+        cli->sendMsg(ResponseCode::CommandOkay, "Tether operation succeeded", false);
+    } else {
+        cli->sendMsg(ResponseCode::OperationFailed, "Tether operation failed", true);
+    }
+    return 0;
 }
 
 int CommandListener::TetherCmd::runCommand(SocketClient *cli,
                                                       int argc, char **argv) {
-    int rc = 0;
-
     if (argc < 2) {
         cli->sendMsg(ResponseCode::CommandSyntaxError, "Missing argument", false);
         return 0;
     }
+    return runSubcommand(this, SUBCOMMANDS, ARRAY_SIZE(SUBCOMMANDS), cli, argc, argv,
+                         "Unknown tether cmd");
+}
 
-    if (!strcmp(argv[1], "stop")) {
-        rc = sTetherCtrl->stopTethering();
-    } else if (!strcmp(argv[1], "status")) {
-        char *tmp = NULL;
+int CommandListener::TetherCmd::runStop(SocketClient *cli, int, char **) {
+    return sendGenericOkFail(cli, sTetherCtrl->stopTethering());
+}
 
-        asprintf(&tmp, "Tethering services %s",
-                 (sTetherCtrl->isTetheringStarted() ? "started" : "stopped"));
-        cli->sendMsg(ResponseCode::TetherStatusResult, tmp, false);
-        free(tmp);
-        return 0;
-    } else if (argc == 3) {
-        if (!strcmp(argv[1], "interface") && !strcmp(argv[2], "list")) {
-            InterfaceCollection *ilist = sTetherCtrl->getTetheredInterfaceList();
-            InterfaceCollection::iterator it;
-            for (it = ilist->begin(); it != ilist->end(); ++it) {
-                cli->sendMsg(ResponseCode::TetherInterfaceListResult, *it, false);
-            }
-        } else if (!strcmp(argv[1], "dns") && !strcmp(argv[2], "list")) {
-            NetAddressCollection *dlist = sTetherCtrl->getDnsForwarders();
-            NetAddressCollection::iterator it;
+int CommandListener::TetherCmd::runStatus(SocketClient *cli, int, char **) {
+    char *tmp = NULL;
 
-            for (it = dlist->begin(); it != dlist->end(); ++it) {
-                cli->sendMsg(ResponseCode::TetherDnsFwdTgtListResult, inet_ntoa(*it), false);
-            }
-        }
-    } else {
-        /*
-         * These commands take a minimum of 4 arguments
-         */
-        if (argc < 4) {
-            cli->sendMsg(ResponseCode::CommandSyntaxError, "Missing argument", false);
-            return 0;
-        }
+    asprintf(&tmp, "Tethering services %s",
+             (sTetherCtrl->isTetheringStarted() ? "started" : "stopped"));
+    cli->sendMsg(ResponseCode::TetherStatusResult, tmp, false);
+    free(tmp);
+    return 0;
+}
 
-        if (!strcmp(argv[1], "start")) {
-            if (argc % 2 == 1) {
-                cli->sendMsg(ResponseCode::CommandSyntaxError, "Bad number of arguments", false);
-                return 0;
-            }
+int CommandListener::TetherCmd::runStart(SocketClient *cli, int argc, char **argv) {
+    if (argc % 2 == 1) {
+        cli->sendMsg(ResponseCode::CommandSyntaxError, "Bad number of arguments", false);
+        return 0;
+    }
 
-            int num_addrs = argc - 2;
-            int arg_index = 2;
-            int array_index = 0;
-            in_addr *addrs = (in_addr *)malloc(sizeof(in_addr) * num_addrs);
-            while (array_index < num_addrs) {
-                if (!inet_aton(argv[arg_index++], &(addrs[array_index++]))) {
-                    cli->sendMsg(ResponseCode::CommandParameterError, "Invalid address", false);
-                    free(addrs);
-                    return 0;
-                }
-            }
-            rc = sTetherCtrl->startTethering(num_addrs, addrs);
+    int num_addrs = argc - 2;
+    int arg_index = 2;
+    int array_index = 0;
+    in_addr *addrs = (in_addr *)malloc(sizeof(in_addr) * num_addrs);
+    while (array_index < num_addrs) {
+        if (!inet_aton(argv[arg_index++], &(addrs[array_index++]))) {
+            cli->sendMsg(ResponseCode::CommandParameterError, "Invalid address", false);
             free(addrs);
-        } else if (!strcmp(argv[1], "interface")) {
-            if (!strcmp(argv[2], "add")) {
-                rc = sTetherCtrl->tetherInterface(argv[3]);
-            } else if (!strcmp(argv[2], "remove")) {
-                rc = sTetherCtrl->untetherInterface(argv[3]);
-            /* else if (!strcmp(argv[2], "list")) handled above */
-            } else {
-                cli->sendMsg(ResponseCode::CommandParameterError,
-                             "Unknown tether interface operation", false);
-                return 0;
-            }
-        } else if (!strcmp(argv[1], "dns")) {
-            if (!strcmp(argv[2], "set")) {
-                rc = sTetherCtrl->setDnsForwarders(&argv[3], argc - 3);
-            /* else if (!strcmp(argv[2], "list")) handled above */
-            } else {
-                cli->sendMsg(ResponseCode::CommandParameterError,
-                             "Unknown tether interface operation", false);
-                return 0;
-            }
-        } else {
-            cli->sendMsg(ResponseCode::CommandSyntaxError, "Unknown tether cmd", false);
             return 0;
         }
     }
+    int rc = sTetherCtrl->startTethering(num_addrs, addrs);
+    free(addrs);
+    return sendGenericOkFail(cli, rc);
+}
 
-    if (!rc) {
-        cli->sendMsg(ResponseCode::CommandOkay, "Tether operation succeeded", false);
-    } else {
-        cli->sendMsg(ResponseCode::OperationFailed, "Tether operation failed", true);
+int CommandListener::TetherCmd::runInterface(SocketClient *cli, int argc, char **argv) {
+    if (argc == 3 && !strcmp(argv[2], "list")) {
+        InterfaceCollection *ilist = sTetherCtrl->getTetheredInterfaceList();
+        InterfaceCollection::iterator it;
+        for (it = ilist->begin(); it != ilist->end(); ++it) {
+            cli->sendMsg(ResponseCode::TetherInterfaceListResult, *it, false);
+        }
+        return sendGenericOkFail(cli, 0);
+    }
+    if (argc < 4) {
+        cli->sendMsg(ResponseCode::CommandSyntaxError, "Missing argument", false);
+        return 0;
     }
 
-    return 0;
-}
-
-CommandListener::NatCmd::NatCmd() :
-                 NetdCommand("nat") {
+    int rc;
+    if (!strcmp(argv[2], "add")) {
+        rc = sTetherCtrl->tetherInterface(argv[3]);
+    } else if (!strcmp(argv[2], "remove")) {
+        rc = sTetherCtrl->untetherInterface(argv[3]);
+    } else {
+        cli->sendMsg(ResponseCode::CommandParameterError,
+                     "Unknown tether interface operation", false);
+        return 0;
+    }
+    return sendGenericOkFail(cli, rc);
 }
 
-int CommandListener::NatCmd::runCommand(SocketClient *cli,
-                                                      int argc, char **argv) {
-    int rc = 0;
+int CommandListener::TetherCmd::runDns(SocketClient *cli, int argc, char **argv) {
+    if (argc == 3 && !strcmp(argv[2], "list")) {
+        NetAddressCollection *dlist = sTetherCtrl->getDnsForwarders();
+        NetAddressCollection::iterator it;
 
-    if (argc < 5) {
+        for (it = dlist->begin(); it != dlist->end(); ++it) {
+            cli->sendMsg(ResponseCode::TetherDnsFwdTgtListResult, it->c_str(), false);
+        }
+        return sendGenericOkFail(cli, 0);
+    }
+    if (argc < 4) {
         cli->sendMsg(ResponseCode::CommandSyntaxError, "Missing argument", false);
         return 0;
     }
 
-    if (!strcmp(argv[1], "enable")) {
-        rc = sNatCtrl->enableNat(argc, argv);
-        if(!rc) {
-            /* Ignore ifaces for now. */
-            rc = sBandwidthCtrl->setGlobalAlertInForwardChain();
-        }
-    } else if (!strcmp(argv[1], "disable")) {
-        /* Ignore ifaces for now. */
-        rc = sBandwidthCtrl->removeGlobalAlertInForwardChain();
-        rc |= sNatCtrl->disableNat(argc, argv);
-    } else {
-        cli->sendMsg(ResponseCode::CommandSyntaxError, "Unknown nat cmd", false);
+    if (strcmp(argv[2], "set")) {
+        cli->sendMsg(ResponseCode::CommandParameterError,
+                     "Unknown tether interface operation", false);
         return 0;
     }
+    return sendGenericOkFail(cli, sTetherCtrl->setDnsForwarders(&argv[3], argc - 3));
+}
+
+const SubcommandEntry<CommandListener::NatCmd> CommandListener::NatCmd::SUBCOMMANDS[] = {
+    { "disable", 5, -1, "Missing argument",
+      &CommandListener::NatCmd::runDisable },
+    { "enable", 5, -1, "Missing argument",
+      &CommandListener::NatCmd::runEnable },
+};
+
+CommandListener::NatCmd::NatCmd() :
+                 NetdCommand("nat") {
+    checkSubcommandOrder("nat", SUBCOMMANDS, ARRAY_SIZE(SUBCOMMANDS));
+}
 
+int CommandListener::NatCmd::sendGenericOkFail(SocketClient *cli, int rc) {
     if (!rc) {
         cli->sendMsg(ResponseCode::CommandOkay, "Nat operation succeeded", false);
     } else {
         cli->sendMsg(ResponseCode::OperationFailed, "Nat operation failed", true);
     }
-
     return 0;
 }
 
+int CommandListener::NatCmd::runCommand(SocketClient *cli,
+                                                      int argc, char **argv) {
+    if (argc < 2) {
+        cli->sendMsg(ResponseCode::CommandSyntaxError, "Missing argument", false);
+        return 0;
+    }
+    return runSubcommand(this, SUBCOMMANDS, ARRAY_SIZE(SUBCOMMANDS), cli, argc, argv,
+                         "Unknown nat cmd");
+}
+
+int CommandListener::NatCmd::runEnable(SocketClient *cli, int argc, char **argv) {
+    int rc = sNatCtrl->enableNat(argc, argv);
+    if(!rc) {
+        /* Ignore ifaces for now. */
+        rc = sBandwidthCtrl->setGlobalAlertInForwardChain();
+    }
+    return sendGenericOkFail(cli, rc);
+}
+
+int CommandListener::NatCmd::runDisable(SocketClient *cli, int argc, char **argv) {
+    /* Ignore ifaces for now. */
+    int rc = sBandwidthCtrl->removeGlobalAlertInForwardChain();
+    rc |= sNatCtrl->disableNat(argc, argv);
+    return sendGenericOkFail(cli, rc);
+}
+
+const SubcommandEntry<CommandListener::PppdCmd> CommandListener::PppdCmd::SUBCOMMANDS[] = {
+    { "attach", 5, 7, "Missing argument",
+      &CommandListener::PppdCmd::runAttach },
+    { "detach", 3, -1, "Missing argument",
+      &CommandListener::PppdCmd::runDetach },
+};
+
 CommandListener::PppdCmd::PppdCmd() :
                  NetdCommand("pppd") {
+    checkSubcommandOrder("pppd", SUBCOMMANDS, ARRAY_SIZE(SUBCOMMANDS));
+}
+
+int CommandListener::PppdCmd::sendGenericOkFail(SocketClient *cli, int rc) {
+    if (!rc) {
+        cli->sendMsg(ResponseCode::CommandOkay, "Pppd operation succeeded", false);
+    } else {
+        cli->sendMsg(ResponseCode::OperationFailed, "Pppd operation failed", true);
+    }
+    return 0;
 }
 
 int CommandListener::PppdCmd::runCommand(SocketClient *cli,
                                                       int argc, char **argv) {
-    int rc = 0;
-
-    if (argc < 3) {
+    if (argc < 2) {
         cli->sendMsg(ResponseCode::CommandSyntaxError, "Missing argument", false);
         return 0;
     }
+    return runSubcommand(this, SUBCOMMANDS, ARRAY_SIZE(SUBCOMMANDS), cli, argc, argv,
+                         "Unknown pppd cmd");
+}
 
-    if (!strcmp(argv[1], "attach")) {
-        struct in_addr l, r, dns1, dns2;
+int CommandListener::PppdCmd::runAttach(SocketClient *cli, int argc, char **argv) {
+    struct in_addr l, r, dns1, dns2;
 
-        memset(&dns1, 0, sizeof(struct in_addr));
-        memset(&dns2, 0, sizeof(struct in_addr));
+    memset(&dns1, 0, sizeof(struct in_addr));
+    memset(&dns2, 0, sizeof(struct in_addr));
 
-        if (!inet_aton(argv[3], &l)) {
-            cli->sendMsg(ResponseCode::CommandParameterError, "Invalid local address", false);
-            return 0;
-        }
-        if (!inet_aton(argv[4], &r)) {
-            cli->sendMsg(ResponseCode::CommandParameterError, "Invalid remote address", false);
-            return 0;
-        }
-        if ((argc > 3) && (!inet_aton(argv[5], &dns1))) {
-            cli->sendMsg(ResponseCode::CommandParameterError, "Invalid dns1 address", false);
-            return 0;
-        }
-        if ((argc > 4) && (!inet_aton(argv[6], &dns2))) {
-            cli->sendMsg(ResponseCode::CommandParameterError, "Invalid dns2 address", false);
-            return 0;
-        }
-        rc = sPppCtrl->attachPppd(argv[2], l, r, dns1, dns2);
-    } else if (!strcmp(argv[1], "detach")) {
-        rc = sPppCtrl->detachPppd(argv[2]);
-    } else {
-        cli->sendMsg(ResponseCode::CommandSyntaxError, "Unknown pppd cmd", false);
+    if (!inet_aton(argv[3], &l)) {
+        cli->sendMsg(ResponseCode::CommandParameterError, "Invalid local address", false);
         return 0;
     }
-
-    if (!rc) {
-        cli->sendMsg(ResponseCode::CommandOkay, "Pppd operation succeeded", false);
-    } else {
-        cli->sendMsg(ResponseCode::OperationFailed, "Pppd operation failed", true);
+    if (!inet_aton(argv[4], &r)) {
+        cli->sendMsg(ResponseCode::CommandParameterError, "Invalid remote address", false);
+        return 0;
+    }
+    if ((argc > 5) && (!inet_aton(argv[5], &dns1))) {
+        cli->sendMsg(ResponseCode::CommandParameterError, "Invalid dns1 address", false);
+        return 0;
+    }
+    if ((argc > 6) && (!inet_aton(argv[6], &dns2))) {
+        cli->sendMsg(ResponseCode::CommandParameterError, "Invalid dns2 address", false);
+        return 0;
     }
+    return sendGenericOkFail(cli, sPppCtrl->attachPppd(argv[2], l, r, dns1, dns2));
+}
 
-    return 0;
+int CommandListener::PppdCmd::runDetach(SocketClient *cli, int, char **argv) {
+    return sendGenericOkFail(cli, sPppCtrl->detachPppd(argv[2]));
 }
 
+const SubcommandEntry<CommandListener::SoftapCmd> CommandListener::SoftapCmd::SUBCOMMANDS[] = {
+    { "fwreload", 2, -1, "Missing argument in a SoftAP command",
+      &CommandListener::SoftapCmd::runFwReload },
+    { "set", 2, -1, "Missing argument in a SoftAP command",
+      &CommandListener::SoftapCmd::runSet },
+    { "startap", 2, -1, "Missing argument in a SoftAP command",
+      &CommandListener::SoftapCmd::runStartAp },
+    { "status", 2, -1, "Missing argument in a SoftAP command",
+      &CommandListener::SoftapCmd::runStatus },
+    { "stopap", 2, -1, "Missing argument in a SoftAP command",
+      &CommandListener::SoftapCmd::runStopAp },
+};
+
 CommandListener::SoftapCmd::SoftapCmd() :
                  NetdCommand("softap") {
+    checkSubcommandOrder("softap", SUBCOMMANDS, ARRAY_SIZE(SUBCOMMANDS));
+}
+
+/* rc is a response code: an error code, or the code to report success with. */
+int CommandListener::SoftapCmd::sendResult(SocketClient *cli, int rc) {
+    if (rc >= 400 && rc < 600)
+      cli->sendMsg(rc, "SoftAP command has failed", false);
+    else
+      cli->sendMsg(rc, "Ok", false);
+
+    return 0;
 }
 
 int CommandListener::SoftapCmd::runCommand(SocketClient *cli,
                                         int argc, char **argv) {
-    int rc = ResponseCode::SoftapStatusResult;
-    int flag = 0;
-    char *retbuf = NULL;
-
     if (sSoftapCtrl == NULL) {
       cli->sendMsg(ResponseCode::ServiceStartFailed, "SoftAP is not available", false);
       return -1;
@@ -913,142 +1308,300 @@ int CommandListener::SoftapCmd::runCommand(SocketClient *cli,
                      "Missing argument in a SoftAP command", false);
         return 0;
     }
+    return runSubcommand(this, SUBCOMMANDS, ARRAY_SIZE(SUBCOMMANDS), cli, argc, argv,
+                         "Unrecognized SoftAP command");
+}
 
-    if (!strcmp(argv[1], "startap")) {
-        rc = sSoftapCtrl->startSoftap();
-    } else if (!strcmp(argv[1], "stopap")) {
-        rc = sSoftapCtrl->stopSoftap();
-    } else if (!strcmp(argv[1], "fwreload")) {
-        rc = sSoftapCtrl->fwReloadSoftap(argc, argv);
-    } else if (!strcmp(argv[1], "status")) {
-        asprintf(&retbuf, "Softap service %s running",
-                 (sSoftapCtrl->isSoftapStarted() ? "is" : "is not"));
-        cli->sendMsg(rc, retbuf, false);
-        free(retbuf);
-        return 0;
-    } else if (!strcmp(argv[1], "set")) {
-        rc = sSoftapCtrl->setSoftap(argc, argv);
-    } else {
-        cli->sendMsg(ResponseCode::CommandSyntaxError, "Unrecognized SoftAP command", false);
-        return 0;
-    }
+int CommandListener::SoftapCmd::runStartAp(SocketClient *cli, int, char **) {
+    return sendResult(cli, sSoftapCtrl->startSoftap());
+}
 
-    if (rc >= 400 && rc < 600)
-      cli->sendMsg(rc, "SoftAP command has failed", false);
-    else
-      cli->sendMsg(rc, "Ok", false);
+int CommandListener::SoftapCmd::runStopAp(SocketClient *cli, int, char **) {
+    return sendResult(cli, sSoftapCtrl->stopSoftap());
+}
+
+int CommandListener::SoftapCmd::runFwReload(SocketClient *cli, int argc, char **argv) {
+    return sendResult(cli, sSoftapCtrl->fwReloadSoftap(argc, argv));
+}
 
+int CommandListener::SoftapCmd::runStatus(SocketClient *cli, int, char **) {
+    char *retbuf = NULL;
+
+    asprintf(&retbuf, "Softap service %s running",
+             (sSoftapCtrl->isSoftapStarted() ? "is" : "is not"));
+    cli->sendMsg(ResponseCode::SoftapStatusResult, retbuf, false);
+    free(retbuf);
     return 0;
 }
 
+int CommandListener::SoftapCmd::runSet(SocketClient *cli, int argc, char **argv) {
+    return sendResult(cli, sSoftapCtrl->setSoftap(argc, argv));
+}
+
+const SubcommandEntry<CommandListener::ResolverCmd>
+        CommandListener::ResolverCmd::SUBCOMMANDS[] = {
+    { "clearifaceforpid", 3, 3, "Wrong number of arguments to resolver clearifaceforpid",
+      &CommandListener::ResolverCmd::runClearIfaceForPid },
+    { "clearifaceforuidrange", 4, 4, "Wrong number of arguments to resolver clearifaceforuid",
+      &CommandListener::ResolverCmd::runClearIfaceForUidRange },
+    { "clearifacemapping", 2, 2, "Wrong number of arugments to resolver clearifacemapping",
+      &CommandListener::ResolverCmd::runClearIfaceMapping },
+    { "flushdefaultif", 2, 2, "Wrong number of arguments to resolver flushdefaultif",
+      &CommandListener::ResolverCmd::runFlushDefaultIf },
+    { "flushif", 3, 3, "Wrong number of arguments to resolver setdefaultif",
+      &CommandListener::ResolverCmd::runFlushIf },
+    { "getcachestats", 2, 2, "Wrong number of arguments to resolver getcachestats",
+      &CommandListener::ResolverCmd::runGetCacheStats },
+    { "getstats", 3, 3, "Wrong number of arguments to resolver getstats",
+      &CommandListener::ResolverCmd::runGetStats },
+    { "setdefaultif", 3, 3, "Wrong number of arguments to resolver setdefaultif",
+      &CommandListener::ResolverCmd::runSetDefaultIf },
+    { "setifaceforpid", 4, 4, "Wrong number of arguments to resolver setifaceforpid",
+      &CommandListener::ResolverCmd::runSetIfaceForPid },
+    { "setifaceforuidrange", 5, 5, "Wrong number of arguments to resolver setifaceforuid",
+      &CommandListener::ResolverCmd::runSetIfaceForUidRange },
+    { "setifdns", 5, -1, "Wrong number of arguments to resolver setifdns",
+      &CommandListener::ResolverCmd::runSetIfDns },
+    { "setuidweight", 4, -1, "Usage: resolver setuidweight <weight> <uid> ...",
+      &CommandListener::ResolverCmd::runSetUidWeight },
+};
+
 CommandListener::ResolverCmd::ResolverCmd() :
         NetdCommand("resolver") {
+    checkSubcommandOrder("resolver", SUBCOMMANDS, ARRAY_SIZE(SUBCOMMANDS));
 }
 
-int CommandListener::ResolverCmd::runCommand(SocketClient *cli, int argc, char **margv) {
-    int rc = 0;
-    struct in_addr addr;
-    const char **argv = const_cast<const char **>(margv);
+int CommandListener::ResolverCmd::sendGenericOkFail(SocketClient *cli, int rc) {
+    if (!rc) {
+        cli->sendMsg(ResponseCode::CommandOkay, "Resolver command succeeded", false);
+    } else {
+        cli->sendMsg(ResponseCode::OperationFailed, "Resolver command failed", true);
+    }
+    return 0;
+}
 
+int CommandListener::ResolverCmd::runCommand(SocketClient *cli, int argc, char **argv) {
     if (argc < 2) {
         cli->sendMsg(ResponseCode::CommandSyntaxError, "Resolver missing arguments", false);
         return 0;
     }
+    return runSubcommand(this, SUBCOMMANDS, ARRAY_SIZE(SUBCOMMANDS), cli, argc, argv,
+                         "Resolver unknown command");
+}
 
-    if (!strcmp(argv[1], "setdefaultif")) { // "resolver setdefaultif <iface>"
-        if (argc == 3) {
-            unsigned netId = sNetCtrl->getNetworkId(argv[2]);
-            sNetCtrl->setDefaultNetwork(netId);
-        } else {
-            cli->sendMsg(ResponseCode::CommandSyntaxError,
-                    "Wrong number of arguments to resolver setdefaultif", false);
-            return 0;
-        }
-    } else if (!strcmp(argv[1], "setifdns")) {
-        // "resolver setifdns <iface> <domains> <dns1> <dns2> ..."
-        if (argc >= 5) {
-            unsigned netId = sNetCtrl->getNetworkId(argv[2]);
-            rc = sResolverCtrl->setDnsServers(netId, argv[3], &argv[4], argc - 4);
-        } else {
-            cli->sendMsg(ResponseCode::CommandSyntaxError,
-                    "Wrong number of arguments to resolver setifdns", false);
-            return 0;
-        }
-    } else if (!strcmp(argv[1], "flushdefaultif")) { // "resolver flushdefaultif"
-        if (argc == 2) {
-            rc = sResolverCtrl->flushDnsCache(sNetCtrl->getDefaultNetwork());
-        } else {
-            cli->sendMsg(ResponseCode::CommandSyntaxError,
-                    "Wrong number of arguments to resolver flushdefaultif", false);
-            return 0;
-        }
-    } else if (!strcmp(argv[1], "flushif")) { // "resolver flushif <iface>"
-        if (argc == 3) {
-            unsigned netId = sNetCtrl->getNetworkId(argv[2]);
-            rc = sResolverCtrl->flushDnsCache(netId);
-        } else {
-            cli->sendMsg(ResponseCode::CommandSyntaxError,
-                    "Wrong number of arguments to resolver setdefaultif", false);
-            return 0;
-        }
-    } else if (!strcmp(argv[1], "setifaceforpid")) { // resolver setifaceforpid <iface> <pid>
-        if (argc == 4) {
-            unsigned netId = sNetCtrl->getNetworkId(argv[2]);
-            sNetCtrl->setNetworkForPid(atoi(argv[3]), netId);
-        } else {
-            cli->sendMsg(ResponseCode::CommandSyntaxError,
-                    "Wrong number of arguments to resolver setifaceforpid", false);
-            return 0;
-        }
-    } else if (!strcmp(argv[1], "clearifaceforpid")) { // resolver clearifaceforpid <pid>
-        if (argc == 3) {
-            sNetCtrl->setNetworkForPid(atoi(argv[2]), 0);
-        } else {
-            cli->sendMsg(ResponseCode::CommandSyntaxError,
-                    "Wrong number of arguments to resolver clearifaceforpid", false);
-            return 0;
-        }
-    } else if (!strcmp(argv[1], "setifaceforuidrange")) { // resolver setifaceforuid <iface> <l> <h>
-        // TODO: Merge this command with "interface fwmark uid add/remove iface uid_start uid_end
-        if (argc == 5) {
-            unsigned netId = sNetCtrl->getNetworkId(argv[2]);
-            rc = !sNetCtrl->setNetworkForUidRange(atoi(argv[3]), atoi(argv[4]), netId, true);
-        } else {
-            cli->sendMsg(ResponseCode::CommandSyntaxError,
-                    "Wrong number of arguments to resolver setifaceforuid", false);
-            return 0;
-        }
-    } else if (!strcmp(argv[1], "clearifaceforuidrange")) { // resolver clearifaceforuid <l> <h>
-        if (argc == 4) {
-            rc = !sNetCtrl->setNetworkForUidRange(atoi(argv[2]), atoi(argv[3]), NETID_UNSET, false);
-        } else {
-            cli->sendMsg(ResponseCode::CommandSyntaxError,
-                    "Wrong number of arguments to resolver clearifaceforuid", false);
-            return 0;
-        }
-    } else if (!strcmp(argv[1], "clearifacemapping")) {
-        if (argc == 2) {
-            sNetCtrl->clearNetworkPreference();
-        } else {
-            cli->sendMsg(ResponseCode::CommandSyntaxError,
-                    "Wrong number of arugments to resolver clearifacemapping", false);
-        }
-    } else {
-        cli->sendMsg(ResponseCode::CommandSyntaxError,"Resolver unknown command", false);
+// "resolver setdefaultif <iface>"
+int CommandListener::ResolverCmd::runSetDefaultIf(SocketClient *cli, int, char **argv) {
+    unsigned netId = sNetCtrl->getNetworkId(argv[2]);
+    sNetCtrl->setDefaultNetwork(netId);
+    return sendGenericOkFail(cli, 0);
+}
+
+// "resolver setifdns <iface> <domains> <dns1> <dns2> ..."
+int CommandListener::ResolverCmd::runSetIfDns(SocketClient *cli, int argc, char **argv) {
+    unsigned netId = sNetCtrl->getNetworkId(argv[2]);
+    const char **servers = const_cast<const char **>(&argv[4]);
+    return sendGenericOkFail(cli, sResolverCtrl->setDnsServers(netId, argv[3], servers,
+                                                               argc - 4));
+}
+
+// "resolver flushdefaultif"
+int CommandListener::ResolverCmd::runFlushDefaultIf(SocketClient *cli, int, char **) {
+    return sendGenericOkFail(cli, sResolverCtrl->flushDnsCache(sNetCtrl->getDefaultNetwork()));
+}
+
+// "resolver flushif <iface>"
+int CommandListener::ResolverCmd::runFlushIf(SocketClient *cli, int, char **argv) {
+    unsigned netId = sNetCtrl->getNetworkId(argv[2]);
+    return sendGenericOkFail(cli, sResolverCtrl->flushDnsCache(netId));
+}
+
+// "resolver setifaceforpid <iface> <pid>"
+int CommandListener::ResolverCmd::runSetIfaceForPid(SocketClient *cli, int, char **argv) {
+    unsigned netId = sNetCtrl->getNetworkId(argv[2]);
+    sNetCtrl->setNetworkForPid(atoi(argv[3]), netId);
+    return sendGenericOkFail(cli, 0);
+}
+
+// "resolver clearifaceforpid <pid>"
+int CommandListener::ResolverCmd::runClearIfaceForPid(SocketClient *cli, int, char **argv) {
+    sNetCtrl->setNetworkForPid(atoi(argv[2]), 0);
+    return sendGenericOkFail(cli, 0);
+}
+
+// "resolver setifaceforuidrange <iface> <l> <h>"
+// TODO: Merge this command with "interface fwmark uid add/remove iface uid_start uid_end
+int CommandListener::ResolverCmd::runSetIfaceForUidRange(SocketClient *cli, int, char **argv) {
+    unsigned netId = sNetCtrl->getNetworkId(argv[2]);
+    return sendGenericOkFail(cli, !sNetCtrl->setNetworkForUidRange(atoi(argv[3]), atoi(argv[4]),
+                                                                   netId, true));
+}
+
+// "resolver clearifaceforuidrange <l> <h>"
+int CommandListener::ResolverCmd::runClearIfaceForUidRange(SocketClient *cli, int,
+                                                           char **argv) {
+    return sendGenericOkFail(cli, !sNetCtrl->setNetworkForUidRange(atoi(argv[2]), atoi(argv[3]),
+                                                                   NETID_UNSET, false));
+}
+
+// "resolver clearifacemapping"
+int CommandListener::ResolverCmd::runClearIfaceMapping(SocketClient *cli, int, char **) {
+    sNetCtrl->clearNetworkPreference();
+    return sendGenericOkFail(cli, 0);
+}
+
+// "resolver getcachestats"
+int CommandListener::ResolverCmd::runGetCacheStats(SocketClient *cli, int, char **) {
+    sResolverCtrl->dumpCacheStats(cli);
+    return sendGenericOkFail(cli, 0);
+}
+
+// "resolver setuidweight <weight> <uid> ...": the share of the DNS workers the uids get
+// while other uids are waiting too, 1 by default. Foreground apps get more.
+int CommandListener::ResolverCmd::runSetUidWeight(SocketClient *cli, int argc, char **argv) {
+    uint32_t weight;
+    std::vector<uint32_t> uids;
+    bool valid = parseUnsigned(argv[2], MAX_DNS_UID_WEIGHT, &weight);
+    for (int i = 3; valid && i < argc; i++) {
+        uint32_t uid;
+        valid = parseUnsigned(argv[i], UINT_MAX, &uid);
+        uids.push_back(uid);
+    }
+    if (!valid) {
+        cli->sendMsg(ResponseCode::CommandSyntaxError,
+                "Usage: resolver setuidweight <weight> <uid> ...", false);
         return 0;
     }
-
-    if (!rc) {
-        cli->sendMsg(ResponseCode::CommandOkay, "Resolver command succeeded", false);
-    } else {
-        cli->sendMsg(ResponseCode::OperationFailed, "Resolver command failed", true);
+    if (!sDnsPool) {
+        errno = EAGAIN;
+        return sendGenericOkFail(cli, -1);
+    }
+    for (size_t i = 0; i < uids.size(); i++) {
+        sDnsPool->setWeight(uids[i], weight);
     }
+    return sendGenericOkFail(cli, 0);
+}
 
-    return 0;
+// "resolver getstats <netId>"
+int CommandListener::ResolverCmd::runGetStats(SocketClient *cli, int, char **argv) {
+    DnsStats::Instance()->dump(cli, strtoul(argv[2], NULL, 10));
+    return sendGenericOkFail(cli, 0);
+}
+
+const CommandListener::BandwidthControlCmd::Subcommand
+        CommandListener::BandwidthControlCmd::SUBCOMMANDS[] = {
+    { "addnaughtyapps", 3, -1, -1, "addnaughtyapps <appUid> ...",
+      &CommandListener::BandwidthControlCmd::runAddNaughtyApps },
+    { "addniceapps", 3, -1, -1, "addniceapps <appUid> ...",
+      &CommandListener::BandwidthControlCmd::runAddNiceApps },
+    { "aha", 3, -1, -1, "addniceapps <appUid> ...",
+      &CommandListener::BandwidthControlCmd::runAddNiceApps },
+    { "ana", 3, -1, -1, "addnaughtyapps <appUid> ...",
+      &CommandListener::BandwidthControlCmd::runAddNaughtyApps },
+    { "debugremovetetherglobalalert", 4, 4, -1, "debugremovetetherglobalalert <interface0> <interface1>",
+      &CommandListener::BandwidthControlCmd::runRemoveTetherGlobalAlert },
+    { "debugsettetherglobalalert", 4, 4, -1, "debugsettetherglobalalert <interface0> <interface1>",
+      &CommandListener::BandwidthControlCmd::runSetTetherGlobalAlert },
+    { "disable", 2, -1, -1, "disable",
+      &CommandListener::BandwidthControlCmd::runDisable },
+    { "drtga", 4, 4, -1, "debugremovetetherglobalalert <interface0> <interface1>",
+      &CommandListener::BandwidthControlCmd::runRemoveTetherGlobalAlert },
+    { "dstga", 4, 4, -1, "debugsettetherglobalalert <interface0> <interface1>",
+      &CommandListener::BandwidthControlCmd::runSetTetherGlobalAlert },
+    { "enable", 2, -1, -1, "enable",
+      &CommandListener::BandwidthControlCmd::runEnable },
+    { "getiquota", 3, 3, -1, "getiquota <iface>",
+      &CommandListener::BandwidthControlCmd::runGetInterfaceQuota },
+    { "getquota", 2, 2, -1, "getquota",
+      &CommandListener::BandwidthControlCmd::runGetQuota },
+    { "getquotas", 2, 2, -1, "getquotas",
+      &CommandListener::BandwidthControlCmd::runGetQuotas },
+    { "gettetherstats", 2, 4, -1, "gettetherstats [<intInterface> <extInterface>]",
+      &CommandListener::BandwidthControlCmd::runGetTetherStats },
+    { "getuidstats", 2, 3, -1, "getuidstats [<cursor>]",
+      &CommandListener::BandwidthControlCmd::runGetUidStats },
+    { "giq", 3, 3, -1, "getiquota <iface>",
+      &CommandListener::BandwidthControlCmd::runGetInterfaceQuota },
+    { "gq", 2, 2, -1, "getquota",
+      &CommandListener::BandwidthControlCmd::runGetQuota },
+    { "gts", 2, 4, -1, "gettetherstats [<intInterface> <extInterface>]",
+      &CommandListener::BandwidthControlCmd::runGetTetherStats },
+    { "gus", 2, 3, -1, "getuidstats [<cursor>]",
+      &CommandListener::BandwidthControlCmd::runGetUidStats },
+    { "happybox", 3, -1, -1, "happybox (enable | disable)",
+      &CommandListener::BandwidthControlCmd::runHappyBox },
+    { "removeglobalalert", 2, 2, -1, "removeglobalalert",
+      &CommandListener::BandwidthControlCmd::runRemoveGlobalAlert },
+    { "removeinterfacealert", 3, 3, -1, "removeinterfacealert <interface>",
+      &CommandListener::BandwidthControlCmd::runRemoveInterfaceAlert },
+    { "removeiquota", 3, 3, -1, "removeiquota <interface>",
+      &CommandListener::BandwidthControlCmd::runRemoveInterfaceQuota },
+    { "removenaughtyapps", 3, -1, -1, "removenaughtyapps <appUid> ...",
+      &CommandListener::BandwidthControlCmd::runRemoveNaughtyApps },
+    { "removeniceapps", 3, -1, -1, "removeniceapps <appUid> ...",
+      &CommandListener::BandwidthControlCmd::runRemoveNiceApps },
+    { "removequota", 3, 3, -1, "removequota <interface>",
+      &CommandListener::BandwidthControlCmd::runRemoveQuota },
+    { "removequotas", 3, -1, -1, "removequotas <interface> ...",
+      &CommandListener::BandwidthControlCmd::runRemoveQuotas },
+    { "removesharedalert", 2, 2, -1, "removesharedalert",
+      &CommandListener::BandwidthControlCmd::runRemoveSharedAlert },
+    { "rga", 2, 2, -1, "removeglobalalert",
+      &CommandListener::BandwidthControlCmd::runRemoveGlobalAlert },
+    { "rha", 3, -1, -1, "removeniceapps <appUid> ...",
+      &CommandListener::BandwidthControlCmd::runRemoveNiceApps },
+    { "ria", 3, 3, -1, "removeinterfacealert <interface>",
+      &CommandListener::BandwidthControlCmd::runRemoveInterfaceAlert },
+    { "riq", 3, 3, -1, "removeiquota <interface>",
+      &CommandListener::BandwidthControlCmd::runRemoveInterfaceQuota },
+    { "rna", 3, -1, -1, "removenaughtyapps <appUid> ...",
+      &CommandListener::BandwidthControlCmd::runRemoveNaughtyApps },
+    { "rq", 3, 3, -1, "removequota <interface>",
+      &CommandListener::BandwidthControlCmd::runRemoveQuota },
+    { "rqs", 3, -1, -1, "removequotas <interface> ...",
+      &CommandListener::BandwidthControlCmd::runRemoveQuotas },
+    { "rsa", 2, 2, -1, "removesharedalert",
+      &CommandListener::BandwidthControlCmd::runRemoveSharedAlert },
+    { "setglobalalert", 3, 3, 2, "setglobalalert <bytes>",
+      &CommandListener::BandwidthControlCmd::runSetGlobalAlert },
+    { "setinterfacealert", 4, 4, 3, "setinterfacealert <interface> <bytes>",
+      &CommandListener::BandwidthControlCmd::runSetInterfaceAlert },
+    { "setiquota", 4, 4, 3, "setiquota <interface> <bytes>",
+      &CommandListener::BandwidthControlCmd::runSetInterfaceQuota },
+    { "setquota", 4, 4, 3, "setquota <interface> <bytes>",
+      &CommandListener::BandwidthControlCmd::runSetQuota },
+    { "setquotas", 4, -1, 2, "setquotas <bytes> <interface> ...",
+      &CommandListener::BandwidthControlCmd::runSetQuotas },
+    { "setsharedalert", 3, 3, 2, "setsharedalert <bytes>",
+      &CommandListener::BandwidthControlCmd::runSetSharedAlert },
+    { "sga", 3, 3, 2, "setglobalalert <bytes>",
+      &CommandListener::BandwidthControlCmd::runSetGlobalAlert },
+    { "sia", 4, 4, 3, "setinterfacealert <interface> <bytes>",
+      &CommandListener::BandwidthControlCmd::runSetInterfaceAlert },
+    { "siq", 4, 4, 3, "setiquota <interface> <bytes>",
+      &CommandListener::BandwidthControlCmd::runSetInterfaceQuota },
+    { "sq", 4, 4, 3, "setquota <interface> <bytes>",
+      &CommandListener::BandwidthControlCmd::runSetQuota },
+    { "sqs", 4, -1, 2, "setquotas <bytes> <interface> ...",
+      &CommandListener::BandwidthControlCmd::runSetQuotas },
+    { "ssa", 3, 3, 2, "setsharedalert <bytes>",
+      &CommandListener::BandwidthControlCmd::runSetSharedAlert },
+};
+
+/* Parses a whole decimal byte count; atoll() would turn garbage into 0. */
+static bool parseBytes(const char *arg, int64_t *bytes) {
+    char *end;
+    errno = 0;
+    long long value = strtoll(arg, &end, 10);
+    if (errno || end == arg || *end) {
+        return false;
+    }
+    *bytes = value;
+    return true;
 }
 
 CommandListener::BandwidthControlCmd::BandwidthControlCmd() :
     NetdCommand("bandwidth") {
+    checkSubcommandOrder("bandwidth", SUBCOMMANDS, ARRAY_SIZE(SUBCOMMANDS));
 }
 
 void CommandListener::BandwidthControlCmd::sendGenericSyntaxError(SocketClient *cli, const char *usageMsg) {
@@ -1072,308 +1625,259 @@ void CommandListener::BandwidthControlCmd::sendGenericOpFailed(SocketClient *cli
 
 int CommandListener::BandwidthControlCmd::runCommand(SocketClient *cli, int argc, char **argv) {
     if (argc < 2) {
-        sendGenericSyntaxError(cli, "<cmds> <args...>");
-        return 0;
-    }
-
-    ALOGV("bwctrlcmd: argc=%d %s %s ...", argc, argv[0], argv[1]);
-
-    if (!strcmp(argv[1], "enable")) {
-        int rc = sBandwidthCtrl->enableBandwidthControl(true);
-        sendGenericOkFail(cli, rc);
-        return 0;
-
-    }
-    if (!strcmp(argv[1], "disable")) {
-        int rc = sBandwidthCtrl->disableBandwidthControl();
-        sendGenericOkFail(cli, rc);
-        return 0;
-
-    }
-    if (!strcmp(argv[1], "removequota") || !strcmp(argv[1], "rq")) {
-        if (argc != 3) {
-            sendGenericSyntaxError(cli, "removequota <interface>");
-            return 0;
-        }
-        int rc = sBandwidthCtrl->removeInterfaceSharedQuota(argv[2]);
-        sendGenericOkFail(cli, rc);
-        return 0;
-
-    }
-    if (!strcmp(argv[1], "getquota") || !strcmp(argv[1], "gq")) {
-        int64_t bytes;
-        if (argc != 2) {
-            sendGenericSyntaxError(cli, "getquota");
-            return 0;
-        }
-        int rc = sBandwidthCtrl->getInterfaceSharedQuota(&bytes);
-        if (rc) {
-            sendGenericOpFailed(cli, "Failed to get quota");
-            return 0;
-        }
-
-        char *msg;
-        asprintf(&msg, "%" PRId64, bytes);
-        cli->sendMsg(ResponseCode::QuotaCounterResult, msg, false);
-        free(msg);
-        return 0;
-
-    }
-    if (!strcmp(argv[1], "getiquota") || !strcmp(argv[1], "giq")) {
-        int64_t bytes;
-        if (argc != 3) {
-            sendGenericSyntaxError(cli, "getiquota <iface>");
-            return 0;
-        }
-
-        int rc = sBandwidthCtrl->getInterfaceQuota(argv[2], &bytes);
-        if (rc) {
-            sendGenericOpFailed(cli, "Failed to get quota");
-            return 0;
-        }
-        char *msg;
-        asprintf(&msg, "%" PRId64, bytes);
-        cli->sendMsg(ResponseCode::QuotaCounterResult, msg, false);
-        free(msg);
-        return 0;
-
-    }
-    if (!strcmp(argv[1], "setquota") || !strcmp(argv[1], "sq")) {
-        if (argc != 4) {
-            sendGenericSyntaxError(cli, "setquota <interface> <bytes>");
-            return 0;
-        }
-        int rc = sBandwidthCtrl->setInterfaceSharedQuota(argv[2], atoll(argv[3]));
-        sendGenericOkFail(cli, rc);
-        return 0;
-    }
-    if (!strcmp(argv[1], "setquotas") || !strcmp(argv[1], "sqs")) {
-        int rc;
-        if (argc < 4) {
-            sendGenericSyntaxError(cli, "setquotas <bytes> <interface> ...");
-            return 0;
-        }
-
-        for (int q = 3; argc >= 4; q++, argc--) {
-            rc = sBandwidthCtrl->setInterfaceSharedQuota(argv[q], atoll(argv[2]));
-            if (rc) {
-                char *msg;
-                asprintf(&msg, "bandwidth setquotas %s %s failed", argv[2], argv[q]);
-                cli->sendMsg(ResponseCode::OperationFailed,
-                             msg, false);
-                free(msg);
-                return 0;
-            }
-        }
-        sendGenericOkFail(cli, rc);
+        sendGenericSyntaxError(cli, "<cmds> <args...>");
         return 0;
-
     }
-    if (!strcmp(argv[1], "removequotas") || !strcmp(argv[1], "rqs")) {
-        int rc;
-        if (argc < 3) {
-            sendGenericSyntaxError(cli, "removequotas <interface> ...");
-            return 0;
-        }
 
-        for (int q = 2; argc >= 3; q++, argc--) {
-            rc = sBandwidthCtrl->removeInterfaceSharedQuota(argv[q]);
-            if (rc) {
-                char *msg;
-                asprintf(&msg, "bandwidth removequotas %s failed", argv[q]);
-                cli->sendMsg(ResponseCode::OperationFailed,
-                             msg, false);
-                free(msg);
-                return 0;
-            }
-        }
-        sendGenericOkFail(cli, rc);
-        return 0;
+    ALOGV("bwctrlcmd: argc=%d %s %s ...", argc, argv[0], argv[1]);
 
-    }
-    if (!strcmp(argv[1], "removeiquota") || !strcmp(argv[1], "riq")) {
-        if (argc != 3) {
-            sendGenericSyntaxError(cli, "removeiquota <interface>");
-            return 0;
-        }
-        int rc = sBandwidthCtrl->removeInterfaceQuota(argv[2]);
-        sendGenericOkFail(cli, rc);
+    const Subcommand *sub = findSubcommand(SUBCOMMANDS, ARRAY_SIZE(SUBCOMMANDS), argv[1]);
+    if (!sub) {
+        cli->sendMsg(ResponseCode::CommandSyntaxError, "Unknown bandwidth cmd", false);
         return 0;
-
     }
-    if (!strcmp(argv[1], "setiquota") || !strcmp(argv[1], "siq")) {
-        if (argc != 4) {
-            sendGenericSyntaxError(cli, "setiquota <interface> <bytes>");
-            return 0;
-        }
-        int rc = sBandwidthCtrl->setInterfaceQuota(argv[2], atoll(argv[3]));
-        sendGenericOkFail(cli, rc);
-        return 0;
 
-    }
-    if (!strcmp(argv[1], "addnaughtyapps") || !strcmp(argv[1], "ana")) {
-        if (argc < 3) {
-            sendGenericSyntaxError(cli, "addnaughtyapps <appUid> ...");
-            return 0;
-        }
-        int rc = sBandwidthCtrl->addNaughtyApps(argc - 2, argv + 2);
-        sendGenericOkFail(cli, rc);
+    int64_t bytes = 0;
+    if (argc < sub->minArgc || (sub->maxArgc >= 0 && argc > sub->maxArgc) ||
+            (sub->bytesArg >= 0 && !parseBytes(argv[sub->bytesArg], &bytes))) {
+        sendGenericSyntaxError(cli, sub->usage);
         return 0;
+    }
 
+    (this->*sub->run)(cli, argc, argv, bytes);
+    return 0;
+}
 
+void CommandListener::BandwidthControlCmd::runEnable(SocketClient *cli, int, char **, int64_t) {
+    sendGenericOkFail(cli, sBandwidthCtrl->enableBandwidthControl(true));
+}
+
+void CommandListener::BandwidthControlCmd::runDisable(SocketClient *cli, int, char **, int64_t) {
+    sendGenericOkFail(cli, sBandwidthCtrl->disableBandwidthControl());
+}
+
+void CommandListener::BandwidthControlCmd::runRemoveQuota(SocketClient *cli, int, char **argv,
+                                                          int64_t) {
+    sendGenericOkFail(cli, sBandwidthCtrl->removeInterfaceSharedQuota(argv[2]));
+}
+
+void CommandListener::BandwidthControlCmd::runGetQuota(SocketClient *cli, int, char **, int64_t) {
+    int64_t bytes;
+    int rc = sBandwidthCtrl->getInterfaceSharedQuota(&bytes);
+    if (rc) {
+        sendGenericOpFailed(cli, "Failed to get quota");
+        return;
     }
-    if (!strcmp(argv[1], "removenaughtyapps") || !strcmp(argv[1], "rna")) {
-        if (argc < 3) {
-            sendGenericSyntaxError(cli, "removenaughtyapps <appUid> ...");
-            return 0;
-        }
-        int rc = sBandwidthCtrl->removeNaughtyApps(argc - 2, argv + 2);
-        sendGenericOkFail(cli, rc);
-        return 0;
-    }
-    if (!strcmp(argv[1], "happybox")) {
-        if (argc < 3) {
-            sendGenericSyntaxError(cli, "happybox (enable | disable)");
-            return 0;
-        }
-        if (!strcmp(argv[2], "enable")) {
-            int rc = sBandwidthCtrl->enableHappyBox();
-            sendGenericOkFail(cli, rc);
-            return 0;
 
+    char *msg;
+    asprintf(&msg, "%" PRId64, bytes);
+    cli->sendMsg(ResponseCode::QuotaCounterResult, msg, false);
+    free(msg);
+}
+
+void CommandListener::BandwidthControlCmd::runGetQuotas(SocketClient *cli, int, char **, int64_t) {
+    std::list<std::pair<std::string, int64_t> > quotas;
+    int rc = sBandwidthCtrl->getInterfaceQuotas(quotas);
+    if (rc) {
+        sendGenericOpFailed(cli, "Failed to get quotas");
+        return;
+    }
+    std::list<std::pair<std::string, int64_t> >::iterator it;
+    if (BinaryFraming::isEnabled(cli)) {
+        FrameBuilder frame(NETD_RECORD_QUOTA);
+        for (it = quotas.begin(); it != quotas.end(); it++) {
+            frame.appendName(it->first.c_str());
+            frame.appendInt64(it->second);
         }
-        if (!strcmp(argv[2], "disable")) {
-            int rc = sBandwidthCtrl->disableHappyBox();
-            sendGenericOkFail(cli, rc);
-            return 0;
+        if (!frame.empty()) {
+            frame.send(cli, ResponseCode::QuotaCounterListResult);
         }
-        sendGenericSyntaxError(cli, "happybox (enable | disable)");
-        return 0;
-    }
-    if (!strcmp(argv[1], "addniceapps") || !strcmp(argv[1], "aha")) {
-        if (argc < 3) {
-            sendGenericSyntaxError(cli, "addniceapps <appUid> ...");
-            return 0;
+    } else {
+        for (it = quotas.begin(); it != quotas.end(); it++) {
+            char *msg;
+            asprintf(&msg, "%s %" PRId64, it->first.c_str(), it->second);
+            cli->sendMsg(ResponseCode::QuotaCounterListResult, msg, false);
+            free(msg);
         }
-        int rc = sBandwidthCtrl->addNiceApps(argc - 2, argv + 2);
-        sendGenericOkFail(cli, rc);
-        return 0;
     }
-    if (!strcmp(argv[1], "removeniceapps") || !strcmp(argv[1], "rha")) {
-        if (argc < 3) {
-            sendGenericSyntaxError(cli, "removeniceapps <appUid> ...");
-            return 0;
-        }
-        int rc = sBandwidthCtrl->removeNiceApps(argc - 2, argv + 2);
-        sendGenericOkFail(cli, rc);
-        return 0;
+    cli->sendMsg(ResponseCode::CommandOkay, "Quotas listed", false);
+}
+
+void CommandListener::BandwidthControlCmd::runGetInterfaceQuota(SocketClient *cli, int,
+                                                                char **argv, int64_t) {
+    int64_t bytes;
+    int rc = sBandwidthCtrl->getInterfaceQuota(argv[2], &bytes);
+    if (rc) {
+        sendGenericOpFailed(cli, "Failed to get quota");
+        return;
     }
-    if (!strcmp(argv[1], "setglobalalert") || !strcmp(argv[1], "sga")) {
-        if (argc != 3) {
-            sendGenericSyntaxError(cli, "setglobalalert <bytes>");
-            return 0;
+    char *msg;
+    asprintf(&msg, "%" PRId64, bytes);
+    cli->sendMsg(ResponseCode::QuotaCounterResult, msg, false);
+    free(msg);
+}
+
+void CommandListener::BandwidthControlCmd::runSetQuota(SocketClient *cli, int, char **argv,
+                                                       int64_t bytes) {
+    sendGenericOkFail(cli, sBandwidthCtrl->setInterfaceSharedQuota(argv[2], bytes));
+}
+
+void CommandListener::BandwidthControlCmd::runSetQuotas(SocketClient *cli, int argc, char **argv,
+                                                        int64_t bytes) {
+    for (int q = 3; q < argc; q++) {
+        if (sBandwidthCtrl->setInterfaceSharedQuota(argv[q], bytes)) {
+            char *msg;
+            asprintf(&msg, "bandwidth setquotas %s %s failed", argv[2], argv[q]);
+            cli->sendMsg(ResponseCode::OperationFailed, msg, false);
+            free(msg);
+            return;
         }
-        int rc = sBandwidthCtrl->setGlobalAlert(atoll(argv[2]));
-        sendGenericOkFail(cli, rc);
-        return 0;
     }
-    if (!strcmp(argv[1], "debugsettetherglobalalert") || !strcmp(argv[1], "dstga")) {
-        if (argc != 4) {
-            sendGenericSyntaxError(cli, "debugsettetherglobalalert <interface0> <interface1>");
-            return 0;
-        }
-        /* We ignore the interfaces for now. */
-        int rc = sBandwidthCtrl->setGlobalAlertInForwardChain();
-        sendGenericOkFail(cli, rc);
-        return 0;
+    sendGenericOkFail(cli, 0);
+}
 
-    }
-    if (!strcmp(argv[1], "removeglobalalert") || !strcmp(argv[1], "rga")) {
-        if (argc != 2) {
-            sendGenericSyntaxError(cli, "removeglobalalert");
-            return 0;
+void CommandListener::BandwidthControlCmd::runRemoveQuotas(SocketClient *cli, int argc,
+                                                           char **argv, int64_t) {
+    for (int q = 2; q < argc; q++) {
+        if (sBandwidthCtrl->removeInterfaceSharedQuota(argv[q])) {
+            char *msg;
+            asprintf(&msg, "bandwidth removequotas %s failed", argv[q]);
+            cli->sendMsg(ResponseCode::OperationFailed, msg, false);
+            free(msg);
+            return;
         }
-        int rc = sBandwidthCtrl->removeGlobalAlert();
-        sendGenericOkFail(cli, rc);
-        return 0;
-
     }
-    if (!strcmp(argv[1], "debugremovetetherglobalalert") || !strcmp(argv[1], "drtga")) {
-        if (argc != 4) {
-            sendGenericSyntaxError(cli, "debugremovetetherglobalalert <interface0> <interface1>");
-            return 0;
-        }
-        /* We ignore the interfaces for now. */
-        int rc = sBandwidthCtrl->removeGlobalAlertInForwardChain();
-        sendGenericOkFail(cli, rc);
-        return 0;
+    sendGenericOkFail(cli, 0);
+}
 
-    }
-    if (!strcmp(argv[1], "setsharedalert") || !strcmp(argv[1], "ssa")) {
-        if (argc != 3) {
-            sendGenericSyntaxError(cli, "setsharedalert <bytes>");
-            return 0;
-        }
-        int rc = sBandwidthCtrl->setSharedAlert(atoll(argv[2]));
-        sendGenericOkFail(cli, rc);
-        return 0;
+void CommandListener::BandwidthControlCmd::runRemoveInterfaceQuota(SocketClient *cli, int,
+                                                                   char **argv, int64_t) {
+    sendGenericOkFail(cli, sBandwidthCtrl->removeInterfaceQuota(argv[2]));
+}
 
-    }
-    if (!strcmp(argv[1], "removesharedalert") || !strcmp(argv[1], "rsa")) {
-        if (argc != 2) {
-            sendGenericSyntaxError(cli, "removesharedalert");
-            return 0;
-        }
-        int rc = sBandwidthCtrl->removeSharedAlert();
-        sendGenericOkFail(cli, rc);
-        return 0;
+void CommandListener::BandwidthControlCmd::runSetInterfaceQuota(SocketClient *cli, int,
+                                                                char **argv, int64_t bytes) {
+    sendGenericOkFail(cli, sBandwidthCtrl->setInterfaceQuota(argv[2], bytes));
+}
 
-    }
-    if (!strcmp(argv[1], "setinterfacealert") || !strcmp(argv[1], "sia")) {
-        if (argc != 4) {
-            sendGenericSyntaxError(cli, "setinterfacealert <interface> <bytes>");
-            return 0;
-        }
-        int rc = sBandwidthCtrl->setInterfaceAlert(argv[2], atoll(argv[3]));
-        sendGenericOkFail(cli, rc);
-        return 0;
+void CommandListener::BandwidthControlCmd::runAddNaughtyApps(SocketClient *cli, int argc,
+                                                             char **argv, int64_t) {
+    sendGenericOkFail(cli, sBandwidthCtrl->addNaughtyApps(argc - 2, argv + 2));
+}
 
-    }
-    if (!strcmp(argv[1], "removeinterfacealert") || !strcmp(argv[1], "ria")) {
-        if (argc != 3) {
-            sendGenericSyntaxError(cli, "removeinterfacealert <interface>");
-            return 0;
-        }
-        int rc = sBandwidthCtrl->removeInterfaceAlert(argv[2]);
-        sendGenericOkFail(cli, rc);
-        return 0;
+void CommandListener::BandwidthControlCmd::runRemoveNaughtyApps(SocketClient *cli, int argc,
+                                                                char **argv, int64_t) {
+    sendGenericOkFail(cli, sBandwidthCtrl->removeNaughtyApps(argc - 2, argv + 2));
+}
 
+void CommandListener::BandwidthControlCmd::runHappyBox(SocketClient *cli, int, char **argv,
+                                                       int64_t) {
+    if (!strcmp(argv[2], "enable")) {
+        sendGenericOkFail(cli, sBandwidthCtrl->enableHappyBox());
+    } else if (!strcmp(argv[2], "disable")) {
+        sendGenericOkFail(cli, sBandwidthCtrl->disableHappyBox());
+    } else {
+        sendGenericSyntaxError(cli, "happybox (enable | disable)");
     }
-    if (!strcmp(argv[1], "gettetherstats") || !strcmp(argv[1], "gts")) {
-        BandwidthController::TetherStats tetherStats;
-        std::string extraProcessingInfo = "";
-        if (argc < 2 || argc > 4) {
-            sendGenericSyntaxError(cli, "gettetherstats [<intInterface> <extInterface>]");
-            return 0;
-        }
-        tetherStats.intIface = argc > 2 ? argv[2] : "";
-        tetherStats.extIface = argc > 3 ? argv[3] : "";
-        int rc = sBandwidthCtrl->getTetherStats(cli, tetherStats, extraProcessingInfo);
-        if (rc) {
-                extraProcessingInfo.insert(0, "Failed to get tethering stats.\n");
-                sendGenericOpFailed(cli, extraProcessingInfo.c_str());
-                return 0;
-        }
-        return 0;
+}
+
+void CommandListener::BandwidthControlCmd::runAddNiceApps(SocketClient *cli, int argc,
+                                                          char **argv, int64_t) {
+    sendGenericOkFail(cli, sBandwidthCtrl->addNiceApps(argc - 2, argv + 2));
+}
+
+void CommandListener::BandwidthControlCmd::runRemoveNiceApps(SocketClient *cli, int argc,
+                                                             char **argv, int64_t) {
+    sendGenericOkFail(cli, sBandwidthCtrl->removeNiceApps(argc - 2, argv + 2));
+}
+
+void CommandListener::BandwidthControlCmd::runSetGlobalAlert(SocketClient *cli, int, char **,
+                                                             int64_t bytes) {
+    sendGenericOkFail(cli, sBandwidthCtrl->setGlobalAlert(bytes));
+}
+
+void CommandListener::BandwidthControlCmd::runSetTetherGlobalAlert(SocketClient *cli, int,
+                                                                   char **, int64_t) {
+    /* We ignore the interfaces for now. */
+    sendGenericOkFail(cli, sBandwidthCtrl->setGlobalAlertInForwardChain());
+}
+
+void CommandListener::BandwidthControlCmd::runRemoveGlobalAlert(SocketClient *cli, int, char **,
+                                                                int64_t) {
+    sendGenericOkFail(cli, sBandwidthCtrl->removeGlobalAlert());
+}
+
+void CommandListener::BandwidthControlCmd::runRemoveTetherGlobalAlert(SocketClient *cli, int,
+                                                                      char **, int64_t) {
+    /* We ignore the interfaces for now. */
+    sendGenericOkFail(cli, sBandwidthCtrl->removeGlobalAlertInForwardChain());
+}
+
+void CommandListener::BandwidthControlCmd::runSetSharedAlert(SocketClient *cli, int, char **,
+                                                             int64_t bytes) {
+    sendGenericOkFail(cli, sBandwidthCtrl->setSharedAlert(bytes));
+}
+
+void CommandListener::BandwidthControlCmd::runRemoveSharedAlert(SocketClient *cli, int, char **,
+                                                                int64_t) {
+    sendGenericOkFail(cli, sBandwidthCtrl->removeSharedAlert());
+}
+
+void CommandListener::BandwidthControlCmd::runSetInterfaceAlert(SocketClient *cli, int,
+                                                                char **argv, int64_t bytes) {
+    sendGenericOkFail(cli, sBandwidthCtrl->setInterfaceAlert(argv[2], bytes));
+}
+
+void CommandListener::BandwidthControlCmd::runRemoveInterfaceAlert(SocketClient *cli, int,
+                                                                   char **argv, int64_t) {
+    sendGenericOkFail(cli, sBandwidthCtrl->removeInterfaceAlert(argv[2]));
+}
 
+void CommandListener::BandwidthControlCmd::runGetTetherStats(SocketClient *cli, int argc,
+                                                             char **argv, int64_t) {
+    BandwidthController::TetherStats tetherStats;
+    std::string extraProcessingInfo = "";
+    tetherStats.intIface = argc > 2 ? argv[2] : "";
+    tetherStats.extIface = argc > 3 ? argv[3] : "";
+    int rc = sBandwidthCtrl->getTetherStats(cli, tetherStats, extraProcessingInfo);
+    if (rc) {
+        extraProcessingInfo.insert(0, "Failed to get tethering stats.\n");
+        sendGenericOpFailed(cli, extraProcessingInfo.c_str());
     }
+}
 
-    cli->sendMsg(ResponseCode::CommandSyntaxError, "Unknown bandwidth cmd", false);
-    return 0;
+void CommandListener::BandwidthControlCmd::runGetUidStats(SocketClient *cli, int argc,
+                                                          char **argv, int64_t) {
+    uint64_t cursor = 0;
+    if (argc > 2) {
+        char *end;
+        errno = 0;
+        cursor = strtoull(argv[2], &end, 10);
+        if (errno || end == argv[2] || *end) {
+            sendGenericSyntaxError(cli, "getuidstats [<cursor>]");
+            return;
+        }
+    }
+    if (sBandwidthCtrl->getUidStats(cli, cursor)) {
+        sendGenericOpFailed(cli, "Failed to get uid stats");
+    }
 }
 
+const SubcommandEntry<CommandListener::IdletimerControlCmd>
+        CommandListener::IdletimerControlCmd::SUBCOMMANDS[] = {
+    { "add", 5, 5, "Missing argument",
+      &CommandListener::IdletimerControlCmd::runAdd },
+    { "disable", 2, -1, "Missing argument",
+      &CommandListener::IdletimerControlCmd::runDisable },
+    { "enable", 2, -1, "Missing argument",
+      &CommandListener::IdletimerControlCmd::runEnable },
+    { "remove", 5, 5, "Missing argument",
+      &CommandListener::IdletimerControlCmd::runRemove },
+};
+
 CommandListener::IdletimerControlCmd::IdletimerControlCmd() :
     NetdCommand("idletimer") {
+    checkSubcommandOrder("idletimer", SUBCOMMANDS, ARRAY_SIZE(SUBCOMMANDS));
 }
 
 int CommandListener::IdletimerControlCmd::runCommand(SocketClient *cli, int argc, char **argv) {
@@ -1385,28 +1889,29 @@ int CommandListener::IdletimerControlCmd::runCommand(SocketClient *cli, int argc
 
     ALOGV("idletimerctrlcmd: argc=%d %s %s ...", argc, argv[0], argv[1]);
 
-    if (!strcmp(argv[1], "enable")) {
+    return runSubcommand(this, SUBCOMMANDS, ARRAY_SIZE(SUBCOMMANDS), cli, argc, argv,
+                         "Unknown idletimer cmd");
+}
+
+int CommandListener::IdletimerControlCmd::runEnable(SocketClient *cli, int, char **) {
       if (0 != sIdletimerCtrl->enableIdletimerControl()) {
         cli->sendMsg(ResponseCode::CommandSyntaxError, "Missing argument", false);
       } else {
         cli->sendMsg(ResponseCode::CommandOkay, "Enable success", false);
       }
       return 0;
+}
 
-    }
-    if (!strcmp(argv[1], "disable")) {
+int CommandListener::IdletimerControlCmd::runDisable(SocketClient *cli, int, char **) {
       if (0 != sIdletimerCtrl->disableIdletimerControl()) {
         cli->sendMsg(ResponseCode::CommandSyntaxError, "Missing argument", false);
       } else {
         cli->sendMsg(ResponseCode::CommandOkay, "Disable success", false);
       }
       return 0;
-    }
-    if (!strcmp(argv[1], "add")) {
-        if (argc != 5) {
-            cli->sendMsg(ResponseCode::CommandSyntaxError, "Missing argument", false);
-            return 0;
-        }
+}
+
+int CommandListener::IdletimerControlCmd::runAdd(SocketClient *cli, int, char **argv) {
         if(0 != sIdletimerCtrl->addInterfaceIdletimer(
                                         argv[2], atoi(argv[3]), argv[4])) {
           cli->sendMsg(ResponseCode::OperationFailed, "Failed to add interface", false);
@@ -1414,12 +1919,9 @@ int CommandListener::IdletimerControlCmd::runCommand(SocketClient *cli, int argc
           cli->sendMsg(ResponseCode::CommandOkay,  "Add success", false);
         }
         return 0;
-    }
-    if (!strcmp(argv[1], "remove")) {
-        if (argc != 5) {
-            cli->sendMsg(ResponseCode::CommandSyntaxError, "Missing argument", false);
-            return 0;
-        }
+}
+
+int CommandListener::IdletimerControlCmd::runRemove(SocketClient *cli, int, char **argv) {
         // ashish: fixme timeout
         if (0 != sIdletimerCtrl->removeInterfaceIdletimer(
                                         argv[2], atoi(argv[3]), argv[4])) {
@@ -1428,14 +1930,32 @@ int CommandListener::IdletimerControlCmd::runCommand(SocketClient *cli, int argc
           cli->sendMsg(ResponseCode::CommandOkay, "Remove success", false);
         }
         return 0;
-    }
-
-    cli->sendMsg(ResponseCode::CommandSyntaxError, "Unknown idletimer cmd", false);
-    return 0;
 }
 
+const SubcommandEntry<CommandListener::FirewallCmd> CommandListener::FirewallCmd::SUBCOMMANDS[] = {
+    { "disable", 2, -1, "Missing command",
+      &CommandListener::FirewallCmd::runDisable },
+    { "enable", 2, -1, "Missing command",
+      &CommandListener::FirewallCmd::runEnable },
+    { "is_enabled", 2, -1, "Missing command",
+      &CommandListener::FirewallCmd::runIsEnabled },
+    { "replace_uid_rules", 2, -1, "Missing command",
+      &CommandListener::FirewallCmd::runReplaceUidRules },
+    { "set_egress_dest_rule", 5, 5,
+      "Usage: firewall set_egress_dest_rule <192.168.0.1> <80> <allow|deny>",
+      &CommandListener::FirewallCmd::runSetEgressDestRule },
+    { "set_egress_source_rule", 4, 4,
+      "Usage: firewall set_egress_source_rule <192.168.0.1> <allow|deny>",
+      &CommandListener::FirewallCmd::runSetEgressSourceRule },
+    { "set_interface_rule", 4, 4, "Usage: firewall set_interface_rule <rmnet0> <allow|deny>",
+      &CommandListener::FirewallCmd::runSetInterfaceRule },
+    { "set_uid_rule", 4, 4, "Usage: firewall set_uid_rule <1000> <allow|deny>",
+      &CommandListener::FirewallCmd::runSetUidRule },
+};
+
 CommandListener::FirewallCmd::FirewallCmd() :
     NetdCommand("firewall") {
+    checkSubcommandOrder("firewall", SUBCOMMANDS, ARRAY_SIZE(SUBCOMMANDS));
 }
 
 int CommandListener::FirewallCmd::sendGenericOkFail(SocketClient *cli, int cond) {
@@ -1461,123 +1981,279 @@ int CommandListener::FirewallCmd::runCommand(SocketClient *cli, int argc,
         cli->sendMsg(ResponseCode::CommandSyntaxError, "Missing command", false);
         return 0;
     }
+    return runSubcommand(this, SUBCOMMANDS, ARRAY_SIZE(SUBCOMMANDS), cli, argc, argv,
+                         "Unknown command");
+}
 
-    if (!strcmp(argv[1], "enable")) {
-        int res = sFirewallCtrl->enableFirewall();
-        return sendGenericOkFail(cli, res);
-    }
-    if (!strcmp(argv[1], "disable")) {
-        int res = sFirewallCtrl->disableFirewall();
-        return sendGenericOkFail(cli, res);
-    }
-    if (!strcmp(argv[1], "is_enabled")) {
-        int res = sFirewallCtrl->isFirewallEnabled();
-        return sendGenericOkFail(cli, res);
-    }
+int CommandListener::FirewallCmd::runEnable(SocketClient *cli, int, char **) {
+    int res = sFirewallCtrl->enableFirewall();
+    return sendGenericOkFail(cli, res);
+}
 
-    if (!strcmp(argv[1], "set_interface_rule")) {
-        if (argc != 4) {
-            cli->sendMsg(ResponseCode::CommandSyntaxError,
-                         "Usage: firewall set_interface_rule <rmnet0> <allow|deny>", false);
-            return 0;
-        }
+int CommandListener::FirewallCmd::runDisable(SocketClient *cli, int, char **) {
+    int res = sFirewallCtrl->disableFirewall();
+    return sendGenericOkFail(cli, res);
+}
+
+int CommandListener::FirewallCmd::runIsEnabled(SocketClient *cli, int, char **) {
+    int res = sFirewallCtrl->isFirewallEnabled();
+    return sendGenericOkFail(cli, res);
+}
 
-        const char* iface = argv[2];
-        FirewallRule rule = parseRule(argv[3]);
+int CommandListener::FirewallCmd::runSetInterfaceRule(SocketClient *cli, int, char **argv) {
+    const char* iface = argv[2];
+    FirewallRule rule = parseRule(argv[3]);
 
-        int res = sFirewallCtrl->setInterfaceRule(iface, rule);
-        return sendGenericOkFail(cli, res);
-    }
+    int res = sFirewallCtrl->setInterfaceRule(iface, rule);
+    return sendGenericOkFail(cli, res);
+}
 
-    if (!strcmp(argv[1], "set_egress_source_rule")) {
-        if (argc != 4) {
-            cli->sendMsg(ResponseCode::CommandSyntaxError,
-                         "Usage: firewall set_egress_source_rule <192.168.0.1> <allow|deny>",
-                         false);
-            return 0;
-        }
+int CommandListener::FirewallCmd::runSetEgressSourceRule(SocketClient *cli, int, char **argv) {
+    const char* addr = argv[2];
+    FirewallRule rule = parseRule(argv[3]);
 
-        const char* addr = argv[2];
-        FirewallRule rule = parseRule(argv[3]);
+    int res = sFirewallCtrl->setEgressSourceRule(addr, rule);
+    return sendGenericOkFail(cli, res);
+}
 
-        int res = sFirewallCtrl->setEgressSourceRule(addr, rule);
-        return sendGenericOkFail(cli, res);
-    }
+int CommandListener::FirewallCmd::runSetEgressDestRule(SocketClient *cli, int, char **argv) {
+    const char* addr = argv[2];
+    int port = atoi(argv[3]);
+    FirewallRule rule = parseRule(argv[4]);
 
-    if (!strcmp(argv[1], "set_egress_dest_rule")) {
-        if (argc != 5) {
-            cli->sendMsg(ResponseCode::CommandSyntaxError,
-                         "Usage: firewall set_egress_dest_rule <192.168.0.1> <80> <allow|deny>",
-                         false);
-            return 0;
-        }
+    int res = 0;
+    res |= sFirewallCtrl->setEgressDestRule(addr, PROTOCOL_TCP, port, rule);
+    res |= sFirewallCtrl->setEgressDestRule(addr, PROTOCOL_UDP, port, rule);
+    return sendGenericOkFail(cli, res);
+}
 
-        const char* addr = argv[2];
-        int port = atoi(argv[3]);
-        FirewallRule rule = parseRule(argv[4]);
+int CommandListener::FirewallCmd::runSetUidRule(SocketClient *cli, int, char **argv) {
+    int uid = atoi(argv[2]);
+    FirewallRule rule = parseRule(argv[3]);
 
-        int res = 0;
-        res |= sFirewallCtrl->setEgressDestRule(addr, PROTOCOL_TCP, port, rule);
-        res |= sFirewallCtrl->setEgressDestRule(addr, PROTOCOL_UDP, port, rule);
-        return sendGenericOkFail(cli, res);
-    }
+    int res = sFirewallCtrl->setUidRule(uid, rule);
+    return sendGenericOkFail(cli, res);
+}
 
-    if (!strcmp(argv[1], "set_uid_rule")) {
-        if (argc != 4) {
-            cli->sendMsg(ResponseCode::CommandSyntaxError,
-                         "Usage: firewall set_uid_rule <1000> <allow|deny>",
-                         false);
+// Every uid listed is allowed, every other uid is denied.
+int CommandListener::FirewallCmd::runReplaceUidRules(SocketClient *cli, int argc, char **argv) {
+    std::vector<int> uids;
+    for (int i = 2; i < argc; i++) {
+        uint32_t uid;
+        if (!parseUnsigned(argv[i], INT_MAX, &uid)) {
+            cli->sendMsg(ResponseCode::CommandParameterError, "Invalid uid", false);
             return 0;
         }
-
-        int uid = atoi(argv[2]);
-        FirewallRule rule = parseRule(argv[3]);
-
-        int res = sFirewallCtrl->setUidRule(uid, rule);
-        return sendGenericOkFail(cli, res);
+        uids.push_back(uid);
     }
 
-    cli->sendMsg(ResponseCode::CommandSyntaxError, "Unknown command", false);
-    return 0;
+    int res = sFirewallCtrl->replaceUidRules(uids);
+    return sendGenericOkFail(cli, res);
 }
 
+const SubcommandEntry<CommandListener::ClatdCmd> CommandListener::ClatdCmd::SUBCOMMANDS[] = {
+    { "start", 3, -1, "Missing argument",
+      &CommandListener::ClatdCmd::runStart },
+    { "status", 2, -1, "Missing argument",
+      &CommandListener::ClatdCmd::runStatus },
+    { "stop", 2, -1, "Missing argument",
+      &CommandListener::ClatdCmd::runStop },
+};
+
 CommandListener::ClatdCmd::ClatdCmd() : NetdCommand("clatd") {
+    checkSubcommandOrder("clatd", SUBCOMMANDS, ARRAY_SIZE(SUBCOMMANDS));
+}
+
+int CommandListener::ClatdCmd::sendGenericOkFail(SocketClient *cli, int rc) {
+    if (!rc) {
+        cli->sendMsg(ResponseCode::CommandOkay, "Clatd operation succeeded", false);
+    } else {
+        cli->sendMsg(ResponseCode::OperationFailed, "Clatd operation failed", false);
+    }
+    return 0;
 }
 
 int CommandListener::ClatdCmd::runCommand(SocketClient *cli, int argc,
                                                             char **argv) {
-    int rc = 0;
     if (argc < 2) {
         cli->sendMsg(ResponseCode::CommandSyntaxError, "Missing argument", false);
         return 0;
     }
+    return runSubcommand(this, SUBCOMMANDS, ARRAY_SIZE(SUBCOMMANDS), cli, argc, argv,
+                         "Unknown clatd cmd");
+}
+
+int CommandListener::ClatdCmd::runStop(SocketClient *cli, int, char **) {
+    return sendGenericOkFail(cli, sClatdCtrl->stopClatd());
+}
+
+int CommandListener::ClatdCmd::runStatus(SocketClient *cli, int, char **) {
+    char *tmp = NULL;
+
+    asprintf(&tmp, "Clatd status: %s", (sClatdCtrl->isClatdStarted() ?
+                                                    "started" : "stopped"));
+    cli->sendMsg(ResponseCode::ClatdStatusResult, tmp, false);
+    free(tmp);
+    return 0;
+}
+
+int CommandListener::ClatdCmd::runStart(SocketClient *cli, int, char **argv) {
+    return sendGenericOkFail(cli, sClatdCtrl->startClatd(argv[2]));
+}
+
+CommandListener::StatsCmd::StatsCmd() : NetdCommand("stats") {
+}
+
+int CommandListener::StatsCmd::runCommand(SocketClient *cli, int argc, char **argv) {
+    if (argc != 2 || strcmp(argv[1], "dump")) {
+        cli->sendMsg(ResponseCode::CommandSyntaxError, "Usage: stats dump", false);
+        return 0;
+    }
+
+    LatencyStats::dumpAll(cli);
+    NetlinkManager::Instance()->dumpStats(cli);
+    ProcessSupervisor::Instance()->dump(cli);
+    RouteCache::Instance()->dump(cli);
+    InterfaceCache::Instance()->dump(cli);
+    if (sDnsPool) {
+        sDnsPool->dump(cli);
+    }
+    Slab::dumpAll(cli);
+    cli->sendMsg(ResponseCode::CommandOkay, "Stats dumped", false);
+    return 0;
+}
 
-    if(!strcmp(argv[1], "stop")) {
-        rc = sClatdCtrl->stopClatd();
-    } else if (!strcmp(argv[1], "status")) {
-        char *tmp = NULL;
+CommandListener::FramingCmd::FramingCmd() : NetdCommand("framing") {
+}
 
-        asprintf(&tmp, "Clatd status: %s", (sClatdCtrl->isClatdStarted() ?
-                                                        "started" : "stopped"));
-        cli->sendMsg(ResponseCode::ClatdStatusResult, tmp, false);
-        free(tmp);
+int CommandListener::FramingCmd::runCommand(SocketClient *cli, int argc, char **argv) {
+    if (argc != 2 || (strcmp(argv[1], "binary") && strcmp(argv[1], "text"))) {
+        cli->sendMsg(ResponseCode::CommandSyntaxError, "Usage: framing (binary | text)", false);
         return 0;
-    } else if(!strcmp(argv[1], "start")) {
-        if (argc < 3) {
-            cli->sendMsg(ResponseCode::CommandSyntaxError, "Missing argument", false);
-            return 0;
-        }
-        rc = sClatdCtrl->startClatd(argv[2]);
-    } else {
-        cli->sendMsg(ResponseCode::CommandSyntaxError, "Unknown clatd cmd", false);
+    }
+
+    bool binary = !strcmp(argv[1], "binary");
+    BinaryFraming::setEnabled(cli, binary);
+    cli->sendMsg(ResponseCode::CommandOkay,
+                 binary ? "Binary framing enabled" : "Text framing enabled", false);
+    return 0;
+}
+
+static const char *TRACE_USAGE = "Usage: trace (start <name> | stop)";
+
+const SubcommandEntry<CommandListener::TraceCmd> CommandListener::TraceCmd::SUBCOMMANDS[] = {
+    { "start", 3, 3, TRACE_USAGE,
+      &CommandListener::TraceCmd::runStart },
+    { "stop", 2, 2, TRACE_USAGE,
+      &CommandListener::TraceCmd::runStop },
+};
+
+CommandListener::TraceCmd::TraceCmd() : NetdCommand("trace") {
+    checkSubcommandOrder("trace", SUBCOMMANDS, ARRAY_SIZE(SUBCOMMANDS));
+}
+
+int CommandListener::TraceCmd::runCommand(SocketClient *cli, int argc, char **argv) {
+    if (argc < 2) {
+        cli->sendMsg(ResponseCode::CommandSyntaxError, TRACE_USAGE, false);
         return 0;
     }
+    return runSubcommand(this, SUBCOMMANDS, ARRAY_SIZE(SUBCOMMANDS), cli, argc, argv,
+                         TRACE_USAGE);
+}
 
-    if (!rc) {
-        cli->sendMsg(ResponseCode::CommandOkay, "Clatd operation succeeded", false);
+int CommandListener::TraceCmd::runStart(SocketClient *cli, int, char **argv) {
+    if (CommandTrace::start(argv[2])) {
+        cli->sendMsg(ResponseCode::OperationFailed, "Unable to start trace", true);
     } else {
-        cli->sendMsg(ResponseCode::OperationFailed, "Clatd operation failed", false);
+        cli->sendMsg(ResponseCode::CommandOkay, "Trace started", false);
+    }
+    return 0;
+}
+
+int CommandListener::TraceCmd::runStop(SocketClient *cli, int, char **) {
+    CommandTrace::stop();
+    cli->sendMsg(ResponseCode::CommandOkay, "Trace stopped", false);
+    return 0;
+}
+
+static const char *SUBSCRIBE_USAGE =
+        "Usage: subscribe (all | none | add <class> [<iface> ...] | remove <class>)";
+
+const SubcommandEntry<CommandListener::SubscribeCmd>
+        CommandListener::SubscribeCmd::SUBCOMMANDS[] = {
+    { "add", 3, -1, SUBSCRIBE_USAGE,
+      &CommandListener::SubscribeCmd::runAdd },
+    { "all", 2, 2, SUBSCRIBE_USAGE,
+      &CommandListener::SubscribeCmd::runAll },
+    { "none", 2, 2, SUBSCRIBE_USAGE,
+      &CommandListener::SubscribeCmd::runNone },
+    { "remove", 3, 3, SUBSCRIBE_USAGE,
+      &CommandListener::SubscribeCmd::runRemove },
+};
+
+CommandListener::SubscribeCmd::SubscribeCmd() : NetdCommand("subscribe") {
+    checkSubcommandOrder("subscribe", SUBCOMMANDS, ARRAY_SIZE(SUBCOMMANDS));
+}
+
+int CommandListener::SubscribeCmd::runCommand(SocketClient *cli, int argc, char **argv) {
+    if (argc < 2) {
+        cli->sendMsg(ResponseCode::CommandSyntaxError, SUBSCRIBE_USAGE, false);
+        return 0;
+    }
+    return runSubcommand(this, SUBCOMMANDS, ARRAY_SIZE(SUBCOMMANDS), cli, argc, argv,
+                         SUBSCRIBE_USAGE);
+}
+
+/* Returns the broadcast class arg names, or -1 once the error is sent. */
+static int parseBroadcastClass(SocketClient *cli, const char *arg) {
+    int code = BroadcastFilter::parseClass(arg);
+    if (code < 0) {
+        cli->sendMsg(ResponseCode::CommandParameterError,
+                "Class must be interface, bandwidth, classactivity, address, dnsinfo or a "
+                "6xx code", false);
+    }
+    return code;
+}
+
+int CommandListener::SubscribeCmd::runAll(SocketClient *cli, int, char **) {
+    BroadcastFilter::reset(cli);
+    cli->sendMsg(ResponseCode::CommandOkay, "Subscribed to all broadcasts", false);
+    return 0;
+}
+
+int CommandListener::SubscribeCmd::runNone(SocketClient *cli, int, char **) {
+    BroadcastFilter::unsubscribeAll(cli);
+    cli->sendMsg(ResponseCode::CommandOkay, "Unsubscribed from all broadcasts", false);
+    return 0;
+}
+
+int CommandListener::SubscribeCmd::runAdd(SocketClient *cli, int argc, char **argv) {
+    int code = parseBroadcastClass(cli, argv[2]);
+    if (code < 0) {
+        return 0;
     }
+    std::vector<std::string> ifaces(argv + 3, argv + argc);
+    BroadcastFilter::subscribe(cli, code, ifaces);
+    cli->sendMsg(ResponseCode::CommandOkay, "Subscribed", false);
+    return 0;
+}
 
+int CommandListener::SubscribeCmd::runRemove(SocketClient *cli, int, char **argv) {
+    int code = parseBroadcastClass(cli, argv[2]);
+    if (code < 0) {
+        return 0;
+    }
+    BroadcastFilter::unsubscribe(cli, code);
+    cli->sendMsg(ResponseCode::CommandOkay, "Unsubscribed", false);
     return 0;
 }
+
+bool CommandListener::onDataAvailable(SocketClient *c) {
+    if (FrameworkListener::onDataAvailable(c)) {
+        return true;
+    }
+    // The client is going away; a later one may get the same address.
+    BinaryFraming::setEnabled(c, false);
+    BroadcastFilter::reset(c);
+    return false;
+}
@@ -33,6 +33,20 @@
 #include "FirewallController.h"
 #include "ClatdController.h"
 
+/*
+ * A subcommand of Cmd, for a table sorted by name that is searched with bsearch(). run is
+ * only called with minArgc <= argc <= maxArgc, otherwise usage is sent back as a syntax
+ * error. run returns what runCommand() does.
+ */
+template <class Cmd>
+struct SubcommandEntry {
+    const char *name;
+    int minArgc;
+    int maxArgc;  // -1 for no limit
+    const char *usage;
+    int (Cmd::*run)(SocketClient *cli, int argc, char **argv);
+};
+
 class CommandListener : public FrameworkListener {
     static TetherController *sTetherCtrl;
     static NatController *sNatCtrl;
@@ -48,10 +62,15 @@ class CommandListener : public FrameworkListener {
 
 public:
     static NetworkController *sNetCtrl;
+    // The dnsproxyd worker pool, for "resolver setuidweight"; set once DnsProxyListener exists.
+    static ThreadPool *sDnsPool;
 
     CommandListener();
     virtual ~CommandListener() {}
 
+protected:
+    virtual bool onDataAvailable(SocketClient *c);
+
 private:
 
     class SoftapCmd : public NetdCommand {
@@ -59,6 +78,16 @@ private:
         SoftapCmd();
         virtual ~SoftapCmd() {}
         int runCommand(SocketClient *c, int argc, char ** argv);
+    private:
+        // Sorted by name, for a binary search.
+        static const SubcommandEntry<SoftapCmd> SUBCOMMANDS[];
+
+        int sendResult(SocketClient *cli, int rc);
+        int runStartAp(SocketClient *cli, int argc, char **argv);
+        int runStopAp(SocketClient *cli, int argc, char **argv);
+        int runFwReload(SocketClient *cli, int argc, char **argv);
+        int runStatus(SocketClient *cli, int argc, char **argv);
+        int runSet(SocketClient *cli, int argc, char **argv);
     };
 
     class InterfaceCmd : public NetdCommand {
@@ -66,6 +95,22 @@ private:
         InterfaceCmd();
         virtual ~InterfaceCmd() {}
         int runCommand(SocketClient *c, int argc, char ** argv);
+    private:
+        // Sorted by name, for a binary search.
+        static const SubcommandEntry<InterfaceCmd> SUBCOMMANDS[];
+
+        int runList(SocketClient *cli, int argc, char **argv);
+        int runGetCfgAll(SocketClient *cli, int argc, char **argv);
+        int runDriver(SocketClient *cli, int argc, char **argv);
+        int runFwmark(SocketClient *cli, int argc, char **argv);
+        int runRoute(SocketClient *cli, int argc, char **argv);
+        int runGetCfg(SocketClient *cli, int argc, char **argv);
+        int runSetCfg(SocketClient *cli, int argc, char **argv);
+        int runClearAddrs(SocketClient *cli, int argc, char **argv);
+        int runIpv6PrivacyExtensions(SocketClient *cli, int argc, char **argv);
+        int runIpv6(SocketClient *cli, int argc, char **argv);
+        int runGetMtu(SocketClient *cli, int argc, char **argv);
+        int runSetMtu(SocketClient *cli, int argc, char **argv);
     };
 
     class IpFwdCmd : public NetdCommand {
@@ -73,6 +118,14 @@ private:
         IpFwdCmd();
         virtual ~IpFwdCmd() {}
         int runCommand(SocketClient *c, int argc, char ** argv);
+    private:
+        // Sorted by name, for a binary search.
+        static const SubcommandEntry<IpFwdCmd> SUBCOMMANDS[];
+
+        int sendGenericOkFail(SocketClient *cli, int rc);
+        int runStatus(SocketClient *cli, int argc, char **argv);
+        int runEnable(SocketClient *cli, int argc, char **argv);
+        int runDisable(SocketClient *cli, int argc, char **argv);
     };
 
     class TetherCmd : public NetdCommand {
@@ -80,6 +133,16 @@ private:
         TetherCmd();
         virtual ~TetherCmd() {}
         int runCommand(SocketClient *c, int argc, char ** argv);
+    private:
+        // Sorted by name, for a binary search.
+        static const SubcommandEntry<TetherCmd> SUBCOMMANDS[];
+
+        int sendGenericOkFail(SocketClient *cli, int rc);
+        int runStop(SocketClient *cli, int argc, char **argv);
+        int runStatus(SocketClient *cli, int argc, char **argv);
+        int runStart(SocketClient *cli, int argc, char **argv);
+        int runInterface(SocketClient *cli, int argc, char **argv);
+        int runDns(SocketClient *cli, int argc, char **argv);
     };
 
     class NatCmd : public NetdCommand {
@@ -87,6 +150,13 @@ private:
         NatCmd();
         virtual ~NatCmd() {}
         int runCommand(SocketClient *c, int argc, char ** argv);
+    private:
+        // Sorted by name, for a binary search.
+        static const SubcommandEntry<NatCmd> SUBCOMMANDS[];
+
+        int sendGenericOkFail(SocketClient *cli, int rc);
+        int runEnable(SocketClient *cli, int argc, char **argv);
+        int runDisable(SocketClient *cli, int argc, char **argv);
     };
 
     class ListTtysCmd : public NetdCommand {
@@ -101,6 +171,13 @@ private:
         PppdCmd();
         virtual ~PppdCmd() {}
         int runCommand(SocketClient *c, int argc, char ** argv);
+    private:
+        // Sorted by name, for a binary search.
+        static const SubcommandEntry<PppdCmd> SUBCOMMANDS[];
+
+        int sendGenericOkFail(SocketClient *cli, int rc);
+        int runAttach(SocketClient *cli, int argc, char **argv);
+        int runDetach(SocketClient *cli, int argc, char **argv);
     };
 
     class BandwidthControlCmd : public NetdCommand {
@@ -112,6 +189,49 @@ private:
         void sendGenericOkFail(SocketClient *cli, int cond);
         void sendGenericOpFailed(SocketClient *cli, const char *errMsg);
         void sendGenericSyntaxError(SocketClient *cli, const char *usageMsg);
+    private:
+        /*
+         * A subcommand, with the argument checks done before run is called.
+         * argv[bytesArg], if not -1, is parsed into the bytes argument of run.
+         */
+        struct Subcommand {
+            const char *name;
+            int minArgc;
+            int maxArgc;  // -1 for no limit
+            int bytesArg;
+            const char *usage;
+            void (BandwidthControlCmd::*run)(SocketClient *cli, int argc, char **argv,
+                                             int64_t bytes);
+        };
+        // Sorted by name, aliases included, for a binary search.
+        static const Subcommand SUBCOMMANDS[];
+
+        void runEnable(SocketClient *cli, int argc, char **argv, int64_t bytes);
+        void runDisable(SocketClient *cli, int argc, char **argv, int64_t bytes);
+        void runRemoveQuota(SocketClient *cli, int argc, char **argv, int64_t bytes);
+        void runGetQuota(SocketClient *cli, int argc, char **argv, int64_t bytes);
+        void runGetQuotas(SocketClient *cli, int argc, char **argv, int64_t bytes);
+        void runGetInterfaceQuota(SocketClient *cli, int argc, char **argv, int64_t bytes);
+        void runSetQuota(SocketClient *cli, int argc, char **argv, int64_t bytes);
+        void runSetQuotas(SocketClient *cli, int argc, char **argv, int64_t bytes);
+        void runRemoveQuotas(SocketClient *cli, int argc, char **argv, int64_t bytes);
+        void runRemoveInterfaceQuota(SocketClient *cli, int argc, char **argv, int64_t bytes);
+        void runSetInterfaceQuota(SocketClient *cli, int argc, char **argv, int64_t bytes);
+        void runAddNaughtyApps(SocketClient *cli, int argc, char **argv, int64_t bytes);
+        void runRemoveNaughtyApps(SocketClient *cli, int argc, char **argv, int64_t bytes);
+        void runHappyBox(SocketClient *cli, int argc, char **argv, int64_t bytes);
+        void runAddNiceApps(SocketClient *cli, int argc, char **argv, int64_t bytes);
+        void runRemoveNiceApps(SocketClient *cli, int argc, char **argv, int64_t bytes);
+        void runSetGlobalAlert(SocketClient *cli, int argc, char **argv, int64_t bytes);
+        void runSetTetherGlobalAlert(SocketClient *cli, int argc, char **argv, int64_t bytes);
+        void runRemoveGlobalAlert(SocketClient *cli, int argc, char **argv, int64_t bytes);
+        void runRemoveTetherGlobalAlert(SocketClient *cli, int argc, char **argv, int64_t bytes);
+        void runSetSharedAlert(SocketClient *cli, int argc, char **argv, int64_t bytes);
+        void runRemoveSharedAlert(SocketClient *cli, int argc, char **argv, int64_t bytes);
+        void runSetInterfaceAlert(SocketClient *cli, int argc, char **argv, int64_t bytes);
+        void runRemoveInterfaceAlert(SocketClient *cli, int argc, char **argv, int64_t bytes);
+        void runGetTetherStats(SocketClient *cli, int argc, char **argv, int64_t bytes);
+        void runGetUidStats(SocketClient *cli, int argc, char **argv, int64_t bytes);
     };
 
     class IdletimerControlCmd : public NetdCommand {
@@ -119,6 +239,14 @@ private:
         IdletimerControlCmd();
         virtual ~IdletimerControlCmd() {}
         int runCommand(SocketClient *c, int argc, char ** argv);
+    private:
+        // Sorted by name, for a binary search.
+        static const SubcommandEntry<IdletimerControlCmd> SUBCOMMANDS[];
+
+        int runEnable(SocketClient *cli, int argc, char **argv);
+        int runDisable(SocketClient *cli, int argc, char **argv);
+        int runAdd(SocketClient *cli, int argc, char **argv);
+        int runRemove(SocketClient *cli, int argc, char **argv);
     };
 
     class ResolverCmd : public NetdCommand {
@@ -126,6 +254,23 @@ private:
         ResolverCmd();
         virtual ~ResolverCmd() {}
         int runCommand(SocketClient *c, int argc, char ** argv);
+    private:
+        // Sorted by name, for a binary search.
+        static const SubcommandEntry<ResolverCmd> SUBCOMMANDS[];
+
+        int sendGenericOkFail(SocketClient *cli, int rc);
+        int runSetDefaultIf(SocketClient *cli, int argc, char **argv);
+        int runSetIfDns(SocketClient *cli, int argc, char **argv);
+        int runFlushDefaultIf(SocketClient *cli, int argc, char **argv);
+        int runFlushIf(SocketClient *cli, int argc, char **argv);
+        int runSetIfaceForPid(SocketClient *cli, int argc, char **argv);
+        int runClearIfaceForPid(SocketClient *cli, int argc, char **argv);
+        int runSetIfaceForUidRange(SocketClient *cli, int argc, char **argv);
+        int runClearIfaceForUidRange(SocketClient *cli, int argc, char **argv);
+        int runClearIfaceMapping(SocketClient *cli, int argc, char **argv);
+        int runGetCacheStats(SocketClient *cli, int argc, char **argv);
+        int runSetUidWeight(SocketClient *cli, int argc, char **argv);
+        int runGetStats(SocketClient *cli, int argc, char **argv);
     };
 
     class FirewallCmd: public NetdCommand {
@@ -136,6 +281,18 @@ private:
     protected:
         int sendGenericOkFail(SocketClient *cli, int cond);
         static FirewallRule parseRule(const char* arg);
+    private:
+        // Sorted by name, for a binary search.
+        static const SubcommandEntry<FirewallCmd> SUBCOMMANDS[];
+
+        int runEnable(SocketClient *cli, int argc, char **argv);
+        int runDisable(SocketClient *cli, int argc, char **argv);
+        int runIsEnabled(SocketClient *cli, int argc, char **argv);
+        int runSetInterfaceRule(SocketClient *cli, int argc, char **argv);
+        int runSetEgressSourceRule(SocketClient *cli, int argc, char **argv);
+        int runSetEgressDestRule(SocketClient *cli, int argc, char **argv);
+        int runSetUidRule(SocketClient *cli, int argc, char **argv);
+        int runReplaceUidRules(SocketClient *cli, int argc, char **argv);
     };
 
     class ClatdCmd : public NetdCommand {
@@ -143,6 +300,56 @@ private:
         ClatdCmd();
         virtual ~ClatdCmd() {}
         int runCommand(SocketClient *c, int argc, char ** argv);
+    private:
+        // Sorted by name, for a binary search.
+        static const SubcommandEntry<ClatdCmd> SUBCOMMANDS[];
+
+        int sendGenericOkFail(SocketClient *cli, int rc);
+        int runStop(SocketClient *cli, int argc, char **argv);
+        int runStatus(SocketClient *cli, int argc, char **argv);
+        int runStart(SocketClient *cli, int argc, char **argv);
+    };
+
+    class StatsCmd : public NetdCommand {
+    public:
+        StatsCmd();
+        virtual ~StatsCmd() {}
+        int runCommand(SocketClient *c, int argc, char ** argv);
+    };
+
+    class FramingCmd : public NetdCommand {
+    public:
+        FramingCmd();
+        virtual ~FramingCmd() {}
+        int runCommand(SocketClient *c, int argc, char ** argv);
+    };
+
+    class SubscribeCmd : public NetdCommand {
+    public:
+        SubscribeCmd();
+        virtual ~SubscribeCmd() {}
+        int runCommand(SocketClient *c, int argc, char ** argv);
+    private:
+        // Sorted by name, for a binary search.
+        static const SubcommandEntry<SubscribeCmd> SUBCOMMANDS[];
+
+        int runAll(SocketClient *cli, int argc, char **argv);
+        int runNone(SocketClient *cli, int argc, char **argv);
+        int runAdd(SocketClient *cli, int argc, char **argv);
+        int runRemove(SocketClient *cli, int argc, char **argv);
+    };
+
+    class TraceCmd : public NetdCommand {
+    public:
+        TraceCmd();
+        virtual ~TraceCmd() {}
+        int runCommand(SocketClient *c, int argc, char ** argv);
+    private:
+        // Sorted by name, for a binary search.
+        static const SubcommandEntry<TraceCmd> SUBCOMMANDS[];
+
+        int runStart(SocketClient *cli, int argc, char **argv);
+        int runStop(SocketClient *cli, int argc, char **argv);
     };
 };
 
@@ -0,0 +1,139 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+
+#define LOG_TAG "CommandTrace"
+
+#include <cutils/atomic.h>
+#include <cutils/log.h>
+#include <cutils/properties.h>
+#include <sysutils/SocketClient.h>
+
+#include "CommandTrace.h"
+#include "LatencyStats.h"
+
+const char *CommandTrace::TRACE_DIR = "/data/misc/net";
+
+static const char TRACE_HEADER[] = "# netd command trace 1\n";
+static const char REDACTED[] = "<redacted>";
+
+// sFd is only read or changed with sLock held; sEnabled lets record() skip the lock.
+static volatile int32_t sEnabled = 0;
+static pthread_mutex_t sLock = PTHREAD_MUTEX_INITIALIZER;
+static int sFd = -1;
+static int64_t sStartUs;
+
+int CommandTrace::start(const char *name) {
+    char debuggable[PROPERTY_VALUE_MAX];
+    property_get("ro.debuggable", debuggable, "0");
+    if (strcmp(debuggable, "1")) {
+        ALOGE("Command traces are only available on debuggable builds");
+        return -1;
+    }
+    if (!*name || strchr(name, '/') || !strcmp(name, ".") || !strcmp(name, "..")) {
+        ALOGE("Invalid trace file name %s", name);
+        return -1;
+    }
+
+    std::string path = std::string(TRACE_DIR) + "/" + name;
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        ALOGE("Unable to create trace file %s (%s)", path.c_str(), strerror(errno));
+        return -1;
+    }
+    if (write(fd, TRACE_HEADER, sizeof(TRACE_HEADER) - 1) < 0) {
+        ALOGE("Unable to write trace file %s (%s)", path.c_str(), strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    pthread_mutex_lock(&sLock);
+    if (sFd >= 0) {
+        close(sFd);
+    }
+    sFd = fd;
+    sStartUs = LatencyStats::now();
+    android_atomic_release_store(1, &sEnabled);
+    pthread_mutex_unlock(&sLock);
+    ALOGI("Tracing commands to %s", path.c_str());
+    return 0;
+}
+
+void CommandTrace::stop() {
+    pthread_mutex_lock(&sLock);
+    android_atomic_release_store(0, &sEnabled);
+    if (sFd >= 0) {
+        close(sFd);
+        sFd = -1;
+    }
+    pthread_mutex_unlock(&sLock);
+}
+
+static void appendArg(std::string &line, const char *arg) {
+    if (*arg && !strpbrk(arg, " \"\\")) {
+        line += arg;
+        return;
+    }
+    char *quoted = SocketClient::quoteArg(arg);
+    line += quoted;
+    free(quoted);
+}
+
+/* Whether argv[i] is a secret that must not reach the trace file. */
+static bool isSecret(const char *listener, int argc, char **argv, int i) {
+    // softap set <iface> <ssid> <broadcast> <channel> <security> <key>
+    return !strcmp(listener, "netd") && argc > 1 && !strcmp(argv[0], "softap") &&
+            !strcmp(argv[1], "set") && i == 7;
+}
+
+void CommandTrace::record(const char *listener, SocketClient *c, int argc, char **argv) {
+    if (!android_atomic_acquire_load(&sEnabled)) {
+        return;
+    }
+
+    int64_t nowUs = LatencyStats::now();
+    char prefix[64];
+    std::string line;
+    for (int i = 0; i < argc; i++) {
+        line += ' ';
+        appendArg(line, isSecret(listener, argc, argv, i) ? REDACTED : argv[i]);
+    }
+    line += '\n';
+
+    pthread_mutex_lock(&sLock);
+    if (sFd >= 0) {
+        snprintf(prefix, sizeof(prefix), "%lld %s %d/%d",
+                 (long long) (nowUs - sStartUs), listener, (int) c->getPid(), c->getSocket());
+        line.insert(0, prefix);
+        // One write per line, so lines from different listener threads don't mix.
+        if (write(sFd, line.data(), line.size()) < 0) {
+            ALOGE("Writing the command trace failed (%s), stopping it", strerror(errno));
+            android_atomic_release_store(0, &sEnabled);
+            close(sFd);
+            sFd = -1;
+        }
+    }
+    pthread_mutex_unlock(&sLock);
+}
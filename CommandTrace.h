@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _COMMAND_TRACE_H
+#define _COMMAND_TRACE_H
+
+#include <stdint.h>
+
+class SocketClient;
+
+/*
+ * Records the commands arriving on the netd, dnsproxyd and mdns sockets to a file in
+ * TRACE_DIR, for netd_replay. Tracing is only available on debuggable builds, and secret
+ * arguments such as the softap key are replaced with "<redacted>". While no trace is
+ * running record() is a single atomic load.
+ *
+ * The file has one line per command, in arrival order:
+ *
+ *     <us since the trace started> <socket> <client> <command line>
+ *
+ * where client is "<pid>/<fd>" of the connection, so commands with the same client can't
+ * have overlapped, and the command line is quoted the way FrameworkListener parses it,
+ * without the sequence number.
+ */
+class CommandTrace {
+public:
+    static const char *TRACE_DIR;
+
+    /*
+     * Starts recording to a new file called name in TRACE_DIR, replacing any running
+     * trace. Fails if name is not a plain file name or the file exists already.
+     */
+    static int start(const char *name);
+    static void stop();
+
+    static void record(const char *listener, SocketClient *c, int argc, char **argv);
+};
+
+#endif
@@ -32,88 +32,231 @@
 #define DBG 0
 #define VDBG 0
 
+#include <map>
+#include <string>
+#include <vector>
+
 #include <cutils/log.h>
+#include <cutils/properties.h>
 #include <sysutils/SocketClient.h>
 
 #include "NetdConstants.h"
 #include "DnsProxyListener.h"
+#include "DnsResponse.h"
+#include "DnsStats.h"
+#include "LatencyStats.h"
 #include "ResponseCode.h"
 
+static const char DEFAULT_THREADS[] = "8";
+static const char DEFAULT_QUEUE_DEPTH[] = "128";
+// Handlers kept for reuse, per type: enough for a busy pool and a full queue.
+static const size_t MAX_FREE_HANDLERS = 64;
+
+// Commands only queue the lookup; these time the resolver calls on the workers.
+static LatencyStats sGetAddrInfoStats("dns", "getaddrinfo");
+static LatencyStats sGetHostByNameStats("dns", "gethostbyname");
+static LatencyStats sGetHostByAddrStats("dns", "gethostbyaddr");
+
+static int getIntProperty(const char *name, const char *defaultValue) {
+    char value[PROPERTY_VALUE_MAX];
+    property_get(name, value, defaultValue);
+    int res = atoi(value);
+    return res > 0 ? res : atoi(defaultValue);
+}
+
 DnsProxyListener::DnsProxyListener(const NetworkController* controller) :
                  FrameworkListener("dnsproxyd"),
                  mNetCtrl(controller) {
-    registerCmd(new GetAddrInfoCmd(controller));
-    registerCmd(new GetHostByAddrCmd(controller));
-    registerCmd(new GetHostByNameCmd(controller));
+    int threads = getIntProperty("ro.netd.dnsproxy.threads", DEFAULT_THREADS);
+    mPool = new ThreadPool("dnsproxyd", threads,
+            getIntProperty("ro.netd.dnsproxy.queue", DEFAULT_QUEUE_DEPTH));
+    // Lookups are scheduled fairly between uids, none of which gets more than half the
+    // workers by default.
+    char uidThreads[16];
+    snprintf(uidThreads, sizeof(uidThreads), "%d", threads > 1 ? threads / 2 : 1);
+    mPool->setFairShare(getIntProperty("ro.netd.dnsproxy.uid_threads", uidThreads));
+    if (mPool->start()) {
+        ALOGE("Unable to start all DNS worker threads");
+    }
+    AsyncResolver::Instance()->setEnabled(getIntProperty("ro.netd.dnsproxy.async", "0") != 0);
+    registerCmd(new TracedCommand("dnsproxyd",
+            new TimedCommand("dnsproxyd", new GetAddrInfoCmd(controller, mPool))));
+    registerCmd(new TracedCommand("dnsproxyd",
+            new TimedCommand("dnsproxyd", new GetHostByAddrCmd(controller, mPool))));
+    registerCmd(new TracedCommand("dnsproxyd",
+            new TimedCommand("dnsproxyd", new GetHostByNameCmd(controller, mPool))));
 }
 
-DnsProxyListener::GetAddrInfoHandler::GetAddrInfoHandler(SocketClient *c,
-                                                         char* host,
-                                                         char* service,
-                                                         struct addrinfo* hints,
-                                                         unsigned netId)
-        : mClient(c),
-          mHost(host),
-          mService(service),
-          mHints(hints),
-          mNetId(netId) {
+/* arg copied to buf if it fits, else to the heap; NULL stays NULL. */
+char *DnsProxyListener::copyArg(const char *arg, char *buf, size_t size) {
+    if (!arg) {
+        return NULL;
+    }
+    size_t len = strlen(arg);
+    if (len >= size) {
+        return strdup(arg);
+    }
+    memcpy(buf, arg, len + 1);
+    return buf;
 }
 
-DnsProxyListener::GetAddrInfoHandler::~GetAddrInfoHandler() {
-    free(mHost);
-    free(mService);
-    free(mHints);
+void DnsProxyListener::freeArg(char *arg, const char *buf) {
+    if (arg != buf) {
+        free(arg);
+    }
 }
 
-void DnsProxyListener::GetAddrInfoHandler::start() {
-    pthread_t thread;
-    pthread_create(&thread, NULL,
-                   DnsProxyListener::GetAddrInfoHandler::threadStart, this);
-    pthread_detach(thread);
+Slab DnsProxyListener::GetAddrInfoHandler::sSlab("GetAddrInfoHandler",
+        sizeof(DnsProxyListener::GetAddrInfoHandler), MAX_FREE_HANDLERS);
+
+void *DnsProxyListener::GetAddrInfoHandler::operator new(size_t size) {
+    return size == sSlab.blockSize() ? sSlab.alloc() : malloc(size);
+}
+
+void DnsProxyListener::GetAddrInfoHandler::operator delete(void *p, size_t size) {
+    if (size == sSlab.blockSize()) {
+        sSlab.free(p);
+    } else {
+        free(p);
+    }
 }
 
-void* DnsProxyListener::GetAddrInfoHandler::threadStart(void* obj) {
-    GetAddrInfoHandler* handler = reinterpret_cast<GetAddrInfoHandler*>(obj);
-    handler->run();
-    delete handler;
-    pthread_exit(NULL);
-    return NULL;
+DnsProxyListener::GetAddrInfoHandler::GetAddrInfoHandler(SocketClient *c,
+                                                         const char* host,
+                                                         const char* service,
+                                                         const struct addrinfo* hints,
+                                                         unsigned netId,
+                                                         const std::string &key,
+                                                         ThreadPool* pool)
+        : mClient(c),
+          mHost(copyArg(host, mHostBuf, sizeof(mHostBuf))),
+          mService(copyArg(service, mServiceBuf, sizeof(mServiceBuf))),
+          mHints(NULL),
+          mNetId(netId),
+          mPool(pool),
+          mKey(key),
+          mStart(0) {
+    if (hints) {
+        mHintsBuf = *hints;
+        mHints = &mHintsBuf;
+    }
 }
 
-// Sends 4 bytes of big-endian length, followed by the data.
-// Returns true on success.
-static bool sendLenAndData(SocketClient *c, const int len, const void* data) {
-    uint32_t len_be = htonl(len);
-    return c->sendData(&len_be, 4) == 0 &&
-        (len == 0 || c->sendData(data, len) == 0);
+DnsProxyListener::GetAddrInfoHandler::~GetAddrInfoHandler() {
+    freeArg(mHost, mHostBuf);
+    freeArg(mService, mServiceBuf);
 }
 
-// Returns true on success
-static bool sendhostent(SocketClient *c, struct hostent *hp) {
-    bool success = true;
-    int i;
-    if (hp->h_name != NULL) {
-        success &= sendLenAndData(c, strlen(hp->h_name)+1, hp->h_name);
-    } else {
-        success &= sendLenAndData(c, 0, "") == 0;
+/*
+ * getaddrinfo() lookups currently being resolved, keyed on (host, service, hints, netId).
+ * A request matching one of them doesn't start its own lookup: its client is queued
+ * on the pending one and answered with the same result.
+ */
+class InFlightLookups {
+public:
+    InFlightLookups() : mCoalesced(0) {
+        pthread_mutex_init(&mLock, NULL);
+    }
+
+    static std::string makeKey(const char *host, const char *service,
+                               const struct addrinfo *hints, unsigned netId) {
+        char buf[64];
+        std::string key;
+        // '\0' separates the fields and a NULL string is distinct from an empty one.
+        key += host ? "h" : "-";
+        if (host) key += host;
+        key += '\0';
+        key += service ? "s" : "-";
+        if (service) key += service;
+        key += '\0';
+        if (hints) {
+            snprintf(buf, sizeof(buf), "%d %d %d %d", hints->ai_flags, hints->ai_family,
+                     hints->ai_socktype, hints->ai_protocol);
+            key += buf;
+        }
+        key += '\0';
+        snprintf(buf, sizeof(buf), "%u", netId);
+        key += buf;
+        return key;
+    }
+
+    /*
+     * Returns true if the caller should perform the lookup, false if client was queued on
+     * a matching lookup in progress, which takes over the client reference.
+     */
+    bool join(const std::string &key, SocketClient *client) {
+        pthread_mutex_lock(&mLock);
+        std::map<std::string, std::vector<SocketClient *> >::iterator it = mLookups.find(key);
+        bool leader = (it == mLookups.end());
+        if (leader) {
+            mLookups[key];
+        } else {
+            it->second.push_back(client);
+            mCoalesced++;
+        }
+        pthread_mutex_unlock(&mLock);
+        return leader;
+    }
+
+    /* Ends the lookup and returns the clients that joined it. */
+    std::vector<SocketClient *> finish(const std::string &key) {
+        std::vector<SocketClient *> waiters;
+        pthread_mutex_lock(&mLock);
+        std::map<std::string, std::vector<SocketClient *> >::iterator it = mLookups.find(key);
+        if (it != mLookups.end()) {
+            waiters.swap(it->second);
+            mLookups.erase(it);
+        }
+        pthread_mutex_unlock(&mLock);
+        return waiters;
     }
 
-    for (i=0; hp->h_aliases[i] != NULL; i++) {
-        success &= sendLenAndData(c, strlen(hp->h_aliases[i])+1, hp->h_aliases[i]);
+    uint64_t getCoalescedCount() {
+        pthread_mutex_lock(&mLock);
+        uint64_t res = mCoalesced;
+        pthread_mutex_unlock(&mLock);
+        return res;
     }
-    success &= sendLenAndData(c, 0, ""); // null to indicate we're done
 
-    uint32_t buf = htonl(hp->h_addrtype);
-    success &= c->sendData(&buf, sizeof(buf)) == 0;
+private:
+    pthread_mutex_t mLock;
+    std::map<std::string, std::vector<SocketClient *> > mLookups;
+    uint64_t mCoalesced;
+};
 
-    buf = htonl(hp->h_length);
-    success &= c->sendData(&buf, sizeof(buf)) == 0;
+static InFlightLookups sInFlightLookups;
 
-    for (i=0; hp->h_addr_list[i] != NULL; i++) {
-        success &= sendLenAndData(c, 16, hp->h_addr_list[i]);
+void DnsProxyListener::GetAddrInfoHandler::start() {
+    AsyncResolver *resolver = AsyncResolver::Instance();
+    if (resolver->isEnabled()) {
+        mStart = LatencyStats::now();
+        if (resolver->getaddrinfo(mNetId, mHost, mService, mHints, this)) {
+            return;  // this may already be gone
+        }
     }
-    success &= sendLenAndData(c, 0, ""); // null to indicate we're done
-    return success;
+    enqueue();
+}
+
+void DnsProxyListener::GetAddrInfoHandler::enqueue() {
+    if (!mPool->enqueue(this, mClient->getUid())) {
+        // Too many lookups pending; fail fast rather than adding to the backlog.
+        respond(EAI_AGAIN, NULL);
+        delete this;
+    }
+}
+
+void DnsProxyListener::GetAddrInfoHandler::onResult(int rv, const struct addrinfo *result) {
+    sGetAddrInfoStats.record(mStart, rv != 0);
+    DnsStats::Instance()->recordLookup(mNetId, mStart, rv != 0);
+    respond(rv, result);
+    delete this;
+}
+
+void DnsProxyListener::GetAddrInfoHandler::onFallback() {
+    if (DBG) {
+        ALOGD("GetAddrInfoHandler, %s left to the blocking resolver", mHost);
+    }
+    enqueue();
 }
 
 void DnsProxyListener::GetAddrInfoHandler::run() {
@@ -122,35 +265,45 @@ void DnsProxyListener::GetAddrInfoHandler::run() {
     }
 
     struct addrinfo* result = NULL;
+    int64_t start = LatencyStats::now();
     uint32_t rv = android_getaddrinfofornet(mHost, mService, mHints, mNetId, 0, &result);
-    if (rv) {
-        // getaddrinfo failed
-        mClient->sendBinaryMsg(ResponseCode::DnsProxyOperationFailed, &rv, sizeof(rv));
-    } else {
-        bool success = !mClient->sendCode(ResponseCode::DnsProxyQueryResult);
-        struct addrinfo* ai = result;
-        while (ai && success) {
-            success = sendLenAndData(mClient, sizeof(struct addrinfo), ai)
-                && sendLenAndData(mClient, ai->ai_addrlen, ai->ai_addr)
-                && sendLenAndData(mClient,
-                                  ai->ai_canonname ? strlen(ai->ai_canonname) + 1 : 0,
-                                  ai->ai_canonname);
-            ai = ai->ai_next;
-        }
-        success = success && sendLenAndData(mClient, 0, "");
-        if (!success) {
-            ALOGW("Error writing DNS result to client");
-        }
-    }
+    sGetAddrInfoStats.record(start, rv != 0);
+    DnsStats::Instance()->recordLookup(mNetId, start, rv != 0);
+
+    respond(rv, result);
+
     if (result) {
         freeaddrinfo(result);
     }
-    mClient->decRef();
 }
 
-DnsProxyListener::GetAddrInfoCmd::GetAddrInfoCmd(const NetworkController* controller) :
+/* Answers the client and everyone who joined its lookup; each holds a client reference. */
+void DnsProxyListener::GetAddrInfoHandler::respond(uint32_t rv, const struct addrinfo *result) {
+    std::vector<SocketClient *> waiters = sInFlightLookups.finish(mKey);
+    waiters.push_back(mClient);
+
+    // The response is the same for everyone waiting on this lookup; build it once.
+    ResponseBuffer buf(rv ? 0 : addrInfoResponseSize(result));
+    if (!rv) {
+        buf.appendCode(ResponseCode::DnsProxyQueryResult);
+        appendAddrInfo(buf, result);
+    }
+    for (size_t i = 0; i < waiters.size(); i++) {
+        if (rv) {
+            // getaddrinfo failed
+            waiters[i]->sendBinaryMsg(ResponseCode::DnsProxyOperationFailed, &rv, sizeof(rv));
+        } else if (!buf.send(waiters[i])) {
+            ALOGW("Error writing DNS result to client");
+        }
+        waiters[i]->decRef();
+    }
+}
+
+DnsProxyListener::GetAddrInfoCmd::GetAddrInfoCmd(const NetworkController* controller,
+                                                 ThreadPool* pool) :
     NetdCommand("getaddrinfo"),
-    mNetCtrl(controller) {
+    mNetCtrl(controller),
+    mPool(pool) {
 }
 
 int DnsProxyListener::GetAddrInfoCmd::runCommand(SocketClient *cli,
@@ -169,20 +322,17 @@ int DnsProxyListener::GetAddrInfoCmd::runCommand(SocketClient *cli,
         return -1;
     }
 
-    char* name = argv[1];
+    const char* name = argv[1];
     if (strcmp("^", name) == 0) {
         name = NULL;
-    } else {
-        name = strdup(name);
     }
 
-    char* service = argv[2];
+    const char* service = argv[2];
     if (strcmp("^", service) == 0) {
         service = NULL;
-    } else {
-        service = strdup(service);
     }
 
+    struct addrinfo hintsBuf;
     struct addrinfo* hints = NULL;
     int ai_flags = atoi(argv[3]);
     int ai_family = atoi(argv[4]);
@@ -196,7 +346,8 @@ int DnsProxyListener::GetAddrInfoCmd::runCommand(SocketClient *cli,
 
     if (ai_flags != -1 || ai_family != -1 ||
         ai_socktype != -1 || ai_protocol != -1) {
-        hints = (struct addrinfo*) calloc(1, sizeof(struct addrinfo));
+        memset(&hintsBuf, 0, sizeof(hintsBuf));
+        hints = &hintsBuf;
         hints->ai_flags = ai_flags;
         hints->ai_family = ai_family;
         hints->ai_socktype = ai_socktype;
@@ -216,9 +367,21 @@ int DnsProxyListener::GetAddrInfoCmd::runCommand(SocketClient *cli,
              netId, pid, uid);
     }
 
+    // A lookup matching one in progress waits for its answer instead of taking a thread.
     cli->incRef();
+    std::string key = InFlightLookups::makeKey(name, service, hints, netId);
+    if (!sInFlightLookups.join(key, cli)) {
+        DnsStats::Instance()->recordCoalesced(netId);
+        if (DBG) {
+            ALOGD("GetAddrInfoHandler, joined lookup in progress (%llu so far)",
+                  (unsigned long long) sInFlightLookups.getCoalescedCount());
+        }
+        return 0;
+    }
+
     DnsProxyListener::GetAddrInfoHandler* handler =
-            new DnsProxyListener::GetAddrInfoHandler(cli, name, service, hints, netId);
+            new DnsProxyListener::GetAddrInfoHandler(cli, name, service, hints, netId, key,
+                                                     mPool);
     handler->start();
 
     return 0;
@@ -227,9 +390,11 @@ int DnsProxyListener::GetAddrInfoCmd::runCommand(SocketClient *cli,
 /*******************************************************
  *                  GetHostByName                      *
  *******************************************************/
-DnsProxyListener::GetHostByNameCmd::GetHostByNameCmd(const NetworkController* controller) :
+DnsProxyListener::GetHostByNameCmd::GetHostByNameCmd(const NetworkController* controller,
+                                                     ThreadPool* pool) :
       NetdCommand("gethostbyname"),
-      mNetCtrl(controller) {
+      mNetCtrl(controller),
+      mPool(pool) {
 }
 
 int DnsProxyListener::GetHostByNameCmd::runCommand(SocketClient *cli,
@@ -251,13 +416,11 @@ int DnsProxyListener::GetHostByNameCmd::runCommand(SocketClient *cli,
     pid_t pid = cli->getPid();
     uid_t uid = cli->getUid();
     unsigned netId = strtoul(argv[1], NULL, 10);
-    char* name = argv[2];
+    const char* name = argv[2];
     int af = atoi(argv[3]);
 
     if (strcmp(name, "^") == 0) {
         name = NULL;
-    } else {
-        name = strdup(name);
     }
 
     netId = mNetCtrl->getNetwork(uid, netId, pid, true);
@@ -265,38 +428,43 @@ int DnsProxyListener::GetHostByNameCmd::runCommand(SocketClient *cli,
     cli->incRef();
     DnsProxyListener::GetHostByNameHandler* handler =
             new DnsProxyListener::GetHostByNameHandler(cli, name, af, netId);
-    handler->start();
+    if (!mPool->enqueue(handler, uid)) {
+        // Too many lookups pending; fail fast rather than adding to the backlog.
+        cli->sendBinaryMsg(ResponseCode::DnsProxyOperationFailed, NULL, 0);
+        cli->decRef();
+        delete handler;
+    }
 
     return 0;
 }
 
+Slab DnsProxyListener::GetHostByNameHandler::sSlab("GetHostByNameHandler",
+        sizeof(DnsProxyListener::GetHostByNameHandler), MAX_FREE_HANDLERS);
+
+void *DnsProxyListener::GetHostByNameHandler::operator new(size_t size) {
+    return size == sSlab.blockSize() ? sSlab.alloc() : malloc(size);
+}
+
+void DnsProxyListener::GetHostByNameHandler::operator delete(void *p, size_t size) {
+    if (size == sSlab.blockSize()) {
+        sSlab.free(p);
+    } else {
+        free(p);
+    }
+}
+
 DnsProxyListener::GetHostByNameHandler::GetHostByNameHandler(SocketClient* c,
-                                                             char* name,
+                                                             const char* name,
                                                              int af,
                                                              unsigned netId)
         : mClient(c),
-          mName(name),
+          mName(copyArg(name, mNameBuf, sizeof(mNameBuf))),
           mAf(af),
           mNetId(netId) {
 }
 
 DnsProxyListener::GetHostByNameHandler::~GetHostByNameHandler() {
-    free(mName);
-}
-
-void DnsProxyListener::GetHostByNameHandler::start() {
-    pthread_t thread;
-    pthread_create(&thread, NULL,
-            DnsProxyListener::GetHostByNameHandler::threadStart, this);
-    pthread_detach(thread);
-}
-
-void* DnsProxyListener::GetHostByNameHandler::threadStart(void* obj) {
-    GetHostByNameHandler* handler = reinterpret_cast<GetHostByNameHandler*>(obj);
-    handler->run();
-    delete handler;
-    pthread_exit(NULL);
-    return NULL;
+    freeArg(mName, mNameBuf);
 }
 
 void DnsProxyListener::GetHostByNameHandler::run() {
@@ -306,7 +474,10 @@ void DnsProxyListener::GetHostByNameHandler::run() {
 
     struct hostent* hp;
 
+    int64_t start = LatencyStats::now();
     hp = android_gethostbynamefornet(mName, mAf, mNetId, 0);
+    sGetHostByNameStats.record(start, hp == NULL);
+    DnsStats::Instance()->recordLookup(mNetId, start, hp == NULL);
 
     if (DBG) {
         ALOGD("GetHostByNameHandler::run gethostbyname errno: %s hp->h_name = %s, name_len = %zu\n",
@@ -317,8 +488,7 @@ void DnsProxyListener::GetHostByNameHandler::run() {
 
     bool success = true;
     if (hp) {
-        success = mClient->sendCode(ResponseCode::DnsProxyQueryResult) == 0;
-        success &= sendhostent(mClient, hp);
+        success = sendhostent(mClient, hp);
     } else {
         success = mClient->sendBinaryMsg(ResponseCode::DnsProxyOperationFailed, NULL, 0) == 0;
     }
@@ -333,9 +503,11 @@ void DnsProxyListener::GetHostByNameHandler::run() {
 /*******************************************************
  *                  GetHostByAddr                      *
  *******************************************************/
-DnsProxyListener::GetHostByAddrCmd::GetHostByAddrCmd(const NetworkController* controller) :
+DnsProxyListener::GetHostByAddrCmd::GetHostByAddrCmd(const NetworkController* controller,
+                                                     ThreadPool* pool) :
         NetdCommand("gethostbyaddr"),
-        mNetCtrl(controller) {
+        mNetCtrl(controller),
+        mPool(pool) {
 }
 
 int DnsProxyListener::GetHostByAddrCmd::runCommand(SocketClient *cli,
@@ -361,15 +533,14 @@ int DnsProxyListener::GetHostByAddrCmd::runCommand(SocketClient *cli,
     uid_t uid = cli->getUid();
     unsigned netId = strtoul(argv[4], NULL, 10);
 
-    void* addr = malloc(sizeof(struct in6_addr));
+    struct in6_addr addr;
     errno = 0;
-    int result = inet_pton(addrFamily, addrStr, addr);
+    int result = inet_pton(addrFamily, addrStr, &addr);
     if (result <= 0) {
         char* msg = NULL;
         asprintf(&msg, "inet_pton(\"%s\") failed %s", addrStr, strerror(errno));
         ALOGW("%s", msg);
         cli->sendMsg(ResponseCode::OperationFailed, msg, false);
-        free(addr);
         free(msg);
         return -1;
     }
@@ -378,43 +549,44 @@ int DnsProxyListener::GetHostByAddrCmd::runCommand(SocketClient *cli,
 
     cli->incRef();
     DnsProxyListener::GetHostByAddrHandler* handler =
-            new DnsProxyListener::GetHostByAddrHandler(cli, addr, addrLen, addrFamily, netId);
-    handler->start();
+            new DnsProxyListener::GetHostByAddrHandler(cli, &addr, addrLen, addrFamily, netId);
+    if (!mPool->enqueue(handler, uid)) {
+        // Too many lookups pending; fail fast rather than adding to the backlog.
+        cli->sendBinaryMsg(ResponseCode::DnsProxyOperationFailed, NULL, 0);
+        cli->decRef();
+        delete handler;
+    }
 
     return 0;
 }
 
+Slab DnsProxyListener::GetHostByAddrHandler::sSlab("GetHostByAddrHandler",
+        sizeof(DnsProxyListener::GetHostByAddrHandler), MAX_FREE_HANDLERS);
+
+void *DnsProxyListener::GetHostByAddrHandler::operator new(size_t size) {
+    return size == sSlab.blockSize() ? sSlab.alloc() : malloc(size);
+}
+
+void DnsProxyListener::GetHostByAddrHandler::operator delete(void *p, size_t size) {
+    if (size == sSlab.blockSize()) {
+        sSlab.free(p);
+    } else {
+        free(p);
+    }
+}
+
 DnsProxyListener::GetHostByAddrHandler::GetHostByAddrHandler(SocketClient* c,
-                                                             void* address,
+                                                             const struct in6_addr* address,
                                                              int   addressLen,
                                                              int   addressFamily,
                                                              unsigned netId)
         : mClient(c),
-          mAddress(address),
+          mAddress(*address),
           mAddressLen(addressLen),
           mAddressFamily(addressFamily),
           mNetId(netId) {
 }
 
-DnsProxyListener::GetHostByAddrHandler::~GetHostByAddrHandler() {
-    free(mAddress);
-}
-
-void DnsProxyListener::GetHostByAddrHandler::start() {
-    pthread_t thread;
-    pthread_create(&thread, NULL,
-                   DnsProxyListener::GetHostByAddrHandler::threadStart, this);
-    pthread_detach(thread);
-}
-
-void* DnsProxyListener::GetHostByAddrHandler::threadStart(void* obj) {
-    GetHostByAddrHandler* handler = reinterpret_cast<GetHostByAddrHandler*>(obj);
-    handler->run();
-    delete handler;
-    pthread_exit(NULL);
-    return NULL;
-}
-
 void DnsProxyListener::GetHostByAddrHandler::run() {
     if (DBG) {
         ALOGD("DnsProxyListener::GetHostByAddrHandler::run\n");
@@ -422,7 +594,10 @@ void DnsProxyListener::GetHostByAddrHandler::run() {
     struct hostent* hp;
 
     // NOTE gethostbyaddr should take a void* but bionic thinks it should be char*
-    hp = android_gethostbyaddrfornet((char*)mAddress, mAddressLen, mAddressFamily, mNetId, 0);
+    int64_t start = LatencyStats::now();
+    hp = android_gethostbyaddrfornet((char*)&mAddress, mAddressLen, mAddressFamily, mNetId, 0);
+    sGetHostByAddrStats.record(start, hp == NULL);
+    DnsStats::Instance()->recordLookup(mNetId, start, hp == NULL);
 
     if (DBG) {
         ALOGD("GetHostByAddrHandler::run gethostbyaddr errno: %s hp->h_name = %s, name_len = %zu\n",
@@ -433,8 +608,7 @@ void DnsProxyListener::GetHostByAddrHandler::run() {
 
     bool success = true;
     if (hp) {
-        success = mClient->sendCode(ResponseCode::DnsProxyQueryResult) == 0;
-        success &= sendhostent(mClient, hp);
+        success = sendhostent(mClient, hp);
     } else {
         success = mClient->sendBinaryMsg(ResponseCode::DnsProxyOperationFailed, NULL, 0) == 0;
     }
@@ -17,72 +17,121 @@
 #ifndef _DNSPROXYLISTENER_H__
 #define _DNSPROXYLISTENER_H__
 
+#include <netdb.h>
+#include <netinet/in.h>
+
+#include <string>
+
 #include <sysutils/FrameworkListener.h>
 
+#include "AsyncResolver.h"
 #include "NetdCommand.h"
 #include "NetworkController.h"
+#include "Slab.h"
+#include "ThreadPool.h"
 
 class DnsProxyListener : public FrameworkListener {
 public:
     DnsProxyListener(const NetworkController* controller);
     virtual ~DnsProxyListener() {}
 
+    /*
+     * Worker pool running the lookups, shared fairly between uids; sized by
+     * ro.netd.dnsproxy.{threads,queue,uid_threads}.
+     */
+    ThreadPool *getThreadPool() { return mPool; }
+
 private:
+    // Request strings up to this long are kept in the handler rather than on the heap.
+    static const size_t INLINE_NAME_SIZE = 256;
+    static const size_t INLINE_SERVICE_SIZE = 32;
+
+    static char *copyArg(const char *arg, char *buf, size_t size);
+    static void freeArg(char *arg, const char *buf);
+
     const NetworkController *mNetCtrl;
+    ThreadPool *mPool;
+
     class GetAddrInfoCmd : public NetdCommand {
     public:
-        GetAddrInfoCmd(const NetworkController* controller);
+        GetAddrInfoCmd(const NetworkController* controller, ThreadPool* pool);
         virtual ~GetAddrInfoCmd() {}
         int runCommand(SocketClient *c, int argc, char** argv);
     private:
         const NetworkController* mNetCtrl;
+        ThreadPool* mPool;
     };
 
-    class GetAddrInfoHandler {
+    class GetAddrInfoHandler : public ThreadPool::Task, public AsyncResolver::Callback {
     public:
-        // Note: All of host, service, and hints may be NULL
+        // Note: All of host, service, and hints may be NULL; they are copied.
+        // key is the lookup's entry in sInFlightLookups, which the caller has joined as leader.
         GetAddrInfoHandler(SocketClient *c,
-                           char* host,
-                           char* service,
-                           struct addrinfo* hints,
-                           unsigned netId);
-        ~GetAddrInfoHandler();
+                           const char* host,
+                           const char* service,
+                           const struct addrinfo* hints,
+                           unsigned netId,
+                           const std::string &key,
+                           ThreadPool* pool);
+        virtual ~GetAddrInfoHandler();
+
+        // Handlers are recycled through sSlab.
+        static void *operator new(size_t size);
+        static void operator delete(void *p, size_t size);
 
-        static void* threadStart(void* handler);
+        /* Hands the lookup to AsyncResolver if it takes it, else to the pool; owns this. */
         void start();
 
+        virtual void run();
+        virtual void onResult(int rv, const struct addrinfo *result);
+        virtual void onFallback();
+
     private:
-        void run();
+        void enqueue();
+        void respond(uint32_t rv, const struct addrinfo *result);
+
+        static Slab sSlab;
+
         SocketClient* mClient;  // ref counted
-        char* mHost;    // owned
-        char* mService; // owned
-        struct addrinfo* mHints;  // owned
+        char* mHost;    // mHostBuf, or owned
+        char* mService; // mServiceBuf, or owned
+        struct addrinfo* mHints;  // &mHintsBuf or NULL
+        char mHostBuf[INLINE_NAME_SIZE];
+        char mServiceBuf[INLINE_SERVICE_SIZE];
+        struct addrinfo mHintsBuf;
         unsigned mNetId;
+        ThreadPool* mPool;
+        std::string mKey;   // in sInFlightLookups until respond()
+        int64_t mStart;
     };
 
     /* ------ gethostbyname ------*/
     class GetHostByNameCmd : public NetdCommand {
     public:
-        GetHostByNameCmd(const NetworkController* controller);
+        GetHostByNameCmd(const NetworkController* controller, ThreadPool* pool);
         virtual ~GetHostByNameCmd() {}
         int runCommand(SocketClient *c, int argc, char** argv);
     private:
         const NetworkController* mNetCtrl;
+        ThreadPool* mPool;
     };
 
-    class GetHostByNameHandler {
+    class GetHostByNameHandler : public ThreadPool::Task {
     public:
         GetHostByNameHandler(SocketClient *c,
-                            char *name,
+                            const char *name,
                             int af,
                             unsigned netId);
-        ~GetHostByNameHandler();
-        static void* threadStart(void* handler);
-        void start();
+        virtual ~GetHostByNameHandler();
+        static void *operator new(size_t size);
+        static void operator delete(void *p, size_t size);
+        virtual void run();
     private:
-        void run();
+        static Slab sSlab;
+
         SocketClient* mClient; //ref counted
-        char* mName; // owned
+        char* mName; // mNameBuf, or owned
+        char mNameBuf[INLINE_NAME_SIZE];
         int mAf;
         unsigned mNetId;
     };
@@ -90,29 +139,32 @@ private:
     /* ------ gethostbyaddr ------*/
     class GetHostByAddrCmd : public NetdCommand {
     public:
-        GetHostByAddrCmd(const NetworkController* controller);
+        GetHostByAddrCmd(const NetworkController* controller, ThreadPool* pool);
         virtual ~GetHostByAddrCmd() {}
         int runCommand(SocketClient *c, int argc, char** argv);
     private:
         const NetworkController* mNetCtrl;
+        ThreadPool* mPool;
     };
 
-    class GetHostByAddrHandler {
+    class GetHostByAddrHandler : public ThreadPool::Task {
     public:
         GetHostByAddrHandler(SocketClient *c,
-                            void* address,
+                            const struct in6_addr* address,
                             int addressLen,
                             int addressFamily,
                             unsigned netId);
-        ~GetHostByAddrHandler();
+        virtual ~GetHostByAddrHandler() {}
+        static void *operator new(size_t size);
+        static void operator delete(void *p, size_t size);
 
-        static void* threadStart(void* handler);
-        void start();
+        virtual void run();
 
     private:
-        void run();
+        static Slab sSlab;
+
         SocketClient* mClient;  // ref counted
-        void* mAddress;    // address to lookup; owned
+        struct in6_addr mAddress;    // address to lookup
         int mAddressLen; // length of address to look up
         int mAddressFamily;  // address family
         unsigned mNetId;
@@ -0,0 +1,147 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <netdb.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LOG_TAG "DnsResponse"
+
+#include <cutils/log.h>
+
+#include "DnsResponse.h"
+#include "ResponseCode.h"
+#include "Slab.h"
+
+static const int CODE_SIZE = 4;
+static const int LEN_SIZE = 4;
+static const int HOSTENT_ADDR_SIZE = 16;
+
+// Holds the answers of all but the largest lookups; about one per DNS worker is kept.
+static const size_t BUFFER_BLOCK_SIZE = 1024;
+static const size_t MAX_FREE_BUFFERS = 16;
+
+static Slab sBufferSlab("ResponseBuffer", BUFFER_BLOCK_SIZE, MAX_FREE_BUFFERS);
+
+ResponseBuffer::ResponseBuffer(size_t size)
+        : mData(NULL), mSize(0), mCapacity(0), mFromSlab(false), mFailed(false) {
+    if (size <= BUFFER_BLOCK_SIZE) {
+        mData = static_cast<char *>(sBufferSlab.alloc());
+        mFromSlab = true;
+    } else {
+        mData = static_cast<char *>(malloc(size));
+    }
+    if (mData) {
+        mCapacity = mFromSlab ? BUFFER_BLOCK_SIZE : size;
+    }
+}
+
+ResponseBuffer::~ResponseBuffer() {
+    release();
+}
+
+void ResponseBuffer::release() {
+    if (mFromSlab) {
+        sBufferSlab.free(mData);
+    } else {
+        free(mData);
+    }
+}
+
+void ResponseBuffer::append(const void *data, size_t len) {
+    if (mFailed) {
+        return;
+    }
+    if (mSize + len > mCapacity) {
+        // The sizes callers pass are exact, so this is rare.
+        size_t capacity = mCapacity * 2 > mSize + len ? mCapacity * 2 : mSize + len;
+        char *grown = static_cast<char *>(malloc(capacity));
+        if (!grown) {
+            ALOGE("Unable to grow a DNS response to %zu bytes", capacity);
+            mFailed = true;
+            return;
+        }
+        if (mSize) {
+            memcpy(grown, mData, mSize);
+        }
+        release();
+        mData = grown;
+        mCapacity = capacity;
+        mFromSlab = false;
+    }
+    memcpy(mData + mSize, data, len);
+    mSize += len;
+}
+
+size_t hostentResponseSize(const struct hostent *hp) {
+    size_t size = CODE_SIZE + LEN_SIZE + (hp->h_name ? strlen(hp->h_name) + 1 : 0);
+    for (int i = 0; hp->h_aliases[i] != NULL; i++) {
+        size += LEN_SIZE + strlen(hp->h_aliases[i]) + 1;
+    }
+    size += LEN_SIZE + 2 * sizeof(uint32_t);
+    for (int i = 0; hp->h_addr_list[i] != NULL; i++) {
+        size += LEN_SIZE + HOSTENT_ADDR_SIZE;
+    }
+    return size + LEN_SIZE;
+}
+
+void appendhostent(ResponseBuffer &buf, const struct hostent *hp) {
+    int i;
+    if (hp->h_name != NULL) {
+        buf.appendLenAndData(strlen(hp->h_name)+1, hp->h_name);
+    } else {
+        buf.appendLenAndData(0, "");
+    }
+
+    for (i=0; hp->h_aliases[i] != NULL; i++) {
+        buf.appendLenAndData(strlen(hp->h_aliases[i])+1, hp->h_aliases[i]);
+    }
+    buf.appendLenAndData(0, ""); // null to indicate we're done
+
+    buf.appendInt(hp->h_addrtype);
+    buf.appendInt(hp->h_length);
+
+    for (i=0; hp->h_addr_list[i] != NULL; i++) {
+        buf.appendLenAndData(HOSTENT_ADDR_SIZE, hp->h_addr_list[i]);
+    }
+    buf.appendLenAndData(0, ""); // null to indicate we're done
+}
+
+bool sendhostent(SocketClient *c, const struct hostent *hp) {
+    ResponseBuffer buf(hostentResponseSize(hp));
+    buf.appendCode(ResponseCode::DnsProxyQueryResult);
+    appendhostent(buf, hp);
+    return buf.send(c);
+}
+
+size_t addrInfoResponseSize(const struct addrinfo *result) {
+    size_t size = CODE_SIZE;
+    for (const struct addrinfo* ai = result; ai; ai = ai->ai_next) {
+        size += LEN_SIZE + sizeof(struct addrinfo) + LEN_SIZE + ai->ai_addrlen + LEN_SIZE +
+                (ai->ai_canonname ? strlen(ai->ai_canonname) + 1 : 0);
+    }
+    return size + LEN_SIZE;
+}
+
+void appendAddrInfo(ResponseBuffer &buf, const struct addrinfo *result) {
+    for (const struct addrinfo* ai = result; ai; ai = ai->ai_next) {
+        buf.appendLenAndData(sizeof(struct addrinfo), ai);
+        buf.appendLenAndData(ai->ai_addrlen, ai->ai_addr);
+        buf.appendLenAndData(ai->ai_canonname ? strlen(ai->ai_canonname) + 1 : 0,
+                             ai->ai_canonname);
+    }
+    buf.appendLenAndData(0, "");
+}
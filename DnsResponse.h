@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _DNS_RESPONSE_H
+#define _DNS_RESPONSE_H
+
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <sysutils/SocketClient.h>
+
+struct addrinfo;
+struct hostent;
+
+/*
+ * A complete response, built before anything is written so that it reaches the client
+ * with a single sendData() rather than one or two writes per field.
+ * The bytes are the same as those of the former field by field writes.
+ * Buffers of the usual sizes come from a Slab rather than the heap.
+ */
+class ResponseBuffer {
+public:
+    ResponseBuffer(size_t size);
+    ~ResponseBuffer();
+
+    // Same bytes as SocketClient::sendCode(): the 3 digit code and a NUL.
+    void appendCode(int code) {
+        char buf[4];
+        snprintf(buf, sizeof(buf), "%.3d", code);
+        append(buf, sizeof(buf));
+    }
+
+    void appendInt(uint32_t value) {
+        uint32_t value_be = htonl(value);
+        append(&value_be, sizeof(value_be));
+    }
+
+    // 4 bytes of big-endian length, followed by the data.
+    void appendLenAndData(int len, const void* data) {
+        appendInt(len);
+        if (len) {
+            append(data, len);
+        }
+    }
+
+    size_t size() const { return mSize; }
+
+    // Returns true on success
+    bool send(SocketClient *c) const {
+        return !mFailed && c->sendData(mData, mSize) == 0;
+    }
+
+private:
+    ResponseBuffer(const ResponseBuffer &);
+    ResponseBuffer &operator=(const ResponseBuffer &);
+
+    void append(const void *data, size_t len);
+    void release();
+
+    char *mData;
+    size_t mSize;
+    size_t mCapacity;
+    bool mFromSlab;
+    bool mFailed;   // out of memory, some data is missing
+};
+
+/* The exact size of a gethostbyname()/gethostbyaddr() response, code included. */
+size_t hostentResponseSize(const struct hostent *hp);
+void appendhostent(ResponseBuffer &buf, const struct hostent *hp);
+// Returns true on success
+bool sendhostent(SocketClient *c, const struct hostent *hp);
+
+/* The exact size of a getaddrinfo() response, code included. */
+size_t addrInfoResponseSize(const struct addrinfo *result);
+void appendAddrInfo(ResponseBuffer &buf, const struct addrinfo *result);
+
+#endif
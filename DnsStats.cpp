@@ -0,0 +1,159 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define __STDC_FORMAT_MACROS 1
+
+#include <inttypes.h>
+#include <stdio.h>
+
+#define LOG_TAG "DnsStats"
+
+#include <cutils/log.h>
+#include <sysutils/SocketClient.h>
+
+#include "DnsStats.h"
+#include "ResponseCode.h"
+
+DnsStats *DnsStats::sInstance = NULL;
+
+DnsStats *DnsStats::Instance() {
+    if (!sInstance) {
+        sInstance = new DnsStats();
+    }
+    return sInstance;
+}
+
+DnsStats::DnsStats() {
+    pthread_mutex_init(&mLock, NULL);
+}
+
+DnsStats::Histogram::Histogram() : count(0), totalUs(0), maxUs(0) {
+    for (int i = 0; i < LatencyStats::NUM_BUCKETS; i++) {
+        buckets[i] = 0;
+    }
+}
+
+void DnsStats::Histogram::add(int64_t us) {
+    count++;
+    totalUs += us;
+    if (us > maxUs) {
+        maxUs = us;
+    }
+    buckets[LatencyStats::bucketFor(us)]++;
+}
+
+/* The same fields as a "stats dump" line. */
+int DnsStats::Histogram::format(char *buf, size_t size) const {
+    int len = snprintf(buf, size, "total_us=%" PRId64 " max_us=%" PRId64 " hist_ms=",
+                       totalUs, maxUs);
+    for (int i = 0; i < LatencyStats::NUM_BUCKETS && len > 0 && len < (int) size; i++) {
+        len += snprintf(buf + len, size - len, "%s%u", i ? "," : "", buckets[i]);
+    }
+    return len;
+}
+
+void DnsStats::setServers(unsigned netId, const char **servers, int numServers) {
+    pthread_mutex_lock(&mLock);
+    std::vector<ServerStats> &stats = mNets[netId].servers;
+    stats.clear();
+    stats.resize(numServers);
+    for (int i = 0; i < numServers; i++) {
+        stats[i].addr = servers[i];
+    }
+    pthread_mutex_unlock(&mLock);
+}
+
+void DnsStats::recordLookup(unsigned netId, int64_t startUs, bool failed) {
+    int64_t us = LatencyStats::now() - startUs;
+    pthread_mutex_lock(&mLock);
+    NetStats &stats = mNets[netId];
+    stats.lookups.add(us);
+    if (failed) {
+        stats.errors++;
+    }
+    pthread_mutex_unlock(&mLock);
+}
+
+void DnsStats::recordCoalesced(unsigned netId) {
+    pthread_mutex_lock(&mLock);
+    mNets[netId].coalesced++;
+    pthread_mutex_unlock(&mLock);
+}
+
+void DnsStats::recordCache(unsigned netId, bool hit) {
+    pthread_mutex_lock(&mLock);
+    NetStats &stats = mNets[netId];
+    if (hit) {
+        stats.cacheHits++;
+    } else {
+        stats.cacheMisses++;
+    }
+    pthread_mutex_unlock(&mLock);
+}
+
+void DnsStats::recordServer(unsigned netId, int server, int64_t latencyUs, Outcome outcome) {
+    pthread_mutex_lock(&mLock);
+    std::vector<ServerStats> &servers = mNets[netId].servers;
+    // The servers may have been replaced while the query was out; it's theirs no longer.
+    if (server >= 0 && server < (int) servers.size()) {
+        ServerStats &stats = servers[server];
+        switch (outcome) {
+        case ANSWERED:
+            stats.latency.add(latencyUs);
+            break;
+        case SERVFAIL:
+            stats.latency.add(latencyUs);
+            stats.servfails++;
+            break;
+        case TIMEOUT:
+            stats.timeouts++;
+            break;
+        case ERROR:
+            stats.errors++;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&mLock);
+}
+
+void DnsStats::dump(SocketClient *cli, unsigned netId) {
+    pthread_mutex_lock(&mLock);
+    std::map<unsigned, NetStats>::const_iterator it = mNets.find(netId);
+    if (it != mNets.end()) {
+        const NetStats &stats = it->second;
+        char msg[384];
+        int len = snprintf(msg, sizeof(msg), "%u lookups=%u errors=%u coalesced=%u "
+                           "cache_hits=%u cache_misses=%u ", netId, stats.lookups.count,
+                           stats.errors, stats.coalesced, stats.cacheHits, stats.cacheMisses);
+        if (len > 0 && len < (int) sizeof(msg)) {
+            stats.lookups.format(msg + len, sizeof(msg) - len);
+        }
+        cli->sendMsg(ResponseCode::ResolverStatsResult, msg, false);
+
+        for (size_t i = 0; i < stats.servers.size(); i++) {
+            const ServerStats &server = stats.servers[i];
+            len = snprintf(msg, sizeof(msg), "%u server=%s answers=%u servfails=%u "
+                           "timeouts=%u errors=%u ", netId, server.addr.c_str(),
+                           server.latency.count, server.servfails, server.timeouts,
+                           server.errors);
+            if (len > 0 && len < (int) sizeof(msg)) {
+                server.latency.format(msg + len, sizeof(msg) - len);
+            }
+            cli->sendMsg(ResponseCode::ResolverStatsResult, msg, false);
+        }
+    }
+    pthread_mutex_unlock(&mLock);
+}
@@ -0,0 +1,100 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _DNS_STATS_H
+#define _DNS_STATS_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "LatencyStats.h"
+
+class SocketClient;
+
+/*
+ * Per-network resolver telemetry for "resolver getstats <netId>": how long dnsproxyd
+ * lookups take, and, for the queries AsyncResolver sends itself, how each of the
+ * network's servers answers. The blocking resolver doesn't say which server answered
+ * or how, so a network whose lookups all go through bionic only has lookup totals.
+ */
+class DnsStats {
+public:
+    enum Outcome {
+        ANSWERED,   // any answer, NXDOMAIN included
+        SERVFAIL,   // any other error rcode
+        TIMEOUT,
+        ERROR       // socket error or malformed answer
+    };
+
+    static DnsStats *Instance();
+
+    /* The servers of netId as ResolverController applies them; resets their counters. */
+    void setServers(unsigned netId, const char **servers, int numServers);
+
+    /* A dnsproxyd lookup that started at startUs (from LatencyStats::now()). */
+    void recordLookup(unsigned netId, int64_t startUs, bool failed);
+    /* A lookup answered by joining a matching lookup in progress. */
+    void recordCoalesced(unsigned netId);
+    void recordCache(unsigned netId, bool hit);
+    /* One query to servers[server] of netId that took latencyUs. */
+    void recordServer(unsigned netId, int server, int64_t latencyUs, Outcome outcome);
+
+    /* Sends ResolverStatsResult lines for netId: the totals, then one per server. */
+    void dump(SocketClient *cli, unsigned netId);
+
+private:
+    struct Histogram {
+        uint32_t count;
+        int64_t totalUs;
+        int64_t maxUs;
+        uint32_t buckets[LatencyStats::NUM_BUCKETS];
+        Histogram();
+        void add(int64_t us);
+        int format(char *buf, size_t size) const;
+    };
+
+    struct ServerStats {
+        std::string addr;
+        Histogram latency;  // of the queries answered, SERVFAIL included
+        uint32_t servfails;
+        uint32_t timeouts;
+        uint32_t errors;
+        ServerStats() : servfails(0), timeouts(0), errors(0) {}
+    };
+
+    struct NetStats {
+        Histogram lookups;
+        uint32_t errors;
+        uint32_t coalesced;
+        uint32_t cacheHits;
+        uint32_t cacheMisses;
+        std::vector<ServerStats> servers;
+        NetStats() : errors(0), coalesced(0), cacheHits(0), cacheMisses(0) {}
+    };
+
+    DnsStats();
+
+    static DnsStats *sInstance;
+
+    pthread_mutex_t mLock;
+    std::map<unsigned, NetStats> mNets;
+};
+
+#endif
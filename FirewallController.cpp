@@ -26,41 +26,91 @@
 
 #include "NetdConstants.h"
 #include "FirewallController.h"
+#include "IptablesTransaction.h"
 
 const char* FirewallController::LOCAL_INPUT = "fw_INPUT";
 const char* FirewallController::LOCAL_OUTPUT = "fw_OUTPUT";
 const char* FirewallController::LOCAL_FORWARD = "fw_FORWARD";
 
-FirewallController::FirewallController(void) {
+FirewallController::FirewallController(void)
+        : mInputUids("fw_INPUT_uid"), mOutputUids("fw_OUTPUT_uid"), mEnabled(false) {
 }
 
-int FirewallController::setupIptablesHooks(void) {
+int FirewallController::setupIptablesHooks(IptablesTransaction &bootstrap,
+                                           const std::string *savedRules) {
+    mInputUids.adopt(savedRules);
+    mOutputUids.adopt(savedRules);
+    mAllowedUids.clear();
+    mEnabled = false;
+    addUidTrees(bootstrap, mAllowedUids, true);
     return 0;
 }
 
+/*
+ * The uid trees are reached with --goto and end with the same DROP/REJECT as the chains
+ * that jump to them, so the jumps must stay the last rules before those: the other
+ * rules are all inserted at the top.
+ */
+void FirewallController::addUidTrees(IptablesTransaction &t, const std::set<int> &uids,
+                                     bool link) {
+    mInputUids.build(t, uids, "RETURN", mEnabled ? "-j DROP" : NULL);
+    mOutputUids.build(t, uids, "RETURN", mEnabled ? "-j REJECT" : NULL);
+    if (link) {
+        t.add(V4V6, "-A", LOCAL_INPUT, "-g", mInputUids.root(), NULL);
+        t.add(V4V6, "-A", LOCAL_OUTPUT, "-g", mOutputUids.root(), NULL);
+    }
+}
+
 int FirewallController::enableFirewall(void) {
-    int res = 0;
+    IptablesTransaction t;
 
     // flush any existing rules
-    disableFirewall();
+    flushRules(t);
+    bool wasEnabled = mEnabled;
+    mEnabled = true;
+    addUidTrees(t, std::set<int>(), true);
 
     // create default rule to drop all traffic
-    res |= execIptables(V4V6, "-A", LOCAL_INPUT, "-j", "DROP", NULL);
-    res |= execIptables(V4V6, "-A", LOCAL_OUTPUT, "-j", "REJECT", NULL);
-    res |= execIptables(V4V6, "-A", LOCAL_FORWARD, "-j", "REJECT", NULL);
+    t.add(V4V6, "-A", LOCAL_INPUT, "-j", "DROP", NULL);
+    t.add(V4V6, "-A", LOCAL_OUTPUT, "-j", "REJECT", NULL);
+    t.add(V4V6, "-A", LOCAL_FORWARD, "-j", "REJECT", NULL);
 
-    return res;
+    return commitFlush(t, wasEnabled);
 }
 
 int FirewallController::disableFirewall(void) {
-    int res = 0;
+    IptablesTransaction t;
 
     // flush any existing rules
-    res |= execIptables(V4V6, "-F", LOCAL_INPUT, NULL);
-    res |= execIptables(V4V6, "-F", LOCAL_OUTPUT, NULL);
-    res |= execIptables(V4V6, "-F", LOCAL_FORWARD, NULL);
+    flushRules(t);
+    bool wasEnabled = mEnabled;
+    mEnabled = false;
+    addUidTrees(t, std::set<int>(), true);
 
-    return res;
+    return commitFlush(t, wasEnabled);
+}
+
+/*
+ * Commits a transaction that flushed the rules and rebuilt the uid trees empty. The
+ * allowed uids are only forgotten once that is in the kernel, so a failed commit leaves
+ * them to diff later changes against.
+ */
+int FirewallController::commitFlush(IptablesTransaction &t, bool wasEnabled) {
+    int res = t.commit();
+    if (res) {
+        mEnabled = wasEnabled;
+        return res;
+    }
+    mAllowedUids.clear();
+    mInputUids.committed();
+    mOutputUids.committed();
+    return 0;
+}
+
+void FirewallController::flushRules(IptablesTransaction &t) {
+    t.add(V4V6, "-F", LOCAL_INPUT, NULL);
+    t.add(V4V6, "-F", LOCAL_OUTPUT, NULL);
+    t.add(V4V6, "-F", LOCAL_FORWARD, NULL);
 }
 
 int FirewallController::isFirewallEnabled(void) {
@@ -130,20 +180,35 @@ int FirewallController::setEgressDestRule(const char* addr, int protocol, int po
 }
 
 int FirewallController::setUidRule(int uid, FirewallRule rule) {
-    char uidStr[16];
-    sprintf(uidStr, "%d", uid);
-
-    const char* op;
+    std::set<int> uids = mAllowedUids;
     if (rule == ALLOW) {
-        op = "-I";
-    } else {
-        op = "-D";
+        if (!uids.insert(uid).second) {
+            return 0;
+        }
+    } else if (!uids.erase(uid)) {
+        ALOGE("No ALLOW rule for uid %d", uid);
+        return -1;
     }
+    return commitUidRules(uids);
+}
 
-    int res = 0;
-    res |= execIptables(V4V6, op, LOCAL_INPUT, "-m", "owner", "--uid-owner", uidStr,
-            "-j", "RETURN", NULL);
-    res |= execIptables(V4V6, op, LOCAL_OUTPUT, "-m", "owner", "--uid-owner", uidStr,
-            "-j", "RETURN", NULL);
+int FirewallController::commitUidRules(const std::set<int> &uids) {
+    IptablesTransaction t;
+    addUidTrees(t, uids, false);
+
+    int res = t.commit();
+    if (!res) {
+        mAllowedUids = uids;
+        mInputUids.committed();
+        mOutputUids.committed();
+    }
     return res;
 }
+
+int FirewallController::replaceUidRules(const std::vector<int> &allowedUids) {
+    std::set<int> newUids(allowedUids.begin(), allowedUids.end());
+    if (newUids == mAllowedUids) {
+        return 0;
+    }
+    return commitUidRules(newUids);
+}
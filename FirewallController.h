@@ -17,13 +17,19 @@
 #ifndef _FIREWALL_CONTROLLER_H
 #define _FIREWALL_CONTROLLER_H
 
+#include <set>
 #include <string>
+#include <vector>
+
+#include "UidChainTree.h"
 
 enum FirewallRule { ALLOW, DENY };
 
 #define PROTOCOL_TCP 6
 #define PROTOCOL_UDP 17
 
+class IptablesTransaction;
+
 /*
  * Simple firewall that drops all packets except those matching explicitly
  * defined ALLOW rules.
@@ -32,7 +38,11 @@ class FirewallController {
 public:
     FirewallController();
 
-    int setupIptablesHooks(void);
+    /*
+     * Queues the uid chains, into the just created fw_INPUT and fw_OUTPUT. savedRules
+     * are the current iptables-save dumps, indexed by V4/V6.
+     */
+    int setupIptablesHooks(IptablesTransaction &bootstrap, const std::string *savedRules);
 
     int enableFirewall(void);
     int disableFirewall(void);
@@ -46,11 +56,31 @@ public:
     int setEgressDestRule(const char*, int, int, FirewallRule);
     /* Match traffic owned by given UID. */
     int setUidRule(int, FirewallRule);
+    /*
+     * Allows exactly the given UIDs and denies every other one, in a single batch.
+     */
+    int replaceUidRules(const std::vector<int> &allowedUids);
 
     static const char* LOCAL_INPUT;
     static const char* LOCAL_OUTPUT;
     static const char* LOCAL_FORWARD;
 
+private:
+    void flushRules(IptablesTransaction &t);
+    /* Commits t, which flushed the rules; wasEnabled is mEnabled from before. */
+    int commitFlush(IptablesTransaction &t, bool wasEnabled);
+    /* Queues the uid trees for uids, and the jumps to them at the end of the chains. */
+    void addUidTrees(IptablesTransaction &t, const std::set<int> &uids, bool link);
+    /* Replaces the ALLOW rules with uids. */
+    int commitUidRules(const std::set<int> &uids);
+
+    /* UIDs that currently have ALLOW rules. */
+    std::set<int> mAllowedUids;
+    /* The uid rules, each a tree jumped to from the end of fw_INPUT and fw_OUTPUT. */
+    UidChainTree mInputUids;
+    UidChainTree mOutputUids;
+    /* Whether the DROP/REJECT rules are in, which the uid trees end with too. */
+    bool mEnabled;
 };
 
 #endif
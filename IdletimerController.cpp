@@ -90,8 +90,9 @@
  * is correct. The benefit of this, is that idletimers can be setup on
  * interfaces than come and go.
  *
- * A remove should be called for each add command issued during cleanup, as duplicate
- * entries of the rule may exist and will all have to removed.
+ * A remove should be called for each add command issued during cleanup. Repeated adds
+ * of the same rule are counted instead of installed again, and the rule only goes away
+ * with the last remove.
  *
  */
 
@@ -108,9 +109,9 @@
 
 #define LOG_TAG "IdletimerController"
 #include <cutils/log.h>
-#include <logwrap/logwrap.h>
 
 #include "IdletimerController.h"
+#include "IptablesTransaction.h"
 #include "NetdConstants.h"
 
 const char* IdletimerController::LOCAL_RAW_PREROUTING = "idletimer_raw_PREROUTING";
@@ -121,13 +122,14 @@ IdletimerController::IdletimerController() {
 
 IdletimerController::~IdletimerController() {
 }
-/* return 0 or non-zero */
-int IdletimerController::runIpxtablesCmd(int argc, const char **argv) {
-    int res;
-
-    res = android_fork_execvp(argc, (char **)argv, NULL, false, false);
-    ALOGV("runCmd() res=%d", res);
-    return res;
+bool IdletimerController::Entry::operator<(const Entry &other) const {
+    if (iface != other.iface) {
+        return iface < other.iface;
+    }
+    if (timeout != other.timeout) {
+        return timeout < other.timeout;
+    }
+    return label < other.label;
 }
 
 bool IdletimerController::setupIptablesHooks() {
@@ -135,29 +137,14 @@ bool IdletimerController::setupIptablesHooks() {
 }
 
 int IdletimerController::setDefaults() {
-  int res;
-  const char *cmd1[] = {
-      IPTABLES_PATH,
-      "-t",
-      "raw",
-      "-F",
-      LOCAL_RAW_PREROUTING
-  };
-  res = runIpxtablesCmd(ARRAY_SIZE(cmd1), cmd1);
-
-  if (res)
+    IptablesTransaction t;
+    t.add(V4, "-t", "raw", "-F", LOCAL_RAW_PREROUTING, NULL);
+    t.add(V4, "-t", "mangle", "-F", LOCAL_MANGLE_POSTROUTING, NULL);
+    int res = t.commit();
+    if (!res) {
+        mActive.clear();
+    }
     return res;
-
-  const char *cmd2[] = {
-      IPTABLES_PATH,
-      "-t",
-      "mangle",
-      "-F",
-      LOCAL_MANGLE_POSTROUTING
-  };
-  res = runIpxtablesCmd(ARRAY_SIZE(cmd2), cmd2);
-
-  return res;
 }
 
 int IdletimerController::enableIdletimerControl() {
@@ -170,55 +157,65 @@ int IdletimerController::disableIdletimerControl() {
     return res;
 }
 
+void IdletimerController::addRules(IptablesTransaction &t, IptOp op, const char *iface,
+                                   const char *timeout, const char *classLabel) {
+    const char *action = (op == IptOpAdd) ? "-A" : "-D";
+    t.add(V4, "-t", "raw", action, LOCAL_RAW_PREROUTING, "-i", iface, "-j", "IDLETIMER",
+          "--timeout", timeout, "--label", classLabel, "--send_nl_msg", "1", NULL);
+    t.add(V4, "-t", "mangle", action, LOCAL_MANGLE_POSTROUTING, "-o", iface, "-j", "IDLETIMER",
+          "--timeout", timeout, "--label", classLabel, "--send_nl_msg", "1", NULL);
+}
+
 int IdletimerController::modifyInterfaceIdletimer(IptOp op, const char *iface,
                                                   uint32_t timeout,
                                                   const char *classLabel) {
-  int res;
-  char timeout_str[11]; //enough to store any 32-bit unsigned decimal
+  Entry entry;
+  entry.iface = iface;
+  entry.timeout = timeout;
+  entry.label = classLabel;
+
+  std::map<Entry, int>::iterator it = mActive.find(entry);
+  if (op == IptOpAdd && it != mActive.end()) {
+    it->second++;
+    return 0;
+  }
+  if (op == IptOpDelete) {
+    if (it == mActive.end()) {
+      // Nothing installed, so "iptables -D" would only fail.
+      ALOGV("No idletimer for %s %u %s", iface, timeout, classLabel);
+      errno = ENOENT;
+      return -1;
+    }
+    if (--it->second > 0) {
+      return 0;
+    }
+  }
 
+  char timeout_str[11]; //enough to store any 32-bit unsigned decimal
   snprintf(timeout_str, sizeof(timeout_str), "%u", timeout);
 
-  const char *cmd1[] = {
-      IPTABLES_PATH,
-      "-t",
-      "raw",
-      (op == IptOpAdd) ? "-A" : "-D",
-      LOCAL_RAW_PREROUTING,
-      "-i",
-      iface,
-      "-j",
-      "IDLETIMER",
-      "--timeout",
-      timeout_str,
-      "--label",
-      classLabel,
-      "--send_nl_msg",
-      "1"
-  };
-  res = runIpxtablesCmd(ARRAY_SIZE(cmd1), cmd1);
-
-  if (res)
-    return res;
-
-  const char *cmd2[] = {
-      IPTABLES_PATH,
-      "-t",
-      "mangle",
-      (op == IptOpAdd) ? "-A" : "-D",
-      LOCAL_MANGLE_POSTROUTING,
-      "-o",
-      iface,
-      "-j",
-      "IDLETIMER",
-      "--timeout",
-      timeout_str,
-      "--label",
-      classLabel,
-      "--send_nl_msg",
-      "1"
-  };
-  res = runIpxtablesCmd(ARRAY_SIZE(cmd2), cmd2);
-
+  // Both rules in one iptables-restore run; raw is committed before mangle.
+  IptablesTransaction t;
+  addRules(t, op, iface, timeout_str, classLabel);
+  int res = t.commit();
+  if (res && !t.getResult(0)) {
+    // Only the raw rule went through: take it back out, or put it back.
+    IptablesTransaction undo;
+    undo.add(V4, "-t", "raw", (op == IptOpAdd) ? "-D" : "-A", LOCAL_RAW_PREROUTING,
+             "-i", iface, "-j", "IDLETIMER", "--timeout", timeout_str, "--label", classLabel,
+             "--send_nl_msg", "1", NULL);
+    undo.commit();
+  }
+
+  if (op == IptOpAdd) {
+    if (!res) {
+      mActive[entry] = 1;
+    }
+  } else if (res) {
+    it->second++;  // still installed
+  } else {
+    mActive.erase(it);
+  }
   return res;
 }
 
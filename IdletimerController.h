@@ -16,6 +16,13 @@
 #ifndef _IDLETIMER_CONTROLLER_H
 #define _IDLETIMER_CONTROLLER_H
 
+#include <stdint.h>
+
+#include <map>
+#include <string>
+
+class IptablesTransaction;
+
 class IdletimerController {
 public:
 
@@ -35,8 +42,24 @@ public:
 
  private:
     enum IptOp { IptOpAdd, IptOpDelete };
+
+    /* An installed pair of IDLETIMER rules. */
+    struct Entry {
+        std::string iface;
+        uint32_t timeout;
+        std::string label;
+        bool operator<(const Entry &other) const;
+    };
+
+    /*
+     * How many times each pair has been added and not yet removed. The kernel only has
+     * one copy; it is installed on the first add and taken out on the last remove.
+     */
+    std::map<Entry, int> mActive;
+
     int setDefaults();
-    int runIpxtablesCmd(int argc, const char **cmd);
+    void addRules(IptablesTransaction &t, IptOp op, const char *iface, const char *timeout,
+                  const char *classLabel);
     int modifyInterfaceIdletimer(IptOp op, const char *iface, uint32_t timeout,
                                  const char *classLabel);
 };
@@ -0,0 +1,285 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <arpa/inet.h>
+#include <linux/if.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <netinet/in.h>
+
+#define LOG_TAG "InterfaceCache"
+
+#include <cutils/log.h>
+#include <sysutils/SocketClient.h>
+
+#include "InterfaceCache.h"
+#include "ResponseCode.h"
+
+static const int DUMP_TIMEOUT_SEC = 5;
+
+/* The flags "interface getcfg" reports, under the same names. */
+static const struct {
+    unsigned flag;
+    const char *name;
+} FLAG_NAMES[] = {
+    { IFF_BROADCAST,   "broadcast" },
+    { IFF_LOOPBACK,    "loopback" },
+    { IFF_POINTOPOINT, "point-to-point" },
+    { IFF_RUNNING,     "running" },
+    { IFF_MULTICAST,   "multicast" },
+};
+
+InterfaceCache *InterfaceCache::sInstance = NULL;
+
+InterfaceCache *InterfaceCache::Instance() {
+    if (!sInstance)
+        sInstance = new InterfaceCache();
+    return sInstance;
+}
+
+InterfaceCache::InterfaceCache() : mValid(false), mAnswered(0), mDumps(0) {
+    pthread_mutex_init(&mLock, NULL);
+}
+
+void InterfaceCache::invalidate() {
+    pthread_mutex_lock(&mLock);
+    mValid = false;
+    pthread_mutex_unlock(&mLock);
+}
+
+void InterfaceCache::handleNotification(const struct nlmsghdr *nlh) {
+    switch (nlh->nlmsg_type) {
+    case RTM_NEWLINK:
+    case RTM_DELLINK:
+    case RTM_NEWADDR:
+    case RTM_DELADDR:
+        invalidate();
+        break;
+    }
+}
+
+void InterfaceCache::parseLinkLocked(const struct nlmsghdr *nlh) {
+    if (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(struct ifinfomsg))) {
+        return;
+    }
+    const struct ifinfomsg *ifi = reinterpret_cast<const struct ifinfomsg *>(NLMSG_DATA(nlh));
+    Link &link = mLinks[ifi->ifi_index];
+    link.flags = ifi->ifi_flags;
+    link.mtu = 0;
+    memset(link.hwaddr, 0, sizeof(link.hwaddr));
+
+    const struct rtattr *rta = IFLA_RTA(ifi);
+    int len = IFLA_PAYLOAD(nlh);
+    for (; RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+        switch (rta->rta_type) {
+        case IFLA_IFNAME:
+            link.name.assign(reinterpret_cast<const char *>(RTA_DATA(rta)),
+                             strnlen(reinterpret_cast<const char *>(RTA_DATA(rta)),
+                                     RTA_PAYLOAD(rta)));
+            break;
+        case IFLA_ADDRESS:
+            // Only Ethernet-like addresses fit; getcfg reports zeros for the others too.
+            if (RTA_PAYLOAD(rta) == sizeof(link.hwaddr)) {
+                memcpy(link.hwaddr, RTA_DATA(rta), sizeof(link.hwaddr));
+            }
+            break;
+        case IFLA_MTU:
+            if (RTA_PAYLOAD(rta) >= sizeof(link.mtu)) {
+                memcpy(&link.mtu, RTA_DATA(rta), sizeof(link.mtu));
+            }
+            break;
+        }
+    }
+    if (link.name.empty()) {
+        mLinks.erase(ifi->ifi_index);
+    }
+}
+
+void InterfaceCache::parseAddrLocked(const struct nlmsghdr *nlh) {
+    if (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(struct ifaddrmsg))) {
+        return;
+    }
+    const struct ifaddrmsg *ifa = reinterpret_cast<const struct ifaddrmsg *>(NLMSG_DATA(nlh));
+    std::map<int, Link>::iterator link = mLinks.find(ifa->ifa_index);
+    size_t addrLen = (ifa->ifa_family == AF_INET6) ? 16 : 4;
+    if (link == mLinks.end() || (ifa->ifa_family != AF_INET && ifa->ifa_family != AF_INET6)) {
+        return;
+    }
+
+    // IFA_ADDRESS is the peer on point-to-point IPv4 links; IFA_LOCAL is ours.
+    const void *addr = NULL;
+    const struct rtattr *rta = IFA_RTA(ifa);
+    int len = IFA_PAYLOAD(nlh);
+    for (; RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+        if (RTA_PAYLOAD(rta) < addrLen) {
+            continue;
+        }
+        if (rta->rta_type == IFA_LOCAL) {
+            addr = RTA_DATA(rta);
+        } else if (rta->rta_type == IFA_ADDRESS && !addr) {
+            addr = RTA_DATA(rta);
+        }
+    }
+    char addrStr[INET6_ADDRSTRLEN];
+    if (!addr || !inet_ntop(ifa->ifa_family, addr, addrStr, sizeof(addrStr))) {
+        return;
+    }
+    char entry[INET6_ADDRSTRLEN + 8];
+    snprintf(entry, sizeof(entry), "%s/%d", addrStr, ifa->ifa_prefixlen);
+    link->second.addrs.push_back(entry);
+}
+
+int InterfaceCache::dumpLocked() {
+    mValid = false;
+    mLinks.clear();
+    mLines.clear();
+    mDumps++;
+
+    int sock = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (sock < 0) {
+        ALOGE("Unable to open rtnetlink socket (%s)", strerror(errno));
+        return -1;
+    }
+    struct timeval tv = { DUMP_TIMEOUT_SEC, 0 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    // Links first, so that the addresses find their interface.
+    static const uint16_t TYPES[] = { RTM_GETLINK, RTM_GETADDR };
+    int res = 0;
+    for (size_t t = 0; t < sizeof(TYPES) / sizeof(TYPES[0]) && !res; t++) {
+        struct {
+            struct nlmsghdr nlh;
+            struct ifinfomsg ifi;   // Only the family is read, ifaddrmsg's as well.
+        } req;
+        memset(&req, 0, sizeof(req));
+        req.nlh.nlmsg_len = NLMSG_LENGTH(TYPES[t] == RTM_GETLINK ? sizeof(struct ifinfomsg) :
+                                                                   sizeof(struct ifaddrmsg));
+        req.nlh.nlmsg_type = TYPES[t];
+        req.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+        req.nlh.nlmsg_seq = t + 1;
+        req.ifi.ifi_family = AF_UNSPEC;
+        if (::send(sock, &req, req.nlh.nlmsg_len, 0) < 0) {
+            res = -errno;
+            break;
+        }
+
+        char buf[16 * 1024];
+        bool done = false;
+        while (!done && !res) {
+            ssize_t len = recv(sock, buf, sizeof(buf), 0);
+            if (len < 0) {
+                if (errno != EINTR)
+                    res = -errno;
+                continue;
+            }
+            struct nlmsghdr *nlh = reinterpret_cast<struct nlmsghdr *>(buf);
+            for (; NLMSG_OK(nlh, (size_t) len); nlh = NLMSG_NEXT(nlh, len)) {
+                if (nlh->nlmsg_type == NLMSG_DONE) {
+                    done = true;
+                    break;
+                }
+                if (nlh->nlmsg_type == NLMSG_ERROR) {
+                    const struct nlmsgerr *err =
+                            reinterpret_cast<const struct nlmsgerr *>(NLMSG_DATA(nlh));
+                    res = err->error ? err->error : -EIO;
+                    break;
+                }
+                if (nlh->nlmsg_type == RTM_NEWLINK) {
+                    parseLinkLocked(nlh);
+                } else if (nlh->nlmsg_type == RTM_NEWADDR) {
+                    parseAddrLocked(nlh);
+                }
+            }
+        }
+    }
+    close(sock);
+
+    if (res) {
+        ALOGE("Dumping the interfaces failed (%s)", strerror(-res));
+        mLinks.clear();
+        return -1;
+    }
+
+    std::map<std::string, std::string> lines;
+    for (std::map<int, Link>::const_iterator it = mLinks.begin(); it != mLinks.end(); ++it) {
+        const Link &link = it->second;
+        std::string flags = (link.flags & IFF_UP) ? "up" : "down";
+        for (size_t i = 0; i < sizeof(FLAG_NAMES) / sizeof(FLAG_NAMES[0]); i++) {
+            if (link.flags & FLAG_NAMES[i].flag) {
+                flags += ",";
+                flags += FLAG_NAMES[i].name;
+            }
+        }
+        std::string addrs;
+        for (size_t i = 0; i < link.addrs.size(); i++) {
+            if (i) {
+                addrs += ",";
+            }
+            addrs += link.addrs[i];
+        }
+        char *line;
+        if (asprintf(&line, "%s hwaddr=%.2x:%.2x:%.2x:%.2x:%.2x:%.2x mtu=%u flags=%s addrs=%s",
+                     link.name.c_str(), link.hwaddr[0], link.hwaddr[1], link.hwaddr[2],
+                     link.hwaddr[3], link.hwaddr[4], link.hwaddr[5], link.mtu, flags.c_str(),
+                     addrs.c_str()) < 0) {
+            mLinks.clear();
+            return -1;
+        }
+        lines[link.name] = line;
+        free(line);
+    }
+    for (std::map<std::string, std::string>::const_iterator it = lines.begin();
+            it != lines.end(); ++it) {
+        mLines.push_back(it->second);
+    }
+    mValid = true;
+    return 0;
+}
+
+int InterfaceCache::send(SocketClient *cli) {
+    pthread_mutex_lock(&mLock);
+    if (!mValid && dumpLocked()) {
+        pthread_mutex_unlock(&mLock);
+        return -1;
+    }
+    // Copied, so that a slow client doesn't hold up the notifications.
+    std::vector<std::string> lines = mLines;
+    mAnswered++;
+    pthread_mutex_unlock(&mLock);
+
+    for (size_t i = 0; i < lines.size(); i++) {
+        cli->sendMsg(ResponseCode::InterfaceCfgListResult, lines[i].c_str(), false);
+    }
+    return 0;
+}
+
+void InterfaceCache::dump(SocketClient *cli) {
+    pthread_mutex_lock(&mLock);
+    char msg[128];
+    snprintf(msg, sizeof(msg), "ifcache valid=%d interfaces=%zu answered=%u dumps=%u",
+             mValid, mLines.size(), mAnswered, mDumps);
+    pthread_mutex_unlock(&mLock);
+    cli->sendMsg(ResponseCode::StatsListResult, msg, false);
+}
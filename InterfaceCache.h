@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _INTERFACE_CACHE_H
+#define _INTERFACE_CACHE_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+struct nlmsghdr;
+class SocketClient;
+
+/*
+ * The name, flags, MAC address, MTU and addresses of every interface, from one
+ * RTM_GETLINK and one RTM_GETADDR dump, for "interface getcfgall".
+ *
+ * The cache follows the link and address notifications of the NETLINK_ROUTE socket
+ * NetlinkManager listens on: any of them, or dropped notifications, make the next
+ * answer dump the interfaces again.
+ */
+class InterfaceCache {
+public:
+    static InterfaceCache *Instance();
+
+    /* The interfaces are dumped again before the next answer. */
+    void invalidate();
+
+    /* Takes a message from the NETLINK_ROUTE multicast socket. */
+    void handleNotification(const struct nlmsghdr *nlh);
+
+    /*
+     * Sends an InterfaceCfgListResult line per interface, ordered by name:
+     *     <iface> hwaddr=<mac> mtu=<n> flags=<flag>[,<flag>...] addrs=[<addr>/<len>[,...]]
+     * Returns -1 if the interfaces couldn't be dumped.
+     */
+    int send(SocketClient *cli);
+
+    /* Sends a StatsListResult line. */
+    void dump(SocketClient *cli);
+
+private:
+    struct Link {
+        std::string name;
+        unsigned flags;
+        uint8_t hwaddr[6];
+        uint32_t mtu;
+        std::vector<std::string> addrs;
+    };
+
+    InterfaceCache();
+
+    int dumpLocked();
+    void parseLinkLocked(const struct nlmsghdr *nlh);
+    void parseAddrLocked(const struct nlmsghdr *nlh);
+
+    static InterfaceCache *sInstance;
+
+    pthread_mutex_t mLock;
+    bool mValid;
+    std::map<int /*ifindex*/, Link> mLinks;
+    std::vector<std::string> mLines;
+    uint32_t mAnswered;
+    uint32_t mDumps;
+};
+
+#endif
@@ -17,8 +17,9 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <string.h>
-#include <dirent.h>
+#include <unistd.h>
 
 #include <dlfcn.h>
 
@@ -36,6 +37,7 @@
 #include <private/android_filesystem_config.h>
 
 #include "NetdConstants.h"
+#include "SysctlCache.h"
 
 #include "InterfaceController.h"
 
@@ -44,10 +46,6 @@ char set_cmd_func_name[] = "net_iface_send_command";
 char set_cmd_init_func_name[] = "net_iface_send_command_init";
 char set_cmd_fini_func_name[] = "net_iface_send_command_fini";
 
-const char ipv6_proc_path[] = "/proc/sys/net/ipv6/conf";
-
-const char sys_net_path[] = "/sys/class/net";
-
 InterfaceController::InterfaceController()
 	: sendCommand_(NULL) {
 	// Initial IPv6 settings.
@@ -115,11 +113,7 @@ int InterfaceController::interfaceCommand(int argc, char *argv[], char **rbuf) {
 }
 
 int InterfaceController::writeIPv6ProcPath(const char *interface, const char *setting, const char *value) {
-	char *path;
-	asprintf(&path, "%s/%s/%s", ipv6_proc_path, interface, setting);
-	int success = writeFile(path, value, strlen(value));
-	free(path);
-	return success;
+	return SysctlCache::Instance()->write("ipv6", interface, setting, value);
 }
 
 int InterfaceController::setEnableIPv6(const char *interface, const int on) {
@@ -136,55 +130,54 @@ int InterfaceController::setIPv6PrivacyExtensions(const char *interface, const i
 	return writeIPv6ProcPath(interface, "use_tempaddr", on ? "2" : "0");
 }
 
-int InterfaceController::isInterfaceName(const char *name) {
-	return strcmp(name, ".") &&
-		strcmp(name, "..") &&
-		strcmp(name, "default") &&
-		strcmp(name, "all");
+int InterfaceController::setAcceptRA(const char *value) {
+	return SysctlCache::Instance()->writeAll("ipv6", "accept_ra", value);
 }
 
-int InterfaceController::setAcceptRA(const char *value) {
-	// Set the default value, which is used by any interfaces that are created in the future.
-	writeIPv6ProcPath("default", "accept_ra", value);
-
-	// Set the value on all the interfaces.
-	DIR *dir = opendir(ipv6_proc_path);
-	if (!dir) {
-		ALOGE("Can't list %s: %s", ipv6_proc_path, strerror(errno));
-		return -errno;
+static int mtuIoctl(const char *interface, int request, int *mtu)
+{
+	struct ifreq ifr;
+	if (strlen(interface) >= sizeof(ifr.ifr_name)) {
+		errno = EINVAL;
+		return -1;
 	}
-	struct dirent *d;
-	while((d = readdir(dir)) != NULL) {
-		if (d->d_type == DT_DIR && isInterfaceName(d->d_name)) {
-			if (writeIPv6ProcPath(d->d_name, "accept_ra", value) < 0) {
-				ALOGE("Can't write to %s/%s/accept_ra: %s", ipv6_proc_path,
-				      d->d_name, strerror(errno));
-			}
-		}
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, interface, sizeof(ifr.ifr_name) - 1);
+	ifr.ifr_mtu = *mtu;
+
+	int s = socket(AF_INET, SOCK_DGRAM, 0);
+	if (s < 0) {
+		ALOGE("socket failed: %s", strerror(errno));
+		return -1;
+	}
+	int res = ioctl(s, request, &ifr);
+	if (res < 0) {
+		ALOGE("MTU ioctl on %s failed: %s", interface, strerror(errno));
+	} else {
+		*mtu = ifr.ifr_mtu;
 	}
-	closedir(dir);
-	return 0;
+	close(s);
+	return res < 0 ? -1 : 0;
 }
 
 int InterfaceController::getMtu(const char *interface, int *mtu)
 {
-	char buf[16];
-	int size = sizeof(buf);
-	char *path;
-	asprintf(&path, "%s/%s/mtu", sys_net_path, interface);
-	int success = readFile(path, buf, &size);
+	int value = 0;
+	int success = mtuIoctl(interface, SIOCGIFMTU, &value);
 	if (!success && mtu)
-		*mtu = atoi(buf);
-	free(path);
+		*mtu = value;
 	return success;
-
 }
 
 int InterfaceController::setMtu(const char *interface, const char *mtu)
 {
-	char *path;
-	asprintf(&path, "%s/%s/mtu", sys_net_path, interface);
-	int success = writeFile(path, mtu, strlen(mtu));
-	free(path);
-	return success;
+	char *end;
+	long value = strtol(mtu, &end, 10);
+	if (end == mtu || *end != '\0' || value <= 0 || value > INT_MAX) {
+		ALOGE("Invalid MTU %s for %s", mtu, interface);
+		errno = EINVAL;
+		return -1;
+	}
+	int newMtu = value;
+	return mtuIoctl(interface, SIOCSIFMTU, &newMtu);
 }
@@ -0,0 +1,303 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+#define LOG_TAG "IptablesTransaction"
+
+#include <cutils/log.h>
+
+#include "IptablesTransaction.h"
+
+static const char DEFAULT_TABLE[] = "filter";
+
+IptablesTransaction::IptablesTransaction() {
+}
+
+void IptablesTransaction::add(IptablesTarget target, ...) {
+    std::vector<std::string> args;
+    va_list ap;
+    va_start(ap, target);
+    const char *arg;
+    while ((arg = va_arg(ap, const char *)) != NULL) {
+        args.push_back(arg);
+    }
+    va_end(ap);
+    addArgs(target, args);
+}
+
+void IptablesTransaction::addCommand(IptablesTarget target, const char *cmd) {
+    std::vector<std::string> args;
+    const char *start = cmd;
+    while (*start) {
+        while (*start == ' ') {
+            start++;
+        }
+        const char *end = start;
+        while (*end && *end != ' ') {
+            end++;
+        }
+        if (end != start) {
+            args.push_back(std::string(start, end - start));
+        }
+        start = end;
+    }
+    addArgs(target, args);
+}
+
+void IptablesTransaction::addChain(IptablesTarget target, const char *table, const char *chain) {
+    // With --noflush, a ":chain -" line creates the chain or flushes the existing one.
+    mRules.push_back(Rule(target, table, std::string(":") + chain + " -"));
+}
+
+void IptablesTransaction::addArgs(IptablesTarget target, const std::vector<std::string> &args) {
+    std::string table = DEFAULT_TABLE;
+    std::string rule;
+
+    for (size_t i = 0; i < args.size(); i++) {
+        if ((args[i] == "-t" || args[i] == "--table") && i + 1 < args.size()) {
+            table = args[++i];
+            continue;
+        }
+        if (!rule.empty()) {
+            rule += ' ';
+        }
+        if (args[i].empty() || args[i].find(' ') != std::string::npos) {
+            rule += '"';
+            rule += args[i];
+            rule += '"';
+        } else {
+            rule += args[i];
+        }
+    }
+    mRules.push_back(Rule(target, table, rule));
+}
+
+void IptablesTransaction::truncate(size_t size) {
+    if (size < mRules.size()) {
+        mRules.erase(mRules.begin() + size, mRules.end());
+    }
+    mResults.clear();
+}
+
+void IptablesTransaction::clear() {
+    mRules.clear();
+    mResults.clear();
+}
+
+int IptablesTransaction::getResult(size_t rule) const {
+    if (rule >= mResults.size()) {
+        return -1;
+    }
+    return mResults[rule];
+}
+
+class IptablesTransaction::CommitTask : public FamilyTask {
+public:
+    CommitTask(const IptablesTransaction *t, bool silent) : mTransaction(t), mSilent(silent) {
+        mResults[0].assign(t->mRules.size(), 0);
+        mResults[1].assign(t->mRules.size(), 0);
+    }
+
+    virtual int run(IptablesTarget family) {
+        return mTransaction->commitFamily(family, mSilent, &mResults[family == V6]);
+    }
+
+    const IptablesTransaction *mTransaction;
+    bool mSilent;
+    std::vector<int> mResults[2];  // V4, V6
+};
+
+int IptablesTransaction::commit(bool silent) {
+    mResults.assign(mRules.size(), 0);
+    if (mRules.empty()) {
+        return 0;
+    }
+
+    CommitTask task(this, silent);
+    int res = runForFamilies(V4V6, &task);
+
+    // A V4V6 rule reports the IPv6 failure if both families failed it.
+    for (size_t i = 0; i < mRules.size(); i++) {
+        mResults[i] = task.mResults[1][i] ? task.mResults[1][i] : task.mResults[0][i];
+    }
+    return res;
+}
+
+/*
+ * iptables-restore identifies the offending input line either as
+ *   "Error occurred at line: N" for a rule it could not apply, or
+ *   "iptables-restore: line N failed" for a COMMIT the kernel rejected.
+ */
+static unsigned findFailedLine(const std::string &output) {
+    static const char *MARKERS[] = { "Error occurred at line: ", ": line " };
+
+    for (size_t i = 0; i < ARRAY_SIZE(MARKERS); i++) {
+        size_t pos = output.find(MARKERS[i]);
+        if (pos != std::string::npos) {
+            return strtoul(output.c_str() + pos + strlen(MARKERS[i]), NULL, 10);
+        }
+    }
+    return 0;
+}
+
+int IptablesTransaction::commitFamily(IptablesTarget family, bool silent,
+                                      std::vector<int> *results) const {
+    std::vector<std::string> tables;
+    for (size_t i = 0; i < mRules.size(); i++) {
+        if (mRules[i].target != family && mRules[i].target != V4V6) {
+            continue;
+        }
+        size_t t;
+        for (t = 0; t < tables.size() && tables[t] != mRules[i].table; t++) {
+        }
+        if (t == tables.size()) {
+            tables.push_back(mRules[i].table);
+        }
+    }
+    if (tables.empty()) {
+        return 0;
+    }
+
+    // Line numbers are 1 based; remember which rule and table each input line is.
+    std::string input;
+    std::vector<int> lineRule(1, -1);
+    std::vector<size_t> lineTable(1, 0);
+    for (size_t t = 0; t < tables.size(); t++) {
+        input += "*" + tables[t] + "\n";
+        lineRule.push_back(-1);
+        lineTable.push_back(t);
+        for (size_t i = 0; i < mRules.size(); i++) {
+            if ((mRules[i].target != family && mRules[i].target != V4V6) ||
+                    mRules[i].table != tables[t]) {
+                continue;
+            }
+            input += mRules[i].rule + "\n";
+            lineRule.push_back(i);
+            lineTable.push_back(t);
+        }
+        input += "COMMIT\n";
+        lineRule.push_back(-1);
+        lineTable.push_back(t);
+    }
+
+    const char *path = (family == V4) ? IPTABLES_RESTORE_PATH : IP6TABLES_RESTORE_PATH;
+    const char *argv[] = { path, "--noflush", NULL };
+    std::string output;
+    int res = execWithInput(argv, input, &output);
+    if (!res) {
+        return 0;
+    }
+
+    // Tables before the failing one were committed; it and everything after were not.
+    unsigned failedLine = findFailedLine(output);
+    size_t failedTable = 0;
+    if (failedLine > 0 && failedLine < lineTable.size()) {
+        failedTable = lineTable[failedLine];
+    } else {
+        failedLine = 0;
+    }
+    for (size_t line = 1; line < lineRule.size(); line++) {
+        if (lineRule[line] >= 0 && lineTable[line] >= failedTable) {
+            (*results)[lineRule[line]] = res;
+        }
+    }
+
+    if (!silent) {
+        if (failedLine && lineRule[failedLine] >= 0) {
+            ALOGE("%s res=%d: rule failed: -t %s %s", path, res, tables[failedTable].c_str(),
+                  mRules[lineRule[failedLine]].rule.c_str());
+        } else if (failedLine) {
+            ALOGE("%s res=%d: commit of table %s failed", path, res,
+                  tables[failedTable].c_str());
+        } else {
+            ALOGE("%s res=%d: no rules applied", path, res);
+        }
+        if (!output.empty()) {
+            ALOGE("%s output: %s", path, output.c_str());
+        }
+    }
+    return res;
+}
+
+int IptablesTransaction::save(IptablesTarget family, std::string *output) {
+    const char *argv[] = {
+        (family == V6) ? IP6TABLES_SAVE_PATH : IPTABLES_SAVE_PATH,
+        NULL
+    };
+    output->clear();
+    int res = execWithInput(argv, std::string(), output);
+    if (res) {
+        ALOGE("%s failed res=%d", argv[0], res);
+    }
+    return res;
+}
+
+/* Appends the lines of a table of an iptables-save dump, without the table header. */
+static void getTableLines(const std::string &dump, const char *table,
+                          std::vector<std::string> *lines) {
+    bool inTable = false;
+    size_t start = 0;
+
+    while (start < dump.size()) {
+        size_t end = dump.find('\n', start);
+        if (end == std::string::npos) {
+            end = dump.size();
+        }
+        if (dump[start] == '*') {
+            inTable = !dump.compare(start + 1, end - start - 1, table);
+        } else if (inTable) {
+            lines->push_back(dump.substr(start, end - start));
+        }
+        start = end + 1;
+    }
+}
+
+int IptablesTransaction::countRules(const std::string &dump, const char *table,
+                                    const std::string &rule) {
+    std::vector<std::string> lines;
+    getTableLines(dump, table, &lines);
+    return std::count(lines.begin(), lines.end(), rule);
+}
+
+void IptablesTransaction::listChains(const std::string &dump, const char *table,
+                                     std::vector<std::string> *chains) {
+    std::vector<std::string> lines;
+    getTableLines(dump, table, &lines);
+    for (size_t i = 0; i < lines.size(); i++) {
+        // ":<chain> <policy> [<packets>:<bytes>]"
+        if (lines[i][0] == ':') {
+            chains->push_back(lines[i].substr(1, lines[i].find(' ') - 1));
+        }
+    }
+}
+
+void IptablesTransaction::listRules(const std::string &dump, const char *table,
+                                    const char *chain, std::vector<std::string> *rules) {
+    std::vector<std::string> lines;
+    getTableLines(dump, table, &lines);
+    std::string prefix = std::string("-A ") + chain + " ";
+    for (size_t i = 0; i < lines.size(); i++) {
+        if (!lines[i].compare(0, prefix.size(), prefix)) {
+            rules->push_back(lines[i]);
+        }
+    }
+}
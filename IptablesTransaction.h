@@ -0,0 +1,96 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _IPTABLES_TRANSACTION_H
+#define _IPTABLES_TRANSACTION_H
+
+#include <string>
+#include <vector>
+
+#include "NetdConstants.h"
+
+/*
+ * Queues iptables rules and applies them with a single iptables-restore --noflush
+ * (and/or ip6tables-restore) run per family, instead of forking iptables per rule.
+ *
+ * Rules take the same arguments as execIptables():
+ *     IptablesTransaction t;
+ *     t.add(V4V6, "-F", "fw_INPUT", NULL);
+ *     t.add(V4V6, "-t", "mangle", "-A", chain, "-j", "RETURN", NULL);
+ *     res = t.commit();
+ *
+ * Rules are grouped by table and every table is committed atomically: if one rule
+ * fails, nothing else queued for that table (and the tables after it) is applied.
+ * There is no equivalent of a deliberately ignored execIptables() failure, so don't
+ * queue tentative operations such as "-D" of a rule that may not exist.
+ */
+class IptablesTransaction {
+public:
+    IptablesTransaction();
+    ~IptablesTransaction() {}
+
+    /* Queues a rule for the given families. The argument list must be NULL terminated. */
+    void add(IptablesTarget target, ...);
+    /* Queues a rule given as a single space separated string, e.g. "-t raw -F chain". */
+    void addCommand(IptablesTarget target, const char *cmd);
+    /* Queues the creation of a user chain; an existing chain is flushed instead. */
+    void addChain(IptablesTarget target, const char *table, const char *chain);
+
+    /*
+     * Applies the queued rules. Returns 0 if every rule was applied.
+     * Failures are logged per rule unless silent; see getResult().
+     */
+    int commit(bool silent = false);
+
+    /* After commit(): 0 if the given rule was applied, non-zero otherwise. */
+    int getResult(size_t rule) const;
+    size_t size() const { return mRules.size(); }
+    /* Drops the rules queued after the first size ones. */
+    void truncate(size_t size);
+    void clear();
+
+    /* Dumps the current ruleset of one family (V4 or V6) in iptables-save format. */
+    static int save(IptablesTarget family, std::string *output);
+    /* Counts the lines equal to rule (e.g. "-A INPUT -j bw_INPUT") in a table of a dump. */
+    static int countRules(const std::string &dump, const char *table, const std::string &rule);
+    /* Appends the names of the chains of a table of a dump, built-in ones included. */
+    static void listChains(const std::string &dump, const char *table,
+                           std::vector<std::string> *chains);
+    /* Appends the rules of a chain of a dump in order, as "-A <chain> ..." lines. */
+    static void listRules(const std::string &dump, const char *table, const char *chain,
+                          std::vector<std::string> *rules);
+
+private:
+    class Rule {
+    public:
+        Rule(IptablesTarget t, const std::string &tbl, const std::string &r)
+                : target(t), table(tbl), rule(r) {};
+        IptablesTarget target;
+        std::string table;
+        std::string rule;
+    };
+
+    class CommitTask;
+
+    void addArgs(IptablesTarget target, const std::vector<std::string> &args);
+    // Fills in results for the rules of family only, so both families can run at once.
+    int commitFamily(IptablesTarget family, bool silent, std::vector<int> *results) const;
+
+    std::vector<Rule> mRules;
+    std::vector<int> mResults;
+};
+
+#endif
@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define __STDC_FORMAT_MACROS 1
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+
+#define LOG_TAG "LatencyStats"
+
+#include <cutils/atomic.h>
+#include <cutils/log.h>
+#include <sysutils/SocketClient.h>
+
+#include "LatencyStats.h"
+#include "ResponseCode.h"
+
+static const int64_t BUCKET_LIMITS_US[LatencyStats::NUM_BUCKETS - 1] = {
+    1000, 10000, 100000, 1000000, 10000000
+};
+
+// Instances register when they are constructed, which in practice is all at startup.
+static pthread_mutex_t sRegistryLock = PTHREAD_MUTEX_INITIALIZER;
+static LatencyStats *sHead = NULL;
+static LatencyStats *sTail = NULL;
+
+LatencyStats::LatencyStats(const char *group, const char *name)
+        : mGroup(group), mName(name), mNext(NULL), mCalls(0), mErrors(0), mTotalUs(0),
+          mMaxUs(0) {
+    for (int i = 0; i < NUM_BUCKETS; i++) {
+        mBuckets[i] = 0;
+    }
+
+    pthread_mutex_lock(&sRegistryLock);
+    if (sTail) {
+        sTail->mNext = this;
+    } else {
+        sHead = this;
+    }
+    sTail = this;
+    pthread_mutex_unlock(&sRegistryLock);
+}
+
+int64_t LatencyStats::now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+int LatencyStats::bucketFor(int64_t us) {
+    int bucket = 0;
+    while (bucket < NUM_BUCKETS - 1 && us >= BUCKET_LIMITS_US[bucket]) {
+        bucket++;
+    }
+    return bucket;
+}
+
+void LatencyStats::record(int64_t startUs, bool failed) {
+    int64_t us = now() - startUs;
+
+    android_atomic_inc(&mBuckets[bucketFor(us)]);
+    android_atomic_inc(&mCalls);
+    if (failed) {
+        android_atomic_inc(&mErrors);
+    }
+
+    __sync_fetch_and_add(&mTotalUs, us);
+    int64_t max = __sync_fetch_and_add(&mMaxUs, 0);
+    while (us > max) {
+        int64_t prev = __sync_val_compare_and_swap(&mMaxUs, max, us);
+        if (prev == max) {
+            break;
+        }
+        max = prev;
+    }
+}
+
+void LatencyStats::dumpAll(SocketClient *cli) {
+    pthread_mutex_lock(&sRegistryLock);
+    for (LatencyStats *stats = sHead; stats != NULL; stats = stats->mNext) {
+        char msg[256];
+        int len = snprintf(msg, sizeof(msg), "%s %s calls=%d errors=%d total_us=%" PRId64
+                           " max_us=%" PRId64 " hist_ms=", stats->mGroup, stats->mName,
+                           android_atomic_acquire_load(&stats->mCalls),
+                           android_atomic_acquire_load(&stats->mErrors),
+                           __sync_fetch_and_add(&stats->mTotalUs, 0),
+                           __sync_fetch_and_add(&stats->mMaxUs, 0));
+        for (int i = 0; i < NUM_BUCKETS && len > 0 && len < (int) sizeof(msg); i++) {
+            len += snprintf(msg + len, sizeof(msg) - len, "%s%d", i ? "," : "",
+                            android_atomic_acquire_load(&stats->mBuckets[i]));
+        }
+        cli->sendMsg(ResponseCode::StatsListResult, msg, false);
+    }
+    pthread_mutex_unlock(&sRegistryLock);
+}
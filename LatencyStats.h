@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _LATENCY_STATS_H
+#define _LATENCY_STATS_H
+
+#include <stdint.h>
+
+class SocketClient;
+
+/*
+ * Call counter and latency histogram for one command or helper, always enabled.
+ * Instances live as long as netd (usually as file statics) and register themselves
+ * for "ndc stats dump". record() only does atomic updates, so it is safe to call from
+ * any thread without locking.
+ *
+ *     static LatencyStats sStats("exec", "NatController::runCmd");
+ *     int64_t start = LatencyStats::now();
+ *     res = android_fork_execvp(...);
+ *     sStats.record(start, res != 0);
+ */
+class LatencyStats {
+public:
+    // Histogram buckets are < 1ms, < 10ms, < 100ms, < 1s, < 10s and the rest.
+    static const int NUM_BUCKETS = 6;
+
+    LatencyStats(const char *group, const char *name);
+
+    /* Counts one call that started at startUs (from now()). */
+    void record(int64_t startUs, bool failed);
+
+    /* CLOCK_MONOTONIC in microseconds. */
+    static int64_t now();
+
+    /* The histogram bucket a call of us microseconds falls in. */
+    static int bucketFor(int64_t us);
+
+    /* Sends one StatsListResult line per registered instance, in registration order. */
+    static void dumpAll(SocketClient *cli);
+
+private:
+    const char *mGroup;
+    const char *mName;
+    LatencyStats *mNext;
+
+    volatile int32_t mCalls;
+    volatile int32_t mErrors;
+    volatile int32_t mBuckets[NUM_BUCKETS];
+    // 64 bit values are updated with the __sync builtins; cutils atomics are 32 bit only.
+    volatile int64_t mTotalUs;
+    volatile int64_t mMaxUs;
+};
+
+#endif
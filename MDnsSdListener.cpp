@@ -22,7 +22,7 @@
 #include <netinet/in.h>
 #include <pthread.h>
 #include <stdlib.h>
-#include <sys/poll.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <string.h>
@@ -44,7 +44,7 @@
 MDnsSdListener::MDnsSdListener() :
                  FrameworkListener("mdns", true) {
     Monitor *m = new Monitor();
-    registerCmd(new Handler(m, this));
+    registerCmd(new TracedCommand("mdns", new TimedCommand("mdns", new Handler(m, this))));
 }
 
 MDnsSdListener::Handler::Handler(Monitor *m, MDnsSdListener *listener) :
@@ -66,8 +66,10 @@ void MDnsSdListener::Handler::discover(SocketClient *cli,
         ALOGD("discover(%s, %s, %s, %d, %d)", iface, regType, domain, requestId,
                 requestFlags);
     }
-    Context *context = new Context(requestId, mListener);
-    DNSServiceRef *ref = mMonitor->allocateServiceRef(requestId, context);
+    Context *context = new Context(requestId, mListener,
+            ResponseCode::ServiceDiscoveryFailed);
+    DNSServiceFlags nativeFlags = iToFlags(requestFlags);
+    DNSServiceRef *ref = mMonitor->allocateServiceRef(requestId, context, &nativeFlags);
     if (ref == NULL) {
         ALOGE("requestId %d already in use during discover call", requestId);
         cli->sendMsg(ResponseCode::CommandParameterError,
@@ -75,7 +77,6 @@ void MDnsSdListener::Handler::discover(SocketClient *cli,
         return;
     }
     if (VDBG) ALOGD("using ref %p", ref);
-    DNSServiceFlags nativeFlags = iToFlags(requestFlags);
     int interfaceInt = ifaceNameToI(iface);
 
     DNSServiceErrorType result = DNSServiceBrowse(ref, nativeFlags, interfaceInt, regType,
@@ -143,7 +144,6 @@ void MDnsSdListener::Handler::stop(SocketClient *cli, int argc, char **argv, con
         return;
     }
     if (VDBG) ALOGD("Stopping %s with ref %p", str, ref);
-    DNSServiceRefDeallocate(*ref);
     mMonitor->freeServiceRef(requestId);
     char *msg;
     asprintf(&msg, "%s stopped", str);
@@ -158,8 +158,10 @@ void MDnsSdListener::Handler::serviceRegister(SocketClient *cli, int requestId,
         ALOGD("serviceRegister(%d, %s, %s, %s, %s, %s, %d, %d, <binary>)", requestId,
                 interfaceName, serviceName, serviceType, domain, host, port, txtLen);
     }
-    Context *context = new Context(requestId, mListener);
-    DNSServiceRef *ref = mMonitor->allocateServiceRef(requestId, context);
+    Context *context = new Context(requestId, mListener,
+            ResponseCode::ServiceRegistrationFailed);
+    DNSServiceFlags nativeFlags = 0;
+    DNSServiceRef *ref = mMonitor->allocateServiceRef(requestId, context, &nativeFlags);
     port = htons(port);
     if (ref == NULL) {
         ALOGE("requestId %d already in use during register call", requestId);
@@ -167,7 +169,6 @@ void MDnsSdListener::Handler::serviceRegister(SocketClient *cli, int requestId,
                 "RequestId already in use during register call", false);
         return;
     }
-    DNSServiceFlags nativeFlags = 0;
     int interfaceInt = ifaceNameToI(interfaceName);
     DNSServiceErrorType result = DNSServiceRegister(ref, interfaceInt, nativeFlags, serviceName,
             serviceType, domain, host, port, txtLen, txtRecord, &MDnsSdListenerRegisterCallback,
@@ -214,15 +215,16 @@ void MDnsSdListener::Handler::resolveService(SocketClient *cli, int requestId,
         ALOGD("resolveService(%d, %s, %s, %s, %s)", requestId, interfaceName,
                 serviceName, regType, domain);
     }
-    Context *context = new Context(requestId, mListener);
-    DNSServiceRef *ref = mMonitor->allocateServiceRef(requestId, context);
+    Context *context = new Context(requestId, mListener,
+            ResponseCode::ServiceResolveFailed);
+    DNSServiceFlags nativeFlags = 0;
+    DNSServiceRef *ref = mMonitor->allocateServiceRef(requestId, context, &nativeFlags);
     if (ref == NULL) {
         ALOGE("request Id %d already in use during resolve call", requestId);
         cli->sendMsg(ResponseCode::CommandParameterError,
                 "RequestId already in use during resolve call", false);
         return;
     }
-    DNSServiceFlags nativeFlags = 0;
     int interfaceInt = ifaceNameToI(interfaceName);
     DNSServiceErrorType result = DNSServiceResolve(ref, nativeFlags, interfaceInt, serviceName,
             regType, domain, &MDnsSdListenerResolveCallback, context);
@@ -269,15 +271,16 @@ void MDnsSdListenerResolveCallback(DNSServiceRef sdRef, DNSServiceFlags flags, u
 void MDnsSdListener::Handler::getAddrInfo(SocketClient *cli, int requestId,
         const char *interfaceName, uint32_t protocol, const char *hostname) {
     if (VDBG) ALOGD("getAddrInfo(%d, %s %d, %s)", requestId, interfaceName, protocol, hostname);
-    Context *context = new Context(requestId, mListener);
-    DNSServiceRef *ref = mMonitor->allocateServiceRef(requestId, context);
+    Context *context = new Context(requestId, mListener,
+            ResponseCode::ServiceGetAddrInfoFailed);
+    DNSServiceFlags nativeFlags = 0;
+    DNSServiceRef *ref = mMonitor->allocateServiceRef(requestId, context, &nativeFlags);
     if (ref == NULL) {
         ALOGE("request ID %d already in use during getAddrInfo call", requestId);
         cli->sendMsg(ResponseCode::CommandParameterError,
                 "RequestId already in use during getAddrInfo call", false);
         return;
     }
-    DNSServiceFlags nativeFlags = 0;
     int interfaceInt = ifaceNameToI(interfaceName);
     DNSServiceErrorType result = DNSServiceGetAddrInfo(ref, nativeFlags, interfaceInt, protocol,
             hostname, &MDnsSdListenerGetAddrInfoCallback, context);
@@ -329,15 +332,16 @@ void MDnsSdListenerGetAddrInfoCallback(DNSServiceRef sdRef, DNSServiceFlags flag
 void MDnsSdListener::Handler::setHostname(SocketClient *cli, int requestId,
         const char *hostname) {
     if (VDBG) ALOGD("setHostname(%d, %s)", requestId, hostname);
-    Context *context = new Context(requestId, mListener);
-    DNSServiceRef *ref = mMonitor->allocateServiceRef(requestId, context);
+    Context *context = new Context(requestId, mListener,
+            ResponseCode::ServiceSetHostnameFailed);
+    DNSServiceFlags nativeFlags = 0;
+    DNSServiceRef *ref = mMonitor->allocateServiceRef(requestId, context, &nativeFlags);
     if (ref == NULL) {
         ALOGE("request Id %d already in use during setHostname call", requestId);
         cli->sendMsg(ResponseCode::CommandParameterError,
                 "RequestId already in use during setHostname call", false);
         return;
     }
-    DNSServiceFlags nativeFlags = 0;
     DNSServiceErrorType result = DNSSetHostname(ref, nativeFlags, hostname,
             &MDnsSdListenerSetHostnameCallback, context);
     if (result != kDNSServiceErr_NoError) {
@@ -492,10 +496,18 @@ int MDnsSdListener::Handler::runCommand(SocketClient *cli,
     return 0;
 }
 
-MDnsSdListener::Monitor::Monitor() {
-    mHead = NULL;
-    pthread_mutex_init(&mHeadMutex, NULL);
+MDnsSdListener::Monitor::Monitor() : mConnection(NULL) {
+    pthread_mutex_init(&mElementsMutex, NULL);
+    pthread_mutex_init(&mConnectionMutex, NULL);
     socketpair(AF_LOCAL, SOCK_STREAM, 0, mCtrlSocketPair);
+    mEpollFd = epoll_create(1);
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;  // the control socket
+    if (epoll_ctl(mEpollFd, EPOLL_CTL_ADD, mCtrlSocketPair[0], &event) < 0) {
+        ALOGE("Unable to add control socket to epoll: %s", strerror(errno));
+    }
     pthread_create(&mThread, NULL, MDnsSdListener::Monitor::threadStart, this);
     pthread_detach(mThread);
 }
@@ -512,7 +524,7 @@ void *MDnsSdListener::Monitor::threadStart(void *obj) {
 int MDnsSdListener::Monitor::startService() {
     int result = 0;
     char property_value[PROPERTY_VALUE_MAX];
-    pthread_mutex_lock(&mHeadMutex);
+    pthread_mutex_lock(&mElementsMutex);
     property_get(MDNS_SERVICE_STATUS, property_value, "");
     if (strcmp("running", property_value) != 0) {
         ALOGD("Starting MDNSD");
@@ -522,14 +534,22 @@ int MDnsSdListener::Monitor::startService() {
     } else {
         result = 0;
     }
-    pthread_mutex_unlock(&mHeadMutex);
+    pthread_mutex_unlock(&mElementsMutex);
     return result;
 }
 
 int MDnsSdListener::Monitor::stopService() {
     int result = 0;
-    pthread_mutex_lock(&mHeadMutex);
-    if (mHead == NULL) {
+    pthread_mutex_lock(&mElementsMutex);
+    bool idle = mElements.empty() && mRemoved.empty();
+    pthread_mutex_unlock(&mElementsMutex);
+    // Only the command thread adds elements, so nothing can start in between.
+    if (idle) {
+        pthread_mutex_lock(&mConnectionMutex);
+        if (mConnection != NULL) {
+            closeConnectionLocked();
+        }
+        pthread_mutex_unlock(&mConnectionMutex);
         ALOGD("Stopping MDNSD");
         property_set("ctl.stop", MDNS_SERVICE_NAME);
         wait_for_property(MDNS_SERVICE_STATUS, "stopped", 5);
@@ -537,156 +557,202 @@ int MDnsSdListener::Monitor::stopService() {
     } else {
         result = 0;
     }
-    pthread_mutex_unlock(&mHeadMutex);
     return result;
 }
 
-void MDnsSdListener::Monitor::run() {
-    int pollCount = 1;
-    mPollSize = 10;
-
-    mPollFds = (struct pollfd *)calloc(sizeof(struct pollfd), mPollSize);
-    mPollRefs = (DNSServiceRef **)calloc(sizeof(DNSServiceRef *), mPollSize);
+#define MAX_EPOLL_EVENTS 32
 
-    mPollFds[0].fd = mCtrlSocketPair[0];
-    mPollFds[0].events = POLLIN;
+void MDnsSdListener::Monitor::run() {
+    struct epoll_event events[MAX_EPOLL_EVENTS];
 
     if (VDBG) ALOGD("MDnsSdListener starting to monitor");
     while (1) {
-        if (VDBG) ALOGD("Going to poll with pollCount %d", pollCount);
-        int pollResults = poll(mPollFds, pollCount, 10000000);
+        int pollResults = epoll_wait(mEpollFd, events, MAX_EPOLL_EVENTS, 10000000);
         if (pollResults < 0) {
-            ALOGE("Error in poll - got %d", errno);
-        } else if (pollResults > 0) {
-            if (VDBG) ALOGD("Monitor poll got data pollCount = %d, %d", pollCount, pollResults);
-            for(int i = 1; i < pollCount; i++) {
-                if (mPollFds[i].revents != 0) {
-                    if (VDBG) {
-                        ALOGD("Monitor found [%d].revents = %d - calling ProcessResults",
-                                i, mPollFds[i].revents);
+            if (errno != EINTR) {
+                ALOGE("Error in epoll_wait - got %d", errno);
+            }
+            continue;
+        } else if (pollResults == 0) {
+            if (VDBG) ALOGD("MDnsSdListener::Monitor poll timed out");
+            continue;
+        }
+
+        if (VDBG) ALOGD("Monitor poll got data %d", pollResults);
+        bool reapNeeded = false;
+        for (int i = 0; i < pollResults; i++) {
+            if (events[i].data.ptr == &mConnection) {
+                pthread_mutex_lock(&mConnectionMutex);
+                // NULL if stopService() closed it after this batch was polled.
+                if (mConnection != NULL) {
+                    if (VDBG) ALOGD("Monitor got data on the shared connection");
+                    DNSServiceErrorType err = DNSServiceProcessResult(mConnection);
+                    if (err != kDNSServiceErr_NoError) {
+                        ALOGE("Lost the mdnsd connection (%d)", err);
+                        closeConnectionLocked();
                     }
-                    DNSServiceProcessResult(*(mPollRefs[i]));
-                    mPollFds[i].revents = 0;
                 }
+                pthread_mutex_unlock(&mConnectionMutex);
+                continue;
             }
-            if (VDBG) ALOGD("controlSocket shows revent= %d", mPollFds[0].revents);
-            switch (mPollFds[0].revents) {
-                case POLLIN: {
-                    char readBuf[2];
-                    read(mCtrlSocketPair[0], &readBuf, 1);
-                    if (DBG) ALOGD("MDnsSdListener::Monitor got %c", readBuf[0]);
-                    if (memcmp(RESCAN, readBuf, 1) == 0) {
-                        pollCount = rescan();
-                    }
+            Element *e = reinterpret_cast<Element *>(events[i].data.ptr);
+            if (e == NULL) {
+                char readBuf[2];
+                read(mCtrlSocketPair[0], &readBuf, 1);
+                if (DBG) ALOGD("MDnsSdListener::Monitor got %c", readBuf[0]);
+                if (memcmp(REAP, readBuf, 1) == 0) {
+                    reapNeeded = true;
                 }
+                continue;
             }
-            mPollFds[0].revents = 0;
-        } else {
-            if (VDBG) ALOGD("MDnsSdListener::Monitor poll timed out");
+            pthread_mutex_lock(&mConnectionMutex);
+            pthread_mutex_lock(&mElementsMutex);
+            bool live = (e->mReady == 1);
+            pthread_mutex_unlock(&mElementsMutex);
+            if (live) {
+                if (VDBG) {
+                    ALOGD("Monitor found %d events = %d - calling ProcessResults",
+                            e->mId, events[i].events);
+                }
+                DNSServiceProcessResult(e->mRef);
+            }
+            pthread_mutex_unlock(&mConnectionMutex);
+        }
+        // Only now that none of this batch's events refer to them, free removed elements.
+        if (reapNeeded) {
+            reap();
         }
     }
-    free(mPollFds);
-    free(mPollRefs);
 }
 
 #define DBG_RESCAN 0
 
-int MDnsSdListener::Monitor::rescan() {
-// rescan the list from mHead and make new pollfds and serviceRefs
-    if (VDBG) {
-        ALOGD("MDnsSdListener::Monitor poll rescanning - size=%d, live=%d", mPollSize, mLiveCount);
-    }
-    int count = 0;
-    pthread_mutex_lock(&mHeadMutex);
-    Element **prevPtr = &mHead;
-    int i = 1;
-    if (mPollSize <= mLiveCount) {
-        mPollSize = mLiveCount + 5;
-        free(mPollFds);
-        free(mPollRefs);
-        mPollFds = (struct pollfd *)calloc(sizeof(struct pollfd), mPollSize);
-        mPollRefs = (DNSServiceRef **)calloc(sizeof(DNSServiceRef *), mPollSize);
-    } else {
-        memset(mPollFds, 0, sizeof(struct pollfd) * mPollSize);
-        memset(mPollRefs, 0, sizeof(DNSServiceRef *) * mPollSize);
-    }
-    mPollFds[0].fd = mCtrlSocketPair[0];
-    mPollFds[0].events = POLLIN;
-    if (DBG_RESCAN) ALOGD("mHead = %p", mHead);
-    while (*prevPtr != NULL) {
-        if (DBG_RESCAN) ALOGD("checking %p, mReady = %d", *prevPtr, (*prevPtr)->mReady);
-        if ((*prevPtr)->mReady == 1) {
-            int fd = DNSServiceRefSockFD((*prevPtr)->mRef);
-            if (fd != -1) {
-                if (DBG_RESCAN) ALOGD("  adding FD %d", fd);
-                mPollFds[i].fd = fd;
-                mPollFds[i].events = POLLIN;
-                mPollRefs[i] = &((*prevPtr)->mRef);
-                i++;
-            } else {
-                ALOGE("Error retreving socket FD for live ServiceRef");
-            }
-            prevPtr = &((*prevPtr)->mNext); // advance to the next element
-        } else if ((*prevPtr)->mReady == -1) {
-            if (DBG_RESCAN) ALOGD("  removing %p from  play", *prevPtr);
-            Element *cur = *prevPtr;
-            *prevPtr = (cur)->mNext; // change our notion of this element and don't advance
-            delete cur;
-        } else if ((*prevPtr)->mReady == 0) {
-            // Not ready so just skip this node and continue on
-            if (DBG_RESCAN) ALOGD("%p not ready.  Continuing.", *prevPtr);
-            prevPtr = &((*prevPtr)->mNext);
+void MDnsSdListener::Monitor::reap() {
+    std::vector<Element *> removed;
+    pthread_mutex_lock(&mElementsMutex);
+    removed.swap(mRemoved);
+    pthread_mutex_unlock(&mElementsMutex);
+    for (size_t i = 0; i < removed.size(); i++) {
+        if (DBG_RESCAN) ALOGD("  removing %p from  play", removed[i]);
+        delete removed[i];
+    }
+}
+
+bool MDnsSdListener::Monitor::openConnectionLocked() {
+    DNSServiceErrorType err = DNSServiceCreateConnection(&mConnection);
+    if (err != kDNSServiceErr_NoError) {
+        ALOGW("Unable to connect to mdnsd (%d)", err);
+        mConnection = NULL;
+        return false;
+    }
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = &mConnection;
+    int fd = DNSServiceRefSockFD(mConnection);
+    if (epoll_ctl(mEpollFd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        ALOGE("Unable to add mdnsd connection fd %d to epoll: %s", fd, strerror(errno));
+        DNSServiceRefDeallocate(mConnection);
+        mConnection = NULL;
+        return false;
+    }
+    if (DBG) ALOGD("Connected to mdnsd on fd %d", fd);
+    return true;
+}
+
+void MDnsSdListener::Monitor::closeConnectionLocked() {
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    epoll_ctl(mEpollFd, EPOLL_CTL_DEL, DNSServiceRefSockFD(mConnection), &event);
+    // This frees the refs of all requests on the connection as well.
+    DNSServiceRefDeallocate(mConnection);
+    mConnection = NULL;
+    std::vector<Context *> failed;
+    pthread_mutex_lock(&mElementsMutex);
+    for (std::map<int, Element *>::iterator it = mElements.begin(); it != mElements.end();
+            ++it) {
+        if (it->second->mShared && it->second->mRef != NULL) {
+            it->second->mRef = NULL;
+            failed.push_back(it->second->mContext);
         }
     }
-    pthread_mutex_unlock(&mHeadMutex);
-    return i;
+    pthread_mutex_unlock(&mElementsMutex);
+    // The requests get no more callbacks, so fail them the way their callbacks would. The
+    // contexts stay valid, as only the command thread frees elements and it is blocked on
+    // the connection lock.
+    for (size_t i = 0; i < failed.size(); i++) {
+        char *msg;
+        if (asprintf(&msg, "%d %d", failed[i]->mRefNumber,
+                kDNSServiceErr_ServiceNotRunning) < 0) {
+            continue;
+        }
+        failed[i]->mListener->sendBroadcast(failed[i]->mFailureCode, msg, false);
+        free(msg);
+    }
 }
 
-DNSServiceRef *MDnsSdListener::Monitor::allocateServiceRef(int id, Context *context) {
-    if (lookupServiceRef(id) != NULL) {
-        delete(context);
+DNSServiceRef *MDnsSdListener::Monitor::allocateServiceRef(int id, Context *context,
+        DNSServiceFlags *flags) {
+    Element *e = new Element(id, context);
+    pthread_mutex_lock(&mConnectionMutex);
+    // Without a connection the request makes one of its own, which reports the error.
+    if (mConnection != NULL || openConnectionLocked()) {
+        e->mRef = mConnection;
+        e->mShared = true;
+    }
+    pthread_mutex_lock(&mElementsMutex);
+    if (!mElements.insert(std::make_pair(id, e)).second) {
+        pthread_mutex_unlock(&mElementsMutex);
+        pthread_mutex_unlock(&mConnectionMutex);
+        delete e;
         return NULL;
     }
-    Element *e = new Element(id, context);
-    pthread_mutex_lock(&mHeadMutex);
-    e->mNext = mHead;
-    mHead = e;
-    pthread_mutex_unlock(&mHeadMutex);
+    pthread_mutex_unlock(&mElementsMutex);
+    if (e->mShared) {
+        *flags |= kDNSServiceFlagsShareConnection;
+    }
     return &(e->mRef);
 }
 
 DNSServiceRef *MDnsSdListener::Monitor::lookupServiceRef(int id) {
-    pthread_mutex_lock(&mHeadMutex);
-    Element *cur = mHead;
-    while (cur != NULL) {
-        if (cur->mId == id) {
-            DNSServiceRef *result = &(cur->mRef);
-            pthread_mutex_unlock(&mHeadMutex);
-            return result;
-        }
-        cur = cur->mNext;
+    DNSServiceRef *result = NULL;
+    pthread_mutex_lock(&mElementsMutex);
+    std::map<int, Element *>::iterator it = mElements.find(id);
+    if (it != mElements.end()) {
+        result = &(it->second->mRef);
     }
-    pthread_mutex_unlock(&mHeadMutex);
-    return NULL;
+    pthread_mutex_unlock(&mElementsMutex);
+    return result;
 }
 
 void MDnsSdListener::Monitor::startMonitoring(int id) {
     if (VDBG) ALOGD("startMonitoring %d", id);
-    pthread_mutex_lock(&mHeadMutex);
-    Element *cur = mHead;
-    while (cur != NULL) {
-        if (cur->mId == id) {
-            if (DBG_RESCAN) ALOGD("marking %p as ready to be added", cur);
-            mLiveCount++;
-            cur->mReady = 1;
-            pthread_mutex_unlock(&mHeadMutex);
-            write(mCtrlSocketPair[1], RESCAN, 1);  // trigger a rescan for a fresh poll
-            if (VDBG) ALOGD("triggering rescan");
-            return;
+    pthread_mutex_lock(&mElementsMutex);
+    std::map<int, Element *>::iterator it = mElements.find(id);
+    if (it != mElements.end()) {
+        Element *e = it->second;
+        e->mStarted = true;
+        int fd = e->mShared ? -1 : DNSServiceRefSockFD(e->mRef);
+        if (e->mShared) {
+            // Its results come in on mConnection, which is already polled.
+            e->mReady = 1;
+        } else if (fd == -1) {
+            ALOGE("Error retreving socket FD for live ServiceRef");
+        } else {
+            struct epoll_event event;
+            memset(&event, 0, sizeof(event));
+            event.events = EPOLLIN;
+            event.data.ptr = e;
+            if (epoll_ctl(mEpollFd, EPOLL_CTL_ADD, fd, &event) < 0) {
+                ALOGE("Unable to add fd %d to epoll: %s", fd, strerror(errno));
+            } else {
+                if (DBG_RESCAN) ALOGD("marking %p as ready, FD %d", e, fd);
+                e->mReady = 1;
+            }
         }
-        cur = cur->mNext;
     }
-    pthread_mutex_unlock(&mHeadMutex);
+    pthread_mutex_unlock(&mElementsMutex);
+    pthread_mutex_unlock(&mConnectionMutex);
 }
 
 #define NAP_TIME 200  // 200 ms between polls
@@ -712,26 +778,46 @@ static int wait_for_property(const char *name, const char *desired_value, int ma
 
 void MDnsSdListener::Monitor::freeServiceRef(int id) {
     if (VDBG) ALOGD("freeServiceRef %d", id);
-    pthread_mutex_lock(&mHeadMutex);
-    Element **prevPtr = &mHead;
-    Element *cur;
-    while (*prevPtr != NULL) {
-        cur = *prevPtr;
-        if (cur->mId == id) {
-            if (DBG_RESCAN) ALOGD("marking %p as ready to be removed", cur);
-            mLiveCount--;
-            if (cur->mReady == 1) {
-                cur->mReady = -1; // tell poll thread to delete
-                write(mCtrlSocketPair[1], RESCAN, 1); // trigger a rescan for a fresh poll
-                if (VDBG) ALOGD("triggering rescan");
-            } else {
-                *prevPtr = cur->mNext;
-                delete cur;
+    // Only the command thread adds and removes elements, so e stays valid.
+    pthread_mutex_lock(&mElementsMutex);
+    std::map<int, Element *>::iterator it = mElements.find(id);
+    Element *e = (it != mElements.end()) ? it->second : NULL;
+    pthread_mutex_unlock(&mElementsMutex);
+    if (e == NULL) {
+        return;
+    }
+    // A request that failed to start still holds the connection lock from
+    // allocateServiceRef(), and the call that failed has already released its ref.
+    if (e->mStarted) {
+        pthread_mutex_lock(&mConnectionMutex);
+        if (e->mReady == 1 && !e->mShared) {
+            // Closing the socket only drops its epoll registration if nothing else refers
+            // to it, and children forked since may have inherited it; remove it first.
+            struct epoll_event event;
+            memset(&event, 0, sizeof(event));
+            int fd = DNSServiceRefSockFD(e->mRef);
+            if (epoll_ctl(mEpollFd, EPOLL_CTL_DEL, fd, &event) < 0) {
+                ALOGE("Unable to remove fd %d from epoll: %s", fd, strerror(errno));
             }
-            pthread_mutex_unlock(&mHeadMutex);
-            return;
         }
-        prevPtr = &(cur->mNext);
+        if (e->mRef != NULL) {
+            DNSServiceRefDeallocate(e->mRef);
+        }
+    }
+    pthread_mutex_lock(&mElementsMutex);
+    mElements.erase(id);
+    if (e->mReady == 1 && !e->mShared) {
+        // The ref's socket is out of the epoll set, but the poll thread may still hold
+        // an event for it.
+        if (DBG_RESCAN) ALOGD("marking %p as ready to be removed", e);
+        e->mReady = -1;
+        mRemoved.push_back(e);
+        write(mCtrlSocketPair[1], REAP, 1);
+    } else {
+        // Refs on mConnection get no more callbacks once deallocated, and have no
+        // events of their own.
+        delete e;
     }
-    pthread_mutex_unlock(&mHeadMutex);
+    pthread_mutex_unlock(&mElementsMutex);
+    pthread_mutex_unlock(&mConnectionMutex);
 }
@@ -21,6 +21,9 @@
 #include <sysutils/FrameworkListener.h>
 #include <dns_sd.h>
 
+#include <map>
+#include <vector>
+
 #include "NetdCommand.h"
 
 // callbacks
@@ -44,7 +47,7 @@ void MDnsSdListenerGetAddrInfoCallback(DNSServiceRef sdRef, DNSServiceFlags flag
         uint32_t interface, DNSServiceErrorType errorCode, const char *hostname,
         const struct sockaddr *const sa, uint32_t ttl, void *inContext);
 
-#define RESCAN "1"
+#define REAP "1"
 
 class MDnsSdListener : public FrameworkListener {
 public:
@@ -55,10 +58,12 @@ public:
     public:
         MDnsSdListener *mListener;
         int mRefNumber;
+        int mFailureCode;  // the response code that reports the request's errors
 
-        Context(int refNumber, MDnsSdListener *m) {
+        Context(int refNumber, MDnsSdListener *m, int failureCode) {
             mRefNumber = refNumber;
             mListener = m;
+            mFailureCode = failureCode;
         }
 
         ~Context() {
@@ -69,7 +74,12 @@ public:
     public:
         Monitor();
         virtual ~Monitor() {}
-        DNSServiceRef *allocateServiceRef(int id, Context *c);
+        // Returns the ref to start request id on, or NULL if id is already in use. The
+        // ref is on the connection shared by all requests, and *flags gets
+        // kDNSServiceFlagsShareConnection, unless mdnsd could not be reached. On success
+        // the connection stays locked until startMonitoring() or freeServiceRef() is
+        // called for id.
+        DNSServiceRef *allocateServiceRef(int id, Context *c, DNSServiceFlags *flags);
         void startMonitoring(int id);
         DNSServiceRef *lookupServiceRef(int id);
         void freeServiceRef(int id);
@@ -78,26 +88,38 @@ public:
         int stopService();
     private:
         void run();
-        int rescan(); // returns the number of elements in the poll
+        void reap(); // deletes the elements freed since the last call
+        bool openConnectionLocked();
+        void closeConnectionLocked();
         class Element {
         public:
             int mId;
-            Element *mNext;
-            DNSServiceRef mRef;
+            DNSServiceRef mRef;     // NULL once a lost connection has taken it along
             Context *mContext;
             int mReady;
+            bool mShared;           // on mConnection rather than a socket of its own
+            bool mStarted;
             Element(int id, Context *context)
-                    : mId(id), mNext(NULL), mContext(context), mReady(0) {}
+                    : mId(id), mRef(NULL), mContext(context), mReady(0), mShared(false),
+                      mStarted(false) {}
             virtual ~Element() { delete(mContext); }
         };
-        Element *mHead;
-        int mLiveCount;
-        struct pollfd *mPollFds;
-        DNSServiceRef **mPollRefs;
-        int mPollSize;
+        // Elements by request id. Monitored elements that are not on mConnection are also
+        // registered with mEpollFd, with the Element pointer as the event data.
+        std::map<int, Element *> mElements;
+        // Freed while monitored; only the poll thread may delete these, as it may still
+        // hold events for them.
+        std::vector<Element *> mRemoved;
+        // The mdnsd connection requests share, or NULL. Registered with mEpollFd with
+        // &mConnection as the event data.
+        DNSServiceRef mConnection;
+        // Serializes all calls into the DNS-SD library, which is not thread safe for
+        // refs on one connection. Taken before mElementsMutex.
+        pthread_mutex_t mConnectionMutex;
+        int mEpollFd;
         pthread_t mThread;
         int mCtrlSocketPair[2];
-        pthread_mutex_t mHeadMutex;
+        pthread_mutex_t mElementsMutex;
     };
 
     class Handler : public NetdCommand {
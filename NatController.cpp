@@ -29,8 +29,9 @@
 
 #define LOG_TAG "NatController"
 #include <cutils/log.h>
-#include <logwrap/logwrap.h>
 
+#include "IptablesTransaction.h"
+#include "LatencyStats.h"
 #include "NatController.h"
 #include "NetworkController.h"
 #include "SecondaryTableController.h"
@@ -53,10 +54,21 @@ struct CommandsAndArgs {
     bool checkRes;
 };
 
+static LatencyStats sRunCmdStats("exec", "NatController::runCmd");
+
 int NatController::runCmd(int argc, const char **argv) {
     int res;
 
-    res = android_fork_execvp(argc, (char **)argv, NULL, false, false);
+    // Stops at a NULL as well, see the HACK below.
+    std::vector<const char *> args;
+    for (int i = 0; i < argc && argv[i]; i++) {
+        args.push_back(argv[i]);
+    }
+    args.push_back(NULL);
+
+    int64_t start = LatencyStats::now();
+    res = execWithInput(&args[0], std::string(), NULL);
+    sRunCmdStats.record(start, res != 0);
 
 #if !LOG_NDEBUG
     std::string full_cmd = argv[0];
@@ -76,50 +88,54 @@ int NatController::runCmd(int argc, const char **argv) {
     return res;
 }
 
-int NatController::setupIptablesHooks() {
-    int res;
-    res = setDefaults();
-    if (res < 0) {
-        return res;
+int NatController::setupIptablesHooks(IptablesTransaction &bootstrap) {
+    /* LOCAL_FORWARD and LOCAL_NAT_POSTROUTING have just been created empty. */
+    bootstrap.add(V4, "-A", LOCAL_FORWARD, "-j", "DROP", NULL);
+    /*
+     * Chain for tethering counters.
+     * This chain is reached via --goto, and then RETURNS.
+     */
+    bootstrap.addChain(V4, "filter", LOCAL_TETHER_COUNTERS_CHAIN);
+    mTetherQuotas.clear();
+    mForwardPairs.clear();
+
+    natCount = 0;
+
+    return setIpRuleDefaults();
+}
+
+int NatController::setDefaults() {
+    IptablesTransaction t;
+    t.add(V4, "-F", LOCAL_FORWARD, NULL);
+    t.add(V4, "-A", LOCAL_FORWARD, "-j", "DROP", NULL);
+    t.add(V4, "-t", "nat", "-F", LOCAL_NAT_POSTROUTING, NULL);
+    if (t.commit()) {
+        return -1;
     }
+    mForwardPairs.clear();
 
-    struct CommandsAndArgs defaultCommands[] = {
-        /*
-         * Chain for tethering counters.
-         * This chain is reached via --goto, and then RETURNS.
-         */
-        {{IPTABLES_PATH, "-F", LOCAL_TETHER_COUNTERS_CHAIN,}, 0},
-        {{IPTABLES_PATH, "-X", LOCAL_TETHER_COUNTERS_CHAIN,}, 0},
-        {{IPTABLES_PATH, "-N", LOCAL_TETHER_COUNTERS_CHAIN,}, 1},
-    };
-    for (unsigned int cmdNum = 0; cmdNum < ARRAY_SIZE(defaultCommands); cmdNum++) {
-        if (runCmd(ARRAY_SIZE(defaultCommands[cmdNum].cmd), defaultCommands[cmdNum].cmd) &&
-            defaultCommands[cmdNum].checkRes) {
-                return -1;
-        }
+    if (setIpRuleDefaults()) {
+        return -1;
     }
 
+    natCount = 0;
+
     return 0;
 }
 
-int NatController::setDefaults() {
-    /*
-     * The following only works because:
-     *  - the defaultsCommands[].cmd array is padded with NULL, and
-     *  - the 1st argc of runCmd() will just be the max for the CommandsAndArgs[].cmd, and
-     *  - internally it will be memcopied to an array and terminated with a NULL.
-     */
+/* Same as "ip route flush cache", without the fork. */
+static void flushRouteCache() {
+    writeFile("/proc/sys/net/ipv4/route/flush", "1", 1);
+}
+
+int NatController::setIpRuleDefaults() {
     struct CommandsAndArgs defaultCommands[] = {
-        {{IPTABLES_PATH, "-F", LOCAL_FORWARD,}, 1},
-        {{IPTABLES_PATH, "-A", LOCAL_FORWARD, "-j", "DROP"}, 1},
-        {{IPTABLES_PATH, "-t", "nat", "-F", LOCAL_NAT_POSTROUTING}, 1},
         {{IP_PATH, "rule", "flush"}, 0},
         {{IP_PATH, "-6", "rule", "flush"}, 0},
         {{IP_PATH, "rule", "add", "from", "all", "lookup", "default", "prio", "32767"}, 0},
         {{IP_PATH, "rule", "add", "from", "all", "lookup", "main", "prio", "32766"}, 0},
         {{IP_PATH, "-6", "rule", "add", "from", "all", "lookup", "default", "prio", "32767"}, 0},
         {{IP_PATH, "-6", "rule", "add", "from", "all", "lookup", "main", "prio", "32766"}, 0},
-        {{IP_PATH, "route", "flush", "cache"}, 0},
     };
     for (unsigned int cmdNum = 0; cmdNum < ARRAY_SIZE(defaultCommands); cmdNum++) {
         if (runCmd(ARRAY_SIZE(defaultCommands[cmdNum].cmd), defaultCommands[cmdNum].cmd) &&
@@ -127,9 +143,7 @@ int NatController::setDefaults() {
                 return -1;
         }
     }
-
-    natCount = 0;
-
+    flushRouteCache();
     return 0;
 }
 
@@ -151,13 +165,7 @@ int NatController::routesOp(bool add, const char *intIface, const char *extIface
             ret |= mSecondaryTableCtrl->modifyFromRule(netId, DEL, argv[5+i]);
         }
     }
-    const char *cmd[] = {
-            IP_PATH,
-            "route",
-            "flush",
-            "cache"
-    };
-    runCmd(ARRAY_SIZE(cmd), cmd);
+    flushRouteCache();
     return ret;
 }
 
@@ -197,219 +205,75 @@ int NatController::enableNat(const int argc, char **argv) {
         return -1;
     }
 
-    // add this if we are the first added nat
-    if (natCount == 0) {
-        const char *cmd[] = {
-                IPTABLES_PATH,
-                "-t",
-                "nat",
-                "-A",
-                LOCAL_NAT_POSTROUTING,
-                "-o",
-                extIface,
-                "-j",
-                "MASQUERADE"
-        };
-        if (runCmd(ARRAY_SIZE(cmd), cmd)) {
-            ALOGE("Error seting postroute rule: iface=%s", extIface);
-            // unwind what's been done, but don't care about success - what more could we do?
-            routesOp(false, intIface, extIface, argv, addrCount);
-            setDefaults();
-            return -1;
-        }
+    /*
+     * All the iptables work goes into one iptables-restore run. The nat table is
+     * queued first: if it fails nothing was applied, and if the filter table fails
+     * only the MASQUERADE rule has to be taken out again.
+     */
+    IptablesTransaction t;
+    size_t masqueradeRule = 0;
+    bool addMasquerade = (natCount == 0);
+    if (addMasquerade) {
+        masqueradeRule = t.size();
+        t.add(V4, "-t", "nat", "-A", LOCAL_NAT_POSTROUTING, "-o", extIface,
+              "-j", "MASQUERADE", NULL);
     }
-
-
-    if (setForwardRules(true, intIface, extIface) != 0) {
-        ALOGE("Error setting forward rules");
-        routesOp(false, intIface, extIface, argv, addrCount);
-        if (natCount == 0) {
-            setDefaults();
+    /* Always make sure the drop rule is at the end */
+    t.add(V4, "-D", LOCAL_FORWARD, "-j", "DROP", NULL);
+    addForwardRules(t, "-A", intIface, extIface);
+    std::vector<std::string> newQuotas;
+    addTetherCountingRules(t, intIface, extIface, &newQuotas);
+    t.add(V4, "-A", LOCAL_FORWARD, "-j", "DROP", NULL);
+
+    if (t.commit()) {
+        ALOGE("Error setting NAT rules: %s -> %s", intIface, extIface);
+        // unwind what's been done, but don't care about success - what more could we do?
+        if (addMasquerade && !t.getResult(masqueradeRule)) {
+            IptablesTransaction undo;
+            undo.add(V4, "-t", "nat", "-D", LOCAL_NAT_POSTROUTING, "-o", extIface,
+                     "-j", "MASQUERADE", NULL);
+            undo.commit();
         }
+        routesOp(false, intIface, extIface, argv, addrCount);
         errno = ENODEV;
         return -1;
     }
 
-    /* Always make sure the drop rule is at the end */
-    const char *cmd1[] = {
-            IPTABLES_PATH,
-            "-D",
-            LOCAL_FORWARD,
-            "-j",
-            "DROP"
-    };
-    runCmd(ARRAY_SIZE(cmd1), cmd1);
-    const char *cmd2[] = {
-            IPTABLES_PATH,
-            "-A",
-            LOCAL_FORWARD,
-            "-j",
-            "DROP"
-    };
-    runCmd(ARRAY_SIZE(cmd2), cmd2);
-
+    mTetherQuotas.insert(newQuotas.begin(), newQuotas.end());
+    mForwardPairs.insert(std::make_pair(std::string(intIface), std::string(extIface)));
     natCount++;
     return 0;
 }
 
-int NatController::setTetherCountingRules(bool add, const char *intIface, const char *extIface) {
-
-    /* We only ever add tethering quota rules so that they stick. */
-    if (!add) {
-        return 0;
-    }
-    char *quota_name, *proc_path;
-    int quota_fd;
-    asprintf(&quota_name, "%s_%s", intIface, extIface);
-
-    asprintf(&proc_path, "/proc/net/xt_quota/%s", quota_name);
-    quota_fd = open(proc_path, O_RDONLY);
-    if (quota_fd >= 0) {
-        /* quota for iface pair already exists */
-        free(proc_path);
-        free(quota_name);
-        return 0;
-    }
-    close(quota_fd);
-    free(proc_path);
-
-    const char *cmd2b[] = {
-            IPTABLES_PATH,
-            "-A",
-            LOCAL_TETHER_COUNTERS_CHAIN,
-            "-i",
-            intIface,
-            "-o",
-            extIface,
-            "-m",
-            "quota2",
-            "--name",
-            quota_name,
-            "--grow",
-            "-j",
-          "RETURN"
-    };
-
-    if (runCmd(ARRAY_SIZE(cmd2b), cmd2b) && add) {
-        free(quota_name);
-        return -1;
-    }
-    free(quota_name);
-
-    asprintf(&quota_name, "%s_%s", extIface, intIface);
-    asprintf(&proc_path, "/proc/net/xt_quota/%s", quota_name);
-    quota_fd = open(proc_path, O_RDONLY);
-    if (quota_fd >= 0) {
-        /* quota for iface pair already exists */
-        free(proc_path);
-        free(quota_name);
-        return 0;
-    }
-    close(quota_fd);
-    free(proc_path);
-
-    const char *cmd3b[] = {
-            IPTABLES_PATH,
-            "-A",
-            LOCAL_TETHER_COUNTERS_CHAIN,
-            "-i",
-            extIface,
-            "-o",
-            intIface,
-            "-m",
-            "quota2",
-            "--name",
-            quota_name,
-            "--grow",
-            "-j",
-            "RETURN"
-    };
-
-    if (runCmd(ARRAY_SIZE(cmd3b), cmd3b) && add) {
-        // unwind what's been done, but don't care about success - what more could we do?
-        free(quota_name);
-        return -1;
+/*
+ * Queues the quota rules counting traffic in both directions between the interfaces.
+ * These are only ever added, so that the counters stick around; the names of the ones
+ * queued are returned in newQuotas, to be remembered once they are committed.
+ */
+void NatController::addTetherCountingRules(IptablesTransaction &t, const char *intIface,
+                                           const char *extIface,
+                                           std::vector<std::string> *newQuotas) {
+    const char *pairs[2][2] = { { intIface, extIface }, { extIface, intIface } };
+    for (int i = 0; i < 2; i++) {
+        std::string quotaName = std::string(pairs[i][0]) + "_" + pairs[i][1];
+        if (mTetherQuotas.count(quotaName)) {
+            /* quota for iface pair already exists */
+            continue;
+        }
+        t.add(V4, "-A", LOCAL_TETHER_COUNTERS_CHAIN, "-i", pairs[i][0], "-o", pairs[i][1],
+              "-m", "quota2", "--name", quotaName.c_str(), "--grow", "-j", "RETURN", NULL);
+        newQuotas->push_back(quotaName);
     }
-    free(quota_name);
-    return 0;
 }
 
-int NatController::setForwardRules(bool add, const char *intIface, const char *extIface) {
-    const char *cmd1[] = {
-            IPTABLES_PATH,
-            add ? "-A" : "-D",
-            LOCAL_FORWARD,
-            "-i",
-            extIface,
-            "-o",
-            intIface,
-            "-m",
-            "state",
-            "--state",
-            "ESTABLISHED,RELATED",
-            "-g",
-            LOCAL_TETHER_COUNTERS_CHAIN
-    };
-    int rc = 0;
-
-    if (runCmd(ARRAY_SIZE(cmd1), cmd1) && add) {
-        return -1;
-    }
-
-    const char *cmd2[] = {
-            IPTABLES_PATH,
-            add ? "-A" : "-D",
-            LOCAL_FORWARD,
-            "-i",
-            intIface,
-            "-o",
-            extIface,
-            "-m",
-            "state",
-            "--state",
-            "INVALID",
-            "-j",
-            "DROP"
-    };
-
-    const char *cmd3[] = {
-            IPTABLES_PATH,
-            add ? "-A" : "-D",
-            LOCAL_FORWARD,
-            "-i",
-            intIface,
-            "-o",
-            extIface,
-            "-g",
-            LOCAL_TETHER_COUNTERS_CHAIN
-    };
-
-    if (runCmd(ARRAY_SIZE(cmd2), cmd2) && add) {
-        // bail on error, but only if adding
-        rc = -1;
-        goto err_invalid_drop;
-    }
-
-    if (runCmd(ARRAY_SIZE(cmd3), cmd3) && add) {
-        // unwind what's been done, but don't care about success - what more could we do?
-        rc = -1;
-        goto err_return;
-    }
-
-    if (setTetherCountingRules(add, intIface, extIface) && add) {
-        rc = -1;
-        goto err_return;
-    }
-
-    return 0;
-
-err_return:
-    cmd2[1] = "-D";
-    runCmd(ARRAY_SIZE(cmd2), cmd2);
-err_invalid_drop:
-    cmd1[1] = "-D";
-    runCmd(ARRAY_SIZE(cmd1), cmd1);
-    return rc;
+void NatController::addForwardRules(IptablesTransaction &t, const char *op,
+                                    const char *intIface, const char *extIface) {
+    t.add(V4, op, LOCAL_FORWARD, "-i", extIface, "-o", intIface, "-m", "state",
+          "--state", "ESTABLISHED,RELATED", "-g", LOCAL_TETHER_COUNTERS_CHAIN, NULL);
+    t.add(V4, op, LOCAL_FORWARD, "-i", intIface, "-o", extIface, "-m", "state",
+          "--state", "INVALID", "-j", "DROP", NULL);
+    t.add(V4, op, LOCAL_FORWARD, "-i", intIface, "-o", extIface,
+          "-g", LOCAL_TETHER_COUNTERS_CHAIN, NULL);
 }
 
 // nat disable intface extface
@@ -434,11 +298,25 @@ int NatController::disableNat(const int argc, char **argv) {
         return -1;
     }
 
-    setForwardRules(false, intIface, extIface);
-    routesOp(false, intIface, extIface, argv, addrCount);
     if (--natCount <= 0) {
         // handle decrement to 0 case (do reset to defaults) and erroneous dec below 0
+        // The flush in setDefaults() takes the forward rules out as well.
+        routesOp(false, intIface, extIface, argv, addrCount);
         setDefaults();
+        return 0;
     }
+
+    // Only delete rules that are known to be there, or the whole batch would fail.
+    std::multiset<std::pair<std::string, std::string> >::iterator it =
+            mForwardPairs.find(std::make_pair(std::string(intIface), std::string(extIface)));
+    if (it != mForwardPairs.end()) {
+        IptablesTransaction t;
+        addForwardRules(t, "-D", intIface, extIface);
+        if (t.commit()) {
+            ALOGE("Error removing forward rules: %s -> %s", intIface, extIface);
+        }
+        mForwardPairs.erase(it);
+    }
+    routesOp(false, intIface, extIface, argv, addrCount);
     return 0;
 }
@@ -19,6 +19,12 @@
 
 #include <linux/in.h>
 
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+class IptablesTransaction;
 class NetworkController;
 class SecondaryTableController;
 
@@ -30,7 +36,8 @@ public:
 
     int enableNat(const int argc, char **argv);
     int disableNat(const int argc, char **argv);
-    int setupIptablesHooks();
+    /* Queues the initial rules; the ip rule defaults are applied right away. */
+    int setupIptablesHooks(IptablesTransaction &bootstrap);
 
     static const char* LOCAL_FORWARD;
     static const char* LOCAL_NAT_POSTROUTING;
@@ -40,12 +47,19 @@ private:
     int natCount;
     SecondaryTableController *mSecondaryTableCtrl;
     NetworkController *mNetCtrl;
+    /* Names of the tether counting quotas in LOCAL_TETHER_COUNTERS_CHAIN. */
+    std::set<std::string> mTetherQuotas;
+    /* (intIface, extIface) of the enabled pairs, whose forward rules are installed. */
+    std::multiset<std::pair<std::string, std::string> > mForwardPairs;
 
     int setDefaults();
+    int setIpRuleDefaults();
     int runCmd(int argc, const char **argv);
     bool checkInterface(const char *iface);
-    int setForwardRules(bool set, const char *intIface, const char *extIface);
-    int setTetherCountingRules(bool add, const char *intIface, const char *extIface);
+    void addForwardRules(IptablesTransaction &t, const char *op, const char *intIface,
+                         const char *extIface);
+    void addTetherCountingRules(IptablesTransaction &t, const char *intIface,
+                                const char *extIface, std::vector<std::string> *newQuotas);
     int routesOp(bool add, const char *intIface, const char *extIface, char **argv, int addrCount);
 };
 
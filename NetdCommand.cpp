@@ -14,8 +14,226 @@
  * limitations under the License.
  */
 
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#define LOG_TAG "NetdCommand"
+
+#include <cutils/log.h>
+#include <sysutils/SocketClient.h>
+
+#include "BinaryFraming.h"
+#include "CommandTrace.h"
 #include "NetdCommand.h"
+#include "ResponseCode.h"
+
+/*
+ * Room for the replies of one queued command. They wait in the socket buffer until the
+ * command is done; a "list" command sends one small message per entry.
+ */
+static const int REPLY_BUFFER_SIZE = 4 * 1024 * 1024;
 
 NetdCommand::NetdCommand(const char *cmd) :
               FrameworkCommand(cmd)  {
 }
+
+TimedCommand::TimedCommand(const char *listener, FrameworkCommand *cmd) :
+              FrameworkCommand(cmd->getCommand()),
+              mCmd(cmd),
+              mStats(listener, cmd->getCommand()) {
+}
+
+int TimedCommand::runCommand(SocketClient *c, int argc, char **argv) {
+    int64_t start = LatencyStats::now();
+    int rc = mCmd->runCommand(c, argc, argv);
+    mStats.record(start, rc != 0);
+    return rc;
+}
+
+TracedCommand::TracedCommand(const char *listener, FrameworkCommand *cmd) :
+              FrameworkCommand(cmd->getCommand()),
+              mListener(listener),
+              mCmd(cmd) {
+}
+
+int TracedCommand::runCommand(SocketClient *c, int argc, char **argv) {
+    CommandTrace::record(mListener, c, argc, argv);
+    return mCmd->runCommand(c, argc, argv);
+}
+
+/*
+ * The replies of one client's queued commands, sent in ticket order. Tickets are taken
+ * in arrival order on the listener thread; whichever thread completes the next ticket
+ * to send also sends the completed ones after it.
+ */
+struct ClientReplies {
+    uint64_t nextTicket;
+    uint64_t nextToSend;
+    bool sending;
+    std::map<uint64_t, std::string> done;
+    ClientReplies() : nextTicket(0), nextToSend(0), sending(false) {}
+};
+
+// Entries go once all of a client's tickets are sent; a pending ticket's Handler holds a
+// reference on its client, so the pointer can't be reused before then.
+static std::map<SocketClient *, ClientReplies> sReplies;
+static pthread_mutex_t sRepliesLock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t takeTicket(SocketClient *c) {
+    pthread_mutex_lock(&sRepliesLock);
+    uint64_t ticket = sReplies[c].nextTicket++;
+    pthread_mutex_unlock(&sRepliesLock);
+    return ticket;
+}
+
+/* Completes ticket with replies, which may be empty, and sends what is now in order. */
+static void sendInOrder(SocketClient *c, uint64_t ticket, std::string *replies) {
+    pthread_mutex_lock(&sRepliesLock);
+    ClientReplies &client = sReplies[c];
+    client.done[ticket].swap(*replies);
+    if (client.sending) {
+        pthread_mutex_unlock(&sRepliesLock);
+        return;
+    }
+    client.sending = true;
+    std::map<uint64_t, std::string>::iterator it;
+    while ((it = client.done.find(client.nextToSend)) != client.done.end()) {
+        std::string data;
+        data.swap(it->second);
+        client.done.erase(it);
+        client.nextToSend++;
+        // Sending without the lock may block on a slow client, but only this one.
+        pthread_mutex_unlock(&sRepliesLock);
+        if (!data.empty()) {
+            c->sendData(data.data(), data.size());
+        }
+        pthread_mutex_lock(&sRepliesLock);
+    }
+    client.sending = false;
+    if (client.nextToSend == client.nextTicket) {
+        sReplies.erase(c);
+    }
+    pthread_mutex_unlock(&sRepliesLock);
+}
+
+class QueuedCommand::Handler : public ThreadPool::Task {
+public:
+    Handler(FrameworkCommand *cmd, SocketClient *cli, int argc, char **argv)
+            : mCmd(cmd), mClient(cli), mCmdNum(cli->getCmdNum()),
+              mBinary(BinaryFraming::isEnabled(cli)), mTicket(takeTicket(cli)) {
+        for (int i = 0; i < argc; i++) {
+            mArgv.push_back(strdup(argv[i]));
+        }
+        mArgv.push_back(NULL);
+        mClient->incRef();
+    }
+
+    virtual ~Handler() {
+        for (size_t i = 0; i < mArgv.size(); i++) {
+            free(mArgv[i]);
+        }
+        mClient->decRef();
+    }
+
+    virtual void run();
+    void sendFailure(const char *msg);
+
+private:
+    FrameworkCommand *mCmd;
+    SocketClient *mClient;
+    int mCmdNum;
+    bool mBinary;  // the framing in effect when the command arrived
+    uint64_t mTicket;
+    std::vector<char *> mArgv;
+};
+
+QueuedCommand::QueuedCommand(ThreadPool *queue, FrameworkCommand *cmd) :
+              FrameworkCommand(cmd->getCommand()),
+              mQueue(queue),
+              mCmd(cmd) {
+}
+
+int QueuedCommand::runCommand(SocketClient *c, int argc, char **argv) {
+    Handler *handler = new Handler(mCmd, c, argc, argv);
+    if (!mQueue) {
+        handler->run();
+    } else if (!mQueue->enqueue(handler)) {
+        handler->sendFailure("Too many commands pending");
+    } else {
+        return 0;
+    }
+    delete handler;
+    return 0;
+}
+
+/*
+ * The reply may wait behind earlier commands, and the client may have moved on to other
+ * sequence numbers by then, so tag it by hand.
+ */
+void QueuedCommand::Handler::sendFailure(const char *msg) {
+    char *buf;
+    int len = asprintf(&buf, "%d %d %s", ResponseCode::OperationFailed, mCmdNum, msg);
+    std::string reply;
+    if (len >= 0) {
+        reply.assign(buf, len + 1);  // with the NUL, as sendMsg() sends it
+        free(buf);
+    }
+    sendInOrder(mClient, mTicket, &reply);
+}
+
+void QueuedCommand::Handler::run() {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv)) {
+        ALOGE("socketpair failed (%s)", strerror(errno));
+        sendFailure("Unable to run command");
+        return;
+    }
+    // Fail the odd oversized reply rather than block this queue on it.
+    int size = REPLY_BUFFER_SIZE;
+    if (setsockopt(sv[0], SOL_SOCKET, SO_SNDBUFFORCE, &size, sizeof(size))) {
+        setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    }
+    int flags = fcntl(sv[0], F_GETFL);
+    fcntl(sv[0], F_SETFL, flags | O_NONBLOCK);
+
+    SocketClient *capture = new SocketClient(sv[0], false, true);
+    capture->setCmdNum(mCmdNum);
+    if (mBinary) {
+        BinaryFraming::setEnabled(capture, true);
+    }
+    int rc = mCmd->runCommand(capture, mArgv.size() - 1, &mArgv[0]);
+    if (rc < 0) {
+        ALOGE("Handler '%s' error (%s)", mCmd->getCommand(), strerror(errno));
+    }
+    BinaryFraming::setEnabled(capture, false);
+    capture->decRef();
+    close(sv[0]);
+
+    std::string replies;
+    char buf[4096];
+    ssize_t n;
+    while ((n = read(sv[1], buf, sizeof(buf))) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ALOGE("Reading replies of '%s' failed (%s)", mCmd->getCommand(), strerror(errno));
+            break;
+        }
+        replies.append(buf, n);
+    }
+    close(sv[1]);
+
+    sendInOrder(mClient, mTicket, &replies);
+}
@@ -19,10 +19,69 @@
 
 #include <sysutils/FrameworkCommand.h>
 
+#include "LatencyStats.h"
+#include "ThreadPool.h"
+
 class NetdCommand : public FrameworkCommand {
 public:
     NetdCommand(const char *cmd);
     virtual ~NetdCommand() {}
 };
 
+/*
+ * Registers in place of cmd and forwards to it, counting and timing every call
+ * as "<listener> <command>" in "ndc stats dump". Takes ownership of cmd.
+ */
+class TimedCommand : public FrameworkCommand {
+public:
+    TimedCommand(const char *listener, FrameworkCommand *cmd);
+    virtual ~TimedCommand() { delete mCmd; }
+    virtual int runCommand(SocketClient *c, int argc, char **argv);
+
+private:
+    FrameworkCommand *mCmd;
+    LatencyStats mStats;
+};
+
+/*
+ * Registers in place of cmd and forwards to it, recording every call that arrives on
+ * listener in the command trace while one is running. Goes outside any QueuedCommand,
+ * so that the trace has the arrival times and clients. Takes ownership of cmd.
+ */
+class TracedCommand : public FrameworkCommand {
+public:
+    TracedCommand(const char *listener, FrameworkCommand *cmd);
+    virtual ~TracedCommand() { delete mCmd; }
+    virtual int runCommand(SocketClient *c, int argc, char **argv);
+
+private:
+    const char *mListener;
+    FrameworkCommand *mCmd;
+};
+
+/*
+ * Registers in place of cmd and runs it on queue, a single worker ThreadPool, instead of
+ * on the listener thread, so that a slow command only holds up the commands sharing its
+ * queue. Commands on one queue run one at a time in the order they arrived.
+ *
+ * The replies of each command are collected and written to the client in one piece,
+ * tagged with that command's sequence number. Replies go out in the order the client's
+ * commands arrived, across all queues: a finished command's replies wait until every
+ * earlier QueuedCommand of the client has replied, so clients that don't use sequence
+ * numbers can still match replies to commands. A NULL queue runs cmd inline, with its
+ * replies ordered the same way. Takes ownership of cmd, but not of queue.
+ */
+class QueuedCommand : public FrameworkCommand {
+public:
+    QueuedCommand(ThreadPool *queue, FrameworkCommand *cmd);
+    virtual ~QueuedCommand() { delete mCmd; }
+    virtual int runCommand(SocketClient *c, int argc, char **argv);
+
+private:
+    class Handler;
+
+    ThreadPool *mQueue;
+    FrameworkCommand *mCmd;
+};
+
 #endif
@@ -14,26 +14,42 @@
  * limitations under the License.
  */
 
+#include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 #include <string.h>
+#include <unistd.h>
 #include <sys/wait.h>
 
+#include <vector>
+
 #define LOG_TAG "Netd"
 
 #include <cutils/log.h>
-#include <logwrap/logwrap.h>
 
+#include "LatencyStats.h"
 #include "NetdConstants.h"
 
 const char * const OEM_SCRIPT_PATH = "/system/bin/oem-iptables-init.sh";
+const char * const OEM_RULES_PATH = "/system/etc/oem-iptables.rules";
 const char * const IPTABLES_PATH = "/system/bin/iptables";
 const char * const IP6TABLES_PATH = "/system/bin/ip6tables";
+const char * const IPTABLES_RESTORE_PATH = "/system/bin/iptables-restore";
+const char * const IP6TABLES_RESTORE_PATH = "/system/bin/ip6tables-restore";
+const char * const IPTABLES_SAVE_PATH = "/system/bin/iptables-save";
+const char * const IP6TABLES_SAVE_PATH = "/system/bin/ip6tables-save";
 const char * const TC_PATH = "/system/bin/tc";
 const char * const IP_PATH = "/system/bin/ip";
 const char * const ADD = "add";
 const char * const DEL = "del";
 
-static void logExecError(const char* argv[], int res, int status) {
+static LatencyStats sExecIptablesStats("exec", "execIptables");
+static LatencyStats sExecWithInputStats("exec", "execWithInput");
+
+static int runWithInput(const char *argv[], const std::string &input, std::string *output);
+
+static void logExecError(const char* argv[], int res, const std::string &output) {
     const char** argp = argv;
     std::string args = "";
     while (*argp) {
@@ -41,54 +57,89 @@ static void logExecError(const char* argv[], int res, int status) {
         args += ' ';
         argp++;
     }
-    ALOGE("exec() res=%d, status=%d for %s", res, status, args.c_str());
+    ALOGE("exec() res=%d for %s: %s", res, args.c_str(), output.c_str());
+}
+
+/*
+ * logwrap serializes its callers on a single lock for as long as the child runs, so
+ * iptables is run through runWithInput(), which only waits for its own child and lets
+ * the two families run concurrently.
+ */
+static int execIptablesCommand(const char *argv[], bool silent) {
+    std::string output;
+    int64_t start = LatencyStats::now();
+    int res = runWithInput(argv, std::string(), &output);
+    sExecIptablesStats.record(start, res != 0);
+    if (res && !silent) {
+        logExecError(argv, res, output);
+    }
+    return res;
 }
 
-static int execIptablesCommand(int argc, const char *argv[], bool silent) {
+namespace {
+
+struct FamilyRun {
+    FamilyTask *task;
+    IptablesTarget family;
     int res;
-    int status;
+};
 
-    res = android_fork_execvp(argc, (char **)argv, &status, false,
-        !silent);
-    if (res || !WIFEXITED(status) || WEXITSTATUS(status)) {
-        if (!silent) {
-            logExecError(argv, res, status);
-        }
-        if (res)
-            return res;
-        if (!WIFEXITED(status))
-            return ECHILD;
+void *runFamilyThread(void *obj) {
+    FamilyRun *run = reinterpret_cast<FamilyRun *>(obj);
+    run->res = run->task->run(run->family);
+    return NULL;
+}
+
+class ExecIptablesTask : public FamilyTask {
+public:
+    ExecIptablesTask(const std::vector<const char *> &args, bool silent)
+            : mArgs(args), mSilent(silent) {}
+
+    virtual int run(IptablesTarget family) {
+        std::vector<const char *> argv(mArgs);
+        argv[0] = (family == V4) ? IPTABLES_PATH : IP6TABLES_PATH;
+        return execIptablesCommand(&argv[0], mSilent);
     }
-    return WEXITSTATUS(status);
+
+private:
+    const std::vector<const char *> &mArgs;
+    bool mSilent;
+};
+
+}  // namespace
+
+int runForFamilies(IptablesTarget target, FamilyTask *task) {
+    if (target != V4V6) {
+        return task->run(target);
+    }
+
+    FamilyRun v6 = { task, V6, 0 };
+    pthread_t thread;
+    bool threaded = !pthread_create(&thread, NULL, runFamilyThread, &v6);
+    if (!threaded) {
+        ALOGW("pthread_create failed, running IPv6 after IPv4");
+    }
+    int res = task->run(V4);
+    if (threaded) {
+        pthread_join(thread, NULL);
+    } else {
+        v6.res = task->run(V6);
+    }
+    return res | v6.res;
 }
 
 static int execIptables(IptablesTarget target, bool silent, va_list args) {
     /* Read arguments from incoming va_list; we expect the list to be NULL terminated. */
-    std::list<const char*> argsList;
-    argsList.push_back(NULL);
+    std::vector<const char *> argv;
+    argv.push_back(NULL);
     const char* arg;
     do {
         arg = va_arg(args, const char *);
-        argsList.push_back(arg);
+        argv.push_back(arg);
     } while (arg);
 
-    int i = 0;
-    const char* argv[argsList.size()];
-    std::list<const char*>::iterator it;
-    for (it = argsList.begin(); it != argsList.end(); it++, i++) {
-        argv[i] = *it;
-    }
-
-    int res = 0;
-    if (target == V4 || target == V4V6) {
-        argv[0] = IPTABLES_PATH;
-        res |= execIptablesCommand(argsList.size(), argv, silent);
-    }
-    if (target == V6 || target == V4V6) {
-        argv[0] = IP6TABLES_PATH;
-        res |= execIptablesCommand(argsList.size(), argv, silent);
-    }
-    return res;
+    ExecIptablesTask task(argv, silent);
+    return runForFamilies(target, &task);
 }
 
 int execIptables(IptablesTarget target, ...) {
@@ -107,6 +158,165 @@ int execIptablesSilently(IptablesTarget target, ...) {
     return res;
 }
 
+/*
+ * Commands run on several threads, but iptables replaces a whole table at once and fails
+ * or loses rules when another run changed the table under it. So runs of each family's
+ * tools are serialized; the two families have separate tables and don't wait for each other.
+ */
+static pthread_mutex_t sIptablesLock[2] = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER };
+
+static pthread_mutex_t *iptablesLockFor(const char *path) {
+    if (!strcmp(path, IPTABLES_PATH) || !strcmp(path, IPTABLES_RESTORE_PATH) ||
+            !strcmp(path, IPTABLES_SAVE_PATH)) {
+        return &sIptablesLock[0];
+    }
+    if (!strcmp(path, IP6TABLES_PATH) || !strcmp(path, IP6TABLES_RESTORE_PATH) ||
+            !strcmp(path, IP6TABLES_SAVE_PATH)) {
+        return &sIptablesLock[1];
+    }
+    return NULL;
+}
+
+static int runWithInputLocked(const char *argv[], const std::string &input,
+                              std::string *output);
+
+static int runWithInput(const char *argv[], const std::string &input, std::string *output) {
+    pthread_mutex_t *lock = iptablesLockFor(argv[0]);
+    if (lock) {
+        pthread_mutex_lock(lock);
+    }
+    int res = runWithInputLocked(argv, input, output);
+    if (lock) {
+        pthread_mutex_unlock(lock);
+    }
+    return res;
+}
+
+static int runWithInputLocked(const char *argv[], const std::string &input,
+                              std::string *output) {
+    int in[2], out[2];
+
+    if (pipe2(in, O_CLOEXEC)) {
+        ALOGE("pipe2() failed (%s)", strerror(errno));
+        return errno;
+    }
+    if (pipe2(out, O_CLOEXEC)) {
+        ALOGE("pipe2() failed (%s)", strerror(errno));
+        close(in[0]);
+        close(in[1]);
+        return errno;
+    }
+
+    // vfork() skips copying the page tables of netd, which grow with every thread and
+    // map. The child shares our memory until it execs: it may only dup2(), exec or exit.
+    pid_t pid = vfork();
+    if (pid < 0) {
+        int err = errno;
+        ALOGE("vfork() failed (%s)", strerror(err));
+        close(in[0]);
+        close(in[1]);
+        close(out[0]);
+        close(out[1]);
+        return err;
+    }
+    if (pid == 0) {
+        // dup2() clears O_CLOEXEC on the new descriptors.
+        if (dup2(in[0], STDIN_FILENO) < 0 || dup2(out[1], STDOUT_FILENO) < 0 ||
+                dup2(out[1], STDERR_FILENO) < 0) {
+            _exit(127);
+        }
+        execv(argv[0], (char **) argv);
+        _exit(127);
+    }
+
+    close(in[0]);
+    close(out[1]);
+    fcntl(in[1], F_SETFL, O_NONBLOCK);
+
+    // Write the input while draining the output, so neither side can fill its pipe
+    // and block the other.
+    size_t written = 0;
+    int inFd = in[1];
+    int outFd = out[0];
+    if (input.empty()) {
+        close(inFd);
+        inFd = -1;
+    }
+    while (inFd >= 0 || outFd >= 0) {
+        struct pollfd fds[2];
+        int nfds = 0;
+        if (outFd >= 0) {
+            fds[nfds].fd = outFd;
+            fds[nfds].events = POLLIN;
+            fds[nfds++].revents = 0;
+        }
+        if (inFd >= 0) {
+            fds[nfds].fd = inFd;
+            fds[nfds].events = POLLOUT;
+            fds[nfds++].revents = 0;
+        }
+        if (poll(fds, nfds, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ALOGE("poll() failed (%s)", strerror(errno));
+            break;
+        }
+        for (int i = 0; i < nfds; i++) {
+            if (!fds[i].revents) {
+                continue;
+            }
+            if (fds[i].fd == outFd) {
+                char buf[512];
+                ssize_t n = read(outFd, buf, sizeof(buf));
+                if (n > 0) {
+                    if (output) {
+                        output->append(buf, n);
+                    }
+                } else if (n == 0 || errno != EINTR) {
+                    close(outFd);
+                    outFd = -1;
+                }
+            } else {
+                ssize_t n = write(inFd, input.data() + written, input.size() - written);
+                if (n > 0) {
+                    written += n;
+                }
+                // The child may exit early on a bad line; stop feeding it (EPIPE).
+                if (written == input.size() || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+                    close(inFd);
+                    inFd = -1;
+                }
+            }
+        }
+    }
+    if (inFd >= 0) {
+        close(inFd);
+    }
+    if (outFd >= 0) {
+        close(outFd);
+    }
+
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            ALOGE("waitpid() failed (%s)", strerror(errno));
+            return ECHILD;
+        }
+    }
+    if (!WIFEXITED(status)) {
+        return ECHILD;
+    }
+    return WEXITSTATUS(status);
+}
+
+int execWithInput(const char *argv[], const std::string &input, std::string *output) {
+    int64_t start = LatencyStats::now();
+    int res = runWithInput(argv, input, output);
+    sExecWithInputStats.record(start, res != 0);
+    return res;
+}
+
 int writeFile(const char *path, const char *value, int size) {
     int fd = open(path, O_WRONLY);
     if (fd < 0) {
@@ -23,16 +23,43 @@
 
 extern const char * const IPTABLES_PATH;
 extern const char * const IP6TABLES_PATH;
+extern const char * const IPTABLES_RESTORE_PATH;
+extern const char * const IP6TABLES_RESTORE_PATH;
+extern const char * const IPTABLES_SAVE_PATH;
+extern const char * const IP6TABLES_SAVE_PATH;
 extern const char * const IP_PATH;
 extern const char * const TC_PATH;
 extern const char * const OEM_SCRIPT_PATH;
+extern const char * const OEM_RULES_PATH;
 extern const char * const ADD;
 extern const char * const DEL;
 
 enum IptablesTarget { V4, V6, V4V6 };
 
+/*
+ * Work that is done separately for each address family. The iptables and ip6tables
+ * tables are independent, so runForFamilies() runs the V4 and V6 halves of a V4V6
+ * target at the same time, on the calling thread and one extra thread. Each half runs
+ * its own steps in order.
+ */
+class FamilyTask {
+public:
+    virtual ~FamilyTask() {}
+    /* Called with V4 or V6; may be called on another thread. */
+    virtual int run(IptablesTarget family) = 0;
+};
+
+/* Returns the results of the families OR-ed together, as the sequential callers did. */
+int runForFamilies(IptablesTarget target, FamilyTask *task);
+
 int execIptables(IptablesTarget target, ...);
 int execIptablesSilently(IptablesTarget target, ...);
+/*
+ * Runs argv[0] with input fed to its stdin; stdout and stderr are collected in
+ * *output when it is not NULL. argv must be NULL terminated.
+ * Returns the exit status of the child, or errno style value if it couldn't be run.
+ */
+int execWithInput(const char *argv[], const std::string &input, std::string *output);
 int writeFile(const char *path, const char *value, int size);
 int readFile(const char *path, char *buf, int *sizep);
 
@@ -19,23 +19,54 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/netfilter_ipv4/ipt_ULOG.h>
+
+#define __STDC_FORMAT_MACROS 1
+#include <inttypes.h>
 
 #define LOG_TAG "Netd"
 
+#include <cutils/atomic.h>
 #include <cutils/log.h>
 
 #include <sysutils/NetlinkEvent.h>
+#include "BroadcastFilter.h"
+#include "BroadcastQueue.h"
+#include "InterfaceCache.h"
 #include "NetlinkHandler.h"
 #include "NetlinkManager.h"
 #include "ResponseCode.h"
+#include "RouteCache.h"
+#include "SysctlCache.h"
+
+/* Same size as the NetlinkListener buffer, so nothing gets truncated here either. */
+static const size_t RECV_BUFFER_SIZE = 64 * 1024;
+
+/* xt_quota2 alerts use the ulog_packet_msg_t layout with their own message type. */
+static const int QLOG_NL_EVENT = 112;
 
 NetlinkHandler::NetlinkHandler(NetlinkManager *nm, int listenerSocket,
-                               int format) :
+                               int format, int netlinkFamily) :
                         NetlinkListener(listenerSocket, format) {
     mNm = nm;
+    mQueueDrops = 0;
+    mFormat = format;
+    mNetlinkFamily = netlinkFamily;
+    mBuffer = NULL;
+    if (netlinkFamily == NETLINK_KOBJECT_UEVENT || netlinkFamily == NETLINK_NFLOG ||
+            netlinkFamily == NETLINK_ROUTE) {
+        mBuffer = new char[RECV_BUFFER_SIZE + 1];
+    }
 }
 
 NetlinkHandler::~NetlinkHandler() {
+    delete[] mBuffer;
 }
 
 int NetlinkHandler::start() {
@@ -46,6 +77,204 @@ int NetlinkHandler::stop() {
     return this->stopListener();
 }
 
+uint32_t NetlinkHandler::getQueueDrops() const {
+    return android_atomic_acquire_load(&mQueueDrops);
+}
+
+static int64_t nowNs(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Moves a CLOCK_REALTIME stamp onto the CLOCK_BOOTTIME timeline the framework uses. */
+static int64_t realtimeToBoottimeNs(const struct timespec &ts) {
+    int64_t realNs = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    return nowNs(CLOCK_BOOTTIME) - (nowNs(CLOCK_REALTIME) - realNs);
+}
+
+/* Returns the value of a "KEY=value" uevent parameter if it is the given key. */
+static const char *matchParam(const char *param, const char *key) {
+    size_t len = strlen(key);
+    return strncmp(param, key, len) ? NULL : param + len;
+}
+
+/*
+ * Like uevent_kernel_multicast_uid_recv(), only takes multicasts that the kernel sent as
+ * root. Netlink doesn't timestamp its messages, so *timestampNs is the CLOCK_BOOTTIME
+ * time at which the message was read.
+ */
+ssize_t NetlinkHandler::receive(int sock, int64_t *timestampNs) {
+    struct iovec iov = { mBuffer, RECV_BUFFER_SIZE };
+    struct sockaddr_nl addr;
+    char control[CMSG_SPACE(sizeof(struct ucred))];
+    struct msghdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_name = &addr;
+    hdr.msg_namelen = sizeof(addr);
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = control;
+    hdr.msg_controllen = sizeof(control);
+
+    ssize_t n = TEMP_FAILURE_RETRY(recvmsg(sock, &hdr, 0));
+    if (n < 0) {
+        return -1;
+    }
+
+    struct ucred *cred = NULL;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr); cmsg; cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_CREDENTIALS) {
+            cred = (struct ucred *) CMSG_DATA(cmsg);
+        }
+    }
+    if (!cred || cred->uid != 0 || addr.nl_groups == 0 || addr.nl_pid != 0) {
+        errno = EIO;
+        return -1;
+    }
+
+    *timestampNs = nowNs(CLOCK_BOOTTIME);
+    mBuffer[n] = '\0';
+    return n;
+}
+
+bool NetlinkHandler::onDataAvailable(SocketClient *cli) {
+    if (!mBuffer) {
+        return NetlinkListener::onDataAvailable(cli);
+    }
+
+    int64_t timestampNs;
+    ssize_t count = receive(cli->getSocket(), &timestampNs);
+    if (count < 0) {
+        if (errno == ENOBUFS && mNetlinkFamily == NETLINK_ROUTE) {
+            // Route notifications got lost; don't trust what the cache made of the rest.
+            SLOGW("Route socket overrun, dumping the routing tables and interfaces again");
+            RouteCache::Instance()->invalidate();
+            InterfaceCache::Instance()->invalidate();
+            return true;
+        }
+        SLOGE("recvmsg failed (%s)", strerror(errno));
+        return false;
+    }
+
+    bool handled;
+    if (mNetlinkFamily == NETLINK_KOBJECT_UEVENT) {
+        handled = handleIdletimerUevent(count, timestampNs);
+    } else if (mNetlinkFamily == NETLINK_NFLOG) {
+        handled = handleQuotaAlerts(count, timestampNs);
+    } else {
+        handled = handleRouteMessages(count);
+    }
+    if (handled) {
+        return true;
+    }
+
+    NetlinkEvent *evt = new NetlinkEvent();
+    if (!evt->decode(mBuffer, count, mFormat)) {
+        SLOGE("Error decoding NetlinkEvent");
+    } else {
+        onEvent(evt);
+    }
+    delete evt;
+    return true;
+}
+
+/*
+ * Shows every message to the route and interface caches. Returns false unless they were
+ * all route or rule changes, which NetlinkEvent has nothing to say about.
+ */
+bool NetlinkHandler::handleRouteMessages(ssize_t count) {
+    size_t len = count;
+    bool onlyRoutes = true;
+    struct nlmsghdr *nh = (struct nlmsghdr *) mBuffer;
+    for (; NLMSG_OK(nh, len); nh = NLMSG_NEXT(nh, len)) {
+        RouteCache::Instance()->handleNotification(nh);
+        InterfaceCache::Instance()->handleNotification(nh);
+        if (nh->nlmsg_type != RTM_NEWROUTE && nh->nlmsg_type != RTM_DELROUTE &&
+                nh->nlmsg_type != RTM_NEWRULE && nh->nlmsg_type != RTM_DELRULE) {
+            onlyRoutes = false;
+        }
+    }
+    return onlyRoutes;
+}
+
+/* Returns false if the uevent isn't from xt_idletimer. */
+bool NetlinkHandler::handleIdletimerUevent(ssize_t count, int64_t timestampNs) {
+    const char *end = mBuffer + count;
+    const char *subsystem = NULL;
+    const char *label = NULL;
+    const char *iface = NULL;
+    const char *state = NULL;
+    const char *timeNs = NULL;
+
+    // "action@devpath" comes first, then one "KEY=value" string after another.
+    for (const char *p = mBuffer + strlen(mBuffer) + 1; p < end; p += strlen(p) + 1) {
+        const char *value;
+        if ((value = matchParam(p, "SUBSYSTEM="))) {
+            subsystem = value;
+        } else if ((value = matchParam(p, "LABEL="))) {
+            label = value;
+        } else if ((value = matchParam(p, "INTERFACE="))) {
+            iface = value;
+        } else if ((value = matchParam(p, "STATE="))) {
+            state = value;
+        } else if ((value = matchParam(p, "TIME_NS="))) {
+            timeNs = value;
+        }
+    }
+    if (!subsystem || strcmp(subsystem, "xt_idletimer")) {
+        return false;
+    }
+
+    // if no LABEL, use INTERFACE instead
+    if (!label) {
+        label = iface;
+    }
+    if (label && state) {
+        // Kernels that stamp the event themselves do it on the boot time clock.
+        notifyInterfaceClassActivity(label, !strcmp("active", state),
+                                     timeNs ? strtoll(timeNs, NULL, 10) : timestampNs);
+    }
+    return true;
+}
+
+/* Returns false if the messages aren't quota2 alerts. */
+bool NetlinkHandler::handleQuotaAlerts(ssize_t count, int64_t timestampNs) {
+    size_t len = count;
+    struct nlmsghdr *nh = (struct nlmsghdr *) mBuffer;
+    if (!NLMSG_OK(nh, len) || nh->nlmsg_type != QLOG_NL_EVENT) {
+        return false;
+    }
+
+    for (; NLMSG_OK(nh, len); nh = NLMSG_NEXT(nh, len)) {
+        if (nh->nlmsg_type != QLOG_NL_EVENT ||
+                nh->nlmsg_len < NLMSG_LENGTH(sizeof(ulog_packet_msg_t))) {
+            continue;
+        }
+        const ulog_packet_msg_t *pm = (const ulog_packet_msg_t *) NLMSG_DATA(nh);
+        const char *devname = pm->indev_name[0] ? pm->indev_name : pm->outdev_name;
+        int64_t stampNs = timestampNs;
+        if (pm->timestamp_sec) {
+            struct timespec ts;
+            ts.tv_sec = pm->timestamp_sec;
+            ts.tv_nsec = pm->timestamp_usec * 1000;
+            stampNs = realtimeToBoottimeNs(ts);
+        }
+        notifyQuotaLimitReached(pm->prefix, devname, stampNs);
+    }
+    return true;
+}
+
+/*
+ * The uevent socket filter already drops other subsystems in the kernel; the route and
+ * quota sockets only ever produce "net" and "qlog".
+ */
+const NetlinkHandler::SubsystemHandler NetlinkHandler::SUBSYSTEM_HANDLERS[] = {
+    { "net",          &NetlinkHandler::onNetEvent },
+    { "qlog",         &NetlinkHandler::onQuotaEvent },
+    { "xt_idletimer", &NetlinkHandler::onIdletimerEvent },
+};
+
 void NetlinkHandler::onEvent(NetlinkEvent *evt) {
     const char *subsys = evt->getSubsystem();
     if (!subsys) {
@@ -53,106 +282,147 @@ void NetlinkHandler::onEvent(NetlinkEvent *evt) {
         return;
     }
 
-    if (!strcmp(subsys, "net")) {
-        int action = evt->getAction();
-        const char *iface = evt->findParam("INTERFACE");
-
-        if (action == evt->NlActionAdd) {
-            notifyInterfaceAdded(iface);
-        } else if (action == evt->NlActionRemove) {
-            notifyInterfaceRemoved(iface);
-        } else if (action == evt->NlActionChange) {
-            evt->dump();
-            notifyInterfaceChanged("nana", true);
-        } else if (action == evt->NlActionLinkUp) {
-            notifyInterfaceLinkChanged(iface, true);
-        } else if (action == evt->NlActionLinkDown) {
-            notifyInterfaceLinkChanged(iface, false);
-        } else if (action == evt->NlActionAddressUpdated ||
-                   action == evt->NlActionAddressRemoved) {
-            const char *address = evt->findParam("ADDRESS");
-            const char *flags = evt->findParam("FLAGS");
-            const char *scope = evt->findParam("SCOPE");
-            if (iface && flags && scope) {
-                notifyAddressChanged(action, address, iface, flags, scope);
-            }
-        } else if (action == evt->NlActionRdnss) {
-            const char *lifetime = evt->findParam("LIFETIME");
-            const char *servers = evt->findParam("SERVERS");
-            if (lifetime && servers) {
-                notifyInterfaceDnsServers(iface, lifetime, servers);
-            }
+    for (size_t i = 0; i < sizeof(SUBSYSTEM_HANDLERS) / sizeof(SUBSYSTEM_HANDLERS[0]); i++) {
+        if (!strcmp(subsys, SUBSYSTEM_HANDLERS[i].subsystem)) {
+            (this->*SUBSYSTEM_HANDLERS[i].handle)(evt);
+            return;
         }
-
-    } else if (!strcmp(subsys, "qlog")) {
-        const char *alertName = evt->findParam("ALERT_NAME");
-        const char *iface = evt->findParam("INTERFACE");
-        notifyQuotaLimitReached(alertName, iface);
-
-    } else if (!strcmp(subsys, "xt_idletimer")) {
-        int action = evt->getAction();
-        const char *label = evt->findParam("LABEL");
-        const char *state = evt->findParam("STATE");
-        // if no LABEL, use INTERFACE instead
-        if (label == NULL) {
-            label = evt->findParam("INTERFACE");
-        }
-        if (state)
-            notifyInterfaceClassActivity(label, !strcmp("active", state));
+    }
 
 #if !LOG_NDEBUG
-    } else if (strcmp(subsys, "platform") && strcmp(subsys, "backlight")) {
+    if (strcmp(subsys, "platform") && strcmp(subsys, "backlight")) {
         /* It is not a VSYNC or a backlight event */
         ALOGV("unexpected event from subsystem %s", subsys);
+    }
 #endif
+}
+
+void NetlinkHandler::onNetEvent(NetlinkEvent *evt) {
+    int action = evt->getAction();
+    const char *iface = evt->findParam("INTERFACE");
+
+    if (action == evt->NlActionAdd) {
+        notifyInterfaceAdded(iface);
+    } else if (action == evt->NlActionRemove) {
+        if (iface) {
+            SysctlCache::Instance()->forgetInterface(iface);
+        }
+        notifyInterfaceRemoved(iface);
+    } else if (action == evt->NlActionChange) {
+        evt->dump();
+        notifyInterfaceChanged("nana", true);
+    } else if (action == evt->NlActionLinkUp) {
+        notifyInterfaceLinkChanged(iface, true);
+    } else if (action == evt->NlActionLinkDown) {
+        notifyInterfaceLinkChanged(iface, false);
+    } else if (action == evt->NlActionAddressUpdated ||
+               action == evt->NlActionAddressRemoved) {
+        const char *address = evt->findParam("ADDRESS");
+        const char *flags = evt->findParam("FLAGS");
+        const char *scope = evt->findParam("SCOPE");
+        if (iface && flags && scope) {
+            notifyAddressChanged(action, address, iface, flags, scope);
+        }
+    } else if (action == evt->NlActionRdnss) {
+        const char *lifetime = evt->findParam("LIFETIME");
+        const char *servers = evt->findParam("SERVERS");
+        if (lifetime && servers) {
+            notifyInterfaceDnsServers(iface, lifetime, servers);
+        }
+    }
+}
+
+void NetlinkHandler::onQuotaEvent(NetlinkEvent *evt) {
+    const char *alertName = evt->findParam("ALERT_NAME");
+    const char *iface = evt->findParam("INTERFACE");
+    notifyQuotaLimitReached(alertName, iface, nowNs(CLOCK_BOOTTIME));
+}
+
+void NetlinkHandler::onIdletimerEvent(NetlinkEvent *evt) {
+    const char *label = evt->findParam("LABEL");
+    const char *state = evt->findParam("STATE");
+    const char *timeNs = evt->findParam("TIME_NS");
+    // if no LABEL, use INTERFACE instead
+    if (label == NULL) {
+        label = evt->findParam("INTERFACE");
     }
+    if (state)
+        notifyInterfaceClassActivity(label, !strcmp("active", state),
+                                     timeNs ? strtoll(timeNs, NULL, 10) : nowNs(CLOCK_BOOTTIME));
 }
 
-void NetlinkHandler::notify(int code, const char *format, ...) {
-    char *msg;
+/*
+ * Hands the event to the broadcast queue, which formats it in place and sends it from
+ * its own thread. Events with the same key that are still queued are coalesced; a NULL
+ * key only coalesces identical messages. iface is what subscriptions filter on.
+ */
+void NetlinkHandler::notify(int code, const char *iface, const char *key,
+                            const char *format, ...) {
     va_list args;
     va_start(args, format);
-    if (vasprintf(&msg, format, args) >= 0) {
-        mNm->getBroadcaster()->sendBroadcast(code, msg, false);
-        free(msg);
+    BroadcastQueue *queue = mNm->getBroadcastQueue();
+    if (queue) {
+        if (!queue->post(code, iface, key, format, args)) {
+            android_atomic_inc(&mQueueDrops);
+        }
     } else {
-        SLOGE("Failed to send notification: vasprintf: %s", strerror(errno));
+        char *msg;
+        if (vasprintf(&msg, format, args) >= 0) {
+            BroadcastFilter::broadcast(mNm->getBroadcaster(), code, iface, msg);
+            free(msg);
+        } else {
+            SLOGE("Failed to send notification: vasprintf: %s", strerror(errno));
+        }
     }
     va_end(args);
 }
 
 void NetlinkHandler::notifyInterfaceAdded(const char *name) {
-    notify(ResponseCode::InterfaceChange, "Iface added %s", name);
+    notify(ResponseCode::InterfaceChange, name, NULL, "Iface added %s", name);
 }
 
 void NetlinkHandler::notifyInterfaceRemoved(const char *name) {
-    notify(ResponseCode::InterfaceChange, "Iface removed %s", name);
+    notify(ResponseCode::InterfaceChange, name, NULL, "Iface removed %s", name);
 }
 
 void NetlinkHandler::notifyInterfaceChanged(const char *name, bool isUp) {
-    notify(ResponseCode::InterfaceChange,
+    char key[64];
+    snprintf(key, sizeof(key), "changed %s", name);
+    notify(ResponseCode::InterfaceChange, name, key,
            "Iface changed %s %s", name, (isUp ? "up" : "down"));
 }
 
 void NetlinkHandler::notifyInterfaceLinkChanged(const char *name, bool isUp) {
-    notify(ResponseCode::InterfaceChange,
+    char key[64];
+    snprintf(key, sizeof(key), "linkstate %s", name);
+    notify(ResponseCode::InterfaceChange, name, key,
            "Iface linkstate %s %s", name, (isUp ? "up" : "down"));
 }
 
-void NetlinkHandler::notifyQuotaLimitReached(const char *name, const char *iface) {
-    notify(ResponseCode::BandwidthControl, "limit alert %s %s", name, iface);
+/*
+ * The names may come straight out of a ulog message, which doesn't promise to terminate
+ * them, so they are bounded by the sizes of its fields.
+ */
+void NetlinkHandler::notifyQuotaLimitReached(const char *name, const char *iface,
+                                             int64_t timestampNs) {
+    notify(ResponseCode::BandwidthControl, iface, NULL, "limit alert %.*s %.*s %" PRId64,
+           ULOG_PREFIX_LEN, name, IFNAMSIZ, iface, timestampNs);
 }
 
 void NetlinkHandler::notifyInterfaceClassActivity(const char *name,
-                                                  bool isActive) {
-    notify(ResponseCode::InterfaceClassActivity,
-           "IfaceClass %s %s", isActive ? "active" : "idle", name);
+                                                  bool isActive, int64_t timestampNs) {
+    char key[64];
+    snprintf(key, sizeof(key), "IfaceClass %s", name);
+    notify(ResponseCode::InterfaceClassActivity, name, key,
+           "IfaceClass %s %s %" PRId64, isActive ? "active" : "idle", name, timestampNs);
 }
 
 void NetlinkHandler::notifyAddressChanged(int action, const char *addr,
                                           const char *iface, const char *flags,
                                           const char *scope) {
-    notify(ResponseCode::InterfaceAddressChange,
+    char key[96];
+    snprintf(key, sizeof(key), "Address %s %s", addr, iface);
+    notify(ResponseCode::InterfaceAddressChange, iface, key,
            "Address %s %s %s %s %s",
            (action == NetlinkEvent::NlActionAddressUpdated) ?
            "updated" : "removed", addr, iface, flags, scope);
@@ -161,6 +431,6 @@ void NetlinkHandler::notifyAddressChanged(int action, const char *addr,
 void NetlinkHandler::notifyInterfaceDnsServers(const char *iface,
                                                const char *lifetime,
                                                const char *servers) {
-    notify(ResponseCode::InterfaceDnsInfo, "DnsInfo servers %s %s %s",
+    notify(ResponseCode::InterfaceDnsInfo, iface, NULL, "DnsInfo servers %s %s %s",
            iface, lifetime, servers);
 }
@@ -17,33 +17,67 @@
 #ifndef _NETLINKHANDLER_H
 #define _NETLINKHANDLER_H
 
+#include <stdint.h>
+
 #include <sysutils/NetlinkListener.h>
 #include "NetlinkManager.h"
 
 class NetlinkHandler: public NetlinkListener {
     NetlinkManager *mNm;
+    volatile int32_t mQueueDrops;
+    int mFormat;
+    int mNetlinkFamily;
+    /* Receive buffer of the fast path, NULL on sockets that don't have one. */
+    char *mBuffer;
 
 public:
-    NetlinkHandler(NetlinkManager *nm, int listenerSocket, int format);
+    NetlinkHandler(NetlinkManager *nm, int listenerSocket, int format, int netlinkFamily);
     virtual ~NetlinkHandler();
 
     int start(void);
     int stop(void);
 
+    /* Events dropped because the broadcast queue was full. */
+    uint32_t getQueueDrops() const;
+
 protected:
+    /*
+     * Idletimer uevents and quota2 alerts are picked out of the receive buffer in place
+     * and notified right away, and route messages are fed to RouteCache; everything else
+     * is decoded into a NetlinkEvent as usual. The notifications carry the time the kernel
+     * put in the event if it has one (TIME_NS, the ulog packet stamp), otherwise the
+     * CLOCK_BOOTTIME time at which netd read the event.
+     */
+    virtual bool onDataAvailable(SocketClient *cli);
     virtual void onEvent(NetlinkEvent *evt);
 
-    void notify(int code, const char *format, ...);
+    void onNetEvent(NetlinkEvent *evt);
+    void onQuotaEvent(NetlinkEvent *evt);
+    void onIdletimerEvent(NetlinkEvent *evt);
+
+    void notify(int code, const char *iface, const char *key, const char *format, ...);
     void notifyInterfaceAdded(const char *name);
     void notifyInterfaceRemoved(const char *name);
     void notifyInterfaceChanged(const char *name, bool isUp);
     void notifyInterfaceLinkChanged(const char *name, bool isUp);
-    void notifyQuotaLimitReached(const char *name, const char *iface);
-    void notifyInterfaceClassActivity(const char *name, bool isActive);
+    /* timestampNs is on the CLOCK_BOOTTIME timeline. */
+    void notifyQuotaLimitReached(const char *name, const char *iface, int64_t timestampNs);
+    void notifyInterfaceClassActivity(const char *name, bool isActive, int64_t timestampNs);
     void notifyAddressChanged(int action, const char *addr, const char *iface,
                               const char *flags, const char *scope);
     void notifyInterfaceDnsServers(const char *iface, const char *lifetime,
                                    const char *servers);
 
+private:
+    ssize_t receive(int sock, int64_t *timestampNs);
+    bool handleIdletimerUevent(ssize_t count, int64_t timestampNs);
+    bool handleQuotaAlerts(ssize_t count, int64_t timestampNs);
+    bool handleRouteMessages(ssize_t count);
+
+    struct SubsystemHandler {
+        const char *subsystem;
+        void (NetlinkHandler::*handle)(NetlinkEvent *evt);
+    };
+    static const SubsystemHandler SUBSYSTEM_HANDLERS[];
 };
 #endif
@@ -15,6 +15,8 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 
 #include <sys/socket.h>
@@ -23,15 +25,21 @@
 #include <sys/types.h>
 #include <sys/un.h>
 
+#include <linux/filter.h>
 #include <linux/netlink.h>
 #include <linux/rtnetlink.h>
 
+#include <vector>
+
 #define LOG_TAG "Netd"
 
 #include <cutils/log.h>
+#include <sysutils/SocketClient.h>
 
+#include "BroadcastQueue.h"
 #include "NetlinkManager.h"
 #include "NetlinkHandler.h"
+#include "ResponseCode.h"
 
 const int NetlinkManager::NFLOG_QUOTA_GROUP = 1;
 
@@ -45,11 +53,104 @@ NetlinkManager *NetlinkManager::Instance() {
 
 NetlinkManager::NetlinkManager() {
     mBroadcaster = NULL;
+    mBroadcastQueue = NULL;
+    mUeventHandler = NULL;
+    mRouteHandler = NULL;
+    mQuotaHandler = NULL;
 }
 
 NetlinkManager::~NetlinkManager() {
 }
 
+/*
+ * Subsystems whose uevents netd handles; everything else (power_supply, backlight,
+ * input, ...) is dropped in the kernel by the socket filter below.
+ */
+static const char *const UEVENT_SUBSYSTEMS[] = { "net", "xt_idletimer" };
+
+/*
+ * Kernel uevents are "action@devpath\0ACTION=...\0DEVPATH=...\0SUBSYSTEM=...\0...", so
+ * SUBSYSTEM= is at a position that depends on the devpath length. Classic BPF has no
+ * loops, so the search is unrolled over the first UEVENT_SCAN_LEN bytes, which is far
+ * more than any network device or idletimer path needs.
+ */
+static const unsigned UEVENT_SCAN_LEN = 512;
+
+static void appendMatch(std::vector<struct sock_filter> *prog, std::vector<size_t> *fails,
+                        unsigned offset, const char *value, size_t len) {
+    // Compares value (which may include its terminator) against packet[X + offset].
+    for (size_t i = 0; i < len; ) {
+        size_t chunk = (len - i >= 4) ? 4 : (len - i >= 2) ? 2 : 1;
+        uint32_t expected = 0;
+        for (size_t j = 0; j < chunk; j++) {
+            expected = (expected << 8) | (unsigned char) value[i + j];
+        }
+        uint16_t size = (chunk == 4) ? BPF_W : (chunk == 2) ? BPF_H : BPF_B;
+        struct sock_filter load = BPF_STMT(BPF_LD | size | BPF_IND, (uint32_t) (offset + i));
+        struct sock_filter test = BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, expected, 0, 0);
+        prog->push_back(load);
+        fails->push_back(prog->size());
+        prog->push_back(test);
+        i += chunk;
+    }
+}
+
+static void setJumpFalse(std::vector<struct sock_filter> *prog, const std::vector<size_t> &jumps,
+                         size_t target) {
+    for (size_t i = 0; i < jumps.size(); i++) {
+        (*prog)[jumps[i]].jf = target - jumps[i] - 1;
+    }
+}
+
+static int attachUeventFilter(int sock) {
+    static const char KEY[] = "SUBSYSTEM=";
+    std::vector<struct sock_filter> prog;
+
+    // Scan: at the first offset holding "SUBS", load it into X and jump to the check.
+    std::vector<size_t> toCheck;
+    uint32_t subs = ((uint32_t) 'S' << 24) | ((uint32_t) 'U' << 16) | ('B' << 8) | 'S';
+    for (unsigned k = 0; k + 4 <= UEVENT_SCAN_LEN; k++) {
+        struct sock_filter insns[] = {
+            BPF_STMT(BPF_LD | BPF_W | BPF_ABS, k),
+            BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, subs, 0, 2),
+            BPF_STMT(BPF_LDX | BPF_IMM, k),
+            BPF_STMT(BPF_JMP | BPF_JA, 0),
+        };
+        prog.insert(prog.end(), insns, insns + 4);
+        toCheck.push_back(prog.size() - 1);
+    }
+    struct sock_filter drop = BPF_STMT(BPF_RET | BPF_K, 0);
+    struct sock_filter accept = BPF_STMT(BPF_RET | BPF_K, 0xffffffff);
+    prog.push_back(drop);
+
+    size_t check = prog.size();
+    for (size_t i = 0; i < toCheck.size(); i++) {
+        prog[toCheck[i]].k = check - toCheck[i] - 1;
+    }
+
+    // Check: the rest of the key, then each subsystem name including its terminator.
+    std::vector<size_t> toDrop;
+    appendMatch(&prog, &toDrop, 4, KEY + 4, sizeof(KEY) - 1 - 4);
+    for (size_t i = 0; i < sizeof(UEVENT_SUBSYSTEMS) / sizeof(UEVENT_SUBSYSTEMS[0]); i++) {
+        std::vector<size_t> toNext;
+        appendMatch(&prog, &toNext, sizeof(KEY) - 1, UEVENT_SUBSYSTEMS[i],
+                    strlen(UEVENT_SUBSYSTEMS[i]) + 1);
+        prog.push_back(accept);
+        setJumpFalse(&prog, toNext, prog.size());
+    }
+    prog.push_back(drop);
+    setJumpFalse(&prog, toDrop, prog.size() - 1);
+
+    struct sock_fprog fprog;
+    fprog.len = prog.size();
+    fprog.filter = &prog[0];
+    if (setsockopt(sock, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog)) < 0) {
+        ALOGE("Unable to attach uevent socket filter: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
 NetlinkHandler *NetlinkManager::setupSocket(int *sock, int netlinkFamily,
     int groups, int format) {
 
@@ -79,13 +180,18 @@ NetlinkHandler *NetlinkManager::setupSocket(int *sock, int netlinkFamily,
         return NULL;
     }
 
+    // Unfiltered still works, NetlinkHandler ignores the other subsystems anyway.
+    if (netlinkFamily == NETLINK_KOBJECT_UEVENT) {
+        attachUeventFilter(*sock);
+    }
+
     if (bind(*sock, (struct sockaddr *) &nladdr, sizeof(nladdr)) < 0) {
         ALOGE("Unable to bind netlink socket: %s", strerror(errno));
         close(*sock);
         return NULL;
     }
 
-    NetlinkHandler *handler = new NetlinkHandler(this, *sock, format);
+    NetlinkHandler *handler = new NetlinkHandler(this, *sock, format, netlinkFamily);
     if (handler->start()) {
         ALOGE("Unable to start NetlinkHandler: %s", strerror(errno));
         close(*sock);
@@ -96,6 +202,13 @@ NetlinkHandler *NetlinkManager::setupSocket(int *sock, int netlinkFamily,
 }
 
 int NetlinkManager::start() {
+    mBroadcastQueue = new BroadcastQueue(mBroadcaster);
+    if (mBroadcastQueue->start()) {
+        ALOGE("Unable to start broadcast queue, sending events synchronously");
+        delete mBroadcastQueue;
+        mBroadcastQueue = NULL;
+    }
+
     if ((mUeventHandler = setupSocket(&mUeventSock, NETLINK_KOBJECT_UEVENT,
          0xffffffff, NetlinkListener::NETLINK_FORMAT_ASCII)) == NULL) {
         return -1;
@@ -105,6 +218,10 @@ int NetlinkManager::start() {
                                      RTMGRP_LINK |
                                      RTMGRP_IPV4_IFADDR |
                                      RTMGRP_IPV6_IFADDR |
+                                     RTMGRP_IPV4_ROUTE |
+                                     RTMGRP_IPV6_ROUTE |
+                                     (1 << (RTNLGRP_IPV4_RULE - 1)) |
+                                     (1 << (RTNLGRP_IPV6_RULE - 1)) |
                                      (1 << (RTNLGRP_ND_USEROPT - 1)),
          NetlinkListener::NETLINK_FORMAT_BINARY)) == NULL) {
         return -1;
@@ -157,5 +274,99 @@ int NetlinkManager::stop() {
         mQuotaSock = -1;
     }
 
+    // The listener threads are gone, so nothing posts anymore; stop() sends what's left.
+    delete mBroadcastQueue;
+    mBroadcastQueue = NULL;
+
     return status;
 }
+
+/*
+ * Finds the kernel's drop counter for our socket of the given family in
+ * /proc/net/netlink. The columns vary between kernels, so they are located by the
+ * header line.
+ */
+static int readKernelDrops(int netlinkFamily, unsigned int *drops) {
+    FILE *fp = fopen("/proc/net/netlink", "re");
+    if (!fp) {
+        ALOGE("Unable to open /proc/net/netlink: %s", strerror(errno));
+        return -1;
+    }
+
+    char line[256];
+    int ethCol = -1, pidCol = -1, dropsCol = -1;
+    if (fgets(line, sizeof(line), fp)) {
+        char *save;
+        int col = 0;
+        for (char *tok = strtok_r(line, " \t\n", &save); tok;
+             tok = strtok_r(NULL, " \t\n", &save), col++) {
+            if (!strcmp(tok, "Eth")) {
+                ethCol = col;
+            } else if (!strcmp(tok, "Pid")) {
+                pidCol = col;
+            } else if (!strcmp(tok, "Drops")) {
+                dropsCol = col;
+            }
+        }
+    }
+    if (ethCol < 0 || pidCol < 0 || dropsCol < 0) {
+        ALOGE("Unexpected /proc/net/netlink format");
+        fclose(fp);
+        return -1;
+    }
+
+    int res = -1;
+    while (res && fgets(line, sizeof(line), fp)) {
+        long eth = -1, pid = -1;
+        unsigned long value = 0;
+        char *save;
+        int col = 0;
+        for (char *tok = strtok_r(line, " \t\n", &save); tok;
+             tok = strtok_r(NULL, " \t\n", &save), col++) {
+            if (col == ethCol) {
+                eth = strtol(tok, NULL, 10);
+            } else if (col == pidCol) {
+                pid = strtol(tok, NULL, 10);
+            } else if (col == dropsCol) {
+                value = strtoul(tok, NULL, 10);
+            }
+        }
+        if (eth == netlinkFamily && pid == getpid()) {
+            *drops = value;
+            res = 0;
+        }
+    }
+    fclose(fp);
+    return res;
+}
+
+void NetlinkManager::dumpSocketStats(SocketClient *cli, const char *name,
+                                     int netlinkFamily, NetlinkHandler *handler) {
+    if (!handler) {
+        return;
+    }
+
+    unsigned int kernelDrops = 0;
+    char msg[128];
+    if (readKernelDrops(netlinkFamily, &kernelDrops)) {
+        snprintf(msg, sizeof(msg), "netlink %s kernel_drops=unknown queue_drops=%u", name,
+                 handler->getQueueDrops());
+    } else {
+        snprintf(msg, sizeof(msg), "netlink %s kernel_drops=%u queue_drops=%u", name,
+                 kernelDrops, handler->getQueueDrops());
+    }
+    cli->sendMsg(ResponseCode::StatsListResult, msg, false);
+}
+
+void NetlinkManager::dumpStats(SocketClient *cli) {
+    dumpSocketStats(cli, "uevent", NETLINK_KOBJECT_UEVENT, mUeventHandler);
+    dumpSocketStats(cli, "route", NETLINK_ROUTE, mRouteHandler);
+    dumpSocketStats(cli, "quota", NETLINK_NFLOG, mQuotaHandler);
+
+    if (mBroadcastQueue) {
+        char msg[64];
+        snprintf(msg, sizeof(msg), "netlink broadcasts coalesced=%u",
+                 mBroadcastQueue->getCoalescedCount());
+        cli->sendMsg(ResponseCode::StatsListResult, msg, false);
+    }
+}
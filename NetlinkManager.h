@@ -21,7 +21,9 @@
 #include <sysutils/NetlinkListener.h>
 
 
+class BroadcastQueue;
 class NetlinkHandler;
+class SocketClient;
 
 class NetlinkManager {
 private:
@@ -29,6 +31,7 @@ private:
 
 private:
     SocketListener       *mBroadcaster;
+    BroadcastQueue       *mBroadcastQueue;
     NetlinkHandler       *mUeventHandler;
     NetlinkHandler       *mRouteHandler;
     NetlinkHandler       *mQuotaHandler;
@@ -46,6 +49,12 @@ public:
     void setBroadcaster(SocketListener *sl) { mBroadcaster = sl; }
     SocketListener *getBroadcaster() { return mBroadcaster; }
 
+    /* NULL if the queue couldn't be started; events are then sent synchronously. */
+    BroadcastQueue *getBroadcastQueue() { return mBroadcastQueue; }
+
+    /* Sends kernel and queue drop counts for each netlink socket as StatsListResult. */
+    void dumpStats(SocketClient *cli);
+
     static NetlinkManager *Instance();
 
     /* This is the nflog group arg that the xt_quota2 neftiler will use. */
@@ -58,5 +67,7 @@ private:
     NetlinkManager();
     NetlinkHandler* setupSocket(int *sock, int netlinkFamily, int groups,
         int format);
+    void dumpSocketStats(SocketClient *cli, const char *name, int netlinkFamily,
+        NetlinkHandler *handler);
 };
 #endif
@@ -15,96 +15,173 @@
  */
 
 #include <resolv_netid.h>
+#include <sched.h>
 
 #define LOG_TAG "NetworkController"
+#include <cutils/atomic-inline.h>
+#include <cutils/atomic.h>
 #include <cutils/log.h>
 
 #include "NetworkController.h"
 
 // Mark 1 is reserved for SecondaryTableController::PROTECT_MARK.
 NetworkController::NetworkController()
-        : mDefaultNetId(NETID_UNSET),
-          mNextFreeNetId(10) {}
+        : mCurrent(0),
+          mNextFreeNetId(10) {
+    mState[0].defaultNetId = NETID_UNSET;
+    mReaders[0] = mReaders[1] = 0;
+    pthread_mutex_init(&mWriteLock, NULL);
+    pthread_mutex_init(&mIfaceLock, NULL);
+}
+
+const NetworkController::State& NetworkController::acquireState(int32_t* slot) const {
+    while (true) {
+        int32_t current = android_atomic_acquire_load(&mCurrent);
+        android_atomic_inc(&mReaders[current]);
+        // The increment only has release ordering; without a full barrier the recheck
+        // below could be satisfied before the writer can see the increment.
+        android_memory_barrier();
+        // A writer may have switched states before we were counted; if so, try again.
+        if (android_atomic_acquire_load(&mCurrent) == current) {
+            *slot = current;
+            return mState[current];
+        }
+        android_atomic_dec(&mReaders[current]);
+    }
+}
+
+void NetworkController::releaseState(int32_t slot) const {
+    android_atomic_dec(&mReaders[slot]);
+}
+
+NetworkController::State& NetworkController::beginUpdate() {
+    pthread_mutex_lock(&mWriteLock);
+    // The spare copy has no readers: the previous writer waited for them to leave.
+    State& next = mState[1 - mCurrent];
+    next = mState[mCurrent];
+    return next;
+}
+
+void NetworkController::endUpdate() {
+    int32_t previous = mCurrent;
+    android_atomic_release_store(1 - previous, &mCurrent);
+    // Pairs with the barrier in acquireState(): either the reader sees the new mCurrent,
+    // or we see its count.
+    android_memory_barrier();
+    while (android_atomic_acquire_load(&mReaders[previous]) != 0) {
+        sched_yield();
+    }
+    pthread_mutex_unlock(&mWriteLock);
+}
 
 void NetworkController::clearNetworkPreference() {
-    android::RWLock::AutoWLock lock(mRWLock);
-    mUidMap.clear();
-    mPidMap.clear();
+    State& state = beginUpdate();
+    state.uidMap.clear();
+    state.pidMap.clear();
+    endUpdate();
 }
 
 unsigned NetworkController::getDefaultNetwork() const {
-    return mDefaultNetId;
+    int32_t slot;
+    unsigned netId = acquireState(&slot).defaultNetId;
+    releaseState(slot);
+    return netId;
 }
 
 void NetworkController::setDefaultNetwork(unsigned netId) {
-    android::RWLock::AutoWLock lock(mRWLock);
-    mDefaultNetId = netId;
+    State& state = beginUpdate();
+    state.defaultNetId = netId;
+    endUpdate();
 }
 
 void NetworkController::setNetworkForPid(int pid, unsigned netId) {
-    android::RWLock::AutoWLock lock(mRWLock);
+    State& state = beginUpdate();
     if (netId == 0) {
-        mPidMap.erase(pid);
+        state.pidMap.erase(pid);
     } else {
-        mPidMap[pid] = netId;
+        state.pidMap[pid] = netId;
+    }
+    endUpdate();
+}
+
+int NetworkController::findUidEntry(const std::vector<UidEntry>& uidMap, int uid) {
+    int lo = 0;
+    int hi = uidMap.size();
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (uidMap[mid].uid_start <= uid) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
     }
+    return lo - 1;
 }
 
 bool NetworkController::setNetworkForUidRange(int uid_start, int uid_end, unsigned netId,
         bool forward_dns) {
-    android::RWLock::AutoWLock lock(mRWLock);
     if (uid_start > uid_end)
         return false;
 
-    for (std::list<UidEntry>::iterator it = mUidMap.begin(); it != mUidMap.end(); ++it) {
-        if (it->uid_start > uid_end || uid_start > it->uid_end)
-            continue;
+    State& state = beginUpdate();
+    std::vector<UidEntry>& uidMap = state.uidMap;
+    bool res = true;
+
+    // Ranges don't overlap, so only the last one starting at or below uid_end can.
+    int i = findUidEntry(uidMap, uid_end);
+    if (i >= 0 && uidMap[i].uid_end >= uid_start) {
+        UidEntry& entry = uidMap[i];
         /* Overlapping or identical range. */
-        if (it->uid_start != uid_start || it->uid_end != uid_end) {
+        if (entry.uid_start != uid_start || entry.uid_end != uid_end) {
             ALOGE("Overlapping but not identical uid range detected.");
-            return false;
-        }
-
-        if (netId == NETID_UNSET) {
-            mUidMap.erase(it);
+            res = false;
+        } else if (netId == NETID_UNSET) {
+            uidMap.erase(uidMap.begin() + i);
         } else {
-            it->netId = netId;
-            it->forward_dns = forward_dns;
+            entry.netId = netId;
+            entry.forward_dns = forward_dns;
         }
-        return true;
+    } else {
+        uidMap.insert(uidMap.begin() + i + 1, UidEntry(uid_start, uid_end, netId, forward_dns));
     }
 
-    mUidMap.push_back(UidEntry(uid_start, uid_end, netId, forward_dns));
-    return true;
+    endUpdate();
+    return res;
 }
 
 unsigned NetworkController::getNetwork(int uid, unsigned requested_netId, int pid,
         bool for_dns) const {
-    android::RWLock::AutoRLock lock(mRWLock);
-    for (std::list<UidEntry>::const_iterator it = mUidMap.begin(); it != mUidMap.end(); ++it) {
-        if (uid < it->uid_start || it->uid_end < uid)
-            continue;
-        if (for_dns && !it->forward_dns)
-            break;
-        return it->netId;
-    }
-    if (requested_netId != NETID_UNSET)
-        return requested_netId;
-    if (pid != PID_UNSPECIFIED) {
-        std::map<int, unsigned>::const_iterator it = mPidMap.find(pid);
-        if (it != mPidMap.end())
-            return it->second;
+    int32_t slot;
+    const State& state = acquireState(&slot);
+    unsigned netId = state.defaultNetId;
+
+    int i = findUidEntry(state.uidMap, uid);
+    if (i >= 0 && uid <= state.uidMap[i].uid_end &&
+            (!for_dns || state.uidMap[i].forward_dns)) {
+        netId = state.uidMap[i].netId;
+    } else if (requested_netId != NETID_UNSET) {
+        netId = requested_netId;
+    } else if (pid != PID_UNSPECIFIED) {
+        std::map<int, unsigned>::const_iterator it = state.pidMap.find(pid);
+        if (it != state.pidMap.end())
+            netId = it->second;
     }
-    return mDefaultNetId;
+
+    releaseState(slot);
+    return netId;
 }
 
 unsigned NetworkController::getNetworkId(const char* interface) {
+    pthread_mutex_lock(&mIfaceLock);
+    unsigned netId;
     std::map<std::string, unsigned>::const_iterator it = mIfaceNetidMap.find(interface);
-    if (it != mIfaceNetidMap.end())
-        return it->second;
-
-    unsigned netId = mNextFreeNetId++;
-    mIfaceNetidMap[interface] = netId;
+    if (it != mIfaceNetidMap.end()) {
+        netId = it->second;
+    } else {
+        netId = mNextFreeNetId++;
+        mIfaceNetidMap[interface] = netId;
+    }
+    pthread_mutex_unlock(&mIfaceLock);
     return netId;
 }
 
@@ -17,19 +17,23 @@
 #ifndef _NETD_NETWORKCONTROLLER_H
 #define _NETD_NETWORKCONTROLLER_H
 
-#include <list>
 #include <map>
 #include <string>
+#include <vector>
 
+#include <pthread.h>
 #include <stddef.h>
 #include <stdint.h>
-#include <utils/RWLock.h>
 
 /*
  * Keeps track of default, per-pid, and per-uid-range network selection, as
  * well as the mark associated with each network. Networks are identified
  * by netid. In all set* commands netid == 0 means "unspecified" and is
  * equivalent to clearing the mapping.
+ *
+ * Lookups don't take a lock: readers use an immutable copy of the state, and
+ * writers replace it with an updated copy, then wait until no reader is left
+ * on the old one before it can be reused.
  */
 class NetworkController {
 public:
@@ -66,11 +70,33 @@ private:
         UidEntry(int uid_start, int uid_end, unsigned netId, bool forward_dns);
     };
 
-    mutable android::RWLock mRWLock;
-    std::list<UidEntry> mUidMap;
-    std::map<int, unsigned> mPidMap;
-    unsigned mDefaultNetId;
+    struct State {
+        // Non-overlapping ranges, sorted by uid_start.
+        std::vector<UidEntry> uidMap;
+        std::map<int, unsigned> pidMap;
+        unsigned defaultNetId;
+    };
+
+    // Index of the last entry of uidMap starting at or below uid, or -1 if there is none.
+    static int findUidEntry(const std::vector<UidEntry>& uidMap, int uid);
+
+    // Returns the published state; it stays valid until releaseState(*slot).
+    const State& acquireState(int32_t* slot) const;
+    void releaseState(int32_t slot) const;
+    // Locks out other writers and returns a copy of the state to modify.
+    State& beginUpdate();
+    // Publishes the copy returned by beginUpdate().
+    void endUpdate();
+
+    // mState[mCurrent] is the published state, the other one is spare.
+    State mState[2];
+    volatile int32_t mCurrent;
+    // Readers currently using each of mState.
+    mutable volatile int32_t mReaders[2];
+    pthread_mutex_t mWriteLock;
 
+    // Guards mIfaceNetidMap and mNextFreeNetId.
+    pthread_mutex_t mIfaceLock;
     std::map<std::string, unsigned> mIfaceNetidMap;
     unsigned mNextFreeNetId;
 };
@@ -22,21 +22,24 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
-#include <sys/wait.h>
 
 #include <dirent.h>
 
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
+#include <string>
+#include <vector>
+
 #define LOG_TAG "PppController"
 #include <cutils/log.h>
 
 #include "PppController.h"
+#include "ProcessSupervisor.h"
 
 PppController::PppController() {
     mTtys = new TtyCollection();
-    mPid = 0;
+    mPppdId = -1;
 }
 
 PppController::~PppController() {
@@ -51,9 +54,7 @@ PppController::~PppController() {
 int PppController::attachPppd(const char *tty, struct in_addr local,
                               struct in_addr remote, struct in_addr dns1,
                               struct in_addr dns2) {
-    pid_t pid;
-
-    if (mPid) {
+    if (mPppdId != -1) {
         ALOGE("Multiple PPPD instances not currently supported");
         errno = EBUSY;
         return -1;
@@ -71,48 +72,43 @@ int PppController::attachPppd(const char *tty, struct in_addr local,
         return -1;
     }
 
-    if ((pid = fork()) < 0) {
-        ALOGE("fork failed (%s)", strerror(errno));
+    std::string lr = inet_ntoa(local);
+    lr += ":";
+    lr += inet_ntoa(remote);
+    std::string dev = "/dev/";
+    dev += tty;
+
+    // TODO: Deal with pppd bailing out after 99999 seconds of being started
+    // but not getting a connection
+    std::vector<std::string> args;
+    args.push_back("/system/bin/pppd");
+    args.push_back("-detach");
+    args.push_back(dev);
+    args.push_back("115200");
+    args.push_back(lr);
+    args.push_back("ms-dns");
+    args.push_back(inet_ntoa(dns1));
+    args.push_back("ms-dns");
+    args.push_back(inet_ntoa(dns2));
+    args.push_back("lcp-max-configure");
+    args.push_back("99999");
+    mPppdId = ProcessSupervisor::Instance()->spawn("pppd", args, -1, false);
+    if (mPppdId == -1) {
         return -1;
     }
-
-    if (!pid) {
-        char *l = strdup(inet_ntoa(local));
-        char *r = strdup(inet_ntoa(remote));
-        char *d1 = strdup(inet_ntoa(dns1));
-        char *d2 = strdup(inet_ntoa(dns2));
-        char dev[32];
-        char *lr;
-
-        asprintf(&lr, "%s:%s", l, r);
-
-        snprintf(dev, sizeof(dev), "/dev/%s", tty);
-
-        // TODO: Deal with pppd bailing out after 99999 seconds of being started
-        // but not getting a connection
-        if (execl("/system/bin/pppd", "/system/bin/pppd", "-detach", dev, "115200",
-                  lr, "ms-dns", d1, "ms-dns", d2, "lcp-max-configure", "99999", (char *) NULL)) {
-            ALOGE("execl failed (%s)", strerror(errno));
-        }
-        ALOGE("Should never get here!");
-        return 0;
-    } else {
-        mPid = pid;
-    }
     return 0;
 }
 
 int PppController::detachPppd(const char *tty) {
 
-    if (mPid == 0) {
+    if (mPppdId == -1) {
         ALOGE("PPPD already stopped");
         return 0;
     }
 
     ALOGD("Stopping PPPD services on port %s", tty);
-    kill(mPid, SIGTERM);
-    waitpid(mPid, NULL, 0);
-    mPid = 0;
+    ProcessSupervisor::Instance()->stop(mPppdId);
+    mPppdId = -1;
     ALOGD("PPPD services on port %s stopped", tty);
     return 0;
 }
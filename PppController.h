@@ -25,7 +25,8 @@ typedef android::netd::List<char *> TtyCollection;
 
 class PppController {
     TtyCollection *mTtys;
-    pid_t          mPid; // TODO: Add support for > 1 pppd instance
+    int            mPppdId; // ProcessSupervisor id, -1 when detached
+                            // TODO: Add support for > 1 pppd instance
 
 public:
     PppController();
@@ -0,0 +1,290 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/signalfd.h>
+#include <sys/wait.h>
+
+#define __STDC_FORMAT_MACROS 1
+#include <inttypes.h>
+
+#define LOG_TAG "ProcessSupervisor"
+
+#include <cutils/log.h>
+#include <sysutils/SocketClient.h>
+
+#include "LatencyStats.h"
+#include "ProcessSupervisor.h"
+#include "ResponseCode.h"
+
+/* A run shorter than this counts as a crash loop and doubles the restart delay. */
+static const int64_t STABLE_RUN_US = 60 * 1000000LL;
+static const int64_t MIN_BACKOFF_US = 1000000LL;
+static const int64_t MAX_BACKOFF_US = 64 * 1000000LL;
+
+static LatencyStats sSpawnStats("exec", "ProcessSupervisor::spawn");
+
+ProcessSupervisor *ProcessSupervisor::sInstance = NULL;
+
+ProcessSupervisor *ProcessSupervisor::Instance() {
+    if (!sInstance)
+        sInstance = new ProcessSupervisor();
+    return sInstance;
+}
+
+ProcessSupervisor::ProcessSupervisor() : mNextId(1), mSignalFd(-1) {
+    pthread_mutex_init(&mLock, NULL);
+    sigemptyset(&mChildMask);
+}
+
+int ProcessSupervisor::start() {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    mSignalFd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (mSignalFd < 0) {
+        ALOGE("signalfd failed (%s)", strerror(errno));
+        return -1;
+    }
+
+    pthread_t thread;
+    int res = pthread_create(&thread, NULL, ProcessSupervisor::threadStart, this);
+    if (res) {
+        ALOGE("pthread_create failed (%s)", strerror(res));
+        close(mSignalFd);
+        mSignalFd = -1;
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+int ProcessSupervisor::spawn(const char *name, const std::vector<std::string> &args,
+                             int stdinFd, bool restart) {
+    Child child;
+    child.name = name;
+    child.args = args;
+    child.stdinFd = stdinFd;
+    child.restart = restart;
+    child.pid = 0;
+    child.stopping = false;
+    child.startedUs = 0;
+    child.restartUs = 0;
+    child.backoffUs = MIN_BACKOFF_US;
+    child.starts = 0;
+    child.crashes = 0;
+    child.lastStartLatencyUs = 0;
+
+    pthread_mutex_lock(&mLock);
+    if (launchLocked(child)) {
+        int err = errno;
+        pthread_mutex_unlock(&mLock);
+        errno = err;
+        return -1;
+    }
+    int id = mNextId++;
+    mChildren[id] = child;
+    pthread_mutex_unlock(&mLock);
+    return id;
+}
+
+int ProcessSupervisor::launchLocked(Child &child) {
+    // Everything the child needs is set up here: after vfork() it may only exec or exit.
+    std::vector<char *> argv;
+    for (size_t i = 0; i < child.args.size(); i++) {
+        argv.push_back(const_cast<char *>(child.args[i].c_str()));
+    }
+    argv.push_back(NULL);
+    pthread_sigmask(SIG_SETMASK, NULL, &mChildMask);
+    sigdelset(&mChildMask, SIGCHLD);
+    int stdinFd = child.stdinFd;
+
+    // The child shares our memory until it execs, so it can report why it couldn't.
+    volatile int execErrno = 0;
+    int64_t start = LatencyStats::now();
+    pid_t pid = vfork();
+    if (pid == 0) {
+        sigprocmask(SIG_SETMASK, &mChildMask, NULL);
+        if (stdinFd >= 0 && dup2(stdinFd, STDIN_FILENO) < 0) {
+            execErrno = errno;
+            _exit(127);
+        }
+        execv(argv[0], &argv[0]);
+        execErrno = errno;
+        _exit(127);
+    }
+    if (pid < 0 || execErrno) {
+        int err = (pid < 0) ? errno : execErrno;
+        if (pid > 0) {
+            waitpid(pid, NULL, 0);
+        }
+        sSpawnStats.record(start, true);
+        ALOGE("Unable to start %s (%s)", argv[0], strerror(err));
+        errno = err;
+        return -1;
+    }
+
+    child.pid = pid;
+    child.startedUs = LatencyStats::now();
+    child.restartUs = 0;
+    child.starts++;
+    child.lastStartLatencyUs = child.startedUs - start;
+    sSpawnStats.record(start, false);
+    ALOGD("%s started, pid %d", child.name.c_str(), pid);
+    return 0;
+}
+
+int ProcessSupervisor::stop(int id) {
+    pthread_mutex_lock(&mLock);
+    std::map<int, Child>::iterator it = mChildren.find(id);
+    if (it == mChildren.end()) {
+        pthread_mutex_unlock(&mLock);
+        errno = ENOENT;
+        return -1;
+    }
+    pid_t pid = it->second.pid;
+    if (!pid) {
+        mChildren.erase(it);
+        pthread_mutex_unlock(&mLock);
+        return 0;
+    }
+    // The reaper leaves it alone from now on, the waitpid() below is ours.
+    it->second.stopping = true;
+    std::string name = it->second.name;
+    pthread_mutex_unlock(&mLock);
+
+    ALOGD("Stopping %s, pid %d", name.c_str(), pid);
+    kill(pid, SIGTERM);
+    while (waitpid(pid, NULL, 0) < 0 && errno == EINTR) {
+    }
+
+    pthread_mutex_lock(&mLock);
+    mChildren.erase(id);
+    pthread_mutex_unlock(&mLock);
+    return 0;
+}
+
+bool ProcessSupervisor::isRunning(int id) {
+    pthread_mutex_lock(&mLock);
+    bool running = false;
+    std::map<int, Child>::iterator it = mChildren.find(id);
+    if (it != mChildren.end()) {
+        // Don't depend on the reaper having caught up.
+        reapLocked(it->second, LatencyStats::now());
+        running = it->second.pid || it->second.restartUs;
+    }
+    pthread_mutex_unlock(&mLock);
+    return running;
+}
+
+/* Returns true if the child exited; a restart is scheduled if it wants one. */
+bool ProcessSupervisor::reapLocked(Child &child, int64_t now) {
+    if (!child.pid || child.stopping) {
+        return false;
+    }
+    int status;
+    if (waitpid(child.pid, &status, WNOHANG) <= 0) {
+        return false;
+    }
+
+    if (WIFSIGNALED(status)) {
+        ALOGW("%s (pid %d) killed by signal %d", child.name.c_str(), child.pid,
+              WTERMSIG(status));
+    } else {
+        ALOGW("%s (pid %d) exited with status %d", child.name.c_str(), child.pid,
+              WEXITSTATUS(status));
+    }
+    child.pid = 0;
+    child.crashes++;
+    if (child.restart) {
+        if (now - child.startedUs >= STABLE_RUN_US) {
+            child.backoffUs = MIN_BACKOFF_US;
+        }
+        child.restartUs = now + child.backoffUs;
+        ALOGI("Restarting %s in %" PRId64 "ms", child.name.c_str(), child.backoffUs / 1000);
+        child.backoffUs = (child.backoffUs * 2 > MAX_BACKOFF_US) ?
+                MAX_BACKOFF_US : child.backoffUs * 2;
+    }
+    return true;
+}
+
+/* Reaps and restarts what is due. Returns the poll() timeout until the next restart. */
+int ProcessSupervisor::reapAllLocked() {
+    int64_t now = LatencyStats::now();
+    int64_t next = -1;
+    std::map<int, Child>::iterator it;
+    for (it = mChildren.begin(); it != mChildren.end(); ++it) {
+        Child &child = it->second;
+        reapLocked(child, now);
+        if (child.restartUs && child.restartUs <= now && launchLocked(child)) {
+            // Couldn't even exec it; try again later rather than spin.
+            child.restartUs = now + child.backoffUs;
+        }
+        if (child.restartUs && (next < 0 || child.restartUs < next)) {
+            next = child.restartUs;
+        }
+    }
+    return (next < 0) ? -1 : (int) ((next - now) / 1000) + 1;
+}
+
+void *ProcessSupervisor::threadStart(void *obj) {
+    reinterpret_cast<ProcessSupervisor *>(obj)->run();
+    return NULL;
+}
+
+void ProcessSupervisor::run() {
+    while (true) {
+        pthread_mutex_lock(&mLock);
+        int timeoutMs = reapAllLocked();
+        pthread_mutex_unlock(&mLock);
+
+        struct pollfd fds = { mSignalFd, POLLIN, 0 };
+        if (poll(&fds, 1, timeoutMs) < 0 && errno != EINTR) {
+            ALOGE("poll failed (%s)", strerror(errno));
+            return;
+        }
+        // SIGCHLDs coalesce, so each wakeup checks every child anyway.
+        struct signalfd_siginfo info;
+        while (read(mSignalFd, &info, sizeof(info)) > 0) {
+        }
+    }
+}
+
+void ProcessSupervisor::dump(SocketClient *cli) {
+    std::vector<std::string> lines;
+    pthread_mutex_lock(&mLock);
+    std::map<int, Child>::iterator it;
+    for (it = mChildren.begin(); it != mChildren.end(); ++it) {
+        const Child &child = it->second;
+        char *msg;
+        if (asprintf(&msg, "process %s pid=%d starts=%u crashes=%u start_us=%" PRId64,
+                     child.name.c_str(), child.pid, child.starts, child.crashes,
+                     child.lastStartLatencyUs) >= 0) {
+            lines.push_back(msg);
+            free(msg);
+        }
+    }
+    pthread_mutex_unlock(&mLock);
+
+    for (size_t i = 0; i < lines.size(); i++) {
+        cli->sendMsg(ResponseCode::StatsListResult, lines[i].c_str(), false);
+    }
+}
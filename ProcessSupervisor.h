@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _PROCESS_SUPERVISOR_H
+#define _PROCESS_SUPERVISOR_H
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+class SocketClient;
+
+/*
+ * Starts and reaps the daemons netd runs: clatd, dnsmasq, hostapd and pppd.
+ *
+ * Children are started with vfork() and execv(), so the page tables of netd are not
+ * copied for every start, and a single thread reaps them off a signalfd. Only the
+ * supervised pids are waited for; the exec helpers keep reaping their own children.
+ * A child started with restart set is started again when it dies on its own, after a
+ * delay that doubles with every crash that follows a short run.
+ */
+class ProcessSupervisor {
+public:
+    static ProcessSupervisor *Instance();
+
+    /* Starts the reaper thread. SIGCHLD must already be blocked in every thread. */
+    int start();
+
+    /*
+     * Runs args[0] with args, and stdin from stdinFd unless that is -1. The caller keeps
+     * stdinFd; it is reused on restarts. Returns an id for the other calls, or -1 with
+     * errno set if the program could not be run.
+     */
+    int spawn(const char *name, const std::vector<std::string> &args, int stdinFd,
+              bool restart);
+
+    /* Sends SIGTERM and waits for the child to exit. It is forgotten afterwards. */
+    int stop(int id);
+
+    /* False once the child has exited, unless it is about to be restarted. */
+    bool isRunning(int id);
+
+    /* Sends one StatsListResult line per child. */
+    void dump(SocketClient *cli);
+
+private:
+    struct Child {
+        std::string name;
+        std::vector<std::string> args;
+        int stdinFd;
+        bool restart;
+        pid_t pid;            // 0 while not running
+        bool stopping;        // stop() is reaping it
+        int64_t startedUs;
+        int64_t restartUs;    // when to start it again, 0 if it isn't going to be
+        int64_t backoffUs;
+        uint32_t starts;
+        uint32_t crashes;
+        int64_t lastStartLatencyUs;
+    };
+
+    ProcessSupervisor();
+
+    static void *threadStart(void *obj);
+    void run();
+    int launchLocked(Child &child);
+    bool reapLocked(Child &child, int64_t now);
+    int reapAllLocked();
+
+    static ProcessSupervisor *sInstance;
+
+    pthread_mutex_t mLock;
+    std::map<int, Child> mChildren;
+    int mNextId;
+    int mSignalFd;
+    sigset_t mChildMask;  // what the children start with: ours minus SIGCHLD
+};
+
+#endif
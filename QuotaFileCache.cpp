@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define LOG_TAG "QuotaFileCache"
+
+#include <cutils/log.h>
+
+#include "QuotaFileCache.h"
+
+QuotaFileCache::~QuotaFileCache() {
+    clear();
+}
+
+int QuotaFileCache::open(const char *name) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "/proc/net/xt_quota/%s", name);
+    int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        ALOGE("Reading quota %s failed (%s)", name, strerror(errno));
+        return -1;
+    }
+    mFds[name] = fd;
+    return fd;
+}
+
+int QuotaFileCache::read(const char *name, int64_t *bytes) {
+    std::map<std::string, int>::iterator it = mFds.find(name);
+    int fd = (it != mFds.end()) ? it->second : open(name);
+
+    /*
+     * If the quota was deleted and recreated under the same name, the cached file
+     * belongs to the old proc entry and the read fails; reopen once in that case.
+     */
+    char buf[32];
+    ssize_t len = -1;
+    for (int attempt = 0; attempt < 2 && fd >= 0; attempt++) {
+        len = pread(fd, buf, sizeof(buf) - 1, 0);
+        if (len > 0) {
+            break;
+        }
+        forget(name);
+        fd = (attempt == 0) ? open(name) : -1;
+    }
+    if (len <= 0) {
+        return -1;
+    }
+    buf[len] = '\0';
+
+    char *end;
+    *bytes = strtoll(buf, &end, 10);
+    return (end != buf) ? 0 : -1;
+}
+
+void QuotaFileCache::forget(const char *name) {
+    std::map<std::string, int>::iterator it = mFds.find(name);
+    if (it != mFds.end()) {
+        close(it->second);
+        mFds.erase(it);
+    }
+}
+
+void QuotaFileCache::clear() {
+    std::map<std::string, int>::iterator it;
+    for (it = mFds.begin(); it != mFds.end(); ++it) {
+        close(it->second);
+    }
+    mFds.clear();
+}
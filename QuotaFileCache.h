@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _QUOTA_FILE_CACHE_H
+#define _QUOTA_FILE_CACHE_H
+
+#include <stdint.h>
+
+#include <map>
+#include <string>
+
+/*
+ * Keeps /proc/net/xt_quota/<name> open for each quota that has been read, so reading
+ * a counter again is a single pread() instead of open + fscanf + close.
+ * Not thread safe; it belongs to the controller that owns the quotas.
+ */
+class QuotaFileCache {
+public:
+    QuotaFileCache() {}
+    ~QuotaFileCache();
+
+    /* Reads the current value of a quota. Returns 0 on success, -1 otherwise. */
+    int read(const char *name, int64_t *bytes);
+    /* Closes the file of a quota whose rule is going away. */
+    void forget(const char *name);
+    void clear();
+
+private:
+    int open(const char *name);
+
+    std::map<std::string, int> mFds;
+};
+
+#endif
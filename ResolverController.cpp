@@ -20,20 +20,43 @@
 #include <cutils/log.h>
 
 #include <net/if.h>
+#include <stdio.h>
+
+#include <sysutils/SocketClient.h>
 
 // NOTE: <resolv_netid.h> is a private C library header that provides
 //       declarations for _resolv_set_nameservers_for_net and
 //       _resolv_flush_cache_for_net
 #include <resolv_netid.h>
 
+#include "AsyncResolver.h"
+#include "DnsStats.h"
 #include "ResolverController.h"
+#include "ResponseCode.h"
 
 int ResolverController::setDnsServers(unsigned netId, const char* domains,
         const char** servers, int numservers) {
     if (DBG) {
         ALOGD("setDnsServers netId = %u\n", netId);
     }
+
+    NetConfig &config = mConfigs[netId];
+    std::vector<std::string> newServers(servers, servers + numservers);
+    const char *newDomains = domains ? domains : "";
+    if (config.applied && config.servers == newServers && config.domains == newDomains) {
+        if (DBG) {
+            ALOGD("setDnsServers netId = %u unchanged, keeping cache\n", netId);
+        }
+        config.skipped++;
+        return 0;
+    }
+
     _resolv_set_nameservers_for_net(netId, servers, numservers, domains);
+    AsyncResolver::Instance()->setServers(netId, servers, numservers, domains);
+    DnsStats::Instance()->setServers(netId, servers, numservers);
+    config.servers.swap(newServers);
+    config.domains = newDomains;
+    config.applied++;
 
     return 0;
 }
@@ -44,7 +67,21 @@ int ResolverController::flushDnsCache(unsigned netId) {
     }
 
     _resolv_flush_cache_for_net(netId);
+    AsyncResolver::Instance()->flushCache(netId);
+    mConfigs[netId].flushes++;
 
     return 0;
 }
 
+void ResolverController::dumpCacheStats(SocketClient *cli) {
+    for (std::map<unsigned, NetConfig>::const_iterator it = mConfigs.begin();
+            it != mConfigs.end(); ++it) {
+        const NetConfig &config = it->second;
+        char msg[128];
+        snprintf(msg, sizeof(msg), "%u servers=%d applied=%u skipped=%u flushes=%u",
+                it->first, (int) config.servers.size(), config.applied, config.skipped,
+                config.flushes);
+        cli->sendMsg(ResponseCode::ResolverCacheStatsResult, msg, false);
+    }
+}
+
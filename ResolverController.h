@@ -20,15 +20,40 @@
 #include <netinet/in.h>
 #include <linux/in.h>
 
+#include <map>
+#include <string>
+#include <vector>
+
+class SocketClient;
+
 class ResolverController {
 public:
     ResolverController() {};
     virtual ~ResolverController() {};
 
+    /*
+     * Setting the servers rebuilds the network's resolver cache, so a call that
+     * repeats the configuration already applied to netid is skipped.
+     */
     int setDnsServers(unsigned netid, const char * domains, const char** servers,
             int numservers);
     int flushDnsCache(unsigned netid);
     // TODO: Add deleteDnsCache(unsigned netId)
+
+    /* Sends one ResolverCacheStatsResult line per configured network. */
+    void dumpCacheStats(SocketClient *cli);
+
+private:
+    struct NetConfig {
+        std::string domains;
+        std::vector<std::string> servers;
+        unsigned applied;   // updates that rebuilt the cache
+        unsigned skipped;   // updates identical to the applied config
+        unsigned flushes;
+        NetConfig() : applied(0), skipped(0), flushes(0) {}
+    };
+
+    std::map<unsigned, NetConfig> mConfigs;
 };
 
 #endif /* _RESOLVER_CONTROLLER_H_ */
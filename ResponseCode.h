@@ -29,6 +29,12 @@ public:
     static const int TetherDnsFwdTgtListResult = 112;
     static const int TtyListResult             = 113;
     static const int TetheringStatsListResult  = 114;
+    static const int StatsListResult           = 115;
+    static const int QuotaCounterListResult    = 116;
+    static const int ResolverCacheStatsResult  = 117;
+    static const int ResolverStatsResult       = 118;
+    static const int InterfaceCfgListResult    = 119;
+    static const int UidStatsListResult        = 120;
 
     // 200 series - Requested action has been successfully completed
     static const int CommandOkay               = 200;
@@ -47,6 +53,7 @@ public:
     static const int ClatdStatusResult         = 223;
     static const int InterfaceGetMtuResult     = 224;
     static const int GetMarkResult             = 225;
+    static const int UidStatsResult            = 226;
 
     // 400 series - The command was accepted but the requested action
     // did not take place.
@@ -0,0 +1,495 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <linux/fib_rules.h>
+#include <linux/if.h>
+#include <linux/ipv6_route.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <netinet/in.h>
+
+#define LOG_TAG "RouteCache"
+
+#include <cutils/log.h>
+#include <sysutils/SocketClient.h>
+
+#include "ResponseCode.h"
+#include "RouteCache.h"
+
+static const int DUMP_TIMEOUT_SEC = 5;
+
+RouteCache *RouteCache::sInstance = NULL;
+
+RouteCache *RouteCache::Instance() {
+    if (!sInstance)
+        sInstance = new RouteCache();
+    return sInstance;
+}
+
+RouteCache::RouteCache() : mFirstTable(0), mValid(false), mRouteCount(0), mRuleCount(0),
+                           mNextOwnPort(0), mAnswered(0), mDumps(0) {
+    pthread_mutex_init(&mLock, NULL);
+    memset(mOwnPorts, 0, sizeof(mOwnPorts));
+}
+
+bool RouteCache::Dest::operator<(const Dest &other) const {
+    if (family != other.family)
+        return family < other.family;
+    if (table != other.table)
+        return table < other.table;
+    if (dstLen != other.dstLen)
+        return dstLen < other.dstLen;
+    return memcmp(dst, other.dst, sizeof(dst)) < 0;
+}
+
+int RouteCache::start(uint32_t firstTable) {
+    pthread_mutex_lock(&mLock);
+    mFirstTable = firstTable;
+    int res = dumpLocked();
+    pthread_mutex_unlock(&mLock);
+    return res;
+}
+
+void RouteCache::invalidate() {
+    pthread_mutex_lock(&mLock);
+    mValid = false;
+    pthread_mutex_unlock(&mLock);
+}
+
+bool RouteCache::tracked(uint32_t table) const {
+    return mFirstTable && table >= mFirstTable &&
+            (table < RT_TABLE_DEFAULT || table > RT_TABLE_LOCAL);
+}
+
+/* Clears the address bits past the prefix, as the kernel stores IPv6 prefixes. */
+static void maskPrefix(uint8_t addr[16], uint8_t prefixLen) {
+    for (int bit = prefixLen; bit < 128; bit++) {
+        addr[bit / 8] &= ~(0x80 >> (bit % 8));
+    }
+}
+
+/* Copies an address attribute; false if it is too short for the family. */
+static bool copyAddr(uint8_t addr[16], const struct rtattr *rta, int family) {
+    size_t len = (family == AF_INET6) ? 16 : 4;
+    if (RTA_PAYLOAD(rta) < len) {
+        return false;
+    }
+    memcpy(addr, RTA_DATA(rta), len);
+    return true;
+}
+
+static uint32_t getU32(const struct rtattr *rta) {
+    uint32_t value = 0;
+    if (RTA_PAYLOAD(rta) >= sizeof(value)) {
+        memcpy(&value, RTA_DATA(rta), sizeof(value));
+    }
+    return value;
+}
+
+bool RouteCache::parseRoute(const struct nlmsghdr *nlh, Dest *dest, Nexthop *nh) const {
+    if (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(struct rtmsg))) {
+        return false;
+    }
+    const struct rtmsg *rtm = reinterpret_cast<const struct rtmsg *>(NLMSG_DATA(nlh));
+    if ((rtm->rtm_family != AF_INET && rtm->rtm_family != AF_INET6) ||
+            (rtm->rtm_flags & RTM_F_CLONED)) {
+        return false;
+    }
+
+    memset(dest, 0, sizeof(*dest));
+    memset(nh, 0, sizeof(*nh));
+    dest->family = rtm->rtm_family;
+    dest->dstLen = rtm->rtm_dst_len;
+    dest->table = rtm->rtm_table;
+    nh->tos = rtm->rtm_tos;
+
+    const struct rtattr *rta = RTM_RTA(rtm);
+    int len = RTM_PAYLOAD(nlh);
+    for (; RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+        switch (rta->rta_type) {
+        case RTA_TABLE:
+            dest->table = getU32(rta);
+            break;
+        case RTA_DST:
+            if (!copyAddr(dest->dst, rta, dest->family))
+                return false;
+            break;
+        case RTA_GATEWAY:
+            if (!copyAddr(nh->gateway, rta, dest->family))
+                return false;
+            nh->hasGateway = true;
+            break;
+        case RTA_OIF:
+            nh->oif = getU32(rta);
+            break;
+        case RTA_PRIORITY:
+            nh->priority = getU32(rta);
+            nh->hasPriority = true;
+            break;
+        case RTA_CACHEINFO:
+            if (RTA_PAYLOAD(rta) >= sizeof(struct rta_cacheinfo)) {
+                nh->expires = reinterpret_cast<const struct rta_cacheinfo *>(
+                        RTA_DATA(rta))->rta_expires != 0;
+            }
+            break;
+        }
+    }
+    if (dest->family == AF_INET6) {
+        maskPrefix(dest->dst, dest->dstLen);
+    }
+    return tracked(dest->table);
+}
+
+bool RouteCache::parseRule(const struct nlmsghdr *nlh, Rule *rule) const {
+    if (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(struct fib_rule_hdr))) {
+        return false;
+    }
+    const struct fib_rule_hdr *frh =
+            reinterpret_cast<const struct fib_rule_hdr *>(NLMSG_DATA(nlh));
+    if (frh->family != AF_INET && frh->family != AF_INET6) {
+        return false;
+    }
+
+    memset(rule, 0, sizeof(*rule));
+    rule->family = frh->family;
+    rule->table = frh->table;
+    rule->srcLen = frh->src_len;
+    rule->dstLen = frh->dst_len;
+
+    const struct rtattr *rta = reinterpret_cast<const struct rtattr *>(
+            reinterpret_cast<const char *>(frh) + NLMSG_ALIGN(sizeof(*frh)));
+    int len = nlh->nlmsg_len - NLMSG_LENGTH(sizeof(*frh));
+    for (; RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+        switch (rta->rta_type) {
+        case FRA_TABLE:
+            rule->table = getU32(rta);
+            break;
+        case FRA_PRIORITY:
+            rule->priority = getU32(rta);
+            rule->hasPriority = true;
+            break;
+        case FRA_FWMARK:
+            rule->fwmark = getU32(rta);
+            break;
+        case FRA_SRC:
+            if (!copyAddr(rule->src, rta, rule->family))
+                return false;
+            break;
+        case FRA_DST:
+            if (!copyAddr(rule->dst, rta, rule->family))
+                return false;
+            break;
+        }
+    }
+    return tracked(rule->table);
+}
+
+/*
+ * Whether the kernel would take have for want. A delete leaves out what it doesn't care
+ * about, unless exact: the kernel's own messages describe the one route they are about.
+ */
+bool RouteCache::routeMatches(const Nexthop &have, const Nexthop &want, bool exact) {
+    if (exact && (have.oif != want.oif || have.hasGateway != want.hasGateway ||
+                  have.priority != want.priority))
+        return false;
+    if (want.oif && have.oif != want.oif)
+        return false;
+    if (want.hasGateway && (!have.hasGateway || memcmp(have.gateway, want.gateway, 16)))
+        return false;
+    if (want.hasPriority && have.hasPriority && have.priority != want.priority)
+        return false;
+    return have.tos == want.tos;
+}
+
+/* A rule netd added without a priority got one from the kernel that we don't know. */
+bool RouteCache::ruleMatches(const Rule &have, const Rule &want) {
+    if (want.hasPriority && have.hasPriority && have.priority != want.priority)
+        return false;
+    if (want.fwmark && have.fwmark != want.fwmark)
+        return false;
+    if (want.srcLen && (have.srcLen != want.srcLen || memcmp(have.src, want.src, 16)))
+        return false;
+    if (want.dstLen && (have.dstLen != want.dstLen || memcmp(have.dst, want.dst, 16)))
+        return false;
+    return true;
+}
+
+bool RouteCache::validLocked() {
+    if (!mFirstTable) {
+        return false;
+    }
+    return mValid || !dumpLocked();
+}
+
+int RouteCache::check(const struct nlmsghdr *request) {
+    int res = 0;
+    pthread_mutex_lock(&mLock);
+    if (request->nlmsg_type == RTM_NEWROUTE || request->nlmsg_type == RTM_DELROUTE) {
+        Dest dest;
+        Nexthop want;
+        if (parseRoute(request, &dest, &want) && validLocked()) {
+            bool add = request->nlmsg_type == RTM_NEWROUTE;
+            // What a route added without a metric gets.
+            if (add && !want.hasPriority) {
+                want.hasPriority = true;
+                want.priority = (dest.family == AF_INET6) ? IP6_RT_PRIO_USER : 0;
+            }
+            bool found = false;
+            RouteMap::const_iterator it = mRoutes.find(dest);
+            for (size_t i = 0; it != mRoutes.end() && i < it->second.size() && !found; i++) {
+                const Nexthop &have = it->second[i];
+                found = routeMatches(have, want, add) && !(add && have.expires);
+            }
+            if (add && found) {
+                res = -EEXIST;
+            } else if (!add && !found) {
+                res = -ESRCH;
+            }
+        }
+    } else if (request->nlmsg_type == RTM_DELRULE) {
+        Rule want;
+        if (parseRule(request, &want) && validLocked()) {
+            RuleMap::const_iterator it = mRules.find(std::make_pair(want.family, want.table));
+            bool found = false;
+            for (size_t i = 0; it != mRules.end() && i < it->second.size() && !found; i++) {
+                found = ruleMatches(it->second[i], want);
+            }
+            if (!found) {
+                res = -ENOENT;
+            }
+        }
+    }
+    if (res) {
+        mAnswered++;
+    }
+    pthread_mutex_unlock(&mLock);
+    return res;
+}
+
+void RouteCache::applied(const struct nlmsghdr *request) {
+    pthread_mutex_lock(&mLock);
+    if (mValid) {
+        applyLocked(request, false);
+    }
+    pthread_mutex_unlock(&mLock);
+}
+
+void RouteCache::addOwnPort(uint32_t port) {
+    pthread_mutex_lock(&mLock);
+    mOwnPorts[mNextOwnPort] = port;
+    mNextOwnPort = (mNextOwnPort + 1) % OWN_PORTS;
+    pthread_mutex_unlock(&mLock);
+}
+
+void RouteCache::handleNotification(const struct nlmsghdr *nlh) {
+    pthread_mutex_lock(&mLock);
+    if (!mValid || !mFirstTable) {
+        pthread_mutex_unlock(&mLock);
+        return;
+    }
+
+    switch (nlh->nlmsg_type) {
+    case RTM_NEWROUTE:
+    case RTM_DELROUTE:
+    case RTM_NEWRULE:
+    case RTM_DELRULE: {
+        // Our own changes were recorded when they were ACKed, and may have been
+        // undone since.
+        bool own = false;
+        for (size_t i = 0; i < OWN_PORTS && nlh->nlmsg_pid; i++) {
+            own |= mOwnPorts[i] == nlh->nlmsg_pid;
+        }
+        if (!own) {
+            applyLocked(nlh, true);
+        }
+        break;
+    }
+    case RTM_NEWLINK:
+    case RTM_DELLINK:
+        // IPv4 flushes the routes of an interface that goes down without a word.
+        if (nlh->nlmsg_len >= NLMSG_LENGTH(sizeof(struct ifinfomsg))) {
+            const struct ifinfomsg *ifi =
+                    reinterpret_cast<const struct ifinfomsg *>(NLMSG_DATA(nlh));
+            if (nlh->nlmsg_type == RTM_DELLINK || !(ifi->ifi_flags & IFF_UP)) {
+                mValid = false;
+            }
+        }
+        break;
+    case RTM_DELADDR:
+        // So it does when the last IPv4 address goes.
+        if (nlh->nlmsg_len >= NLMSG_LENGTH(sizeof(struct ifaddrmsg)) &&
+                reinterpret_cast<const struct ifaddrmsg *>(
+                        NLMSG_DATA(nlh))->ifa_family == AF_INET) {
+            mValid = false;
+        }
+        break;
+    }
+    pthread_mutex_unlock(&mLock);
+}
+
+void RouteCache::applyLocked(const struct nlmsghdr *nlh, bool fromKernel) {
+    switch (nlh->nlmsg_type) {
+    case RTM_NEWROUTE:
+    case RTM_DELROUTE: {
+        Dest dest;
+        Nexthop nh;
+        if (!parseRoute(nlh, &dest, &nh)) {
+            return;
+        }
+        if (nlh->nlmsg_type == RTM_NEWROUTE && !nh.hasPriority) {
+            nh.hasPriority = true;
+            nh.priority = (dest.family == AF_INET6) ? IP6_RT_PRIO_USER : 0;
+        }
+        std::vector<Nexthop> &nexthops = mRoutes[dest];
+        size_t i = 0;
+        bool exact = fromKernel || nlh->nlmsg_type == RTM_NEWROUTE;
+        while (i < nexthops.size() && !routeMatches(nexthops[i], nh, exact)) {
+            i++;
+        }
+        if (nlh->nlmsg_type == RTM_NEWROUTE) {
+            // Otherwise a replace, or an add we already know of.
+            if (i == nexthops.size()) {
+                nexthops.push_back(nh);
+                mRouteCount++;
+            }
+        } else if (i < nexthops.size()) {
+            nexthops.erase(nexthops.begin() + i);
+            mRouteCount--;
+        }
+        if (nexthops.empty()) {
+            mRoutes.erase(dest);
+        }
+        break;
+    }
+    case RTM_NEWRULE:
+    case RTM_DELRULE: {
+        Rule rule;
+        if (!parseRule(nlh, &rule)) {
+            return;
+        }
+        std::pair<uint8_t, uint32_t> key(rule.family, rule.table);
+        std::vector<Rule> &rules = mRules[key];
+        if (nlh->nlmsg_type == RTM_NEWRULE) {
+            rules.push_back(rule);
+            mRuleCount++;
+            return;
+        }
+        for (size_t i = 0; i < rules.size(); i++) {
+            if (ruleMatches(rules[i], rule)) {
+                rules.erase(rules.begin() + i);
+                mRuleCount--;
+                break;
+            }
+        }
+        if (rules.empty()) {
+            mRules.erase(key);
+        }
+        break;
+    }
+    }
+}
+
+int RouteCache::dumpLocked() {
+    mValid = false;
+    mRoutes.clear();
+    mRules.clear();
+    mRouteCount = 0;
+    mRuleCount = 0;
+    mDumps++;
+
+    int sock = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (sock < 0) {
+        ALOGE("Unable to open rtnetlink socket (%s)", strerror(errno));
+        return -1;
+    }
+    struct timeval tv = { DUMP_TIMEOUT_SEC, 0 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    static const uint16_t TYPES[] = { RTM_GETROUTE, RTM_GETRULE };
+    int res = 0;
+    for (size_t t = 0; t < sizeof(TYPES) / sizeof(TYPES[0]) && !res; t++) {
+        struct {
+            struct nlmsghdr nlh;
+            struct rtmsg rtm;
+        } req;
+        memset(&req, 0, sizeof(req));
+        req.nlh.nlmsg_len = NLMSG_LENGTH(sizeof(req.rtm));
+        req.nlh.nlmsg_type = TYPES[t];
+        req.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+        req.nlh.nlmsg_seq = t + 1;
+        req.rtm.rtm_family = AF_UNSPEC;
+        if (send(sock, &req, req.nlh.nlmsg_len, 0) < 0) {
+            res = -errno;
+            break;
+        }
+
+        char buf[16 * 1024];
+        bool done = false;
+        while (!done && !res) {
+            ssize_t len = recv(sock, buf, sizeof(buf), 0);
+            if (len < 0) {
+                if (errno != EINTR)
+                    res = -errno;
+                continue;
+            }
+            struct nlmsghdr *nlh = reinterpret_cast<struct nlmsghdr *>(buf);
+            for (; NLMSG_OK(nlh, (size_t) len); nlh = NLMSG_NEXT(nlh, len)) {
+                if (nlh->nlmsg_type == NLMSG_DONE) {
+                    done = true;
+                    break;
+                }
+                if (nlh->nlmsg_type == NLMSG_ERROR) {
+                    const struct nlmsgerr *err =
+                            reinterpret_cast<const struct nlmsgerr *>(NLMSG_DATA(nlh));
+                    res = err->error ? err->error : -EIO;
+                    break;
+                }
+                // The dump replies look like RTM_NEWROUTE and RTM_NEWRULE notifications.
+                applyLocked(nlh, true);
+            }
+        }
+    }
+    close(sock);
+
+    if (res) {
+        ALOGE("Dumping the routing tables failed (%s)", strerror(-res));
+        mRoutes.clear();
+        mRules.clear();
+        mRouteCount = 0;
+        mRuleCount = 0;
+        return -1;
+    }
+    mValid = true;
+    return 0;
+}
+
+void RouteCache::dump(SocketClient *cli) {
+    pthread_mutex_lock(&mLock);
+    char msg[128];
+    snprintf(msg, sizeof(msg), "routecache valid=%d routes=%zu rules=%zu answered=%u dumps=%u",
+             mValid, mRouteCount, mRuleCount, mAnswered, mDumps);
+    pthread_mutex_unlock(&mLock);
+    cli->sendMsg(ResponseCode::StatsListResult, msg, false);
+}
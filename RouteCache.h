@@ -0,0 +1,132 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _ROUTE_CACHE_H
+#define _ROUTE_CACHE_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <map>
+#include <utility>
+#include <vector>
+
+struct nlmsghdr;
+class SocketClient;
+
+/*
+ * What the kernel has in the routing tables netd manages (firstTable and up), so that
+ * RtnetlinkBatch can answer a duplicate add or the delete of something that isn't there
+ * with the error the kernel would have given, without asking it.
+ *
+ * The cache is seeded with a dump, follows the route and rule notifications of the
+ * NETLINK_ROUTE socket NetlinkManager listens on, and records netd's own changes as
+ * their ACKs come in. It only answers when it is sure: whenever the kernel may have
+ * changed the tables without saying so (an interface going down, the last IPv4 address
+ * going away, dropped notifications) it dumps the tables again before the next answer.
+ * Rule adds always go to the kernel, which keeps duplicate rules.
+ */
+class RouteCache {
+public:
+    static RouteCache *Instance();
+
+    /* Starts tracking the tables from firstTable up, bar the kernel's own. */
+    int start(uint32_t firstTable);
+
+    /* The tables are dumped again before the next answer. */
+    void invalidate();
+
+    /*
+     * For an RTM_NEWROUTE, RTM_DELROUTE or RTM_DELRULE request about to be sent: the
+     * -errno the kernel would answer, or 0 if it has to be sent.
+     */
+    int check(const struct nlmsghdr *request);
+
+    /* Records a request of netd's that the kernel ACKed. */
+    void applied(const struct nlmsghdr *request);
+
+    /* Notifications caused by netd's requests from this netlink port are skipped. */
+    void addOwnPort(uint32_t port);
+
+    /* Takes a message from the NETLINK_ROUTE multicast socket. */
+    void handleNotification(const struct nlmsghdr *nlh);
+
+    /* Sends a StatsListResult line. */
+    void dump(SocketClient *cli);
+
+private:
+    struct Dest {
+        uint8_t family;
+        uint8_t dstLen;
+        uint32_t table;
+        uint8_t dst[16];
+        bool operator<(const Dest &other) const;
+    };
+
+    struct Nexthop {
+        uint32_t oif;           // 0: any, on a delete
+        bool hasGateway;
+        uint8_t gateway[16];
+        bool hasPriority;
+        uint32_t priority;
+        uint8_t tos;
+        bool expires;
+    };
+
+    struct Rule {
+        uint8_t family;
+        uint32_t table;
+        bool hasPriority;
+        uint32_t priority;
+        uint32_t fwmark;        // 0: any, on a delete
+        uint8_t srcLen;
+        uint8_t src[16];
+        uint8_t dstLen;
+        uint8_t dst[16];
+    };
+
+    typedef std::map<Dest, std::vector<Nexthop> > RouteMap;
+    typedef std::map<std::pair<uint8_t, uint32_t>, std::vector<Rule> > RuleMap;
+
+    static const size_t OWN_PORTS = 16;
+
+    RouteCache();
+
+    bool tracked(uint32_t table) const;
+    bool parseRoute(const struct nlmsghdr *nlh, Dest *dest, Nexthop *nh) const;
+    bool parseRule(const struct nlmsghdr *nlh, Rule *rule) const;
+    static bool routeMatches(const Nexthop &have, const Nexthop &want, bool exact);
+    static bool ruleMatches(const Rule &have, const Rule &want);
+    bool validLocked();
+    int dumpLocked();
+    void applyLocked(const struct nlmsghdr *nlh, bool fromKernel);
+
+    static RouteCache *sInstance;
+
+    pthread_mutex_t mLock;
+    uint32_t mFirstTable;   // 0 until started
+    bool mValid;
+    RouteMap mRoutes;
+    size_t mRouteCount;
+    RuleMap mRules;
+    size_t mRuleCount;
+    uint32_t mOwnPorts[OWN_PORTS];
+    size_t mNextOwnPort;
+    uint32_t mAnswered;
+    uint32_t mDumps;
+};
+
+#endif
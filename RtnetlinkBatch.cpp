@@ -0,0 +1,403 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+
+#include <arpa/inet.h>
+#include <linux/fib_rules.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <net/if.h>
+#include <netinet/in.h>
+
+#define LOG_TAG "RtnetlinkBatch"
+
+#include <cutils/log.h>
+
+#include "LatencyStats.h"
+#include "RouteCache.h"
+#include "RtnetlinkBatch.h"
+
+// Keeps each sendmsg() (and the ACKs it produces) well below the default socket buffers.
+static const size_t MAX_SEND_BYTES = 16 * 1024;
+static const int ACK_TIMEOUT_SEC = 5;
+
+static LatencyStats sSendStats("rtnetlink", "RtnetlinkBatch::send");
+
+static void appendAttr(std::string *msg, uint16_t type, const void *data, size_t len) {
+    struct rtattr rta;
+    rta.rta_type = type;
+    rta.rta_len = RTA_LENGTH(len);
+    msg->append(reinterpret_cast<const char *>(&rta), sizeof(rta));
+    msg->append(reinterpret_cast<const char *>(data), len);
+    msg->append(RTA_ALIGN(len) - len, '\0');
+}
+
+static void appendAttr32(std::string *msg, uint16_t type, uint32_t value) {
+    appendAttr(msg, type, &value, sizeof(value));
+}
+
+/*
+ * Parses "addr/prefixlen" or "addr" (a host prefix) into addr. "default" is the empty
+ * prefix. Returns the address length in bytes, or -EINVAL.
+ */
+static int parsePrefix(int family, const char *str, uint8_t addr[16], uint8_t *prefixLen) {
+    int addrLen = (family == AF_INET6) ? 16 : 4;
+
+    if (!strcmp(str, "default")) {
+        memset(addr, 0, addrLen);
+        *prefixLen = 0;
+        return addrLen;
+    }
+
+    char buf[INET6_ADDRSTRLEN];
+    const char *slash = strchr(str, '/');
+    size_t len = slash ? (size_t) (slash - str) : strlen(str);
+    if (len >= sizeof(buf)) {
+        return -EINVAL;
+    }
+    memcpy(buf, str, len);
+    buf[len] = '\0';
+    if (inet_pton(family, buf, addr) != 1) {
+        return -EINVAL;
+    }
+
+    *prefixLen = addrLen * 8;
+    if (slash) {
+        char *end;
+        long bits = strtol(slash + 1, &end, 10);
+        if (*(slash + 1) == '\0' || *end != '\0' || bits < 0 || bits > addrLen * 8) {
+            return -EINVAL;
+        }
+        *prefixLen = bits;
+    }
+    return addrLen;
+}
+
+static std::string startMessage(uint16_t type, uint16_t flags, const struct rtmsg &rtm) {
+    struct nlmsghdr nlh;
+    memset(&nlh, 0, sizeof(nlh));
+    nlh.nlmsg_type = type;
+    nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | flags;
+
+    std::string msg(reinterpret_cast<const char *>(&nlh), NLMSG_HDRLEN);
+    msg.append(reinterpret_cast<const char *>(&rtm), sizeof(rtm));
+    msg.append(NLMSG_ALIGN(sizeof(rtm)) - sizeof(rtm), '\0');
+    return msg;
+}
+
+RtnetlinkBatch::RtnetlinkBatch() {
+}
+
+int RtnetlinkBatch::addRoute(bool add, int family, const char *dest, const char *gateway,
+                             const char *iface, uint32_t table) {
+    char description[160];
+    snprintf(description, sizeof(description), "ip %s route %s %s%s%s dev %s table %u",
+             family == AF_INET6 ? "-6" : "-4", add ? "add" : "del", dest,
+             gateway ? " via " : "", gateway ? gateway : "", iface, table);
+
+    struct rtmsg rtm;
+    memset(&rtm, 0, sizeof(rtm));
+    rtm.rtm_family = family;
+    rtm.rtm_table = (table < 256) ? table : RT_TABLE_UNSPEC;
+    if (add) {
+        // Same defaults as "ip route add": on-link unless there is a gateway.
+        rtm.rtm_protocol = RTPROT_BOOT;
+        rtm.rtm_scope = gateway ? RT_SCOPE_UNIVERSE : RT_SCOPE_LINK;
+        rtm.rtm_type = RTN_UNICAST;
+    } else {
+        rtm.rtm_scope = RT_SCOPE_NOWHERE;
+    }
+
+    uint8_t destAddr[16];
+    int destLen = parsePrefix(family, dest, destAddr, &rtm.rtm_dst_len);
+    if (destLen < 0) {
+        return queue(std::string(), description, destLen);
+    }
+
+    uint8_t gatewayAddr[16];
+    if (gateway && inet_pton(family, gateway, gatewayAddr) != 1) {
+        return queue(std::string(), description, -EINVAL);
+    }
+
+    unsigned ifindex = if_nametoindex(iface);
+    if (!ifindex) {
+        return queue(std::string(), description, -ENODEV);
+    }
+
+    std::string msg = startMessage(add ? RTM_NEWROUTE : RTM_DELROUTE,
+                                   add ? NLM_F_CREATE | NLM_F_EXCL : 0, rtm);
+    appendAttr32(&msg, RTA_TABLE, table);
+    if (rtm.rtm_dst_len) {
+        appendAttr(&msg, RTA_DST, destAddr, destLen);
+    }
+    if (gateway) {
+        appendAttr(&msg, RTA_GATEWAY, gatewayAddr, destLen);
+    }
+    appendAttr32(&msg, RTA_OIF, ifindex);
+    return queue(msg, description, 0);
+}
+
+int RtnetlinkBatch::addRule(bool add, int family, uint32_t priority, const char *from,
+                            const char *to, uint32_t fwmark, uint32_t table) {
+    char description[160];
+    snprintf(description, sizeof(description), "ip %s rule %s prio %u from %s to %s "
+             "fwmark %u table %u", family == AF_INET6 ? "-6" : "-4", add ? "add" : "del",
+             priority, from ? from : "all", to ? to : "all", fwmark, table);
+
+    struct rtmsg rtm;
+    memset(&rtm, 0, sizeof(rtm));
+    rtm.rtm_family = family;
+    rtm.rtm_table = (table < 256) ? table : RT_TABLE_UNSPEC;
+    rtm.rtm_protocol = RTPROT_BOOT;
+    rtm.rtm_scope = RT_SCOPE_UNIVERSE;
+    if (add) {
+        rtm.rtm_type = FR_ACT_TO_TBL;
+    }
+
+    uint8_t fromAddr[16];
+    int fromLen = 0;
+    if (from && (fromLen = parsePrefix(family, from, fromAddr, &rtm.rtm_src_len)) < 0) {
+        return queue(std::string(), description, fromLen);
+    }
+    uint8_t toAddr[16];
+    int toLen = 0;
+    if (to && (toLen = parsePrefix(family, to, toAddr, &rtm.rtm_dst_len)) < 0) {
+        return queue(std::string(), description, toLen);
+    }
+
+    std::string msg = startMessage(add ? RTM_NEWRULE : RTM_DELRULE,
+                                   add ? NLM_F_CREATE | NLM_F_EXCL : 0, rtm);
+    appendAttr32(&msg, FRA_TABLE, table);
+    if (priority != NO_PRIORITY) {
+        appendAttr32(&msg, FRA_PRIORITY, priority);
+    }
+    if (rtm.rtm_src_len) {
+        appendAttr(&msg, FRA_SRC, fromAddr, fromLen);
+    }
+    if (rtm.rtm_dst_len) {
+        appendAttr(&msg, FRA_DST, toAddr, toLen);
+    }
+    if (fwmark != NO_FWMARK) {
+        appendAttr32(&msg, FRA_FWMARK, fwmark);
+    }
+    return queue(msg, description, 0);
+}
+
+/* The cache doesn't see this batch's changes before it is sent. */
+bool RtnetlinkBatch::undoesEarlierMessage(const std::string &data) const {
+    uint16_t type = reinterpret_cast<const struct nlmsghdr *>(data.data())->nlmsg_type;
+    uint16_t opposite;
+    switch (type) {
+    case RTM_NEWROUTE: opposite = RTM_DELROUTE; break;
+    case RTM_DELROUTE: opposite = RTM_NEWROUTE; break;
+    case RTM_NEWRULE:  opposite = RTM_DELRULE; break;
+    case RTM_DELRULE:  opposite = RTM_NEWRULE; break;
+    default:           return false;
+    }
+    for (size_t i = 0; i < mMessages.size(); i++) {
+        const std::string &other = mMessages[i].data;
+        if (!other.empty() &&
+                reinterpret_cast<const struct nlmsghdr *>(other.data())->nlmsg_type == opposite) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int RtnetlinkBatch::queue(const std::string &data, const std::string &description, int error) {
+    if (!error && !data.empty() && !undoesEarlierMessage(data)) {
+        std::string msg(data);
+        struct nlmsghdr *nlh = reinterpret_cast<struct nlmsghdr *>(&msg[0]);
+        nlh->nlmsg_len = msg.size();
+        // Nothing to send if the cache already knows the kernel would refuse it.
+        int known = RouteCache::Instance()->check(nlh);
+        if (known) {
+            ALOGD("%s: %s, not sent", description.c_str(), strerror(-known));
+            mMessages.push_back(Message(std::string(), description, known));
+            return known;
+        }
+    }
+    mMessages.push_back(Message(data, description, error));
+    if (error) {
+        ALOGE("%s: %s", description.c_str(), strerror(-error));
+    }
+    return error;
+}
+
+void RtnetlinkBatch::clear() {
+    mMessages.clear();
+}
+
+int RtnetlinkBatch::getResult(size_t message) const {
+    if (message >= mMessages.size()) {
+        return -EINVAL;
+    }
+    return mMessages[message].result;
+}
+
+/*
+ * Reads ACKs until every message in [first, last) that was sent has one.
+ * Sequence numbers are message index + 1.
+ */
+static int readAcks(int sock, std::vector<int> *results, std::vector<bool> *pending,
+                    size_t first, size_t last) {
+    size_t waiting = 0;
+    for (size_t i = first; i < last; i++) {
+        if ((*pending)[i]) {
+            waiting++;
+        }
+    }
+
+    char buf[8192];
+    while (waiting > 0) {
+        ssize_t len = recv(sock, buf, sizeof(buf), 0);
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        struct nlmsghdr *nlh = reinterpret_cast<struct nlmsghdr *>(buf);
+        for (; NLMSG_OK(nlh, (size_t) len); nlh = NLMSG_NEXT(nlh, len)) {
+            if (nlh->nlmsg_type != NLMSG_ERROR ||
+                    nlh->nlmsg_len < NLMSG_LENGTH(sizeof(struct nlmsgerr))) {
+                continue;
+            }
+            size_t i = nlh->nlmsg_seq - 1;
+            if (i < first || i >= last || !(*pending)[i]) {
+                continue;
+            }
+            const struct nlmsgerr *err =
+                    reinterpret_cast<const struct nlmsgerr *>(NLMSG_DATA(nlh));
+            (*results)[i] = err->error;
+            (*pending)[i] = false;
+            waiting--;
+        }
+    }
+    return 0;
+}
+
+int RtnetlinkBatch::send() {
+    if (mMessages.empty()) {
+        return 0;
+    }
+
+    int64_t start = LatencyStats::now();
+    std::vector<int> results(mMessages.size());
+    std::vector<bool> pending(mMessages.size(), false);
+    for (size_t i = 0; i < mMessages.size(); i++) {
+        results[i] = mMessages[i].result;
+        if (!mMessages[i].data.empty()) {
+            struct nlmsghdr *nlh = reinterpret_cast<struct nlmsghdr *>(&mMessages[i].data[0]);
+            nlh->nlmsg_len = mMessages[i].data.size();
+            nlh->nlmsg_seq = i + 1;
+            results[i] = -ETIMEDOUT;
+            pending[i] = true;
+        }
+    }
+
+    int sock = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_ROUTE);
+    int res = (sock < 0) ? -errno : 0;
+    struct sockaddr_nl kernel;
+    memset(&kernel, 0, sizeof(kernel));
+    kernel.nl_family = AF_NETLINK;
+
+    if (sock >= 0) {
+        struct timeval tv = { ACK_TIMEOUT_SEC, 0 };
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+        // Bind now to learn our port, which the notifications of our changes carry.
+        struct sockaddr_nl local = kernel;
+        socklen_t localLen = sizeof(local);
+        if (!bind(sock, (struct sockaddr *) &local, sizeof(local)) &&
+                !getsockname(sock, (struct sockaddr *) &local, &localLen)) {
+            RouteCache::Instance()->addOwnPort(local.nl_pid);
+        }
+    }
+
+    size_t next = 0;
+    while (!res && next < mMessages.size()) {
+        // Gather as many messages as fit into one datagram; the kernel handles them in order.
+        std::vector<struct iovec> iov;
+        size_t bytes = 0;
+        size_t first = next;
+        for (; next < mMessages.size(); next++) {
+            std::string &data = mMessages[next].data;
+            if (data.empty()) {
+                continue;
+            }
+            if (!iov.empty() && bytes + data.size() > MAX_SEND_BYTES) {
+                break;
+            }
+            struct iovec v = { &data[0], data.size() };
+            iov.push_back(v);
+            bytes += data.size();
+        }
+        if (iov.empty()) {
+            break;
+        }
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_name = &kernel;
+        msg.msg_namelen = sizeof(kernel);
+        msg.msg_iov = &iov[0];
+        msg.msg_iovlen = iov.size();
+        if (sendmsg(sock, &msg, 0) < 0) {
+            res = -errno;
+            break;
+        }
+        res = readAcks(sock, &results, &pending, first, next);
+    }
+
+    if (sock >= 0) {
+        close(sock);
+    }
+    if (res) {
+        ALOGE("rtnetlink exchange failed: %s", strerror(-res));
+        for (size_t i = 0; i < mMessages.size(); i++) {
+            if (pending[i]) {
+                results[i] = res;
+            }
+        }
+    }
+
+    int firstError = 0;
+    for (size_t i = 0; i < mMessages.size(); i++) {
+        if (results[i] && !mMessages[i].result) {
+            ALOGE("%s: %s", mMessages[i].description.c_str(), strerror(-results[i]));
+        }
+        mMessages[i].result = results[i];
+        if (results[i] && !firstError) {
+            firstError = results[i];
+        }
+        if (!results[i] && !mMessages[i].data.empty()) {
+            RouteCache::Instance()->applied(
+                    reinterpret_cast<const struct nlmsghdr *>(mMessages[i].data.data()));
+        }
+    }
+    sSendStats.record(start, firstError != 0);
+    return firstError;
+}
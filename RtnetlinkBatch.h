@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _RTNETLINK_BATCH_H
+#define _RTNETLINK_BATCH_H
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+/*
+ * Queues route and rule changes and sends them to the kernel as rtnetlink messages,
+ * all in one sendmsg(), instead of forking /system/bin/ip for each of them.
+ *
+ *     RtnetlinkBatch batch;
+ *     batch.addRoute(true, AF_INET, "default", NULL, "tun0", 61);
+ *     batch.addRule(true, AF_INET, 100, NULL, NULL, 61, 61);
+ *     res = batch.send();
+ *
+ * Every message asks for a kernel ACK, so each one succeeds or fails on its own;
+ * a failure does not stop the messages after it from being applied. A route add that
+ * RouteCache knows to be a duplicate, or a delete of something it knows isn't there, is
+ * not sent at all and gets the error the kernel would have returned.
+ */
+class RtnetlinkBatch {
+public:
+    static const uint32_t NO_PRIORITY = 0;
+    static const uint32_t NO_FWMARK = 0;
+
+    RtnetlinkBatch();
+    ~RtnetlinkBatch() {}
+
+    /*
+     * Queues the equivalent of
+     *     ip route add|del <dest> [via <gateway>] dev <iface> table <table>
+     * dest is "addr/prefixlen", "addr" or "default"; gateway may be NULL.
+     * Returns 0, or -errno if the arguments are invalid (the message is then not sent
+     * and its result is that error).
+     */
+    int addRoute(bool add, int family, const char *dest, const char *gateway,
+                 const char *iface, uint32_t table);
+
+    /*
+     * Queues the equivalent of
+     *     ip rule add|del [prio <priority>] [from <from>] [to <to>] [fwmark <fwmark>] table <table>
+     * from and to may be NULL. Return value as for addRoute().
+     */
+    int addRule(bool add, int family, uint32_t priority, const char *from, const char *to,
+                uint32_t fwmark, uint32_t table);
+
+    /*
+     * Sends the queued messages and waits for their ACKs.
+     * Returns 0 if every message was applied, otherwise the first -errno.
+     */
+    int send();
+
+    /* After send(): 0 if the given message was applied, -errno otherwise. */
+    int getResult(size_t message) const;
+    size_t size() const { return mMessages.size(); }
+    void clear();
+
+private:
+    class Message {
+    public:
+        Message(const std::string &d, const std::string &desc, int res)
+                : data(d), description(desc), result(res) {};
+        std::string data;
+        std::string description;
+        int result;
+    };
+
+    int queue(const std::string &data, const std::string &description, int error);
+    bool undoesEarlierMessage(const std::string &data) const;
+
+    std::vector<Message> mMessages;
+};
+
+#endif
@@ -26,14 +26,16 @@
 
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <linux/rtnetlink.h>
 #include <resolv_netid.h>
 
 #define LOG_TAG "SecondaryTablController"
 #include <cutils/log.h>
 #include <cutils/properties.h>
-#include <logwrap/logwrap.h>
 
+#include "IptablesTransaction.h"
 #include "ResponseCode.h"
+#include "RtnetlinkBatch.h"
 #include "NetdConstants.h"
 #include "SecondaryTableController.h"
 
@@ -45,28 +47,19 @@ const char* SecondaryTableController::LOCAL_FILTER_OUTPUT = "st_filter_OUTPUT";
 
 SecondaryTableController::SecondaryTableController(NetworkController* controller) :
         mNetCtrl(controller) {
+    pthread_mutex_init(&mRuleCountLock, NULL);
 }
 
 SecondaryTableController::~SecondaryTableController() {
 }
 
-int SecondaryTableController::setupIptablesHooks() {
-    int res = execIptables(V4V6,
-            "-t",
-            "mangle",
-            "-F",
-            LOCAL_MANGLE_OUTPUT,
-            NULL);
-    res |= execIptables(V4V6,
-            "-t",
-            "mangle",
-            "-F",
-            LOCAL_MANGLE_EXEMPT,
-            NULL);
+int SecondaryTableController::setupIptablesHooks(IptablesTransaction &bootstrap) {
+    /* LOCAL_MANGLE_OUTPUT and LOCAL_MANGLE_EXEMPT have just been created empty. */
+
     // rule for skipping anything marked with the PROTECT_MARK
     char protect_mark_str[11];
     snprintf(protect_mark_str, sizeof(protect_mark_str), "%d", PROTECT_MARK);
-    res |= execIptables(V4V6,
+    bootstrap.add(V4V6,
             "-t",
             "mangle",
             "-A",
@@ -81,7 +74,7 @@ int SecondaryTableController::setupIptablesHooks() {
 
     // protect the legacy VPN daemons from routes.
     // TODO: Remove this when legacy VPN's are removed.
-    res |= execIptables(V4V6,
+    bootstrap.add(V4V6,
             "-t",
             "mangle",
             "-A",
@@ -93,7 +86,7 @@ int SecondaryTableController::setupIptablesHooks() {
             "-j",
             "RETURN",
             NULL);
-    return res;
+    return 0;
 }
 
 int SecondaryTableController::addRoute(SocketClient *cli, char *iface, char *dest, int prefix,
@@ -104,44 +97,19 @@ int SecondaryTableController::addRoute(SocketClient *cli, char *iface, char *des
 int SecondaryTableController::modifyRoute(SocketClient *cli, const char *action, char *iface,
         char *dest, int prefix, char *gateway, unsigned netId) {
     char dest_str[44]; // enough to store an IPv6 address + 3 character bitmask
-    char tableIndex_str[11];
-    int ret;
+    bool add = (strcmp(action, ADD) == 0);
 
-    //  IP tool doesn't like "::" - the equiv of 0.0.0.0 that it accepts for ipv4
     snprintf(dest_str, sizeof(dest_str), "%s/%d", dest, prefix);
-    snprintf(tableIndex_str, sizeof(tableIndex_str), "%u", netId + BASE_TABLE_NUMBER);
-
-    if (strcmp("::", gateway) == 0) {
-        const char *cmd[] = {
-                IP_PATH,
-                "route",
-                action,
-                dest_str,
-                "dev",
-                iface,
-                "table",
-                tableIndex_str
-        };
-        ret = runCmd(ARRAY_SIZE(cmd), cmd);
-    } else {
-        const char *cmd[] = {
-                IP_PATH,
-                "route",
-                action,
-                dest_str,
-                "via",
-                gateway,
-                "dev",
-                iface,
-                "table",
-                tableIndex_str
-        };
-        ret = runCmd(ARRAY_SIZE(cmd), cmd);
-    }
+
+    //  "::" is how the framework says there is no gateway
+    RtnetlinkBatch batch;
+    batch.addRoute(add, getFamily(dest), dest_str, strcmp("::", gateway) ? gateway : NULL, iface,
+            netId + BASE_TABLE_NUMBER);
+    int ret = batch.send();
 
     if (ret) {
-        ALOGE("ip route %s failed: %s route %s %s/%d via %s dev %s table %u", action,
-                IP_PATH, action, dest, prefix, gateway, iface, netId + BASE_TABLE_NUMBER);
+        ALOGE("ip route %s failed: route %s %s/%d via %s dev %s table %u (%s)", action,
+                action, dest, prefix, gateway, iface, netId + BASE_TABLE_NUMBER, strerror(-ret));
         errno = ENODEV;
         cli->sendMsg(ResponseCode::OperationFailed, "ip route modification failed", true);
         return -1;
@@ -153,6 +121,7 @@ int SecondaryTableController::modifyRoute(SocketClient *cli, const char *action,
 }
 
 void SecondaryTableController::modifyRuleCount(unsigned netId, const char *action) {
+    pthread_mutex_lock(&mRuleCountLock);
     if (strcmp(action, ADD) == 0) {
         if (mNetIdRuleCount.count(netId) == 0)
             mNetIdRuleCount[netId] = 0;
@@ -164,13 +133,21 @@ void SecondaryTableController::modifyRuleCount(unsigned netId, const char *actio
             }
         }
     }
+    pthread_mutex_unlock(&mRuleCountLock);
 }
 
-const char *SecondaryTableController::getVersion(const char *addr) {
+bool SecondaryTableController::hasRules(unsigned netId) {
+    pthread_mutex_lock(&mRuleCountLock);
+    bool res = mNetIdRuleCount.count(netId) > 0;
+    pthread_mutex_unlock(&mRuleCountLock);
+    return res;
+}
+
+int SecondaryTableController::getFamily(const char *addr) {
     if (strchr(addr, ':') != NULL) {
-        return "-6";
+        return AF_INET6;
     } else {
-        return "-4";
+        return AF_INET;
     }
 }
 
@@ -189,20 +166,10 @@ int SecondaryTableController::removeRoute(SocketClient *cli, char *iface, char *
 
 int SecondaryTableController::modifyFromRule(unsigned netId, const char *action,
         const char *addr) {
-    char tableIndex_str[11];
-
-    snprintf(tableIndex_str, sizeof(tableIndex_str), "%u", netId + BASE_TABLE_NUMBER);
-    const char *cmd[] = {
-            IP_PATH,
-            getVersion(addr),
-            "rule",
-            action,
-            "from",
-            addr,
-            "table",
-            tableIndex_str
-    };
-    if (runCmd(ARRAY_SIZE(cmd), cmd)) {
+    RtnetlinkBatch batch;
+    batch.addRule(strcmp(action, ADD) == 0, getFamily(addr), RtnetlinkBatch::NO_PRIORITY, addr,
+            NULL, RtnetlinkBatch::NO_FWMARK, netId + BASE_TABLE_NUMBER);
+    if (batch.send()) {
         return -1;
     }
 
@@ -212,23 +179,14 @@ int SecondaryTableController::modifyFromRule(unsigned netId, const char *action,
 
 int SecondaryTableController::modifyLocalRoute(unsigned netId, const char *action,
         const char *iface, const char *addr) {
-    char tableIndex_str[11];
-
     modifyRuleCount(netId, action); // some del's will fail as the iface is already gone.
-    snprintf(tableIndex_str, sizeof(tableIndex_str), "%u", netId + BASE_TABLE_NUMBER);
-    const char *cmd[] = {
-            IP_PATH,
-            "route",
-            action,
-            addr,
-            "dev",
-            iface,
-            "table",
-            tableIndex_str
-    };
 
-    return runCmd(ARRAY_SIZE(cmd), cmd);
+    RtnetlinkBatch batch;
+    batch.addRoute(strcmp(action, ADD) == 0, getFamily(addr), addr, NULL, iface,
+            netId + BASE_TABLE_NUMBER);
+    return batch.send();
 }
+
 int SecondaryTableController::addFwmarkRule(const char *iface) {
     return setFwmarkRule(iface, true);
 }
@@ -241,71 +199,27 @@ int SecondaryTableController::setFwmarkRule(const char *iface, bool add) {
     unsigned netId = mNetCtrl->getNetworkId(iface);
 
     // Fail fast if any rules already exist for this interface
-    if (mNetIdRuleCount.count(netId) > 0) {
+    if (hasRules(netId)) {
         errno = EBUSY;
         return -1;
     }
 
     int ret;
+    unsigned mark = netId + BASE_TABLE_NUMBER;
     char mark_str[11];
-    snprintf(mark_str, sizeof(mark_str), "%u", netId + BASE_TABLE_NUMBER);
-    //add the catch all route to the tun. Route rules will make sure the right packets hit the table
-    const char *route_cmd[] = {
-        IP_PATH,
-        "route",
-        add ? "add" : "del",
-        "default",
-        "dev",
-        iface,
-        "table",
-        mark_str
-    };
-    ret = runCmd(ARRAY_SIZE(route_cmd), route_cmd);
-
-    const char *fwmark_cmd[] = {
-        IP_PATH,
-        "rule",
-        add ? "add" : "del",
-        "prio",
-        RULE_PRIO,
-        "fwmark",
-        mark_str,
-        "table",
-        mark_str
-    };
-    ret = runCmd(ARRAY_SIZE(fwmark_cmd), fwmark_cmd);
-    if (ret) return ret;
-
-    //add rules for v6
-    const char *route6_cmd[] = {
-        IP_PATH,
-        "-6",
-        "route",
-        add ? "add" : "del",
-        "default",
-        "dev",
-        iface,
-        "table",
-        mark_str
-    };
-    ret = runCmd(ARRAY_SIZE(route6_cmd), route6_cmd);
-
-    const char *fwmark6_cmd[] = {
-        IP_PATH,
-        "-6",
-        "rule",
-        add ? "add" : "del",
-        "prio",
-        RULE_PRIO,
-        "fwmark",
-        mark_str,
-        "table",
-        mark_str
-    };
-    ret = runCmd(ARRAY_SIZE(fwmark6_cmd), fwmark6_cmd);
-
-
-    if (ret) return ret;
+    snprintf(mark_str, sizeof(mark_str), "%u", mark);
+
+    //add the catch all routes to the tun. Route rules will make sure the right packets hit the
+    //table. Failing routes are tolerated (e.g. already gone on del), failing rules are not.
+    RtnetlinkBatch batch;
+    batch.addRoute(add, AF_INET, "default", NULL, iface, mark);
+    batch.addRule(add, AF_INET, RULE_PRIO, NULL, NULL, mark, mark);
+    batch.addRoute(add, AF_INET6, "default", NULL, iface, mark);
+    batch.addRule(add, AF_INET6, RULE_PRIO, NULL, NULL, mark, mark);
+    batch.send();
+    if (batch.getResult(1) || batch.getResult(3)) {
+        return -1;
+    }
 
     //create the route rule chain
     char chain_str[IFNAMSIZ + 18];
@@ -504,7 +418,7 @@ int SecondaryTableController::removeHostExemption(const char *host) {
 }
 
 int SecondaryTableController::setHostExemption(const char *host, bool add) {
-    IptablesTarget target = !strcmp(getVersion(host), "-4") ? V4 : V6;
+    IptablesTarget target = getIptablesTarget(host);
     char protect_mark_str[11];
     snprintf(protect_mark_str, sizeof(protect_mark_str), "%d", PROTECT_MARK);
     int ret = execIptables(target,
@@ -519,19 +433,10 @@ int SecondaryTableController::setHostExemption(const char *host, bool add) {
             "--set-mark",
             protect_mark_str,
             NULL);
-    const char *cmd[] = {
-        IP_PATH,
-        getVersion(host),
-        "rule",
-        add ? "add" : "del",
-        "prio",
-        EXEMPT_PRIO,
-        "to",
-        host,
-        "table",
-        "main"
-    };
-    ret |= runCmd(ARRAY_SIZE(cmd), cmd);
+    RtnetlinkBatch batch;
+    batch.addRule(add, getFamily(host), EXEMPT_PRIO, NULL, host, RtnetlinkBatch::NO_FWMARK,
+            RT_TABLE_MAIN);
+    ret |= batch.send();
     return ret;
 }
 
@@ -548,10 +453,3 @@ void SecondaryTableController::getProtectMark(SocketClient *cli) {
     snprintf(protect_mark_str, sizeof(protect_mark_str), "%d", PROTECT_MARK);
     cli->sendMsg(ResponseCode::GetMarkResult, protect_mark_str, false);
 }
-
-int SecondaryTableController::runCmd(int argc, const char **argv) {
-    int ret = 0;
-
-    ret = android_fork_execvp(argc, (char **)argv, NULL, false, false);
-    return ret;
-}
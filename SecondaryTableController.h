@@ -17,6 +17,9 @@
 #ifndef _SECONDARY_TABLE_CONTROLLER_H
 #define _SECONDARY_TABLE_CONTROLLER_H
 
+#include <pthread.h>
+#include <stdint.h>
+
 #include <map>
 
 #include <sysutils/FrameworkListener.h>
@@ -25,14 +28,16 @@
 #include "NetdConstants.h"
 #include "NetworkController.h"
 
+class IptablesTransaction;
+
 #ifndef IFNAMSIZ
 #define IFNAMSIZ 16
 #endif
 
 static const int BASE_TABLE_NUMBER = 60;
 static const int PROTECT_MARK = 0x1;
-static const char *EXEMPT_PRIO = "99";
-static const char *RULE_PRIO = "100";
+static const uint32_t EXEMPT_PRIO = 99;
+static const uint32_t RULE_PRIO = 100;
 
 // SecondaryTableController is responsible for maintaining the "secondary" routing tables, where
 // "secondary" means not the main table.  The "secondary" tables are used for VPNs.
@@ -76,7 +81,7 @@ public:
     void getUidMark(SocketClient *cli, int uid);
     void getProtectMark(SocketClient *cli);
 
-    int setupIptablesHooks();
+    int setupIptablesHooks(IptablesTransaction &bootstrap);
 
     static const char* LOCAL_MANGLE_OUTPUT;
     static const char* LOCAL_MANGLE_EXEMPT;
@@ -95,12 +100,13 @@ private:
     int modifyRoute(SocketClient *cli, const char *action, char *iface, char *dest, int prefix,
             char *gateway, unsigned netId);
 
+    // Guards mNetIdRuleCount; the interface and nat commands run on different threads.
+    pthread_mutex_t mRuleCountLock;
     std::map<unsigned, int> mNetIdRuleCount;
     void modifyRuleCount(unsigned netId, const char *action);
-    const char *getVersion(const char *addr);
+    bool hasRules(unsigned netId);
+    int getFamily(const char *addr);
     IptablesTarget getIptablesTarget(const char *addr);
-
-    int runCmd(int argc, const char **argv);
 };
 
 #endif
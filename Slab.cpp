@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define __STDC_FORMAT_MACROS 1
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define LOG_TAG "Slab"
+
+#include <cutils/log.h>
+#include <sysutils/SocketClient.h>
+
+#include "ResponseCode.h"
+#include "Slab.h"
+
+// Instances register when they are constructed, which in practice is all at startup.
+static pthread_mutex_t sRegistryLock = PTHREAD_MUTEX_INITIALIZER;
+static Slab *sHead = NULL;
+
+Slab::Slab(const char *name, size_t blockSize, size_t maxFree)
+        : mName(name),
+          mBlockSize(blockSize < sizeof(FreeBlock) ? sizeof(FreeBlock) : blockSize),
+          mMaxFree(maxFree),
+          mFree(NULL),
+          mFreeCount(0),
+          mAllocs(0),
+          mRecycled(0),
+          mFrees(0),
+          mReleased(0) {
+    pthread_mutex_init(&mLock, NULL);
+
+    pthread_mutex_lock(&sRegistryLock);
+    mNext = sHead;
+    sHead = this;
+    pthread_mutex_unlock(&sRegistryLock);
+}
+
+void *Slab::alloc() {
+    pthread_mutex_lock(&mLock);
+    mAllocs++;
+    FreeBlock *block = mFree;
+    if (block) {
+        mFree = block->next;
+        mFreeCount--;
+        mRecycled++;
+    }
+    pthread_mutex_unlock(&mLock);
+
+    if (!block) {
+        block = static_cast<FreeBlock *>(malloc(mBlockSize));
+        if (!block) {
+            ALOGE("%s: unable to allocate %zu bytes", mName, mBlockSize);
+        }
+    }
+    return block;
+}
+
+void Slab::free(void *p) {
+    if (!p) {
+        return;
+    }
+    FreeBlock *block = static_cast<FreeBlock *>(p);
+    pthread_mutex_lock(&mLock);
+    mFrees++;
+    bool keep = mFreeCount < mMaxFree;
+    if (keep) {
+        block->next = mFree;
+        mFree = block;
+        mFreeCount++;
+    } else {
+        mReleased++;
+    }
+    pthread_mutex_unlock(&mLock);
+
+    if (!keep) {
+        ::free(block);
+    }
+}
+
+void Slab::dumpAll(SocketClient *cli) {
+    pthread_mutex_lock(&sRegistryLock);
+    for (Slab *slab = sHead; slab != NULL; slab = slab->mNext) {
+        char msg[256];
+        pthread_mutex_lock(&slab->mLock);
+        snprintf(msg, sizeof(msg), "slab %s size=%zu allocs=%" PRIu64 " recycled=%" PRIu64
+                 " frees=%" PRIu64 " released=%" PRIu64 " in_use=%" PRIu64 " free=%zu",
+                 slab->mName, slab->mBlockSize, slab->mAllocs, slab->mRecycled, slab->mFrees,
+                 slab->mReleased, slab->mAllocs - slab->mFrees, slab->mFreeCount);
+        pthread_mutex_unlock(&slab->mLock);
+        cli->sendMsg(ResponseCode::StatsListResult, msg, false);
+    }
+    pthread_mutex_unlock(&sRegistryLock);
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _SLAB_H
+#define _SLAB_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+class SocketClient;
+
+/*
+ * Fixed-size blocks recycled through a free list, for objects allocated and freed at
+ * a high rate, such as the per-lookup objects of dnsproxyd. Up to maxFree blocks are
+ * kept for reuse; beyond that free() returns them to the heap.
+ * Blocks may be freed on any thread; the lock is only held to pop or push the list.
+ * Instances live as long as netd (usually as file statics) and register themselves
+ * for "ndc stats dump", like LatencyStats.
+ */
+class Slab {
+public:
+    Slab(const char *name, size_t blockSize, size_t maxFree);
+
+    /* A block of blockSize() bytes, or NULL if the heap is exhausted. */
+    void *alloc();
+    void free(void *block);
+
+    size_t blockSize() const { return mBlockSize; }
+
+    /* Sends one StatsListResult line per registered instance. */
+    static void dumpAll(SocketClient *cli);
+
+private:
+    struct FreeBlock {
+        FreeBlock *next;
+    };
+
+    const char *mName;
+    size_t mBlockSize;
+    size_t mMaxFree;
+    Slab *mNext;
+
+    pthread_mutex_t mLock;
+    FreeBlock *mFree;
+    size_t mFreeCount;
+    uint64_t mAllocs;
+    uint64_t mRecycled;     // allocs served from the free list
+    uint64_t mFrees;
+    uint64_t mReleased;     // frees that went back to the heap
+};
+
+#endif
@@ -17,19 +17,24 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
-#include <sys/wait.h>
+#include <sys/un.h>
 
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
 #include <linux/wireless.h>
 
+#include <string>
+#include <vector>
+
 #include <openssl/evp.h>
 #include <openssl/sha.h>
 
@@ -40,102 +45,73 @@
 #include "wifi.h"
 #include "ResponseCode.h"
 
+#include "ProcessSupervisor.h"
 #include "SoftapController.h"
 
 static const char HOSTAPD_CONF_FILE[]    = "/data/misc/wifi/hostapd.conf";
 static const char HOSTAPD_BIN_FILE[]    = "/system/bin/hostapd";
+static const char HOSTAPD_CTRL_DIR[]    = "/data/misc/wifi/hostapd";
 
 SoftapController::SoftapController()
-    : mPid(0) {}
+    : mHostapdId(-1), mRunningChannel(0), mRunningHidden(0), mConfigChannel(0),
+      mConfigHidden(0) {}
 
 SoftapController::~SoftapController() {
 }
 
 int SoftapController::startSoftap() {
-    pid_t pid = 1;
-
-    if (mPid) {
+    if (mHostapdId != -1) {
         ALOGE("SoftAP is already running");
         return ResponseCode::SoftapStatusResult;
     }
 
-    if ((pid = fork()) < 0) {
-        ALOGE("fork failed (%s)", strerror(errno));
-        return ResponseCode::ServiceStartFailed;
-    }
-
-    if (!pid) {
-        ensure_entropy_file_exists();
-        if (execl(HOSTAPD_BIN_FILE, HOSTAPD_BIN_FILE,
-                  "-e", WIFI_ENTROPY_FILE,
-                  HOSTAPD_CONF_FILE, (char *) NULL)) {
-            ALOGE("execl failed (%s)", strerror(errno));
-        }
+    ensure_entropy_file_exists();
+    std::vector<std::string> args;
+    args.push_back(HOSTAPD_BIN_FILE);
+    args.push_back("-e");
+    args.push_back(WIFI_ENTROPY_FILE);
+    args.push_back(HOSTAPD_CONF_FILE);
+    mHostapdId = ProcessSupervisor::Instance()->spawn("hostapd", args, -1, false);
+    if (mHostapdId == -1) {
         ALOGE("SoftAP failed to start");
         return ResponseCode::ServiceStartFailed;
-    } else {
-        mPid = pid;
-        ALOGD("SoftAP started successfully");
-        usleep(AP_BSS_START_DELAY);
     }
+
+    mRunningConfig = mConfig;
+    mRunningChannel = mConfigChannel;
+    mRunningHidden = mConfigHidden;
+    ALOGD("SoftAP started successfully");
+    usleep(AP_BSS_START_DELAY);
     return ResponseCode::SoftapStatusResult;
 }
 
 int SoftapController::stopSoftap() {
 
-    if (mPid == 0) {
+    if (mHostapdId == -1) {
         ALOGE("SoftAP is not running");
         return ResponseCode::SoftapStatusResult;
     }
 
     ALOGD("Stopping the SoftAP service...");
-    kill(mPid, SIGTERM);
-    waitpid(mPid, NULL, 0);
+    ProcessSupervisor::Instance()->stop(mHostapdId);
 
-    mPid = 0;
+    mHostapdId = -1;
+    mRunningConfig.clear();
     ALOGD("SoftAP stopped successfully");
     usleep(AP_BSS_STOP_DELAY);
     return ResponseCode::SoftapStatusResult;
 }
 
 bool SoftapController::isSoftapStarted() {
-    return (mPid != 0);
+    return (mHostapdId != -1);
 }
 
-/*
- * Arguments:
- *  argv[2] - wlan interface
- *  argv[3] - SSID
- *  argv[4] - Broadcast/Hidden
- *  argv[5] - Channel
- *  argv[6] - Security
- *  argv[7] - Key
- */
-int SoftapController::setSoftap(int argc, char *argv[]) {
+bool SoftapController::buildConfig(int argc, char *argv[], int channel, int hidden,
+                                   std::string *config) {
     char psk_str[2*SHA256_DIGEST_LENGTH+1];
-    int ret = ResponseCode::SoftapStatusResult;
-    int i = 0;
-    int fd;
-    int hidden = 0;
-    int channel = AP_CHANNEL_DEFAULT;
     char *wbuf = NULL;
     char *fbuf = NULL;
 
-    if (argc < 5) {
-        ALOGE("Softap set is missing arguments. Please use:");
-        ALOGE("softap <wlan iface> <SSID> <hidden/broadcast> <channel> <wpa2?-psk|open> <passphrase>");
-        return ResponseCode::CommandSyntaxError;
-    }
-
-    if (!strcasecmp(argv[4], "hidden"))
-        hidden = 1;
-
-    if (argc >= 5) {
-        channel = atoi(argv[5]);
-        if (channel <= 0)
-            channel = AP_CHANNEL_DEFAULT;
-    }
-
     asprintf(&wbuf, "interface=%s\ndriver=nl80211\nctrl_interface="
             "/data/misc/wifi/hostapd\nssid=%s\nchannel=%d\nieee80211n=1\n"
             "hw_mode=g\nignore_broadcast_ssid=%d\n",
@@ -158,20 +134,49 @@ int SoftapController::setSoftap(int argc, char *argv[]) {
     } else {
         asprintf(&fbuf, "%s", wbuf);
     }
+    free(wbuf);
+
+    if (!fbuf) {
+        ALOGE("Unknown softap security %s", argv[6]);
+        return false;
+    }
+    config->assign(fbuf);
+    free(fbuf);
+    return true;
+}
+
+int SoftapController::writeConfig(const std::string &config) {
+    int fd;
+    struct stat st;
+
+    /* Rewriting an identical file would only wear the flash. */
+    fd = open(HOSTAPD_CONF_FILE, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd >= 0) {
+        std::string current;
+        char buf[SOFTAP_MAX_BUFFER_SIZE];
+        ssize_t n;
+        bool same = !fstat(fd, &st) && st.st_uid == AID_SYSTEM && st.st_gid == AID_WIFI &&
+                (st.st_mode & 0777) == 0660;
+        while (same && (n = read(fd, buf, sizeof(buf))) > 0 && current.size() <= config.size()) {
+            current.append(buf, n);
+        }
+        close(fd);
+        if (same && current == config) {
+            ALOGD("%s is up to date", HOSTAPD_CONF_FILE);
+            return 0;
+        }
+    }
 
     fd = open(HOSTAPD_CONF_FILE, O_CREAT | O_TRUNC | O_WRONLY | O_NOFOLLOW, 0660);
     if (fd < 0) {
         ALOGE("Cannot update \"%s\": %s", HOSTAPD_CONF_FILE, strerror(errno));
-        free(wbuf);
-        free(fbuf);
-        return ResponseCode::OperationFailed;
+        return -1;
     }
-    if (write(fd, fbuf, strlen(fbuf)) < 0) {
+    int ret = 0;
+    if (write(fd, config.data(), config.size()) < 0) {
         ALOGE("Cannot write to \"%s\": %s", HOSTAPD_CONF_FILE, strerror(errno));
-        ret = ResponseCode::OperationFailed;
+        ret = -1;
     }
-    free(wbuf);
-    free(fbuf);
 
     /* Note: apparently open can fail to set permissions correctly at times */
     if (fchmod(fd, 0660) < 0) {
@@ -179,7 +184,7 @@ int SoftapController::setSoftap(int argc, char *argv[]) {
                 HOSTAPD_CONF_FILE, strerror(errno));
         close(fd);
         unlink(HOSTAPD_CONF_FILE);
-        return ResponseCode::OperationFailed;
+        return -1;
     }
 
     if (fchown(fd, AID_SYSTEM, AID_WIFI) < 0) {
@@ -187,13 +192,139 @@ int SoftapController::setSoftap(int argc, char *argv[]) {
                 HOSTAPD_CONF_FILE, AID_WIFI, strerror(errno));
         close(fd);
         unlink(HOSTAPD_CONF_FILE);
-        return ResponseCode::OperationFailed;
+        return -1;
     }
 
     close(fd);
     return ret;
 }
 
+int SoftapController::hostapdCommand(const char *iface, const char *cmd) {
+    struct sockaddr_un local, remote;
+    static int sCount;
+
+    int sock = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        ALOGE("Unable to open a hostapd control socket (%s)", strerror(errno));
+        return -1;
+    }
+
+    /* hostapd answers to the sender's address; an abstract one needs no cleanup. */
+    memset(&local, 0, sizeof(local));
+    local.sun_family = AF_UNIX;
+    snprintf(local.sun_path + 1, sizeof(local.sun_path) - 1, "netd_hostapd_%d_%d",
+             getpid(), sCount++);
+    memset(&remote, 0, sizeof(remote));
+    remote.sun_family = AF_UNIX;
+    snprintf(remote.sun_path, sizeof(remote.sun_path), "%s/%s", HOSTAPD_CTRL_DIR, iface);
+
+    if (bind(sock, (struct sockaddr *) &local, sizeof(local)) < 0 ||
+            connect(sock, (struct sockaddr *) &remote, sizeof(remote)) < 0 ||
+            send(sock, cmd, strlen(cmd), 0) < 0) {
+        ALOGE("Unable to reach hostapd at %s (%s)", remote.sun_path, strerror(errno));
+        close(sock);
+        return -1;
+    }
+
+    char reply[SOFTAP_MAX_BUFFER_SIZE];
+    ssize_t n = -1;
+    struct pollfd pfd = { sock, POLLIN, 0 };
+    if (poll(&pfd, 1, AP_CTRL_TIMEOUT_MS) > 0) {
+        n = recv(sock, reply, sizeof(reply) - 1, 0);
+    }
+    close(sock);
+    if (n < 0) {
+        ALOGE("No answer from hostapd to %s", cmd);
+        return -1;
+    }
+    reply[n] = '\0';
+    if (strncmp(reply, "OK", 2)) {
+        ALOGE("hostapd refused %s: %s", cmd, reply);
+        return -1;
+    }
+    return 0;
+}
+
+int SoftapController::applyLive(const char *iface, int channel, int hidden) {
+    char cmd[64];
+
+    if (hidden != mRunningHidden) {
+        snprintf(cmd, sizeof(cmd), "SET ignore_broadcast_ssid %d", hidden);
+        if (hostapdCommand(iface, cmd) || hostapdCommand(iface, "UPDATE_BEACON")) {
+            return -1;
+        }
+        mRunningHidden = hidden;
+    }
+    if (channel != mRunningChannel) {
+        /* hw_mode=g: channels 1-13 are 5MHz apart, 14 is on its own. */
+        int freq = (channel == 14) ? 2484 : 2407 + 5 * channel;
+        snprintf(cmd, sizeof(cmd), "CHAN_SWITCH %d %d", AP_CSA_BEACON_COUNT, freq);
+        if (hostapdCommand(iface, cmd)) {
+            return -1;
+        }
+        mRunningChannel = channel;
+    }
+    return 0;
+}
+
+/*
+ * Arguments:
+ *  argv[2] - wlan interface
+ *  argv[3] - SSID
+ *  argv[4] - Broadcast/Hidden
+ *  argv[5] - Channel
+ *  argv[6] - Security
+ *  argv[7] - Key
+ *
+ * If hostapd is running and only the channel or the SSID broadcast changed, the change
+ * is applied through its control interface; otherwise it takes the next startSoftap().
+ */
+int SoftapController::setSoftap(int argc, char *argv[]) {
+    int hidden = 0;
+    int channel = AP_CHANNEL_DEFAULT;
+    std::string config;
+
+    if (argc < 5) {
+        ALOGE("Softap set is missing arguments. Please use:");
+        ALOGE("softap <wlan iface> <SSID> <hidden/broadcast> <channel> <wpa2?-psk|open> <passphrase>");
+        return ResponseCode::CommandSyntaxError;
+    }
+
+    if (!strcasecmp(argv[4], "hidden"))
+        hidden = 1;
+
+    if (argc >= 5) {
+        channel = atoi(argv[5]);
+        if (channel <= 0)
+            channel = AP_CHANNEL_DEFAULT;
+    }
+
+    if (!buildConfig(argc, argv, channel, hidden, &config)) {
+        return ResponseCode::CommandParameterError;
+    }
+    if (writeConfig(config)) {
+        return ResponseCode::OperationFailed;
+    }
+    mConfig = config;
+    mConfigChannel = channel;
+    mConfigHidden = hidden;
+
+    if (mHostapdId != -1 && config != mRunningConfig && channel <= 14) {
+        std::string sameRadio;
+        if (buildConfig(argc, argv, mRunningChannel, mRunningHidden, &sameRadio) &&
+                sameRadio == mRunningConfig) {
+            if (applyLive(argv[2], channel, hidden)) {
+                ALOGW("Unable to reconfigure hostapd, the change waits for a restart");
+            } else {
+                ALOGD("SoftAP reconfigured without a restart");
+            }
+            // What's left to apply, if anything, stays in mRunningChannel/mRunningHidden.
+            buildConfig(argc, argv, mRunningChannel, mRunningHidden, &mRunningConfig);
+        }
+    }
+    return ResponseCode::SoftapStatusResult;
+}
+
 /*
  * Arguments:
  *	argv[2] - interface name
@@ -231,6 +362,12 @@ int SoftapController::fwReloadSoftap(int argc, char *argv[])
 void SoftapController::generatePsk(char *ssid, char *passphrase, char *psk_str) {
     unsigned char psk[SHA256_DIGEST_LENGTH];
     int j;
+
+    // 4096 rounds of PBKDF2 take a while, and toggling the hotspot asks again.
+    if (!mPsk.empty() && mPskSsid == ssid && mPskPassphrase == passphrase) {
+        strcpy(psk_str, mPsk.c_str());
+        return;
+    }
     // Use the PKCS#5 PBKDF2 with 4096 iterations
     PKCS5_PBKDF2_HMAC_SHA1(passphrase, strlen(passphrase),
             reinterpret_cast<const unsigned char *>(ssid), strlen(ssid),
@@ -238,4 +375,7 @@ void SoftapController::generatePsk(char *ssid, char *passphrase, char *psk_str)
     for (j=0; j < SHA256_DIGEST_LENGTH; j++) {
         sprintf(&psk_str[j*2], "%02x", psk[j]);
     }
+    mPskSsid = ssid;
+    mPskPassphrase = passphrase;
+    mPsk = psk_str;
 }
@@ -20,12 +20,16 @@
 #include <linux/in.h>
 #include <net/if.h>
 
+#include <string>
+
 #define SOFTAP_MAX_BUFFER_SIZE	4096
 #define AP_BSS_START_DELAY	200000
 #define AP_BSS_STOP_DELAY	500000
 #define AP_SET_CFG_DELAY	500000
 #define AP_DRIVER_START_DELAY	800000
 #define AP_CHANNEL_DEFAULT	6
+#define AP_CTRL_TIMEOUT_MS	1000
+#define AP_CSA_BEACON_COUNT	5
 
 class SoftapController {
 public:
@@ -38,8 +42,31 @@ public:
     int setSoftap(int argc, char *argv[]);
     int fwReloadSoftap(int argc, char *argv[]);
 private:
-    pid_t mPid;
+    int mHostapdId;  // ProcessSupervisor id, -1 when stopped
+
+    /* The config hostapd runs with, as last written or changed live. */
+    std::string mRunningConfig;
+    int mRunningChannel;
+    int mRunningHidden;
+    /* The config last written, which the next startSoftap() runs with. */
+    std::string mConfig;
+    int mConfigChannel;
+    int mConfigHidden;
+
+    /* The last PSK derived, and what from. */
+    std::string mPskSsid;
+    std::string mPskPassphrase;
+    std::string mPsk;
+
     void generatePsk(char *ssid, char *passphrase, char *psk);
+    /* Builds hostapd.conf from the "softap set" arguments; false if they are invalid. */
+    bool buildConfig(int argc, char *argv[], int channel, int hidden, std::string *config);
+    /* Writes hostapd.conf, unless it already holds config with the right permissions. */
+    static int writeConfig(const std::string &config);
+    /* Changes the channel and SSID broadcast of the running hostapd. */
+    int applyLive(const char *iface, int channel, int hidden);
+    /* Sends a command to hostapd's control interface; 0 if it answered "OK". */
+    static int hostapdCommand(const char *iface, const char *cmd);
 };
 
 #endif
@@ -0,0 +1,148 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define LOG_TAG "SysctlCache"
+
+#include <cutils/log.h>
+
+#include "SysctlCache.h"
+
+SysctlCache *SysctlCache::sInstance = NULL;
+
+SysctlCache *SysctlCache::Instance() {
+    if (!sInstance)
+        sInstance = new SysctlCache();
+    return sInstance;
+}
+
+SysctlCache::SysctlCache() {
+    pthread_mutex_init(&mLock, NULL);
+}
+
+static int writeFd(int fd, const char *value, size_t len) {
+    return (pwrite(fd, value, len, 0) == (ssize_t) len) ? 0 : -1;
+}
+
+int SysctlCache::write(const char *proto, const char *iface, const char *setting,
+                       const char *value) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "/proc/sys/net/%s/conf/%s/%s", proto, iface, setting);
+    size_t len = strlen(value);
+
+    pthread_mutex_lock(&mLock);
+    std::map<std::string, int> &fds = mFds[iface];
+    std::map<std::string, int>::iterator it = fds.find(path);
+    if (it != fds.end()) {
+        if (!writeFd(it->second, value, len)) {
+            pthread_mutex_unlock(&mLock);
+            return 0;
+        }
+        // The interface may have been recreated under the same name; try a fresh open.
+        close(it->second);
+        fds.erase(it);
+    }
+
+    int res = -1;
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        ALOGE("Failed to open %s: %s", path, strerror(errno));
+    } else if (writeFd(fd, value, len)) {
+        ALOGE("Failed to write %s: %s", path, strerror(errno));
+        close(fd);
+    } else {
+        fds[path] = fd;
+        res = 0;
+    }
+    if (fds.empty()) {
+        mFds.erase(iface);
+    }
+    pthread_mutex_unlock(&mLock);
+    return res;
+}
+
+static int isInterfaceName(const char *name) {
+    return strcmp(name, ".") &&
+        strcmp(name, "..") &&
+        strcmp(name, "default") &&
+        strcmp(name, "all");
+}
+
+int SysctlCache::writeAll(const char *proto, const char *setting, const char *value) {
+    char path[PATH_MAX];
+    size_t len = strlen(value);
+
+    snprintf(path, sizeof(path), "/proc/sys/net/%s/conf", proto);
+    int dirFd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirFd < 0) {
+        ALOGE("Can't open %s: %s", path, strerror(errno));
+        return -1;
+    }
+    DIR *dir = fdopendir(dirFd);
+    if (!dir) {
+        ALOGE("Can't list %s: %s", path, strerror(errno));
+        close(dirFd);
+        return -1;
+    }
+
+    // Open relative to the conf directory so each write only resolves two path components.
+    // The default value is used by any interfaces that are created in the future.
+    snprintf(path, sizeof(path), "default/%s", setting);
+    int fd = openat(dirFd, path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0 || writeFd(fd, value, len)) {
+        ALOGE("Can't write to %s: %s", path, strerror(errno));
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    struct dirent *d;
+    while ((d = readdir(dir)) != NULL) {
+        if (d->d_type != DT_DIR || !isInterfaceName(d->d_name)) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", d->d_name, setting);
+        fd = openat(dirFd, path, O_WRONLY | O_CLOEXEC);
+        if (fd < 0 || writeFd(fd, value, len)) {
+            ALOGE("Can't write to %s/%s: %s", proto, path, strerror(errno));
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    closedir(dir);
+    return 0;
+}
+
+void SysctlCache::forgetInterface(const char *iface) {
+    pthread_mutex_lock(&mLock);
+    std::map<std::string, std::map<std::string, int> >::iterator it = mFds.find(iface);
+    if (it != mFds.end()) {
+        std::map<std::string, int>::iterator fd;
+        for (fd = it->second.begin(); fd != it->second.end(); ++fd) {
+            close(fd->second);
+        }
+        mFds.erase(it);
+    }
+    pthread_mutex_unlock(&mLock);
+}
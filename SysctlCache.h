@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _SYSCTL_CACHE_H
+#define _SYSCTL_CACHE_H
+
+#include <pthread.h>
+
+#include <map>
+#include <string>
+
+/*
+ * Writes per-interface sysctls under /proc/sys/net/<proto>/conf, keeping the file of
+ * each setting open so that changing it again is a single pwrite(). The files of an
+ * interface are closed when NetlinkHandler sees it go away.
+ */
+class SysctlCache {
+public:
+    static SysctlCache *Instance();
+
+    /* Writes /proc/sys/net/<proto>/conf/<iface>/<setting>. Returns 0 or -1. */
+    int write(const char *proto, const char *iface, const char *setting, const char *value);
+
+    /*
+     * Writes the setting for "default" and every existing interface in one pass. These
+     * are one-off writes, so the files are not kept open.
+     */
+    int writeAll(const char *proto, const char *setting, const char *value);
+
+    void forgetInterface(const char *iface);
+
+private:
+    SysctlCache();
+
+    static SysctlCache *sInstance;
+
+    pthread_mutex_t mLock;
+    // iface -> path -> fd
+    std::map<std::string, std::map<std::string, int> > mFds;
+};
+
+#endif
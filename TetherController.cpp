@@ -21,9 +21,10 @@
 
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
-#include <sys/wait.h>
 
+#include <netdb.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
@@ -31,13 +32,23 @@
 #include <cutils/log.h>
 #include <cutils/properties.h>
 
+#include "ProcessSupervisor.h"
 #include "TetherController.h"
 
 TetherController::TetherController() {
     mInterfaces = new InterfaceCollection();
     mDnsForwarders = new NetAddressCollection();
     mDaemonFd = -1;
-    mDaemonPid = 0;
+    mDaemonId = -1;
+
+    pthread_mutex_init(&mDaemonLock, NULL);
+    pthread_cond_init(&mUpdateCond, NULL);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, TetherController::updateThreadStart, this)) {
+        ALOGE("Unable to start dnsmasq update thread (%s)", strerror(errno));
+    } else {
+        pthread_detach(thread);
+    }
 }
 
 TetherController::~TetherController() {
@@ -96,10 +107,8 @@ bool TetherController::getIpFwdEnabled() {
     return (enabled  == '1' ? true : false);
 }
 
-#define TETHER_START_CONST_ARG        8
-
 int TetherController::startTethering(int num_addrs, struct in_addr* addrs) {
-    if (mDaemonPid != 0) {
+    if (mDaemonId != -1) {
         ALOGE("Tethering already started");
         errno = EBUSY;
         return -1;
@@ -107,133 +116,176 @@ int TetherController::startTethering(int num_addrs, struct in_addr* addrs) {
 
     ALOGD("Starting tethering services");
 
-    pid_t pid;
     int pipefd[2];
 
-    if (pipe(pipefd) < 0) {
+    // O_CLOEXEC keeps the write end out of dnsmasq; dup2() clears it on its stdin.
+    if (pipe2(pipefd, O_CLOEXEC) < 0) {
         ALOGE("pipe failed (%s)", strerror(errno));
         return -1;
     }
 
+    std::vector<std::string> args;
+    args.push_back("/system/bin/dnsmasq");
+    args.push_back("--keep-in-foreground");
+    args.push_back("--no-resolv");
+    args.push_back("--no-poll");
+    args.push_back("--dhcp-authoritative");
+    // TODO: pipe through metered status from ConnService
+    args.push_back("--dhcp-option-force=43,ANDROID_METERED");
+    args.push_back("--pid-file");
+    args.push_back("");
+    for (int addrIndex = 0; addrIndex + 1 < num_addrs; addrIndex += 2) {
+        std::string range = "--dhcp-range=";
+        range += inet_ntoa(addrs[addrIndex]);
+        range += ",";
+        range += inet_ntoa(addrs[addrIndex + 1]);
+        range += ",1h";
+        args.push_back(range);
+    }
+
     /*
-     * TODO: Create a monitoring thread to handle and restart
-     * the daemon if it exits prematurely
+     * TODO: restart the daemon if it exits prematurely; it would need the
+     * interfaces and DNS servers sent again.
      */
-    if ((pid = fork()) < 0) {
-        ALOGE("fork failed (%s)", strerror(errno));
-        close(pipefd[0]);
+    int id = ProcessSupervisor::Instance()->spawn("dnsmasq", args, pipefd[0], false);
+    close(pipefd[0]);
+    if (id == -1) {
         close(pipefd[1]);
         return -1;
     }
 
-    if (!pid) {
-        close(pipefd[1]);
-        if (pipefd[0] != STDIN_FILENO) {
-            if (dup2(pipefd[0], STDIN_FILENO) != STDIN_FILENO) {
-                ALOGE("dup2 failed (%s)", strerror(errno));
-                return -1;
-            }
-            close(pipefd[0]);
-        }
-
-        int num_processed_args = TETHER_START_CONST_ARG + (num_addrs/2) + 1;
-        char **args = (char **)malloc(sizeof(char *) * num_processed_args);
-        args[num_processed_args - 1] = NULL;
-        args[0] = (char *)"/system/bin/dnsmasq";
-        args[1] = (char *)"--keep-in-foreground";
-        args[2] = (char *)"--no-resolv";
-        args[3] = (char *)"--no-poll";
-        args[4] = (char *)"--dhcp-authoritative";
-        // TODO: pipe through metered status from ConnService
-        args[5] = (char *)"--dhcp-option-force=43,ANDROID_METERED";
-        args[6] = (char *)"--pid-file";
-        args[7] = (char *)"";
-
-        int nextArg = TETHER_START_CONST_ARG;
-        for (int addrIndex=0; addrIndex < num_addrs;) {
-            char *start = strdup(inet_ntoa(addrs[addrIndex++]));
-            char *end = strdup(inet_ntoa(addrs[addrIndex++]));
-            asprintf(&(args[nextArg++]),"--dhcp-range=%s,%s,1h", start, end);
-        }
-
-        if (execv(args[0], args)) {
-            ALOGE("execl failed (%s)", strerror(errno));
-        }
-        ALOGE("Should never get here!");
-        _exit(-1);
-    } else {
-        close(pipefd[0]);
-        mDaemonPid = pid;
-        mDaemonFd = pipefd[1];
-        applyDnsInterfaces();
-        ALOGD("Tethering services running");
-    }
+    mDaemonId = id;
+    pthread_mutex_lock(&mDaemonLock);
+    mDaemonFd = pipefd[1];
+    pthread_mutex_unlock(&mDaemonLock);
+    applyDnsInterfaces();
+    ALOGD("Tethering services running");
 
     return 0;
 }
 
 int TetherController::stopTethering() {
 
-    if (mDaemonPid == 0) {
+    if (mDaemonId == -1) {
         ALOGE("Tethering already stopped");
         return 0;
     }
 
     ALOGD("Stopping tethering services");
 
-    kill(mDaemonPid, SIGTERM);
-    waitpid(mDaemonPid, NULL, 0);
-    mDaemonPid = 0;
+    ProcessSupervisor::Instance()->stop(mDaemonId);
+    mDaemonId = -1;
+    pthread_mutex_lock(&mDaemonLock);
     close(mDaemonFd);
     mDaemonFd = -1;
+    mPendingIfacesCmd.clear();
+    mPendingDnsCmd.clear();
+    pthread_mutex_unlock(&mDaemonLock);
     ALOGD("Tethering services stopped");
     return 0;
 }
 
 bool TetherController::isTetheringStarted() {
-    return (mDaemonPid == 0 ? false : true);
+    return (mDaemonId == -1 ? false : true);
 }
 
+// dnsmasq reads its commands in chunks of this size, so no command may be longer.
 #define MAX_CMD_SIZE 1024
+// How long updates are held back so that they can be merged.
+#define UPDATE_DELAY_MS 100
+
+void *TetherController::updateThreadStart(void *obj) {
+    reinterpret_cast<TetherController *>(obj)->runUpdates();
+    return NULL;
+}
+
+void TetherController::runUpdates() {
+    pthread_mutex_lock(&mDaemonLock);
+    while (true) {
+        while (mPendingIfacesCmd.empty() && mPendingDnsCmd.empty()) {
+            pthread_cond_wait(&mUpdateCond, &mDaemonLock);
+        }
+
+        // Let further updates accumulate for a moment; they replace the pending ones.
+        struct timeval now;
+        gettimeofday(&now, NULL);
+        struct timespec deadline;
+        deadline.tv_sec = now.tv_sec;
+        deadline.tv_nsec = now.tv_usec * 1000 + UPDATE_DELAY_MS * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        int rc;
+        do {
+            rc = pthread_cond_timedwait(&mUpdateCond, &mDaemonLock, &deadline);
+        } while (rc != ETIMEDOUT);
+
+        // dnsmasq takes one command per read and drops whatever follows it in the
+        // same read, so each command goes out in a write of its own.
+        std::string cmds[2];
+        cmds[0].swap(mPendingIfacesCmd);
+        cmds[1].swap(mPendingDnsCmd);
+        for (int i = 0; i < 2 && mDaemonFd != -1; i++) {
+            if (cmds[i].empty()) {
+                continue;
+            }
+            ALOGD("Sending update msg to dnsmasq [%s]", cmds[i].c_str());
+            if (write(mDaemonFd, cmds[i].data(), cmds[i].size()) < 0) {
+                ALOGE("Failed to send update command to dnsmasq (%s)", strerror(errno));
+            }
+        }
+    }
+}
+
+/*
+ * Replaces the pending command of the same kind, cmd includes its terminating NUL.
+ * Must be called with mDaemonLock held.
+ */
+void TetherController::queueDaemonCmd(std::string *pending, const std::string &cmd) {
+    *pending = cmd;
+    pthread_cond_signal(&mUpdateCond);
+}
 
 int TetherController::setDnsForwarders(char **servers, int numServers) {
     int i;
-    char daemonCmd[MAX_CMD_SIZE];
-
-    strcpy(daemonCmd, "update_dns");
-    int cmdLen = strlen(daemonCmd);
+    std::string daemonCmd("update_dns");
+    NetAddressCollection forwarders;
 
-    mDnsForwarders->clear();
     for (i = 0; i < numServers; i++) {
         ALOGD("setDnsForwarders(%d = '%s')", i, servers[i]);
 
-        struct in_addr a;
-
-        if (!inet_aton(servers[i], &a)) {
+        // dnsmasq parses a ':' separated list, which has no room for IPv6 addresses.
+        struct addrinfo hints, *res;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_INET;
+        hints.ai_flags = AI_NUMERICHOST;
+        if (getaddrinfo(servers[i], NULL, &hints, &res)) {
             ALOGE("Failed to parse DNS server '%s'", servers[i]);
-            mDnsForwarders->clear();
             return -1;
         }
+        freeaddrinfo(res);
 
-        cmdLen += (strlen(servers[i]) + 1);
-        if (cmdLen + 1 >= MAX_CMD_SIZE) {
-            ALOGD("Too many DNS servers listed");
-            break;
-        }
+        daemonCmd += ":";
+        daemonCmd += servers[i];
+        forwarders.push_back(servers[i]);
+    }
+    daemonCmd += '\0';
+
+    if (daemonCmd.size() > MAX_CMD_SIZE) {
+        ALOGE("Too many DNS servers listed");
+        errno = E2BIG;
+        return -1;
+    }
 
-        strcat(daemonCmd, ":");
-        strcat(daemonCmd, servers[i]);
-        mDnsForwarders->push_back(a);
+    mDnsForwarders->clear();
+    for (NetAddressCollection::iterator it = forwarders.begin(); it != forwarders.end(); ++it) {
+        mDnsForwarders->push_back(*it);
     }
 
+    pthread_mutex_lock(&mDaemonLock);
     if (mDaemonFd != -1) {
-        ALOGD("Sending update msg to dnsmasq [%s]", daemonCmd);
-        if (write(mDaemonFd, daemonCmd, strlen(daemonCmd) +1) < 0) {
-            ALOGE("Failed to send update command to dnsmasq (%s)", strerror(errno));
-            mDnsForwarders->clear();
-            return -1;
-        }
+        queueDaemonCmd(&mPendingDnsCmd, daemonCmd);
     }
+    pthread_mutex_unlock(&mDaemonLock);
     return 0;
 }
 
@@ -242,33 +294,28 @@ NetAddressCollection *TetherController::getDnsForwarders() {
 }
 
 int TetherController::applyDnsInterfaces() {
-    int i;
-    char daemonCmd[MAX_CMD_SIZE];
-
-    strcpy(daemonCmd, "update_ifaces");
-    int cmdLen = strlen(daemonCmd);
+    std::string daemonCmd("update_ifaces");
     InterfaceCollection::iterator it;
     bool haveInterfaces = false;
 
     for (it = mInterfaces->begin(); it != mInterfaces->end(); ++it) {
-        cmdLen += (strlen(*it) + 1);
-        if (cmdLen + 1 >= MAX_CMD_SIZE) {
-            ALOGD("Too many DNS ifaces listed");
-            break;
-        }
-
-        strcat(daemonCmd, ":");
-        strcat(daemonCmd, *it);
+        daemonCmd += ":";
+        daemonCmd += *it;
         haveInterfaces = true;
     }
+    daemonCmd += '\0';
+
+    if (daemonCmd.size() > MAX_CMD_SIZE) {
+        ALOGE("Too many DNS ifaces listed");
+        errno = E2BIG;
+        return -1;
+    }
 
+    pthread_mutex_lock(&mDaemonLock);
     if ((mDaemonFd != -1) && haveInterfaces) {
-        ALOGD("Sending update msg to dnsmasq [%s]", daemonCmd);
-        if (write(mDaemonFd, daemonCmd, strlen(daemonCmd) +1) < 0) {
-            ALOGE("Failed to send update command to dnsmasq (%s)", strerror(errno));
-            return -1;
-        }
+        queueDaemonCmd(&mPendingIfacesCmd, daemonCmd);
     }
+    pthread_mutex_unlock(&mDaemonLock);
     return 0;
 }
 
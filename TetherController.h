@@ -18,18 +18,32 @@
 #define _TETHER_CONTROLLER_H
 
 #include <netinet/in.h>
+#include <pthread.h>
+
+#include <string>
 
 #include "List.h"
 
 typedef android::netd::List<char *> InterfaceCollection;
-typedef android::netd::List<struct in_addr> NetAddressCollection;
+// Numeric IPv4 addresses
+typedef android::netd::List<std::string> NetAddressCollection;
 
 class TetherController {
     InterfaceCollection  *mInterfaces;
     NetAddressCollection *mDnsForwarders;
-    pid_t                 mDaemonPid;
+    int                   mDaemonId;  // ProcessSupervisor id of dnsmasq, -1 if stopped
     int                   mDaemonFd;
 
+    /*
+     * Updates for dnsmasq are sent from a separate thread a short while after they are
+     * made, so that several changes in a row (e.g. during a tethering handoff) only
+     * make dnsmasq reload once. Only the latest command of each kind is kept.
+     */
+    pthread_mutex_t       mDaemonLock;
+    pthread_cond_t        mUpdateCond;
+    std::string           mPendingIfacesCmd;
+    std::string           mPendingDnsCmd;
+
 public:
     TetherController();
     virtual ~TetherController();
@@ -51,6 +65,9 @@ public:
 
 private:
     int applyDnsInterfaces();
+    void queueDaemonCmd(std::string *pending, const std::string &cmd);
+    static void *updateThreadStart(void *obj);
+    void runUpdates();
 };
 
 #endif
@@ -0,0 +1,245 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define LOG_TAG "ThreadPool"
+
+#include <cutils/log.h>
+#include <sysutils/SocketClient.h>
+
+#include "ResponseCode.h"
+#include "ThreadPool.h"
+
+// Stride scheduling: a key's pass advances by STRIDE / weight for each task started.
+static const uint64_t STRIDE = 1 << 20;
+
+static int64_t nowUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+ThreadPool::ThreadPool(const char *name, int threads, int maxQueued)
+        : mName(name),
+          mThreads(threads > 0 ? threads : 1),
+          mMaxQueued(maxQueued > 0 ? maxQueued : 1),
+          mMaxRunningPerKey(0),
+          mFairQueued(0),
+          mPass(0),
+          mStopping(false) {
+    pthread_mutex_init(&mLock, NULL);
+    pthread_cond_init(&mCond, NULL);
+    memset(&mStats, 0, sizeof(mStats));
+    mStats.maxQueued = mMaxQueued;
+}
+
+ThreadPool::~ThreadPool() {
+    stop();
+    pthread_cond_destroy(&mCond);
+    pthread_mutex_destroy(&mLock);
+}
+
+int ThreadPool::start() {
+    for (int i = 0; i < mThreads; i++) {
+        pthread_t thread;
+        int res = pthread_create(&thread, NULL, ThreadPool::threadStart, this);
+        if (res) {
+            ALOGE("%s: failed to start worker %d (%s)", mName, i, strerror(res));
+            return res;
+        }
+        pthread_mutex_lock(&mLock);
+        mWorkers.push_back(thread);
+        mStats.threads = mWorkers.size();
+        pthread_mutex_unlock(&mLock);
+    }
+    ALOGD("%s: started %d workers, queue depth %d", mName, mThreads, mMaxQueued);
+    return 0;
+}
+
+void ThreadPool::stop() {
+    pthread_mutex_lock(&mLock);
+    mStopping = true;
+    pthread_cond_broadcast(&mCond);
+    pthread_mutex_unlock(&mLock);
+
+    for (size_t i = 0; i < mWorkers.size(); i++) {
+        pthread_join(mWorkers[i], NULL);
+    }
+    pthread_mutex_lock(&mLock);
+    mWorkers.clear();
+    mStats.threads = 0;
+    pthread_mutex_unlock(&mLock);
+}
+
+void ThreadPool::setFairShare(int maxRunningPerKey) {
+    pthread_mutex_lock(&mLock);
+    mMaxRunningPerKey = maxRunningPerKey > 0 ? maxRunningPerKey : 1;
+    pthread_mutex_unlock(&mLock);
+}
+
+void ThreadPool::setWeight(uint32_t key, int weight) {
+    pthread_mutex_lock(&mLock);
+    if (weight > 0) {
+        mWeights[key] = weight;
+    } else {
+        mWeights.erase(key);
+    }
+    pthread_mutex_unlock(&mLock);
+}
+
+bool ThreadPool::enqueue(Task *task) {
+    return enqueue(task, 0);
+}
+
+bool ThreadPool::enqueue(Task *task, uint32_t key) {
+    pthread_mutex_lock(&mLock);
+    int queued = mMaxRunningPerKey ? mFairQueued : (int) mQueue.size();
+    bool full = queued >= mMaxQueued;
+    if (mMaxRunningPerKey && !full) {
+        std::map<uint32_t, KeyQueue>::const_iterator it = mKeys.find(key);
+        full = it != mKeys.end() && (int) it->second.tasks.size() >= (mMaxQueued + 1) / 2;
+    }
+    // Without a worker, say if start() failed, the task would never run.
+    if (mStopping || full || mWorkers.empty()) {
+        mStats.rejected++;
+        pthread_mutex_unlock(&mLock);
+        return false;
+    }
+    task->mQueuedAt = nowUs();
+    task->mKey = key;
+    if (mMaxRunningPerKey) {
+        KeyQueue &keyQueue = mKeys[key];
+        if (keyQueue.tasks.empty() && !keyQueue.running) {
+            // An idle key doesn't bank the share it didn't use.
+            keyQueue.pass = mPass;
+        }
+        keyQueue.tasks.push_back(task);
+        mStats.queued = ++mFairQueued;
+    } else {
+        mQueue.push_back(task);
+        mStats.queued = mQueue.size();
+    }
+    if (mStats.queued > mStats.queuedHighWater) {
+        mStats.queuedHighWater = mStats.queued;
+    }
+    pthread_cond_signal(&mCond);
+    pthread_mutex_unlock(&mLock);
+    return true;
+}
+
+void ThreadPool::getStats(Stats *stats) {
+    pthread_mutex_lock(&mLock);
+    *stats = mStats;
+    pthread_mutex_unlock(&mLock);
+}
+
+void ThreadPool::dump(SocketClient *cli) {
+    Stats stats;
+    getStats(&stats);
+    char msg[256];
+    snprintf(msg, sizeof(msg), "threadpool %s threads=%d busy=%d queued=%d max_queued=%d"
+             " queued_high_water=%d executed=%" PRIu64 " rejected=%" PRIu64
+             " avg_wait_us=%" PRId64 " max_wait_us=%" PRId64,
+             mName, stats.threads, stats.busy, stats.queued, stats.maxQueued,
+             stats.queuedHighWater, stats.executed, stats.rejected,
+             stats.executed ? stats.totalWaitUs / (int64_t) stats.executed : 0,
+             stats.maxWaitUs);
+    cli->sendMsg(ResponseCode::StatsListResult, msg, false);
+}
+
+void *ThreadPool::threadStart(void *obj) {
+    ThreadPool *pool = reinterpret_cast<ThreadPool *>(obj);
+    pool->runWorker();
+    return NULL;
+}
+
+/* The next task to run, or NULL if there is none a worker may take now. */
+ThreadPool::Task *ThreadPool::takeNextLocked() {
+    if (!mMaxRunningPerKey) {
+        if (mQueue.empty()) {
+            return NULL;
+        }
+        Task *task = mQueue.front();
+        mQueue.pop_front();
+        mStats.queued = mQueue.size();
+        return task;
+    }
+
+    std::map<uint32_t, KeyQueue>::iterator next = mKeys.end();
+    for (std::map<uint32_t, KeyQueue>::iterator it = mKeys.begin(); it != mKeys.end(); ++it) {
+        const KeyQueue &keyQueue = it->second;
+        if (!keyQueue.tasks.empty() && keyQueue.running < mMaxRunningPerKey &&
+                (next == mKeys.end() || keyQueue.pass < next->second.pass)) {
+            next = it;
+        }
+    }
+    if (next == mKeys.end()) {
+        return NULL;
+    }
+    KeyQueue &keyQueue = next->second;
+    Task *task = keyQueue.tasks.front();
+    keyQueue.tasks.pop_front();
+    keyQueue.running++;
+    mPass = keyQueue.pass;
+    std::map<uint32_t, int>::const_iterator weight = mWeights.find(next->first);
+    keyQueue.pass += STRIDE / (weight != mWeights.end() ? weight->second : 1);
+    mStats.queued = --mFairQueued;
+    return task;
+}
+
+void ThreadPool::runWorker() {
+    pthread_mutex_lock(&mLock);
+    while (true) {
+        Task *task;
+        while (!(task = takeNextLocked()) && !(mStopping && !mStats.queued)) {
+            pthread_cond_wait(&mCond, &mLock);
+        }
+        if (!task) {
+            break;
+        }
+
+        int64_t waitUs = nowUs() - task->mQueuedAt;
+        mStats.busy++;
+        mStats.executed++;
+        mStats.totalWaitUs += waitUs;
+        if (waitUs > mStats.maxWaitUs) {
+            mStats.maxWaitUs = waitUs;
+        }
+        pthread_mutex_unlock(&mLock);
+
+        uint32_t key = task->mKey;
+        task->run();
+        delete task;
+
+        pthread_mutex_lock(&mLock);
+        mStats.busy--;
+        if (mMaxRunningPerKey) {
+            std::map<uint32_t, KeyQueue>::iterator it = mKeys.find(key);
+            if (--it->second.running == 0 && it->second.tasks.empty()) {
+                mKeys.erase(it);
+            } else if (!it->second.tasks.empty()) {
+                // The key may have had tasks waiting only for this worker to finish.
+                pthread_cond_signal(&mCond);
+            }
+        }
+    }
+    pthread_mutex_unlock(&mLock);
+}
@@ -0,0 +1,120 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _THREAD_POOL_H
+#define _THREAD_POOL_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <list>
+#include <map>
+#include <vector>
+
+class SocketClient;
+
+/*
+ * A fixed number of worker threads fed from a bounded FIFO queue.
+ * When the queue is full enqueue() fails right away, so callers can push back
+ * instead of piling up work.
+ *
+ * With setFairShare(), tasks are instead queued per key (a uid, say) and the keys are
+ * served by stride scheduling in proportion to their weights. A key then never runs on
+ * more than maxRunningPerKey workers nor holds more than half the queue, so one busy
+ * key can't starve the others of workers or of queue space.
+ */
+class ThreadPool {
+public:
+    class Task {
+    public:
+        Task() : mQueuedAt(0), mKey(0) {}
+        virtual ~Task() {}
+        /* Runs on a worker thread. The pool deletes the task once it returns. */
+        virtual void run() = 0;
+    private:
+        friend class ThreadPool;
+        int64_t mQueuedAt;
+        uint32_t mKey;
+    };
+
+    struct Stats {
+        int threads;          // workers running
+        int maxQueued;
+        int queued;           // tasks currently waiting
+        int queuedHighWater;  // most tasks ever waiting at once
+        int busy;             // workers currently running a task
+        uint64_t executed;
+        uint64_t rejected;    // enqueue() calls that found the queue full
+        int64_t totalWaitUs;  // sum of the time executed tasks spent queued
+        int64_t maxWaitUs;
+    };
+
+    ThreadPool(const char *name, int threads, int maxQueued);
+    virtual ~ThreadPool();
+
+    /* Starts the workers. Returns 0 on success, otherwise errno. */
+    int start();
+    /* Waits for the queued tasks to be run, then stops the workers. */
+    void stop();
+
+    /*
+     * Queues task, which is owned by the pool on success. Returns false if the queue is
+     * full or no worker is running.
+     */
+    bool enqueue(Task *task);
+    /* The same, for the fair share of key. */
+    bool enqueue(Task *task, uint32_t key);
+
+    /* Switches to per-key scheduling; call before start(). */
+    void setFairShare(int maxRunningPerKey);
+    /* Weight of key's share, 1 by default; 0 restores the default. */
+    void setWeight(uint32_t key, int weight);
+
+    void getStats(Stats *stats);
+    /* Sends the stats as a StatsListResult line. */
+    void dump(SocketClient *cli);
+
+private:
+    struct KeyQueue {
+        std::list<Task *> tasks;
+        int running;
+        uint64_t pass;      // stride scheduling: the key with the lowest pass goes next
+        KeyQueue() : running(0), pass(0) {}
+    };
+
+    static void *threadStart(void *obj);
+    void runWorker();
+    Task *takeNextLocked();
+
+    const char *mName;
+    int mThreads;
+    int mMaxQueued;
+
+    pthread_mutex_t mLock;
+    pthread_cond_t mCond;
+    std::list<Task *> mQueue;
+    // Fair share mode: the keys with queued or running tasks, and the weights set.
+    int mMaxRunningPerKey;  // 0: plain FIFO
+    int mFairQueued;
+    uint64_t mPass;         // of the last task started
+    std::map<uint32_t, KeyQueue> mKeys;
+    std::map<uint32_t, int> mWeights;
+    std::vector<pthread_t> mWorkers;
+    bool mStopping;
+    Stats mStats;
+};
+
+#endif
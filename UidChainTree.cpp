@@ -0,0 +1,156 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+
+#define LOG_TAG "UidChainTree"
+
+#include <cutils/log.h>
+
+#include "IptablesTransaction.h"
+#include "NetdConstants.h"
+#include "UidChainTree.h"
+
+UidChainTree::UidChainTree(const char *root) : mRoot(root), mChains(1), mPendingChains(1) {
+}
+
+std::string UidChainTree::chainName(size_t index) const {
+    if (!index) {
+        return mRoot;
+    }
+    char suffix[16];
+    snprintf(suffix, sizeof(suffix), "_%zu", index);
+    return mRoot + suffix;
+}
+
+/* The node index of a chain of the tree named root; 0 if it isn't one. */
+static size_t getNodeIndex(const std::string &root, const std::string &chain) {
+    if (chain.size() <= root.size() + 1 || chain.compare(0, root.size(), root) ||
+            chain[root.size()] != '_') {
+        return 0;
+    }
+    const char *digits = chain.c_str() + root.size() + 1;
+    char *end;
+    unsigned long index = strtoul(digits, &end, 10);
+    return (*digits >= '1' && *digits <= '9' && !*end) ? index : 0;
+}
+
+bool UidChainTree::isTreeChain(const std::string &chain) const {
+    return chain == mRoot || getNodeIndex(mRoot, chain);
+}
+
+static std::string makeUidMatch(int first, int last) {
+    char uids[32];
+    if (first == last) {
+        snprintf(uids, sizeof(uids), "%d", first);
+    } else {
+        snprintf(uids, sizeof(uids), "%d-%d", first, last);
+    }
+    return std::string("-m owner --uid-owner ") + uids;
+}
+
+void UidChainTree::buildNode(IptablesTransaction &t, const std::vector<UidRange> &ranges,
+                             size_t lo, size_t hi, size_t index, size_t *next,
+                             const char *jump, const char *tail) {
+    std::string chain = chainName(index);
+    std::string prefix = "-A " + chain + " ";
+
+    t.addChain(V4V6, "filter", chain.c_str());
+    if (hi - lo <= LEAF_RULES) {
+        for (size_t i = lo; i < hi; i++) {
+            std::string rule = prefix + makeUidMatch(ranges[i].first, ranges[i].second) +
+                    " -j " + jump;
+            t.addCommand(V4V6, rule.c_str());
+        }
+    } else {
+        size_t bounds[3] = { lo, lo + (hi - lo) / 2, hi };
+        for (int half = 0; half < 2; half++) {
+            size_t child = (*next)++;
+            buildNode(t, ranges, bounds[half], bounds[half + 1], child, next, jump, tail);
+            std::string rule = prefix + makeUidMatch(ranges[bounds[half]].first,
+                                                     ranges[bounds[half + 1] - 1].second) +
+                    " -g " + chainName(child);
+            t.addCommand(V4V6, rule.c_str());
+        }
+    }
+    if (tail) {
+        t.addCommand(V4V6, (prefix + tail).c_str());
+    }
+}
+
+void UidChainTree::deleteChains(IptablesTransaction &t, size_t from) {
+    // Flushed first, as they may still jump to each other.
+    for (size_t i = from; i < mChains; i++) {
+        t.addChain(V4V6, "filter", chainName(i).c_str());
+    }
+    for (size_t i = from; i < mChains; i++) {
+        t.add(V4V6, "-X", chainName(i).c_str(), NULL);
+    }
+}
+
+void UidChainTree::build(IptablesTransaction &t, const std::set<int> &uids, const char *jump,
+                         const char *tail) {
+    std::vector<UidRange> ranges;
+    for (std::set<int>::const_iterator it = uids.begin(); it != uids.end(); ++it) {
+        if (!ranges.empty() && ranges.back().second + 1 == *it) {
+            ranges.back().second = *it;
+        } else {
+            ranges.push_back(std::make_pair(*it, *it));
+        }
+    }
+
+    size_t next = 1;
+    buildNode(t, ranges, 0, ranges.size(), 0, &next, jump, tail);
+    // The root no longer reaches the chains past the new tree.
+    deleteChains(t, next);
+    mPendingChains = next;
+    if (mChains < next) {
+        mChains = next;
+    }
+}
+
+void UidChainTree::clear(IptablesTransaction &t) {
+    t.addChain(V4V6, "filter", mRoot.c_str());
+    deleteChains(t, 1);
+    mPendingChains = 1;
+}
+
+void UidChainTree::remove(IptablesTransaction &t) {
+    clear(t);
+    t.add(V4V6, "-X", mRoot.c_str(), NULL);
+}
+
+void UidChainTree::adopt(const std::string *savedRules) {
+    for (int family = V4; family <= V6; family++) {
+        std::vector<std::string> chains;
+        IptablesTransaction::listChains(savedRules[family], "filter", &chains);
+        for (size_t i = 0; i < chains.size(); i++) {
+            size_t index = getNodeIndex(mRoot, chains[i]);
+            if (index >= mChains) {
+                mChains = index + 1;
+            }
+        }
+    }
+    mPendingChains = mChains;
+}
+
+void UidChainTree::committed() {
+    mChains = mPendingChains;
+}
@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _UID_CHAIN_TREE_H
+#define _UID_CHAIN_TREE_H
+
+#include <stddef.h>
+
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+class IptablesTransaction;
+
+/*
+ * Lays out a set of per-uid owner matches as a binary tree of filter chains, so that a
+ * packet goes through a couple of rules per level instead of one rule per uid:
+ *
+ *     <root>:    -m owner --uid-owner 1000-10100 -g <root>_1
+ *                -m owner --uid-owner 10101-10999 -g <root>_2
+ *                <tail>
+ *     <root>_1:  -m owner --uid-owner 1000 -j <jump>
+ *                -m owner --uid-owner 10005-10009 -j <jump>
+ *                ...
+ *                <tail>
+ *
+ * Contiguous uids share a range match, and a leaf holds up to LEAF_RULES of them.
+ * Inside the tree, chains are reached with --goto, so a RETURN from a leaf returns from
+ * whatever jumped to the root, as it would have from a flat list in the root. A packet
+ * that matches no uid gets the tail rule of the chain it ends up in, which is the same
+ * for all of them.
+ *
+ * Every change rewrites the whole tree, in the caller's transaction.
+ */
+class UidChainTree {
+public:
+    /* The chains are <root> and <root>_<n>, in the filter table of both families. */
+    explicit UidChainTree(const char *root);
+
+    const char *root() const { return mRoot.c_str(); }
+    /* Whether chain is one of the tree's, root included. */
+    bool isTreeChain(const std::string &chain) const;
+
+    /*
+     * Queues the tree for uids. jump is the target of a matching uid (e.g. "RETURN"),
+     * tail the rule every chain ends with (e.g. "-j REJECT"), or NULL for none.
+     */
+    void build(IptablesTransaction &t, const std::set<int> &uids, const char *jump,
+               const char *tail);
+    /* Queues flushing the root and deleting the other chains. */
+    void clear(IptablesTransaction &t);
+    /* Queues clear() and deleting the root as well. */
+    void remove(IptablesTransaction &t);
+
+    /* Learns the chains found in savedRules (iptables-save dumps indexed by V4/V6). */
+    void adopt(const std::string *savedRules);
+    /* After build(), clear() or remove() were committed. */
+    void committed();
+
+private:
+    static const size_t LEAF_RULES = 16;
+
+    typedef std::pair<int, int> UidRange;
+
+    std::string chainName(size_t index) const;
+    void buildNode(IptablesTransaction &t, const std::vector<UidRange> &ranges, size_t lo,
+                   size_t hi, size_t index, size_t *next, const char *jump, const char *tail);
+    void deleteChains(IptablesTransaction &t, size_t from);
+
+    std::string mRoot;
+    size_t mChains;         // Chains that may exist, root included.
+    size_t mPendingChains;  // mChains once the queued rules are committed.
+};
+
+#endif
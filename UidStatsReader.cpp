@@ -0,0 +1,250 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOG_TAG "UidStatsReader"
+
+#include <cutils/log.h>
+#include <sysutils/SocketClient.h>
+
+#include "ResponseCode.h"
+#include "UidStatsReader.h"
+
+static const char *STATS_PATH = "/proc/net/xt_qtaguid/stats";
+static const size_t INITIAL_BUFFER_SIZE = 64 * 1024;
+
+/*
+ * Reads the next space separated field of [*p, end) as a number, and moves *p past it.
+ * Base 16 fields start with 0x.
+ */
+static bool scanNumber(const char **p, const char *end, int base, uint64_t *value) {
+    const char *s = *p;
+    if (base == 16) {
+        if (end - s < 2 || s[0] != '0' || s[1] != 'x') {
+            return false;
+        }
+        s += 2;
+    }
+    uint64_t v = 0;
+    const char *start = s;
+    for (; s < end && *s != ' '; s++) {
+        int digit;
+        if (*s >= '0' && *s <= '9') {
+            digit = *s - '0';
+        } else if (base == 16 && *s >= 'a' && *s <= 'f') {
+            digit = *s - 'a' + 10;
+        } else {
+            return false;
+        }
+        v = v * base + digit;
+    }
+    if (s == start) {
+        return false;
+    }
+    while (s < end && *s == ' ') {
+        s++;
+    }
+    *value = v;
+    *p = s;
+    return true;
+}
+
+/* Copies the next field into buf, which gets a NUL, and moves *p past it. */
+static bool scanString(const char **p, const char *end, char *buf, size_t size) {
+    const char *s = *p;
+    size_t len = 0;
+    for (; s < end && *s != ' '; s++) {
+        if (len + 1 == size) {
+            return false;
+        }
+        buf[len++] = *s;
+    }
+    if (len == 0) {
+        return false;
+    }
+    buf[len] = '\0';
+    while (s < end && *s == ' ') {
+        s++;
+    }
+    *p = s;
+    return true;
+}
+
+bool UidStatsReader::Key::operator<(const Key &other) const {
+    if (uid != other.uid) {
+        return uid < other.uid;
+    }
+    if (tag != other.tag) {
+        return tag < other.tag;
+    }
+    if (set != other.set) {
+        return set < other.set;
+    }
+    return strcmp(iface, other.iface) < 0;
+}
+
+UidStatsReader::UidStatsReader() : mFd(-1), mBuf(INITIAL_BUFFER_SIZE) {
+    // Cursors of an earlier netd fall below this one's, and get a full snapshot.
+    mFirstCursor = (uint64_t) time(NULL) << 20;
+    mCursor = mFirstCursor;
+    mOldestCursor = mFirstCursor;
+}
+
+UidStatsReader::~UidStatsReader() {
+    if (mFd >= 0) {
+        close(mFd);
+    }
+}
+
+int UidStatsReader::readFile(size_t *len) {
+    if (mFd < 0) {
+        mFd = open(STATS_PATH, O_RDONLY | O_CLOEXEC);
+        if (mFd < 0) {
+            ALOGE("Unable to open %s (%s)", STATS_PATH, strerror(errno));
+            return -1;
+        }
+    }
+    *len = 0;
+    for (;;) {
+        if (*len == mBuf.size()) {
+            mBuf.resize(mBuf.size() * 2);
+        }
+        ssize_t n = pread(mFd, &mBuf[*len], mBuf.size() - *len, *len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            ALOGE("Reading %s failed (%s)", STATS_PATH, strerror(errno));
+            close(mFd);
+            mFd = -1;
+            return -1;
+        }
+        if (n == 0) {
+            return 0;
+        }
+        *len += n;
+    }
+}
+
+/*
+ * Scans the first len bytes of mBuf into mRows, lines being
+ *     idx iface acct_tag_hex uid_tag_int cnt_set rx_bytes rx_packets tx_bytes tx_packets ...
+ * after a header line. Only rows that were not seen before allocate.
+ */
+int UidStatsReader::update(size_t len) {
+    const char *p = &mBuf[0];
+    const char *bufEnd = p + len;
+    const char *end = static_cast<const char *>(memchr(p, '\n', len));
+    if (end == NULL) {
+        ALOGE("No header in %s", STATS_PATH);
+        return -1;
+    }
+
+    uint64_t cursor = mCursor + 1;
+    for (p = end + 1; p < bufEnd; p = end + 1) {
+        end = static_cast<const char *>(memchr(p, '\n', bufEnd - p));
+        if (end == NULL) {
+            end = bufEnd;
+        }
+        const char *line = p;
+        Key key;
+        uint64_t idx, uid, set;
+        Row row;
+        if (!scanNumber(&p, end, 10, &idx) ||
+                !scanString(&p, end, key.iface, sizeof(key.iface)) ||
+                !scanNumber(&p, end, 16, &key.tag) ||
+                !scanNumber(&p, end, 10, &uid) ||
+                !scanNumber(&p, end, 10, &set) ||
+                !scanNumber(&p, end, 10, &row.rxBytes) ||
+                !scanNumber(&p, end, 10, &row.rxPackets) ||
+                !scanNumber(&p, end, 10, &row.txBytes) ||
+                !scanNumber(&p, end, 10, &row.txPackets)) {
+            ALOGE("Malformed line in %s: %.*s", STATS_PATH, (int) (end - line), line);
+            return -1;
+        }
+        key.uid = uid;
+        key.set = set;
+        row.changed = cursor;
+        row.seen = cursor;
+
+        std::pair<RowMap::iterator, bool> it = mRows.insert(std::make_pair(key, row));
+        Row &have = it.first->second;
+        if (!it.second) {
+            if (have.rxBytes != row.rxBytes || have.rxPackets != row.rxPackets ||
+                    have.txBytes != row.txBytes || have.txPackets != row.txPackets) {
+                have = row;
+            } else {
+                have.seen = cursor;
+            }
+        }
+    }
+
+    /*
+     * The rows of a deleted tag are gone from the file; report them as zeroed for one
+     * read, then forget them. Cursors from before a forgotten deletion get every row,
+     * as they could otherwise miss it.
+     */
+    for (RowMap::iterator it = mRows.begin(); it != mRows.end();) {
+        Row &row = it->second;
+        if (row.seen == cursor) {
+            ++it;
+        } else if (row.rxBytes || row.rxPackets || row.txBytes || row.txPackets) {
+            row.rxBytes = row.rxPackets = row.txBytes = row.txPackets = 0;
+            row.changed = cursor;
+            ++it;
+        } else {
+            if (row.changed > row.seen && row.changed > mOldestCursor) {
+                mOldestCursor = row.changed;
+            }
+            mRows.erase(it++);
+        }
+    }
+    mCursor = cursor;
+    return 0;
+}
+
+int UidStatsReader::send(SocketClient *cli, uint64_t cursor) {
+    size_t len;
+    if (readFile(&len) || update(len)) {
+        return -1;
+    }
+    if (cursor <= mFirstCursor || cursor < mOldestCursor || cursor > mCursor) {
+        cursor = 0;
+    }
+
+    char msg[160];
+    for (RowMap::const_iterator it = mRows.begin(); it != mRows.end(); ++it) {
+        const Key &key = it->first;
+        const Row &row = it->second;
+        if (row.changed <= cursor) {
+            continue;
+        }
+        snprintf(msg, sizeof(msg), "%u 0x%" PRIx64 " %s %u %" PRIu64 " %" PRIu64 " %" PRIu64
+                 " %" PRIu64, key.uid, key.tag, key.iface, key.set, row.rxBytes,
+                 row.rxPackets, row.txBytes, row.txPackets);
+        cli->sendMsg(ResponseCode::UidStatsListResult, msg, false);
+    }
+    snprintf(msg, sizeof(msg), "%" PRIu64, mCursor);
+    cli->sendMsg(ResponseCode::UidStatsResult, msg, false);
+    return 0;
+}
@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _UID_STATS_READER_H
+#define _UID_STATS_READER_H
+
+#include <net/if.h>
+#include <stdint.h>
+
+#include <map>
+#include <vector>
+
+class SocketClient;
+
+/*
+ * Reads the per uid counters of /proc/net/xt_qtaguid/stats incrementally. The file is
+ * pread() into a buffer kept between reads and scanned in place, and each row of the
+ * previous snapshot remembers the read that last changed it, so a caller only gets the
+ * rows that changed since the cursor its previous read returned.
+ * Not thread safe; it belongs to the controller that owns the accounting rules.
+ */
+class UidStatsReader {
+public:
+    UidStatsReader();
+    ~UidStatsReader();
+
+    /*
+     * Reads the file, sends a UidStatsListResult line
+     *     <uid> <tag> <iface> <set> <rx_bytes> <rx_packets> <tx_bytes> <tx_packets>
+     * for every row that changed since cursor, then a UidStatsResult with the cursor for
+     * the next call. A row that left the file is sent with zero counters until the
+     * following read, which forgets it. Cursor 0, any cursor this netd did not hand
+     * out, and any cursor from before a forgotten row left, gets every row; the caller
+     * should then drop the rows it does not get.
+     * Returns 0 on success, -1 if the file could not be read; nothing is sent then.
+     */
+    int send(SocketClient *cli, uint64_t cursor);
+
+private:
+    struct Key {
+        uint32_t uid;
+        uint64_t tag;
+        uint32_t set;
+        char iface[IFNAMSIZ];
+        bool operator<(const Key &other) const;
+    };
+
+    struct Row {
+        uint64_t rxBytes;
+        uint64_t rxPackets;
+        uint64_t txBytes;
+        uint64_t txPackets;
+        uint64_t changed;   // the cursor of the read that last changed it
+        uint64_t seen;      // the cursor of the last read that had it
+    };
+
+    typedef std::map<Key, Row> RowMap;
+
+    int readFile(size_t *len);
+    int update(size_t len);
+
+    int mFd;
+    std::vector<char> mBuf;
+    RowMap mRows;
+    uint64_t mFirstCursor;  // before the first read of this netd
+    uint64_t mCursor;       // of the last read
+    uint64_t mOldestCursor; // the oldest cursor that still gets only the changes
+};
+
+#endif
@@ -34,10 +34,12 @@
 #include "NetlinkManager.h"
 #include "DnsProxyListener.h"
 #include "MDnsSdListener.h"
+#include "ProcessSupervisor.h"
+#include "RouteCache.h"
+#include "SecondaryTableController.h"
 
 static void coldboot(const char *path);
-static void sigchld_handler(int sig);
-static void blockSigpipe();
+static void blockSignals();
 
 int main() {
 
@@ -48,8 +50,12 @@ int main() {
 
     ALOGI("Netd 1.0 starting");
 
-//    signal(SIGCHLD, sigchld_handler);
-    blockSigpipe();
+    // Before any thread is started, so that every thread inherits the mask.
+    blockSignals();
+
+    if (ProcessSupervisor::Instance()->start()) {
+        ALOGE("Unable to start ProcessSupervisor, children are only reaped when stopped");
+    }
 
     if (!(nm = NetlinkManager::Instance())) {
         ALOGE("Unable to create NetlinkManager");
@@ -64,10 +70,15 @@ int main() {
         exit(1);
     }
 
+    if (RouteCache::Instance()->start(BASE_TABLE_NUMBER)) {
+        ALOGE("Unable to start RouteCache, route changes will all go to the kernel");
+    }
+
     // Set local DNS mode, to prevent bionic from proxying
     // back to this service, recursively.
     setenv("ANDROID_DNS_MODE", "local", 1);
     dpl = new DnsProxyListener(CommandListener::sNetCtrl);
+    CommandListener::sDnsPool = dpl->getThreadPool();
     if (dpl->startListener()) {
         ALOGE("Unable to start DnsProxyListener (%s)", strerror(errno));
         exit(1);
@@ -140,17 +151,14 @@ static void coldboot(const char *path)
     }
 }
 
-static void sigchld_handler(int sig) {
-    pid_t pid = wait(NULL);
-    ALOGD("Child process %d exited", pid);
-}
-
-static void blockSigpipe()
+/* SIGCHLD is picked up by ProcessSupervisor with a signalfd. */
+static void blockSignals()
 {
     sigset_t mask;
 
     sigemptyset(&mask);
     sigaddset(&mask, SIGPIPE);
+    sigaddset(&mask, SIGCHLD);
     if (sigprocmask(SIG_BLOCK, &mask, NULL) != 0)
-        ALOGW("WARNING: SIGPIPE not blocked\n");
+        ALOGW("WARNING: SIGPIPE and SIGCHLD not blocked\n");
 }
@@ -21,6 +21,7 @@
 #include <signal.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <stdint.h>
 
 #include <sys/socket.h>
 #include <sys/select.h>
@@ -31,13 +32,24 @@
 #include <cutils/sockets.h>
 #include <private/android_filesystem_config.h>
 
+#include "BinaryFraming.h"
+
 static void usage(char *progname);
 static int do_monitor(int sock, int stop_after_cmd);
-static int do_cmd(int sock, int argc, char **argv);
+static int do_cmd(int sock, int argc, char **argv, int binary);
+static int do_subscribe(int sock, const char *event_class);
 
 int main(int argc, char **argv) {
     int sock;
     int cmdOffset = 0;
+    int binary = 0;
+
+    if (argc > 1 && !strcmp(argv[1], "-b")) {
+        binary = 1;
+        argv[1] = argv[0];
+        argv++;
+        argc--;
+    }
 
     if (argc < 2)
         usage(argv[0]);
@@ -59,16 +71,35 @@ int main(int argc, char **argv) {
         cmdOffset = 1;
     }
 
-    if (!strcmp(argv[1+cmdOffset], "monitor"))
+    if (!strcmp(argv[1+cmdOffset], "monitor")) {
+        int i;
+        for (i = 2 + cmdOffset; i < argc; i++) {
+            int res = do_subscribe(sock, argv[i]);
+            if (res)
+                exit(res);
+        }
         exit(do_monitor(sock, 0));
-    exit(do_cmd(sock, argc-cmdOffset, &(argv[cmdOffset])));
+    }
+    exit(do_cmd(sock, argc-cmdOffset, &(argv[cmdOffset]), binary));
 }
 
-static int do_cmd(int sock, int argc, char **argv) {
+static int do_cmd(int sock, int argc, char **argv, int binary) {
     char *final_cmd;
     char *conv_ptr;
     int i;
 
+    if (binary) {
+        static const char framing_cmd[] = "0 framing binary";
+        if (write(sock, framing_cmd, sizeof(framing_cmd)) < 0) {
+            int res = errno;
+            perror("write");
+            return res;
+        }
+        int res = do_monitor(sock, 1);
+        if (res)
+            return res;
+    }
+
     /* Check if 1st arg is cmd sequence number */ 
     strtol(argv[1], &conv_ptr, 10);
     if (conv_ptr == argv[1]) {
@@ -114,8 +145,82 @@ static int do_cmd(int sock, int argc, char **argv) {
     return do_monitor(sock, 1);
 }
 
+/* Limits the broadcasts netd sends us; the first class drops all the others. */
+static int do_subscribe(int sock, const char *event_class) {
+    char *cmd;
+
+    if (asprintf(&cmd, "0 subscribe add %s", event_class) < 0) {
+        int res = errno;
+        perror("failed asprintf");
+        return res;
+    }
+    if (write(sock, cmd, strlen(cmd) + 1) < 0) {
+        int res = errno;
+        perror("write");
+        free(cmd);
+        return res;
+    }
+    free(cmd);
+    return do_monitor(sock, 1);
+}
+
+static uint32_t get_uint32(const unsigned char *p) {
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+static long long get_int64(const unsigned char *p) {
+    return (long long) (((uint64_t) get_uint32(p) << 32) | get_uint32(p + 4));
+}
+
+/* Prints the records of a binary frame as the text replies they stand for. */
+static int print_frame(const unsigned char *frame) {
+    int type = (frame[2] << 8) | frame[3];
+    int code = get_uint32(frame + 4);
+    int cmd_num = get_uint32(frame + 8);
+    uint32_t length = get_uint32(frame + 12);
+    const unsigned char *p = frame + NETD_FRAME_HEADER_SIZE;
+    const unsigned char *end = p + length;
+    const int n = NETD_FRAME_NAME_SIZE;
+    size_t record_size;
+
+    switch (type) {
+    case NETD_RECORD_NAME:
+        record_size = NETD_RECORD_NAME_SIZE;
+        break;
+    case NETD_RECORD_QUOTA:
+        record_size = NETD_RECORD_QUOTA_SIZE;
+        break;
+    case NETD_RECORD_TETHER_STATS:
+        record_size = NETD_RECORD_TETHER_STATS_SIZE;
+        break;
+    default:
+        printf("%d %d [%u bytes of record type %d]\n", code, cmd_num, length, type);
+        return code;
+    }
+
+    for (; p + record_size <= end; p += record_size) {
+        printf("%d %d ", code, cmd_num);
+        switch (type) {
+        case NETD_RECORD_NAME:
+            printf("%.*s\n", n, (const char *) p);
+            break;
+        case NETD_RECORD_QUOTA:
+            printf("%.*s %lld\n", n, (const char *) p, get_int64(p + n));
+            break;
+        case NETD_RECORD_TETHER_STATS:
+            printf("%.*s %.*s %lld %lld %lld %lld\n", n, (const char *) p,
+                   n, (const char *) p + n, get_int64(p + 2 * n), get_int64(p + 2 * n + 8),
+                   get_int64(p + 2 * n + 16), get_int64(p + 2 * n + 24));
+            break;
+        }
+    }
+    return code;
+}
+
 static int do_monitor(int sock, int stop_after_cmd) {
-    char *buffer = malloc(4096);
+    size_t size = 4096;
+    size_t len = 0;
+    char *buffer = malloc(size);
 
     if (!stop_after_cmd)
         printf("[Connected to Netd]\n");
@@ -141,8 +246,19 @@ static int do_monitor(int sock, int stop_after_cmd) {
             fprintf(stderr, "[TIMEOUT]\n");
             return ETIMEDOUT;
         } else if (FD_ISSET(sock, &read_fds)) {
-            memset(buffer, 0, 4096);
-            if ((rc = read(sock, buffer, 4096)) <= 0) {
+            /* A binary frame can be larger than what is left of the buffer. */
+            if (len == size) {
+                char *bigger = realloc(buffer, size * 2);
+                if (!bigger) {
+                    int res = errno;
+                    perror("realloc");
+                    free(buffer);
+                    return res;
+                }
+                buffer = bigger;
+                size *= 2;
+            }
+            if ((rc = read(sock, buffer + len, size - len)) <= 0) {
                 int res = errno;
                 if (rc == 0)
                     fprintf(stderr, "Lost connection to Netd - did it crash?\n");
@@ -153,27 +269,41 @@ static int do_monitor(int sock, int stop_after_cmd) {
                     return ECONNRESET;
                 return res;
             }
+            len += rc;
 
-            int offset = 0;
-            int i = 0;
-
-            for (i = 0; i < rc; i++) {
-                if (buffer[i] == '\0') {
-                    int code;
-                    char tmp[4];
+            /* Print every complete reply; a partial one waits for the next read. */
+            size_t offset = 0;
+            while (offset < len) {
+                char *reply = buffer + offset;
+                size_t avail = len - offset;
+                int code;
 
-                    strncpy(tmp, buffer + offset, 3);
-                    tmp[3] = '\0';
-                    code = atoi(tmp);
-
-                    printf("%s\n", buffer + offset);
-                    if (stop_after_cmd) {
-                        if (code >= 200 && code < 600)
-                            return 0;
+                if ((unsigned char) reply[0] == NETD_FRAME_MAGIC) {
+                    if (avail < NETD_FRAME_HEADER_SIZE)
+                        break;
+                    size_t frame_len = NETD_FRAME_HEADER_SIZE +
+                            get_uint32((const unsigned char *) reply + 12);
+                    if (avail < frame_len)
+                        break;
+                    code = print_frame((const unsigned char *) reply);
+                    offset += frame_len;
+                } else {
+                    char *end = memchr(reply, '\0', avail);
+                    if (!end)
+                        break;
+                    code = atoi(reply);
+                    printf("%s\n", reply);
+                    offset = end - buffer + 1;
+                }
+                if (stop_after_cmd) {
+                    if (code >= 200 && code < 600) {
+                        free(buffer);
+                        return 0;
                     }
-                    offset = i + 1;
                 }
             }
+            memmove(buffer, buffer + offset, len - offset);
+            len -= offset;
         }
     }
     free(buffer);
@@ -181,6 +311,8 @@ static int do_monitor(int sock, int stop_after_cmd) {
 }
 
 static void usage(char *progname) {
-    fprintf(stderr, "Usage: %s [<sockname>] ([monitor] | ([<cmd_seq_num>] <cmd> [arg ...]))\n", progname);
+    fprintf(stderr, "Usage: %s [-b] [<sockname>] ([monitor [<class> ...]] | ([<cmd_seq_num>] <cmd> [arg ...]))\n"
+            "  -b  ask for binary replies where netd has them, and print them as text\n"
+            "  monitor only shows broadcasts of the given classes, if any, e.g. interface\n", progname);
     exit(1);
 }
@@ -0,0 +1,822 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Microbenchmarks for the paths netd runs most often. Each benchmark is run with more
+ * iterations until it takes long enough to time, then one line is printed per result:
+ *
+ *     <name>[/<param>] iterations=<n> ns_per_op=<n> [writes_per_op=<n>]
+ *
+ * writes_per_op, for the benchmarks that answer a client, is how many writes one answer
+ * takes, counted on a SOCK_SEQPACKET pair. The *Legacy ones send as netd did before
+ * ResponseBuffer, one write per field.
+ *
+ * The iptables benchmarks change the kernel's rules (in a chain of their own), so they
+ * only run with --iptables, as root. The mdns benchmarks need a running mdnsd, and only
+ * run with --mdns.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <resolv_netid.h>
+
+#include <linux/if.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#include <string>
+#include <vector>
+
+#include <dns_sd.h>
+
+#define LOG_TAG "NetdBenchmark"
+
+#include <cutils/log.h>
+#include <sysutils/NetlinkEvent.h>
+#include <sysutils/SocketClient.h>
+#include <sysutils/SocketListener.h>
+
+#include "BandwidthController.h"
+#include "DnsResponse.h"
+#include "IptablesTransaction.h"
+#include "MDnsSdListener.h"
+#include "NetdConstants.h"
+#include "NetlinkHandler.h"
+#include "NetlinkManager.h"
+#include "NetworkController.h"
+#include "ResponseCode.h"
+
+static const int64_t MIN_TIME_NS = 200 * 1000000LL;
+static const int MAX_ITERATIONS = 1 << 24;
+static const char BENCHMARK_CHAIN[] = "netd_benchmark";
+
+/* Keeps the compiler from dropping work whose result is otherwise unused. */
+static volatile unsigned sSink;
+
+static int64_t nowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void *drainThread(void *arg) {
+    int fd = *static_cast<int *>(arg);
+    char buf[16 * 1024];
+    while (read(fd, buf, sizeof(buf)) > 0) {
+    }
+    return NULL;
+}
+
+/*
+ * A client whose replies are read and thrown away on another thread, like a framework
+ * that keeps up, so that the benchmarks that send measure netd's side of the write.
+ */
+static SocketClient *drainedClient() {
+    static SocketClient *client = NULL;
+    static int peer;
+    if (!client) {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds)) {
+            fprintf(stderr, "socketpair failed (%s)\n", strerror(errno));
+            exit(1);
+        }
+        peer = fds[1];
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, drainThread, &peer)) {
+            fprintf(stderr, "Unable to start the drain thread\n");
+            exit(1);
+        }
+        pthread_detach(thread);
+        client = new SocketClient(fds[0], true, false);
+    }
+    return client;
+}
+
+/*******************************************************
+ *                  NetworkController                  *
+ *******************************************************/
+
+/* param ranges of 50 UIDs, 100 apart, so half the lookups fall between two ranges. */
+static int64_t benchGetNetwork(int iterations, int param) {
+    NetworkController controller;
+    controller.setDefaultNetwork(100);
+    for (int i = 0; i < param; i++) {
+        controller.setNetworkForUidRange(10000 + i * 100, 10000 + i * 100 + 49, 101 + i % 8,
+                                         true);
+    }
+
+    int span = param * 100 + 1;
+    unsigned sum = 0;
+    int64_t start = nowNs();
+    for (int i = 0; i < iterations; i++) {
+        int uid = 10000 + (int) ((i * 7919u) % span);
+        sum += controller.getNetwork(uid, NETID_UNSET, NetworkController::PID_UNSPECIFIED,
+                                     true);
+    }
+    int64_t elapsed = nowNs() - start;
+    sSink = sum;
+    return elapsed;
+}
+
+/*******************************************************
+ *                  DnsProxyListener                   *
+ *******************************************************/
+
+/*
+ * A client on a SOCK_SEQPACKET pair: each write netd makes arrives at the peer as a
+ * record of its own, so the peer can count them.
+ */
+static SocketClient *countingClient(int *peer) {
+    static SocketClient *client = NULL;
+    static int peerFd;
+    if (!client) {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds)) {
+            fprintf(stderr, "socketpair failed (%s)\n", strerror(errno));
+            exit(1);
+        }
+        peerFd = fds[1];
+        client = new SocketClient(fds[0], true, false);
+    }
+    *peer = peerFd;
+    return client;
+}
+
+/* Reads everything sent to the peer so far and returns how many writes it took. */
+static int countWrites(int peer) {
+    char buf[16 * 1024];
+    int writes = 0;
+    while (recv(peer, buf, sizeof(buf), MSG_DONTWAIT) >= 0) {
+        writes++;
+    }
+    return writes;
+}
+
+/*
+ * The serializers as they were before ResponseBuffer: every length and every field
+ * went out with a sendData() of its own.
+ */
+static bool legacySendLenAndData(SocketClient *c, const int len, const void* data) {
+    uint32_t len_be = htonl(len);
+    return c->sendData(&len_be, 4) == 0 &&
+        (len == 0 || c->sendData(data, len) == 0);
+}
+
+static bool legacySendhostent(SocketClient *c, const struct hostent *hp) {
+    bool success = c->sendCode(ResponseCode::DnsProxyQueryResult) == 0;
+    success &= legacySendLenAndData(c, strlen(hp->h_name)+1, hp->h_name);
+    for (int i = 0; hp->h_aliases[i] != NULL; i++) {
+        success &= legacySendLenAndData(c, strlen(hp->h_aliases[i])+1, hp->h_aliases[i]);
+    }
+    success &= legacySendLenAndData(c, 0, ""); // null to indicate we're done
+
+    uint32_t buf = htonl(hp->h_addrtype);
+    success &= c->sendData(&buf, sizeof(buf)) == 0;
+
+    buf = htonl(hp->h_length);
+    success &= c->sendData(&buf, sizeof(buf)) == 0;
+
+    for (int i = 0; hp->h_addr_list[i] != NULL; i++) {
+        success &= legacySendLenAndData(c, 16, hp->h_addr_list[i]);
+    }
+    success &= legacySendLenAndData(c, 0, ""); // null to indicate we're done
+    return success;
+}
+
+static bool legacySendAddrInfo(SocketClient *c, const struct addrinfo *result) {
+    bool success = !c->sendCode(ResponseCode::DnsProxyQueryResult);
+    const struct addrinfo* ai = result;
+    while (ai && success) {
+        success = legacySendLenAndData(c, sizeof(struct addrinfo), ai)
+            && legacySendLenAndData(c, ai->ai_addrlen, ai->ai_addr)
+            && legacySendLenAndData(c,
+                                    ai->ai_canonname ? strlen(ai->ai_canonname) + 1 : 0,
+                                    ai->ai_canonname);
+        ai = ai->ai_next;
+    }
+    return success && legacySendLenAndData(c, 0, "");
+}
+
+/* As GetAddrInfoHandler::respond() does for each waiting client. */
+static bool sendAddrInfo(SocketClient *c, const struct addrinfo *result) {
+    ResponseBuffer buf(addrInfoResponseSize(result));
+    buf.appendCode(ResponseCode::DnsProxyQueryResult);
+    appendAddrInfo(buf, result);
+    return buf.send(c);
+}
+
+/* A gethostbyname() answer with two aliases and param IPv6 addresses. */
+class HostentAnswer {
+public:
+    HostentAnswer(int param) : mAddrs(param * 16, '\0') {
+        for (int i = 0; i < param; i++) {
+            char *addr = &mAddrs[i * 16];
+            inet_pton(AF_INET6, "2001:db8::1", addr);
+            addr[15] = (char) i;
+            mAddrList.push_back(addr);
+        }
+        mAddrList.push_back(NULL);
+        mAliases[0] = (char *) "www.example.com";
+        mAliases[1] = (char *) "example.com";
+        mAliases[2] = NULL;
+
+        memset(&mHostent, 0, sizeof(mHostent));
+        mHostent.h_name = (char *) "www.l.example.com";
+        mHostent.h_aliases = mAliases;
+        mHostent.h_addrtype = AF_INET6;
+        mHostent.h_length = 16;
+        mHostent.h_addr_list = &mAddrList[0];
+    }
+
+    const struct hostent *get() const { return &mHostent; }
+
+private:
+    std::string mAddrs;
+    std::vector<char *> mAddrList;
+    char *mAliases[3];
+    struct hostent mHostent;
+};
+
+/* A getaddrinfo() answer of param IPv6 addresses, the first with a canonical name. */
+class AddrInfoAnswer {
+public:
+    AddrInfoAnswer(int param) : mAi(param), mSin6(param) {
+        for (int i = 0; i < param; i++) {
+            memset(&mAi[i], 0, sizeof(mAi[i]));
+            memset(&mSin6[i], 0, sizeof(mSin6[i]));
+            mSin6[i].sin6_family = AF_INET6;
+            inet_pton(AF_INET6, "2001:db8::1", &mSin6[i].sin6_addr);
+            mSin6[i].sin6_addr.s6_addr[15] = (uint8_t) i;
+            mAi[i].ai_family = AF_INET6;
+            mAi[i].ai_socktype = SOCK_STREAM;
+            mAi[i].ai_protocol = IPPROTO_TCP;
+            mAi[i].ai_addrlen = sizeof(mSin6[i]);
+            mAi[i].ai_addr = reinterpret_cast<struct sockaddr *>(&mSin6[i]);
+            mAi[i].ai_next = i + 1 < param ? &mAi[i + 1] : NULL;
+        }
+        mAi[0].ai_canonname = (char *) "www.l.example.com";
+    }
+
+    const struct addrinfo *get() const { return &mAi[0]; }
+
+private:
+    std::vector<struct addrinfo> mAi;
+    std::vector<struct sockaddr_in6> mSin6;
+};
+
+typedef bool (*HostentSender)(SocketClient *c, const struct hostent *hp);
+typedef bool (*AddrInfoSender)(SocketClient *c, const struct addrinfo *result);
+
+static int64_t timeSendHostent(HostentSender send, int iterations, int param) {
+    HostentAnswer answer(param);
+    SocketClient *client = drainedClient();
+    int64_t start = nowNs();
+    for (int i = 0; i < iterations; i++) {
+        if (!send(client, answer.get())) {
+            fprintf(stderr, "Sending the hostent failed (%s)\n", strerror(errno));
+            exit(1);
+        }
+    }
+    return nowNs() - start;
+}
+
+static int countSendHostent(HostentSender send, int param) {
+    HostentAnswer answer(param);
+    int peer;
+    SocketClient *client = countingClient(&peer);
+    if (!send(client, answer.get())) {
+        fprintf(stderr, "Sending the hostent failed (%s)\n", strerror(errno));
+        exit(1);
+    }
+    return countWrites(peer);
+}
+
+static int64_t timeSendAddrInfo(AddrInfoSender send, int iterations, int param) {
+    AddrInfoAnswer answer(param);
+    SocketClient *client = drainedClient();
+    int64_t start = nowNs();
+    for (int i = 0; i < iterations; i++) {
+        if (!send(client, answer.get())) {
+            fprintf(stderr, "Sending the addrinfo failed (%s)\n", strerror(errno));
+            exit(1);
+        }
+    }
+    return nowNs() - start;
+}
+
+static int countSendAddrInfo(AddrInfoSender send, int param) {
+    AddrInfoAnswer answer(param);
+    int peer;
+    SocketClient *client = countingClient(&peer);
+    if (!send(client, answer.get())) {
+        fprintf(stderr, "Sending the addrinfo failed (%s)\n", strerror(errno));
+        exit(1);
+    }
+    return countWrites(peer);
+}
+
+static int64_t benchSendHostent(int iterations, int param) {
+    return timeSendHostent(sendhostent, iterations, param);
+}
+
+static int writesSendHostent(int param) {
+    return countSendHostent(sendhostent, param);
+}
+
+static int64_t benchLegacySendHostent(int iterations, int param) {
+    return timeSendHostent(legacySendhostent, iterations, param);
+}
+
+static int writesLegacySendHostent(int param) {
+    return countSendHostent(legacySendhostent, param);
+}
+
+static int64_t benchSendAddrInfo(int iterations, int param) {
+    return timeSendAddrInfo(sendAddrInfo, iterations, param);
+}
+
+static int writesSendAddrInfo(int param) {
+    return countSendAddrInfo(sendAddrInfo, param);
+}
+
+static int64_t benchLegacySendAddrInfo(int iterations, int param) {
+    return timeSendAddrInfo(legacySendAddrInfo, iterations, param);
+}
+
+static int writesLegacySendAddrInfo(int param) {
+    return countSendAddrInfo(legacySendAddrInfo, param);
+}
+
+/*******************************************************
+ *                 BandwidthController                 *
+ *******************************************************/
+
+class BenchBandwidthController : public BandwidthController {
+public:
+    using BandwidthController::parseForwardChainStats;
+    using BandwidthController::readForwardChainRules;
+    using BandwidthController::sendTetherStats;
+    typedef BandwidthController::ForwardChainRule ForwardChainRule;
+};
+
+struct MemoryFile {
+    const std::string *data;
+    size_t pos;
+};
+
+static int readMemoryFile(void *cookie, char *buf, int len) {
+    MemoryFile *file = static_cast<MemoryFile *>(cookie);
+    size_t n = file->data->size() - file->pos;
+    if (n > (size_t) len) {
+        n = len;
+    }
+    memcpy(buf, file->data->data() + file->pos, n);
+    file->pos += n;
+    return n;
+}
+
+static fpos_t seekMemoryFile(void *cookie, fpos_t offset, int whence) {
+    MemoryFile *file = static_cast<MemoryFile *>(cookie);
+    if (whence != SEEK_SET || offset < 0 || (size_t) offset > file->data->size()) {
+        errno = EINVAL;
+        return -1;
+    }
+    file->pos = offset;
+    return offset;
+}
+
+/* iptables -nvx -L natctrl_FORWARD output with param tethered interface pairs. */
+static int64_t benchParseForwardChainStats(int iterations, int param) {
+    std::string output =
+            "Chain natctrl_FORWARD (1 references)\n"
+            "    pkts      bytes target     prot opt in     out     source               destination\n";
+    char line[256];
+    for (int i = 0; i < param; i++) {
+        snprintf(line, sizeof(line),
+                 "%8d %10d RETURN     all  --  rmnet%d  wlan%d   0.0.0.0/0            0.0.0.0/0            state RELATED,ESTABLISHED\n"
+                 "%8d %10d RETURN     all  --  wlan%d   rmnet%d  0.0.0.0/0            0.0.0.0/0\n",
+                 1000 + i, 1500000 + i, i, i, 900 + i, 90000 + i, i, i);
+        output += line;
+    }
+    output += "       0        0 DROP       all  --  *      *       0.0.0.0/0            0.0.0.0/0\n";
+
+    SocketClient *client = drainedClient();
+    BandwidthController::TetherStats filter;
+    MemoryFile file = { &output, 0 };
+    FILE *fp = funopen(&file, readMemoryFile, NULL, seekMemoryFile, NULL);
+    if (!fp) {
+        fprintf(stderr, "funopen failed (%s)\n", strerror(errno));
+        exit(1);
+    }
+
+    int64_t start = nowNs();
+    for (int i = 0; i < iterations; i++) {
+        std::string extraProcessingInfo;
+        rewind(fp);
+        BenchBandwidthController::parseForwardChainStats(client, filter, fp,
+                                                         extraProcessingInfo);
+    }
+    int64_t elapsed = nowNs() - start;
+    fclose(fp);
+    return elapsed;
+}
+
+/*******************************************************
+ *                       iptables                      *
+ *******************************************************/
+
+static void flushBenchmarkChain() {
+    execIptablesSilently(V4, "-F", BENCHMARK_CHAIN, NULL);
+}
+
+/*
+ * What the framework's tether stats poll costs on the kernel counter path: param
+ * interface pairs in the benchmark chain, read with IPT_SO_GET_ENTRIES and sent as
+ * getTetherStats() does. Compare with parseForwardChainStats for the same param.
+ */
+static int64_t benchReadForwardChainRules(int iterations, int param) {
+    IptablesTransaction transaction;
+    char in[IFNAMSIZ], out[IFNAMSIZ];
+    for (int i = 0; i < param; i++) {
+        snprintf(in, sizeof(in), "rmnet%d", i);
+        snprintf(out, sizeof(out), "wlan%d", i);
+        transaction.add(V4, "-A", BENCHMARK_CHAIN, "-i", in, "-o", out, "-j", "RETURN", NULL);
+        transaction.add(V4, "-A", BENCHMARK_CHAIN, "-i", out, "-o", in, "-j", "RETURN", NULL);
+    }
+    if (transaction.commit()) {
+        fprintf(stderr, "iptables-restore failed\n");
+        exit(1);
+    }
+
+    SocketClient *client = drainedClient();
+    BandwidthController::TetherStats filter;
+    int64_t start = nowNs();
+    for (int i = 0; i < iterations; i++) {
+        std::string extraProcessingInfo;
+        std::vector<BenchBandwidthController::ForwardChainRule> rules;
+        if (BenchBandwidthController::readForwardChainRules(BENCHMARK_CHAIN, rules,
+                                                            extraProcessingInfo)) {
+            fprintf(stderr, "Reading the iptables counters failed\n");
+            exit(1);
+        }
+        BenchBandwidthController::sendTetherStats(client, filter, rules);
+    }
+    int64_t elapsed = nowNs() - start;
+    flushBenchmarkChain();
+    return elapsed;
+}
+
+/* One iptables run per rule. */
+static int64_t benchIptablesExec(int iterations, int) {
+    int64_t start = nowNs();
+    for (int i = 0; i < iterations; i++) {
+        if (execIptables(V4, "-A", BENCHMARK_CHAIN, "-j", "RETURN", NULL)) {
+            fprintf(stderr, "iptables failed\n");
+            exit(1);
+        }
+    }
+    int64_t elapsed = nowNs() - start;
+    flushBenchmarkChain();
+    return elapsed;
+}
+
+/* Maps param MB and writes to every page, so that they all have page table entries. */
+static void *touchMemory(int param) {
+    size_t size = (size_t) param << 20;
+    void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        fprintf(stderr, "mmap of %d MB failed (%s)\n", param, strerror(errno));
+        exit(1);
+    }
+    memset(mem, 1, size);
+    return mem;
+}
+
+static const char *IPTABLES_APPEND_ARGV[] = {
+    NULL, "-A", BENCHMARK_CHAIN, "-j", "RETURN", NULL
+};
+
+/* One iptables run per rule through execWithInput(), with param MB of netd resident. */
+static int64_t benchIptablesExecResident(int iterations, int param) {
+    void *mem = touchMemory(param);
+    const char *argv[ARRAY_SIZE(IPTABLES_APPEND_ARGV)];
+    memcpy(argv, IPTABLES_APPEND_ARGV, sizeof(argv));
+    argv[0] = IPTABLES_PATH;
+
+    int64_t start = nowNs();
+    for (int i = 0; i < iterations; i++) {
+        if (execWithInput(argv, std::string(), NULL)) {
+            fprintf(stderr, "iptables failed\n");
+            exit(1);
+        }
+    }
+    int64_t elapsed = nowNs() - start;
+    munmap(mem, (size_t) param << 20);
+    flushBenchmarkChain();
+    return elapsed;
+}
+
+/*
+ * Same with a plain fork(), as netd ran commands before execWithInput() used vfork().
+ * fork() copies the page tables of the param MB, so it slows down as they grow.
+ */
+static int64_t benchIptablesForkResident(int iterations, int param) {
+    void *mem = touchMemory(param);
+    const char *argv[ARRAY_SIZE(IPTABLES_APPEND_ARGV)];
+    memcpy(argv, IPTABLES_APPEND_ARGV, sizeof(argv));
+    argv[0] = IPTABLES_PATH;
+
+    int64_t start = nowNs();
+    for (int i = 0; i < iterations; i++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            execv(argv[0], (char **) argv);
+            _exit(127);
+        }
+        int status;
+        if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+                WEXITSTATUS(status)) {
+            fprintf(stderr, "iptables failed\n");
+            exit(1);
+        }
+    }
+    int64_t elapsed = nowNs() - start;
+    munmap(mem, (size_t) param << 20);
+    flushBenchmarkChain();
+    return elapsed;
+}
+
+/* One iptables-restore run for param rules. */
+static int64_t benchIptablesBatch(int iterations, int param) {
+    int64_t start = nowNs();
+    for (int i = 0; i < iterations; i++) {
+        IptablesTransaction transaction;
+        for (int j = 0; j < param; j++) {
+            transaction.add(V4, "-A", BENCHMARK_CHAIN, "-j", "RETURN", NULL);
+        }
+        if (transaction.commit()) {
+            fprintf(stderr, "iptables-restore failed\n");
+            exit(1);
+        }
+    }
+    int64_t elapsed = nowNs() - start;
+    flushBenchmarkChain();
+    return elapsed;
+}
+
+/*******************************************************
+ *                   NetlinkHandler                    *
+ *******************************************************/
+
+/* Where the dispatch benchmarks broadcast to: a listener that never gets a client. */
+class IdleListener : public SocketListener {
+public:
+    IdleListener() : SocketListener(-1, false) {}
+
+protected:
+    virtual bool onDataAvailable(SocketClient *) { return false; }
+};
+
+class BenchNetlinkHandler : public NetlinkHandler {
+public:
+    BenchNetlinkHandler(int format, int netlinkFamily)
+            : NetlinkHandler(NetlinkManager::Instance(), -1, format, netlinkFamily) {}
+    using NetlinkHandler::onEvent;
+};
+
+/* Decoding and dispatching a net uevent; the broadcast goes to a listener without clients. */
+static int64_t benchUeventDispatch(int iterations, int) {
+    static const char UEVENT[] =
+            "add@/devices/virtual/net/bench0\0ACTION=add\0DEVPATH=/devices/virtual/net/bench0\0"
+            "SUBSYSTEM=net\0INTERFACE=bench0\0IFINDEX=42\0SEQNUM=1234";
+    BenchNetlinkHandler handler(NetlinkListener::NETLINK_FORMAT_ASCII, NETLINK_KOBJECT_UEVENT);
+    char buf[sizeof(UEVENT)];
+
+    int64_t start = nowNs();
+    for (int i = 0; i < iterations; i++) {
+        // decode() may write to the buffer, as it does to the receive buffer.
+        memcpy(buf, UEVENT, sizeof(buf));
+        NetlinkEvent *evt = new NetlinkEvent();
+        if (evt->decode(buf, sizeof(buf), NetlinkListener::NETLINK_FORMAT_ASCII)) {
+            handler.onEvent(evt);
+        }
+        delete evt;
+    }
+    return nowNs() - start;
+}
+
+/* Same for the RTM_NEWLINK of a link going up, from the route socket. */
+static int64_t benchRtnetlinkDispatch(int iterations, int) {
+    struct {
+        struct nlmsghdr nlh;
+        struct ifinfomsg ifi;
+        struct rtattr rta;
+        char name[IFNAMSIZ];
+    } msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.nlh.nlmsg_len = sizeof(msg);
+    msg.nlh.nlmsg_type = RTM_NEWLINK;
+    msg.ifi.ifi_family = AF_UNSPEC;
+    msg.ifi.ifi_index = 42;
+    msg.ifi.ifi_flags = IFF_UP | IFF_LOWER_UP;
+    msg.rta.rta_type = IFLA_IFNAME;
+    msg.rta.rta_len = RTA_LENGTH(sizeof(msg.name));
+    strncpy(msg.name, "bench0", sizeof(msg.name) - 1);
+    BenchNetlinkHandler handler(NetlinkListener::NETLINK_FORMAT_BINARY, NETLINK_ROUTE);
+    char buf[sizeof(msg)];
+
+    int64_t start = nowNs();
+    for (int i = 0; i < iterations; i++) {
+        memcpy(buf, &msg, sizeof(buf));
+        NetlinkEvent *evt = new NetlinkEvent();
+        if (evt->decode(buf, sizeof(buf), NetlinkListener::NETLINK_FORMAT_BINARY)) {
+            handler.onEvent(evt);
+        }
+        delete evt;
+    }
+    return nowNs() - start;
+}
+
+/*******************************************************
+ *                   MDnsSdListener                    *
+ *******************************************************/
+
+/*
+ * Starting param browses that are all live at once, then stopping them, through a
+ * Monitor of its own. Nothing answers the browses, so the listener never broadcasts.
+ */
+static int64_t benchMdnsRefs(int iterations, int param) {
+    static MDnsSdListener *listener = new MDnsSdListener();
+    static MDnsSdListener::Monitor *monitor = new MDnsSdListener::Monitor();
+
+    int64_t start = nowNs();
+    for (int i = 0; i < iterations; i++) {
+        for (int id = 1; id <= param; id++) {
+            MDnsSdListener::Context *context = new MDnsSdListener::Context(id, listener,
+                    ResponseCode::ServiceDiscoveryFailed);
+            DNSServiceFlags flags = 0;
+            DNSServiceRef *ref = monitor->allocateServiceRef(id, context, &flags);
+            if (ref == NULL || DNSServiceBrowse(ref, flags, 0, "_netdbench._tcp", NULL,
+                    &MDnsSdListenerDiscoverCallback, context) != kDNSServiceErr_NoError) {
+                fprintf(stderr, "DNSServiceBrowse failed, is mdnsd running?\n");
+                exit(1);
+            }
+            monitor->startMonitoring(id);
+        }
+        for (int id = 1; id <= param; id++) {
+            monitor->freeServiceRef(id);
+        }
+    }
+    return nowNs() - start;
+}
+
+/*******************************************************
+ *                       Driver                        *
+ *******************************************************/
+
+enum Requirement { NOTHING, IPTABLES, MDNSD };
+
+struct Benchmark {
+    const char *name;
+    int param;              // printed as name/param unless 0
+    Requirement needs;      // IPTABLES: only run with --iptables, MDNSD: with --mdns
+    int64_t (*run)(int iterations, int param);  // returns the time taken by the iterations
+    int (*writes)(int param);   // if set, returns the writes one operation makes
+};
+
+static const Benchmark BENCHMARKS[] = {
+    { "getNetwork",              0, NOTHING,  benchGetNetwork },
+    { "getNetwork",             10, NOTHING,  benchGetNetwork },
+    { "getNetwork",            100, NOTHING,  benchGetNetwork },
+    { "getNetwork",           1000, NOTHING,  benchGetNetwork },
+    { "sendhostent",             1, NOTHING,  benchSendHostent, writesSendHostent },
+    { "sendhostent",             8, NOTHING,  benchSendHostent, writesSendHostent },
+    { "sendhostentLegacy",       1, NOTHING,  benchLegacySendHostent, writesLegacySendHostent },
+    { "sendhostentLegacy",       8, NOTHING,  benchLegacySendHostent, writesLegacySendHostent },
+    { "sendAddrInfo",            1, NOTHING,  benchSendAddrInfo, writesSendAddrInfo },
+    { "sendAddrInfo",            8, NOTHING,  benchSendAddrInfo, writesSendAddrInfo },
+    { "sendAddrInfoLegacy",      1, NOTHING,  benchLegacySendAddrInfo, writesLegacySendAddrInfo },
+    { "sendAddrInfoLegacy",      8, NOTHING,  benchLegacySendAddrInfo, writesLegacySendAddrInfo },
+    { "parseForwardChainStats",  1, NOTHING,  benchParseForwardChainStats },
+    { "parseForwardChainStats",  8, NOTHING,  benchParseForwardChainStats },
+    { "parseForwardChainStats", 16, NOTHING,  benchParseForwardChainStats },
+    { "ueventDispatch",          0, NOTHING,  benchUeventDispatch },
+    { "rtnetlinkDispatch",       0, NOTHING,  benchRtnetlinkDispatch },
+    { "readForwardChainRules",   8, IPTABLES, benchReadForwardChainRules },
+    { "iptablesExec",            0, IPTABLES, benchIptablesExec },
+    { "iptablesExecResident",   16, IPTABLES, benchIptablesExecResident },
+    { "iptablesExecResident",   64, IPTABLES, benchIptablesExecResident },
+    { "iptablesExecResident",  256, IPTABLES, benchIptablesExecResident },
+    { "iptablesForkResident",   16, IPTABLES, benchIptablesForkResident },
+    { "iptablesForkResident",   64, IPTABLES, benchIptablesForkResident },
+    { "iptablesForkResident",  256, IPTABLES, benchIptablesForkResident },
+    { "iptablesBatch",           1, IPTABLES, benchIptablesBatch },
+    { "iptablesBatch",          20, IPTABLES, benchIptablesBatch },
+    { "mdnsRefs",                1, MDNSD,    benchMdnsRefs },
+    { "mdnsRefs",              500, MDNSD,    benchMdnsRefs },
+};
+
+static void runBenchmark(const Benchmark &b) {
+    int iterations = 1;
+    int64_t elapsed;
+    for (;;) {
+        elapsed = b.run(iterations, b.param);
+        if (elapsed >= MIN_TIME_NS || iterations >= MAX_ITERATIONS) {
+            break;
+        }
+        // Aim a little past MIN_TIME_NS, growing at most 100 fold per round.
+        int64_t perOp = elapsed / iterations + 1;
+        int64_t next = MIN_TIME_NS * 6 / 5 / perOp;
+        if (next > iterations * 100LL) {
+            next = iterations * 100LL;
+        }
+        if (next <= iterations) {
+            next = iterations + 1;
+        }
+        iterations = next > MAX_ITERATIONS ? MAX_ITERATIONS : (int) next;
+    }
+
+    char name[64];
+    if (b.param) {
+        snprintf(name, sizeof(name), "%s/%d", b.name, b.param);
+    } else {
+        snprintf(name, sizeof(name), "%s", b.name);
+    }
+    printf("%s iterations=%d ns_per_op=%lld", name, iterations,
+           (long long) (elapsed / iterations));
+    if (b.writes) {
+        printf(" writes_per_op=%d", b.writes(b.param));
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+static void usage(const char *progname) {
+    fprintf(stderr, "Usage: %s [--iptables] [--mdns] [<name prefix>]\n", progname);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    bool iptables = false;
+    bool mdns = false;
+    const char *prefix = "";
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--iptables")) {
+            iptables = true;
+        } else if (!strcmp(argv[i], "--mdns")) {
+            mdns = true;
+        } else if (argv[i][0] != '-' && !*prefix) {
+            prefix = argv[i];
+        } else {
+            usage(argv[0]);
+        }
+    }
+
+    // Broadcasts from the dispatch benchmarks go nowhere, but they are formatted and sent.
+    IdleListener listener;
+    NetlinkManager::Instance()->setBroadcaster(&listener);
+
+    if (iptables) {
+        execIptablesSilently(V4, "-N", BENCHMARK_CHAIN, NULL);
+        flushBenchmarkChain();
+    }
+
+    for (size_t i = 0; i < ARRAY_SIZE(BENCHMARKS); i++) {
+        const Benchmark &b = BENCHMARKS[i];
+        if ((b.needs == IPTABLES && !iptables) || (b.needs == MDNSD && !mdns) ||
+                strncmp(b.name, prefix, strlen(prefix))) {
+            continue;
+        }
+        runBenchmark(b);
+    }
+
+    if (iptables) {
+        flushBenchmarkChain();
+        execIptablesSilently(V4, "-X", BENCHMARK_CHAIN, NULL);
+    }
+    return 0;
+}
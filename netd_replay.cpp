@@ -0,0 +1,338 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Replays a command trace ("ndc trace start <name>", see CommandTrace.h) against the
+ * running netd and reports how it coped.
+ *
+ * Every client of the trace gets a thread and a connection of its own, and sends its
+ * commands at their recorded times divided by the speed factor, or as soon as its
+ * previous command is answered if it is running late. With -n the whole trace is
+ * replayed that many times at once. dnsproxyd clients connect for every command, as
+ * the resolver does, and a lookup counts as answered when its result code arrives.
+ *
+ * Output is one line per command family and a total:
+ *
+ *     <socket>.<command> count=<n> failed=<n> p50_us=<n> p99_us=<n> p999_us=<n> max_us=<n>
+ *     total count=<n> failed=<n> elapsed_ms=<n> commands_per_s=<n>
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <cutils/sockets.h>
+
+static const int REPLY_TIMEOUT_MS = 10000;
+static const int DNS_PROXY_QUERY_RESULT = 222;
+
+struct Entry {
+    int64_t offsetUs;
+    std::string family;
+    std::string command;
+};
+
+struct Lane {
+    std::string socket;
+    std::vector<Entry> entries;
+};
+
+struct Sample {
+    const std::string *family;
+    int64_t latencyUs;
+    bool failed;
+};
+
+struct Replay {
+    const Lane *lane;
+    double speed;
+    int64_t startUs;
+    std::vector<Sample> samples;
+};
+
+static int64_t nowUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static bool usesCmdNum(const std::string &socket) {
+    return socket != "dnsproxyd";
+}
+
+static int connectTo(const std::string &socket) {
+    return socket_local_client(socket.c_str(), ANDROID_SOCKET_NAMESPACE_RESERVED,
+                               SOCK_STREAM);
+}
+
+/* Reads at least one byte more into buf, giving up after REPLY_TIMEOUT_MS. */
+static bool readMore(int sock, std::string &buf) {
+    struct pollfd pfd = { sock, POLLIN, 0 };
+    int rc = poll(&pfd, 1, REPLY_TIMEOUT_MS);
+    if (rc <= 0) {
+        return false;
+    }
+    char data[4096];
+    ssize_t n = read(sock, data, sizeof(data));
+    if (n <= 0) {
+        return false;
+    }
+    buf.append(data, n);
+    return true;
+}
+
+/*
+ * Waits for the final reply to command cmdNum, skipping broadcasts and the 1xx lines of
+ * list commands. Returns the reply code, or -1 if the connection failed.
+ */
+static int awaitReply(int sock, int cmdNum, std::string &pending) {
+    for (;;) {
+        size_t end;
+        while ((end = pending.find('\0')) == std::string::npos) {
+            if (!readMore(sock, pending)) {
+                return -1;
+            }
+        }
+        std::string msg = pending.substr(0, end);
+        pending.erase(0, end + 1);
+
+        int code, num;
+        if (sscanf(msg.c_str(), "%d %d", &code, &num) != 2 || code >= 600 || code < 200 ||
+                num != cmdNum) {
+            continue;
+        }
+        return code;
+    }
+}
+
+/* The result code of a dnsproxyd lookup; the rest of the answer is drained by close(). */
+static int awaitDnsReply(int sock) {
+    std::string buf;
+    while (buf.size() < 4) {
+        if (!readMore(sock, buf)) {
+            return -1;
+        }
+    }
+    return atoi(buf.c_str());
+}
+
+static void *runReplay(void *arg) {
+    Replay *replay = static_cast<Replay *>(arg);
+    const Lane *lane = replay->lane;
+    bool cmdNums = usesCmdNum(lane->socket);
+    int sock = -1;
+    int cmdNum = 0;
+    std::string pending;
+
+    for (size_t i = 0; i < lane->entries.size(); i++) {
+        const Entry &entry = lane->entries[i];
+        if (replay->speed > 0) {
+            int64_t due = replay->startUs + (int64_t) (entry.offsetUs / replay->speed);
+            int64_t wait = due - nowUs();
+            if (wait > 0) {
+                usleep(wait);
+            }
+        }
+
+        Sample sample = { &entry.family, 0, true };
+        int64_t start = nowUs();
+        if (sock < 0) {
+            sock = connectTo(lane->socket);
+            pending.clear();
+        }
+        if (sock < 0) {
+            replay->samples.push_back(sample);
+            continue;
+        }
+
+        std::string msg;
+        if (cmdNums) {
+            char num[16];
+            snprintf(num, sizeof(num), "%d ", ++cmdNum);
+            msg = num;
+        }
+        msg += entry.command;
+        int code = -1;
+        if (write(sock, msg.c_str(), msg.size() + 1) == (ssize_t) msg.size() + 1) {
+            code = cmdNums ? awaitReply(sock, cmdNum, pending) : awaitDnsReply(sock);
+        }
+        sample.latencyUs = nowUs() - start;
+        sample.failed = cmdNums ? (code < 0 || code >= 400) : code != DNS_PROXY_QUERY_RESULT;
+        replay->samples.push_back(sample);
+
+        if (!cmdNums || code < 0) {
+            close(sock);
+            sock = -1;
+        }
+    }
+    if (sock >= 0) {
+        close(sock);
+    }
+    return NULL;
+}
+
+/* Fills lanes from a trace file, keyed on "<socket> <client>". */
+static int readTrace(const char *path, std::map<std::string, Lane> &lanes) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        fprintf(stderr, "Unable to open %s (%s)\n", path, strerror(errno));
+        return -1;
+    }
+
+    char line[4096];
+    int lineNum = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        lineNum++;
+        line[strcspn(line, "\n")] = '\0';
+        if (line[0] == '#' || line[0] == '\0') {
+            continue;
+        }
+
+        long long offsetUs;
+        char socket[32], client[32];
+        int consumed;
+        if (sscanf(line, "%lld %31s %31s %n", &offsetUs, socket, client, &consumed) != 3 ||
+                !line[consumed]) {
+            fprintf(stderr, "%s:%d: malformed trace line\n", path, lineNum);
+            continue;
+        }
+
+        Lane &lane = lanes[std::string(socket) + " " + client];
+        lane.socket = socket;
+        Entry entry;
+        entry.offsetUs = offsetUs;
+        entry.command = line + consumed;
+        entry.family = std::string(socket) + "." +
+                entry.command.substr(0, entry.command.find(' '));
+        lane.entries.push_back(entry);
+    }
+    fclose(fp);
+    return 0;
+}
+
+static bool entryBefore(const Entry &a, const Entry &b) {
+    return a.offsetUs < b.offsetUs;
+}
+
+static int64_t percentile(const std::vector<int64_t> &sorted, double q) {
+    size_t i = (size_t) (q * sorted.size());
+    return sorted[i < sorted.size() ? i : sorted.size() - 1];
+}
+
+static void usage(const char *progname) {
+    fprintf(stderr, "Usage: %s [-x <speed>] [-n <copies>] <trace>\n"
+                    "    -x  replay speed factor, 0 for no waits (default 1)\n"
+                    "    -n  number of copies of the trace replayed at once (default 1)\n",
+            progname);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    double speed = 1;
+    int copies = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "x:n:")) != -1) {
+        switch (opt) {
+        case 'x':
+            speed = atof(optarg);
+            break;
+        case 'n':
+            copies = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || speed < 0 || copies < 1) {
+        usage(argv[0]);
+    }
+
+    std::map<std::string, Lane> lanes;
+    if (readTrace(argv[optind], lanes)) {
+        return 1;
+    }
+    // Listener threads write their lines independently, so a client's may be out of order.
+    for (std::map<std::string, Lane>::iterator it = lanes.begin(); it != lanes.end(); ++it) {
+        std::stable_sort(it->second.entries.begin(), it->second.entries.end(), entryBefore);
+    }
+
+    std::vector<Replay> replays;
+    for (int copy = 0; copy < copies; copy++) {
+        for (std::map<std::string, Lane>::const_iterator it = lanes.begin();
+                it != lanes.end(); ++it) {
+            Replay replay;
+            replay.lane = &it->second;
+            replay.speed = speed;
+            replays.push_back(replay);
+        }
+    }
+
+    std::vector<pthread_t> threads(replays.size());
+    int64_t start = nowUs();
+    for (size_t i = 0; i < replays.size(); i++) {
+        replays[i].startUs = start;
+        if (pthread_create(&threads[i], NULL, runReplay, &replays[i])) {
+            fprintf(stderr, "Unable to start replay thread %zu\n", i);
+            return 1;
+        }
+    }
+    for (size_t i = 0; i < threads.size(); i++) {
+        pthread_join(threads[i], NULL);
+    }
+    int64_t elapsedUs = nowUs() - start;
+
+    std::map<std::string, std::vector<int64_t> > latencies;
+    std::map<std::string, int> failures;
+    size_t total = 0;
+    int totalFailed = 0;
+    for (size_t i = 0; i < replays.size(); i++) {
+        for (size_t j = 0; j < replays[i].samples.size(); j++) {
+            const Sample &s = replays[i].samples[j];
+            latencies[*s.family].push_back(s.latencyUs);
+            if (s.failed) {
+                failures[*s.family]++;
+                totalFailed++;
+            }
+            total++;
+        }
+    }
+
+    for (std::map<std::string, std::vector<int64_t> >::iterator it = latencies.begin();
+            it != latencies.end(); ++it) {
+        std::vector<int64_t> &v = it->second;
+        std::sort(v.begin(), v.end());
+        printf("%s count=%zu failed=%d p50_us=%lld p99_us=%lld p999_us=%lld max_us=%lld\n",
+               it->first.c_str(), v.size(), failures[it->first],
+               (long long) percentile(v, 0.5), (long long) percentile(v, 0.99),
+               (long long) percentile(v, 0.999), (long long) v.back());
+    }
+    printf("total count=%zu failed=%d elapsed_ms=%lld commands_per_s=%lld\n", total,
+           totalFailed, (long long) (elapsedUs / 1000),
+           (long long) (elapsedUs ? total * 1000000LL / elapsedUs : 0));
+    return totalFailed ? 2 : 0;
+}
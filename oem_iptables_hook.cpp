@@ -22,16 +22,19 @@
 #include <string.h>
 #include <unistd.h>
 
+#include <string>
+#include <vector>
+
 #define LOG_TAG "OemIptablesHook"
 #include <cutils/log.h>
-#include <logwrap/logwrap.h>
+#include "IptablesTransaction.h"
 #include "NetdConstants.h"
+#include "oem_iptables_hook.h"
 
 static int runIptablesCmd(int argc, const char **argv) {
-    int res;
-
-    res = android_fork_execvp(argc, (char **)argv, NULL, false, false);
-    return res;
+    std::vector<const char *> args(argv, argv + argc);
+    args.push_back(NULL);
+    return execWithInput(&args[0], std::string(), NULL);
 }
 
 static bool oemCleanupHooks() {
@@ -70,6 +73,137 @@ static bool oemInitChains() {
     return true;
 }
 
+struct OemRule {
+    IptablesTarget target;
+    std::string table;
+    std::string chain;      // a -N
+    std::string command;    // anything else
+};
+
+static const char *OEM_CHAIN_PREFIX = "oem_";
+
+static bool isCommandOption(const std::string &arg) {
+    static const char *COMMANDS[] = {
+            "-A", "--append", "-I", "--insert", "-N", "--new-chain",
+            "-D", "--delete", "-R", "--replace", "-F", "--flush", "-X", "--delete-chain",
+            "-P", "--policy", "-E", "--rename-chain", "-Z", "--zero", "-L", "--list",
+            "-S", "--list-rules",
+    };
+    for (size_t i = 0; i < ARRAY_SIZE(COMMANDS); i++) {
+        if (arg == COMMANDS[i]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Parses a line of OEM_RULES_PATH that is not blank or a comment. */
+static bool parseOemRule(const char *line, OemRule *rule) {
+    std::vector<std::string> args;
+    const char *start = line;
+    while (*start) {
+        while (*start == ' ' || *start == '\t') {
+            start++;
+        }
+        const char *end = start;
+        while (*end && *end != ' ' && *end != '\t') {
+            end++;
+        }
+        if (end != start) {
+            args.push_back(std::string(start, end - start));
+        }
+        start = end;
+    }
+
+    rule->target = V4;
+    rule->table = "filter";
+    size_t first = 0;
+    if (!args.empty() && (args[0] == "-4" || args[0] == "-6")) {
+        rule->target = args[0] == "-6" ? V6 : V4;
+        first = 1;
+    }
+
+    std::string op, chain;
+    size_t others = 0;
+    for (size_t i = first; i < args.size(); i++) {
+        if ((args[i] == "-t" || args[i] == "--table") && i + 1 < args.size()) {
+            rule->table = args[++i];
+        } else if (isCommandOption(args[i])) {
+            if (!op.empty() || i + 1 == args.size()) {
+                return false;
+            }
+            op = args[i];
+            chain = args[++i];
+        } else {
+            others++;
+        }
+    }
+    if (chain.compare(0, strlen(OEM_CHAIN_PREFIX), OEM_CHAIN_PREFIX) != 0) {
+        return false;
+    }
+
+    if (op == "-N" || op == "--new-chain") {
+        if (others != 0) {
+            return false;
+        }
+        rule->chain = chain;
+        return true;
+    }
+    if (op != "-A" && op != "--append" && op != "-I" && op != "--insert") {
+        return false;
+    }
+    for (size_t i = first; i < args.size(); i++) {
+        if (!rule->command.empty()) {
+            rule->command += ' ';
+        }
+        rule->command += args[i];
+    }
+    return true;
+}
+
+int addOemIptablesRules(IptablesTransaction &t) {
+    FILE *fp = fopen(OEM_RULES_PATH, "r");
+    if (fp == NULL) {
+        if (errno != ENOENT) {
+            ALOGE("Unable to open %s: %s", OEM_RULES_PATH, strerror(errno));
+        }
+        return -1;
+    }
+
+    std::vector<OemRule> rules;
+    char line[1024];
+    int lineNum = 0;
+    bool valid = true;
+    while (fgets(line, sizeof(line), fp)) {
+        lineNum++;
+        line[strcspn(line, "\r\n")] = '\0';
+        const char *p = line + strspn(line, " \t");
+        if (*p == '\0' || *p == '#') {
+            continue;
+        }
+        OemRule rule;
+        if (!parseOemRule(p, &rule)) {
+            ALOGE("%s:%d: not a rule for an %s* chain: %s", OEM_RULES_PATH, lineNum,
+                  OEM_CHAIN_PREFIX, p);
+            valid = false;
+            break;
+        }
+        rules.push_back(rule);
+    }
+    fclose(fp);
+    if (!valid) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < rules.size(); i++) {
+        if (!rules[i].chain.empty()) {
+            t.addChain(rules[i].target, rules[i].table.c_str(), rules[i].chain.c_str());
+        } else {
+            t.addCommand(rules[i].target, rules[i].command.c_str());
+        }
+    }
+    return rules.size();
+}
 
 void setupOemIptablesHook() {
     if (0 == access(OEM_SCRIPT_PATH, R_OK | X_OK)) {
@@ -21,6 +21,20 @@
 #define OEM_IPTABLES_FILTER_FORWARD "oem_fwd"
 #define OEM_IPTABLES_NAT_PREROUTING "oem_nat_pre"
 
+class IptablesTransaction;
+
+/*
+ * Queues the rules of OEM_RULES_PATH into t. Each line is an iptables command that
+ * appends to, inserts into or creates (-A, -I, -N) one of the oem_* chains, e.g.
+ *     -t nat -A oem_nat_pre -p udp --dport 53 -j oem_dns
+ * Lines apply to iptables, or to ip6tables when they start with -6; -4 is accepted
+ * too. Blank lines and lines starting with # are ignored.
+ * Returns the number of rules queued, or -1 if there is no rules file or it has an
+ * invalid line, in which case nothing is queued.
+ */
+int addOemIptablesRules(IptablesTransaction &t);
+
+/* Runs OEM_SCRIPT_PATH, if there is one, to fill the oem_* chains. */
 void setupOemIptablesHook();
 
 #endif